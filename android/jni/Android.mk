@@ -12,7 +12,11 @@ GSTREAMER_ROOT        := $(GSTREAMER_SDK_ROOT_ANDROID)
 endif
 
 LOCAL_MODULE    := android-aurena
-LOCAL_SRC_FILES := android-aurena.c ../../src/common/aur-json.c ../../src/client/aur-client.c
+LOCAL_SRC_FILES := android-aurena.c ../../src/common/aur-cbor.c ../../src/common/aur-json.c \
+    ../../src/common/aur-msg-reader.c ../../src/common/aur-msg-writer.c \
+    ../../src/common/aur-websocket-deflate.c ../../src/common/aur-websocket-mask.c \
+    ../../src/common/aur-websocket-parser.c \
+    ../../src/client/aur-client.c ../../src/client/aur-client-socket.c
 LOCAL_SHARED_LIBRARIES := gstreamer_android
 LOCAL_C_INCLUDES := $(LOCAL_PATH)/../..
 LOCAL_LDLIBS := -landroid
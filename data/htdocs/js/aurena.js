@@ -120,6 +120,12 @@ handle_event : function handle_event(data) {
       aurena.cur_media = json["resource-id"];
       aurena.update_playstate();
       break;
+    case "player-clients":
+      aurena.show_player_clients(json);
+      break;
+    case "player-clients-delta":
+      aurena.apply_player_clients_delta(json);
+      break;
     case "player-clients-changed":
       aurena.update_player_clients();
       break;
@@ -129,6 +135,82 @@ handle_event : function handle_event(data) {
   }
 },
 update_player_clients : function () {
+  if (aurena.fetching_clients)
+    return;
+  aurena.fetching_clients = true;
+  aurena.pending_deltas = [];
+  $.getJSON("../client/player_info", function(data) {
+     aurena.show_player_clients(data);
+  }).complete(function() {
+     // Catch up with the changes that came in during the fetch. The ones
+     // the list already includes are skipped
+     var deltas = aurena.pending_deltas;
+     aurena.fetching_clients = false;
+     aurena.pending_deltas = [];
+     $.each(deltas, function(key, delta) {
+       aurena.apply_player_clients_delta(delta);
+       // A gap starts another fetch, which supersedes the rest
+       return !aurena.fetching_clients;
+     });
+  });
+},
+apply_player_clients_delta : function (json) {
+  var seq = json["seq"];
+
+  // The list being fetched may or may not include this change, so keep
+  // it until the list is in
+  if (aurena.fetching_clients) {
+    aurena.pending_deltas.push(json);
+    return;
+  }
+  if (aurena.clients == null || aurena.clients_seq == null ||
+      seq > aurena.clients_seq + 1) {
+    aurena.update_player_clients();
+    return;
+  }
+  if (seq <= aurena.clients_seq)
+    return;
+
+  var clients = aurena.clients;
+  var membership = false;
+  function find_client(client_id) {
+    for (var i = 0; i < clients.length; i++) {
+      if (clients[i]["client-id"] == client_id)
+        return i;
+    }
+    return -1;
+  }
+
+  $.each(json["removed"] || [], function(key, val) {
+    var i = find_client(val["client-id"]);
+    if (i >= 0) {
+      clients.splice(i, 1);
+      membership = true;
+    }
+  });
+  $.each(json["added"] || [], function(key, val) {
+    var i = find_client(val["client-id"]);
+    if (i >= 0)
+      clients[i] = val;
+    else
+      clients.push(val);
+    membership = true;
+  });
+  $.each(json["changed"] || [], function(key, val) {
+    var i = find_client(val["client-id"]);
+    if (i < 0)
+      return;
+    clients[i] = val;
+    aurena.set_vol_slider (val["client-id"], val["volume"], true);
+    aurena.set_client_enable (val["client-id"], val["enabled"]);
+  });
+
+  if (membership)
+    aurena.show_player_clients({ "seq": seq, "player-clients": clients });
+  else
+    aurena.clients_seq = seq;
+},
+show_player_clients : function (data) {
   function send_enable_val(client_id) {
     if (aurena.sendingEnable)
       return;
@@ -147,41 +229,40 @@ update_player_clients : function () {
     });
   }
 
-  $.getJSON("../client/player_info", function(data) {
-     var items = [];
-     var clients = data['player-clients'];
-     aurena.clients = clients;
-     $.each(clients, function(key, val) {
-       var enable_id = "enable-" + val["client-id"];
-       var volume_id = "volume-" + val["client-id"];
-       var info = '<li id="' + val["client-id"] + '">';
-       info += "<input type='checkbox' id='" + enable_id + "'/>";
-       info += " Client " + val["host"];
-       info += " <div id='" + volume_id + "' />";
-       info += " <div id='volumeval-" + val["client-id"] + "' />";
-       info += '</li>';
-       items.push(info);
-        // console.log ("Client data " + JSON.stringify(val));
-     });
-     $("#cliententries").empty().prepend($('<ul/>', {
-       html: items.join('')
-     }));
-     $.each(clients, function(key, val) {
-       var client_id = val["client-id"];
-       var enable_id = "enable-" + client_id;
-       var volume_id = "volume-" + client_id;
+  var items = [];
+  var clients = data['player-clients'];
+  aurena.clients = clients;
+  aurena.clients_seq = data['seq'];
+  $.each(clients, function(key, val) {
+    var enable_id = "enable-" + val["client-id"];
+    var volume_id = "volume-" + val["client-id"];
+    var info = '<li id="' + val["client-id"] + '">';
+    info += "<input type='checkbox' id='" + enable_id + "'/>";
+    info += " Client " + val["host"];
+    info += " <div id='" + volume_id + "' />";
+    info += " <div id='volumeval-" + val["client-id"] + "' />";
+    info += '</li>';
+    items.push(info);
+     // console.log ("Client data " + JSON.stringify(val));
+  });
+  $("#cliententries").empty().prepend($('<ul/>', {
+    html: items.join('')
+  }));
+  $.each(clients, function(key, val) {
+    var client_id = val["client-id"];
+    var enable_id = "enable-" + client_id;
+    var volume_id = "volume-" + client_id;
 
-       $("#" + volume_id).slider({
-         animate: true,
-         min : 0.0, max : 1.5, range : 'true', value : val["volume"], step : 0.01,
-         start : function(event, ui) { aurena.sliding = true; },
-         stop : function(event, ui) { setTimeout(function() { aurena.sliding = false; }, 100); },
-         slide : function(cid) { return function(event, ui) { aurena.volChange = true; aurena.send_slider_volume(cid); } }(client_id),
-         change : function(cid) { return function(event, ui) { aurena.volChange = true; aurena.send_slider_volume(cid); } }(client_id)
-       });
-       $('#volumeval-' + client_id).text(Math.round(val["volume"] * 100).toString() + '%');
-       $("#" + enable_id).attr('checked', val["enabled"]).change(function(cid) { return function () { send_enable_val (cid) } }(client_id));
-     });
+    $("#" + volume_id).slider({
+      animate: true,
+      min : 0.0, max : 1.5, range : 'true', value : val["volume"], step : 0.01,
+      start : function(event, ui) { aurena.sliding = true; },
+      stop : function(event, ui) { setTimeout(function() { aurena.sliding = false; }, 100); },
+      slide : function(cid) { return function(event, ui) { aurena.volChange = true; aurena.send_slider_volume(cid); } }(client_id),
+      change : function(cid) { return function(event, ui) { aurena.volChange = true; aurena.send_slider_volume(cid); } }(client_id)
+    });
+    $('#volumeval-' + client_id).text(Math.round(val["volume"] * 100).toString() + '%');
+    $("#" + enable_id).attr('checked', val["enabled"]).change(function(cid) { return function () { send_enable_val (cid) } }(client_id));
   });
 },
 
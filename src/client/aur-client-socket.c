@@ -0,0 +1,487 @@
+/* GStreamer
+ * Copyright (C) 2012-2014 Jan Schmidt <thaytan@noraisin.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <libsoup/soup.h>
+
+#include <src/common/aur-cbor.h>
+#include <src/common/aur-websocket-deflate.h>
+#include <src/common/aur-websocket-mask.h>
+
+#include "aur-client-socket.h"
+
+G_DEFINE_TYPE (AurClientSocket, aur_client_socket, AUR_TYPE_WEBSOCKET_PARSER);
+
+enum
+{
+  CONNECTED,
+  CLOSED,
+  LAST_SIGNAL
+};
+
+static guint aur_client_socket_signals[LAST_SIGNAL] = { 0 };
+
+/* Seconds to wait for the TCP connection, as for HTTP requests */
+#define CONNECT_TIMEOUT 5
+
+/* A handshake response bigger than this isn't from an aurena server */
+#define MAX_RESPONSE_SIZE 8192
+
+static void aur_client_socket_dispose (GObject * object);
+static void aur_client_socket_finalize (GObject * object);
+static void aur_client_socket_send_frame (AurWebSocketParser * parser,
+    guint8 opcode, const gchar * data, gsize len);
+
+static void
+aur_client_socket_init (G_GNUC_UNUSED AurClientSocket * sock)
+{
+}
+
+static void
+aur_client_socket_class_init (AurClientSocketClass * sock_class)
+{
+  GObjectClass *gobject_class = (GObjectClass *) (sock_class);
+  AurWebSocketParserClass *parser_class =
+      (AurWebSocketParserClass *) (sock_class);
+
+  gobject_class->dispose = aur_client_socket_dispose;
+  gobject_class->finalize = aur_client_socket_finalize;
+
+  parser_class->send_frame = aur_client_socket_send_frame;
+
+  aur_client_socket_signals[CONNECTED] =
+      g_signal_new ("connected", G_TYPE_FROM_CLASS (sock_class),
+      G_SIGNAL_RUN_LAST, 0, NULL, NULL,
+      g_cclosure_marshal_generic, G_TYPE_NONE, 0, G_TYPE_NONE);
+  /* Emitted when the connection fails or the server closes it. rejected
+   * is set if the server answered but didn't accept the upgrade */
+  aur_client_socket_signals[CLOSED] =
+      g_signal_new ("closed", G_TYPE_FROM_CLASS (sock_class),
+      G_SIGNAL_RUN_LAST, 0, NULL, NULL,
+      g_cclosure_marshal_generic, G_TYPE_NONE, 1, G_TYPE_BOOLEAN);
+}
+
+static void
+aur_client_socket_teardown (AurClientSocket * sock)
+{
+  if (sock->cancellable) {
+    g_cancellable_cancel (sock->cancellable);
+    g_object_unref (sock->cancellable);
+    sock->cancellable = NULL;
+  }
+  if (sock->io_source) {
+    g_source_destroy (sock->io_source);
+    g_source_unref (sock->io_source);
+    sock->io_source = NULL;
+  }
+  if (sock->io) {
+    g_io_channel_unref (sock->io);
+    sock->io = NULL;
+  }
+  if (sock->conn) {
+    g_io_stream_close (G_IO_STREAM (sock->conn), NULL, NULL);
+    g_object_unref (sock->conn);
+    sock->conn = NULL;
+  }
+  sock->connected = FALSE;
+}
+
+static void
+aur_client_socket_dispose (GObject * object)
+{
+  aur_client_socket_teardown ((AurClientSocket *) (object));
+
+  G_OBJECT_CLASS (aur_client_socket_parent_class)->dispose (object);
+}
+
+static void
+aur_client_socket_finalize (GObject * object)
+{
+  AurClientSocket *sock = (AurClientSocket *) (object);
+
+  g_free (sock->host);
+  g_free (sock->path);
+  g_free (sock->key);
+  if (sock->response)
+    g_string_free (sock->response, TRUE);
+  if (sock->context)
+    g_main_context_unref (sock->context);
+
+  G_OBJECT_CLASS (aur_client_socket_parent_class)->finalize (object);
+}
+
+static void
+socket_closed (AurClientSocket * sock, gboolean rejected)
+{
+  aur_client_socket_teardown (sock);
+  g_signal_emit (sock, aur_client_socket_signals[CLOSED], 0, rejected);
+}
+
+/* Writes are rare and small - the handshake, control commands and
+ * answers to pings - so they're made directly, waiting if the socket is
+ * full */
+static gboolean
+write_all (AurClientSocket * sock, const gchar * data, gsize len)
+{
+  GOutputStream *out = g_io_stream_get_output_stream (G_IO_STREAM (sock->conn));
+  GError *err = NULL;
+
+  if (!g_output_stream_write_all (out, data, len, NULL, NULL, &err)) {
+    g_print ("Failed to write to %s:%u: %s\n", sock->host, sock->port,
+        err->message);
+    g_error_free (err);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void
+aur_client_socket_send_frame (AurWebSocketParser * parser, guint8 opcode,
+    const gchar * data, gsize len)
+{
+  AurClientSocket *sock = (AurClientSocket *) (parser);
+  gchar frame[6 + 125];
+  guint32 mask = g_random_int ();
+
+  /* Control frames are never longer */
+  g_return_if_fail (len <= 125);
+
+  if (sock->conn == NULL)
+    return;
+
+  /* Client to server frames are always masked */
+  frame[0] = 0x80 | opcode;
+  frame[1] = 0x80 | len;
+  memcpy (frame + 2, &mask, 4);
+  memcpy (frame + 6, data, len);
+  aur_websocket_mask (frame + 6, len, frame + 2, 0);
+
+  write_all (sock, frame, 6 + len);
+}
+
+static gchar *
+calc_accept_key (const gchar * key)
+{
+  const gchar *guid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  GChecksum *checksum = g_checksum_new (G_CHECKSUM_SHA1);
+  guint8 sha1[20];
+  gsize len = 20;
+
+  g_checksum_update (checksum, (guchar *) (key), -1);
+  g_checksum_update (checksum, (guchar *) (guid), -1);
+  g_checksum_get_digest (checksum, sha1, &len);
+  g_checksum_free (checksum);
+
+  return g_base64_encode (sha1, len);
+}
+
+static gboolean
+check_handshake_response (AurClientSocket * sock, const gchar * str,
+    gsize len)
+{
+  SoupMessageHeaders *headers =
+      soup_message_headers_new (SOUP_MESSAGE_HEADERS_RESPONSE);
+  AurWebSocketDeflateParams deflate_params;
+  const gchar *val;
+  gchar *expected;
+  guint status_code;
+  gboolean ret = FALSE;
+
+  if (!soup_headers_parse_response (str, len, headers, NULL, &status_code,
+          NULL)) {
+    g_print ("Invalid websocket handshake response\n");
+    goto done;
+  }
+  if (status_code != SOUP_STATUS_SWITCHING_PROTOCOLS) {
+    g_print ("Server refused websocket connection, status %u\n",
+        status_code);
+    goto done;
+  }
+
+  expected = calc_accept_key (sock->key);
+  val = soup_message_headers_get_one (headers, "Sec-WebSocket-Accept");
+  ret = val != NULL && g_str_equal (val, expected);
+  g_free (expected);
+  if (!ret) {
+    g_print ("Websocket handshake accept key doesn't match\n");
+    goto done;
+  }
+
+  val = soup_message_headers_get_one (headers, "Sec-WebSocket-Protocol");
+  if (val != NULL && g_str_equal (val, AUR_CBOR_WEBSOCKET_PROTOCOL))
+    sock->cbor = TRUE;
+  else if (val == NULL || !g_str_equal (val, "aurena")) {
+    g_print ("Server chose unknown websocket protocol %s\n",
+        val ? val : "(none)");
+    ret = FALSE;
+    goto done;
+  }
+
+  /* The server's answer has the same form as an offer */
+  val = soup_message_headers_get_list (headers, "Sec-WebSocket-Extensions");
+  if (aur_websocket_deflate_negotiate (val, &deflate_params, NULL))
+    aur_websocket_parser_enable_deflate (AUR_WEBSOCKET_PARSER (sock),
+        deflate_params.server_no_context_takeover);
+
+done:
+  soup_message_headers_free (headers);
+  return ret;
+}
+
+static GIOStatus
+read_handshake_response (AurClientSocket * sock, gboolean * rejected)
+{
+  gchar buf[1024];
+  gsize bread = 0, header_len;
+  const gchar *end;
+  GIOStatus status;
+
+  status = g_io_channel_read_chars (sock->io, buf, sizeof (buf), &bread,
+      NULL);
+  if (status == G_IO_STATUS_AGAIN)
+    return G_IO_STATUS_NORMAL;
+  if (status != G_IO_STATUS_NORMAL)
+    return status;
+
+  g_string_append_len (sock->response, buf, bread);
+  end = g_strstr_len (sock->response->str, sock->response->len, "\r\n\r\n");
+  if (end == NULL) {
+    if (sock->response->len <= MAX_RESPONSE_SIZE)
+      return G_IO_STATUS_NORMAL;
+    *rejected = TRUE;
+    return G_IO_STATUS_ERROR;
+  }
+
+  /* The headers end with the first CRLF, the second is the blank line */
+  header_len = end + 4 - sock->response->str;
+  if (!check_handshake_response (sock, sock->response->str, header_len - 2)) {
+    *rejected = TRUE;
+    return G_IO_STATUS_ERROR;
+  }
+
+  g_print ("Websocket connected to %s:%u%s (%s)\n", sock->host, sock->port,
+      sock->path, sock->cbor ? "CBOR" : "JSON");
+  sock->connected = TRUE;
+  g_signal_emit (sock, aur_client_socket_signals[CONNECTED], 0);
+
+  /* The first messages can arrive along with the response */
+  status = aur_websocket_parser_push_data (AUR_WEBSOCKET_PARSER (sock),
+      sock->response->str + header_len, sock->response->len - header_len);
+  g_string_free (sock->response, TRUE);
+  sock->response = NULL;
+
+  return status;
+}
+
+static gboolean
+aur_client_socket_io_cb (G_GNUC_UNUSED GIOChannel * source,
+    GIOCondition condition, AurClientSocket * sock)
+{
+  GIOStatus status = G_IO_STATUS_NORMAL;
+  gboolean rejected = FALSE;
+
+  /* Pings count as traffic too */
+  sock->last_activity = g_get_monotonic_time ();
+
+  g_object_ref (sock);
+
+  if (condition & G_IO_IN) {
+    if (sock->connected)
+      status = aur_websocket_parser_read_io (AUR_WEBSOCKET_PARSER (sock),
+          sock->io);
+    else
+      status = read_handshake_response (sock, &rejected);
+  } else if (condition & (G_IO_HUP | G_IO_ERR)) {
+    status = G_IO_STATUS_EOF;
+  }
+
+  /* A handler may have closed the socket already */
+  if ((status == G_IO_STATUS_EOF || status == G_IO_STATUS_ERROR) &&
+      sock->io_source != NULL)
+    socket_closed (sock, rejected);
+
+  g_object_unref (sock);
+
+  return TRUE;
+}
+
+static gboolean
+send_handshake (AurClientSocket * sock)
+{
+  guint8 nonce[16];
+  gchar *request;
+  gboolean ret;
+  guint i;
+
+  for (i = 0; i < sizeof (nonce); i++)
+    nonce[i] = g_random_int_range (0, 256);
+  sock->key = g_base64_encode (nonce, sizeof (nonce));
+
+  request = g_strdup_printf ("GET %s HTTP/1.1\r\n"
+      "Host: %s:%u\r\n"
+      "Upgrade: websocket\r\n"
+      "Connection: Upgrade\r\n"
+      "Sec-WebSocket-Key: %s\r\n"
+      "Sec-WebSocket-Version: 13\r\n"
+      "Sec-WebSocket-Protocol: " AUR_CBOR_WEBSOCKET_PROTOCOL ", aurena\r\n"
+      "Sec-WebSocket-Extensions: permessage-deflate\r\n"
+      "\r\n", sock->path, sock->host, sock->port, sock->key);
+  ret = write_all (sock, request, strlen (request));
+  g_free (request);
+
+  return ret;
+}
+
+static void
+connect_done (GSocketClient * connector, GAsyncResult * res,
+    AurClientSocket * sock)
+{
+  GSocketConnection *conn;
+  GSocket *socket;
+  GError *err = NULL;
+
+  conn = g_socket_client_connect_to_host_finish (connector, res, &err);
+  if (conn == NULL) {
+    if (!g_error_matches (err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+      g_print ("Failed to connect to %s:%u: %s\n", sock->host, sock->port,
+          err->message);
+      socket_closed (sock, FALSE);
+    }
+    g_error_free (err);
+    g_object_unref (sock);
+    return;
+  }
+
+  sock->conn = conn;
+  socket = g_socket_connection_get_socket (conn);
+
+  /* Reads are driven from the main loop, and never block it */
+  g_socket_set_blocking (socket, FALSE);
+  sock->io = g_io_channel_unix_new (g_socket_get_fd (socket));
+  g_io_channel_set_encoding (sock->io, NULL, NULL);
+  g_io_channel_set_buffered (sock->io, FALSE);
+
+  sock->response = g_string_new (NULL);
+  if (!send_handshake (sock)) {
+    socket_closed (sock, FALSE);
+    g_object_unref (sock);
+    return;
+  }
+
+  sock->io_source = g_io_create_watch (sock->io,
+      G_IO_IN | G_IO_HUP | G_IO_ERR);
+  g_source_set_callback (sock->io_source,
+      (GSourceFunc) aur_client_socket_io_cb, sock, NULL);
+  g_source_attach (sock->io_source, sock->context);
+
+  g_object_unref (sock);
+}
+
+/* Start connecting to the websocket at path on the server. Callbacks
+ * run in the given main context, or the default one if NULL */
+AurClientSocket *
+aur_client_socket_new (GMainContext * context, const gchar * host,
+    guint port, const gchar * path)
+{
+  AurClientSocket *sock = g_object_new (AUR_TYPE_CLIENT_SOCKET, NULL);
+  GSocketClient *connector;
+
+  sock->host = g_strdup (host);
+  sock->port = port;
+  sock->path = g_strdup (path);
+  if (context)
+    sock->context = g_main_context_ref (context);
+
+  sock->cancellable = g_cancellable_new ();
+
+  connector = g_socket_client_new ();
+  g_socket_client_set_timeout (connector, CONNECT_TIMEOUT);
+
+  /* The connection completes in the thread-default context */
+  if (context)
+    g_main_context_push_thread_default (context);
+  g_socket_client_connect_to_host_async (connector, host, port,
+      sock->cancellable, (GAsyncReadyCallback) connect_done,
+      g_object_ref (sock));
+  if (context)
+    g_main_context_pop_thread_default (context);
+
+  g_object_unref (connector);
+
+  return sock;
+}
+
+/* Send a message to the server, in a binary frame if CBOR was agreed and
+ * a text frame otherwise. Returns FALSE if it couldn't be written */
+gboolean
+aur_client_socket_send_message (AurClientSocket * sock, const gchar * data,
+    gsize len)
+{
+  guint8 opcode = sock->cbor ? AUR_WEBSOCKET_OP_BINARY : AUR_WEBSOCKET_OP_TEXT;
+  guint32 mask = g_random_int ();
+  gsize header_len = 2;
+  gchar *frame;
+  gboolean ret;
+
+  if (!sock->connected)
+    return FALSE;
+
+  frame = g_malloc (14 + len);
+  frame[0] = 0x80 | opcode;
+  if (len < 126) {
+    frame[1] = 0x80 | len;
+  } else if (len <= G_MAXUINT16) {
+    frame[1] = 0x80 | 126;
+    GST_WRITE_UINT16_BE (frame + 2, len);
+    header_len = 4;
+  } else {
+    frame[1] = 0x80 | 127;
+    GST_WRITE_UINT64_BE (frame + 2, len);
+    header_len = 10;
+  }
+
+  memcpy (frame + header_len, &mask, 4);
+  memcpy (frame + header_len + 4, data, len);
+  aur_websocket_mask (frame + header_len + 4, len, frame + header_len, 0);
+
+  ret = write_all (sock, frame, header_len + 4 + len);
+  g_free (frame);
+
+  return ret;
+}
+
+/* Close the connection from this end. Doesn't emit closed */
+void
+aur_client_socket_close (AurClientSocket * sock)
+{
+  if (sock->connected) {
+    gchar status[2];
+
+    GST_WRITE_UINT16_BE (status, 1000);
+    aur_client_socket_send_frame (AUR_WEBSOCKET_PARSER (sock),
+        AUR_WEBSOCKET_OP_CLOSE, status, 2);
+  }
+
+  aur_client_socket_teardown (sock);
+}
@@ -0,0 +1,77 @@
+/* GStreamer
+ * Copyright (C) 2012-2014 Jan Schmidt <thaytan@noraisin.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __AUR_CLIENT_SOCKET_H__
+#define __AUR_CLIENT_SOCKET_H__
+
+#include <gio/gio.h>
+
+#include <src/common/aur-types.h>
+#include <src/common/aur-websocket-parser.h>
+
+G_BEGIN_DECLS
+
+#define AUR_TYPE_CLIENT_SOCKET (aur_client_socket_get_type ())
+
+typedef struct _AurClientSocketClass AurClientSocketClass;
+
+/* The client end of an event channel websocket. Messages arrive through
+ * the parser's message-received signal, in CBOR if the server agreed to
+ * it and JSON otherwise */
+struct _AurClientSocket
+{
+  AurWebSocketParser parent;
+
+  gchar *host;
+  guint port;
+  gchar *path;
+  GMainContext *context;
+
+  GCancellable *cancellable;
+  GSocketConnection *conn;
+  GIOChannel *io;
+  GSource *io_source;
+
+  /* Handshake in progress */
+  gchar *key;
+  GString *response;
+
+  gboolean connected;
+  gboolean cbor;
+
+  /* Last time anything, including a ping, arrived */
+  gint64 last_activity;
+};
+
+struct _AurClientSocketClass
+{
+  AurWebSocketParserClass parent;
+};
+
+GType aur_client_socket_get_type(void);
+
+AurClientSocket *aur_client_socket_new (GMainContext *context,
+    const gchar *host, guint port, const gchar *path);
+gboolean aur_client_socket_send_message (AurClientSocket *sock,
+    const gchar *data, gsize len);
+void aur_client_socket_close (AurClientSocket *sock);
+
+G_END_DECLS
+
+#endif
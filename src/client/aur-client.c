@@ -44,8 +44,11 @@
 #include <netdb.h>
 #endif
 
-#include "src/common/aur-json.h"
+#include "src/common/aur-cbor.h"
+#include "src/common/aur-msg-reader.h"
+#include "src/common/aur-msg-writer.h"
 #include "aur-client.h"
+#include "aur-client-socket.h"
 
 G_DEFINE_TYPE (AurClient, aur_client, G_TYPE_OBJECT);
 
@@ -53,6 +56,10 @@ G_DEFINE_TYPE (AurClient, aur_client, G_TYPE_OBJECT);
 #define g_print(...) __android_log_print(ANDROID_LOG_ERROR, "aurena", __VA_ARGS__)
 #endif
 
+/* Seconds without any traffic from the server before giving up on the
+ * connection */
+#define CONN_IDLE_TIMEOUT 20
+
 enum
 {
   PROP_0,
@@ -93,6 +100,8 @@ static void search_for_server (AurClient * client);
 static void connect_to_server (AurClient * client, const gchar * server,
     int port);
 static void construct_player (AurClient * client);
+static void refresh_clients_array (AurClient * client);
+static void clear_player_deltas (AurClient * client);
 
 static void
 free_player_info (GArray * player_info)
@@ -138,15 +147,82 @@ get_flag_from_msg (SoupMessage * msg)
   return flag;
 }
 
+/* The server answers in CBOR if asked to and it knows how, and in JSON
+ * otherwise */
+static void
+request_cbor (SoupMessage * msg)
+{
+  soup_message_headers_replace (msg->request_headers, "Accept",
+      AUR_CBOR_CONTENT_TYPE ", application/json");
+}
+
+static gboolean
+is_cbor_response (SoupMessage * msg)
+{
+  const gchar *type =
+      soup_message_headers_get_content_type (msg->response_headers, NULL);
+
+  return type != NULL && g_ascii_strcasecmp (type, AUR_CBOR_CONTENT_TYPE) == 0;
+}
+
+static AurClientSocket **
+get_socket_for_flag (AurClient * client, AurClientFlags flag)
+{
+  if (flag == AUR_CLIENT_PLAYER)
+    return &client->player_socket;
+  return &client->controller_socket;
+}
+
+static void
+drop_socket (AurClient * client, AurClientFlags flag)
+{
+  AurClientSocket **sock = get_socket_for_flag (client, flag);
+
+  if (*sock) {
+    g_signal_handlers_disconnect_by_data (*sock, client);
+    aur_client_socket_close (*sock);
+    g_object_unref (*sock);
+    *sock = NULL;
+  }
+}
+
+static void handle_disconnect (AurClient * client, AurClientFlags flag);
+
+/* When it has nothing else to send, the server pings websocket clients
+ * at least every 16 seconds, which the socket notes itself. Chunked
+ * event channels get a keepalive after 2 seconds of silence, to stay
+ * inside the session's 5 second I/O timeout */
 static gboolean
 conn_idle_timeout (AurClient * client)
 {
+  gint64 last_activity = client->last_activity;
+
+  if (client->player_socket)
+    last_activity = MAX (last_activity, client->player_socket->last_activity);
+  if (client->controller_socket)
+    last_activity =
+        MAX (last_activity, client->controller_socket->last_activity);
+
+  if (g_get_monotonic_time () - last_activity <
+      CONN_IDLE_TIMEOUT * G_USEC_PER_SEC)
+    return TRUE;
+
   client->idle_timeout = 0;
 
   if (client->msg) {
     g_print ("Connection timed out\n");
     soup_session_cancel_message (client->soup, client->msg, 200);
   }
+  if (client->player_socket) {
+    g_print ("Player connection timed out\n");
+    drop_socket (client, AUR_CLIENT_PLAYER);
+    handle_disconnect (client, AUR_CLIENT_PLAYER);
+  }
+  if (client->controller_socket) {
+    g_print ("Controller connection timed out\n");
+    drop_socket (client, AUR_CLIENT_CONTROLLER);
+    handle_disconnect (client, AUR_CLIENT_CONTROLLER);
+  }
 
   return FALSE;
 }
@@ -157,21 +233,35 @@ handle_connection_closed_cb (G_GNUC_UNUSED SoupSession * session,
 {
   AurClientFlags flag = get_flag_from_msg (msg);
 
-  client->connecting &= ~flag;
-
-  if (client->idle_timeout) {
-    g_source_remove (client->idle_timeout);
-    client->idle_timeout = 0;
-  }
-
-  if (msg->status_code == SOUP_STATUS_CANCELLED)
+  if (msg->status_code == SOUP_STATUS_CANCELLED) {
+    client->connecting &= ~flag;
+    if (client->idle_timeout) {
+      g_source_remove (client->idle_timeout);
+      client->idle_timeout = 0;
+    }
     return;
+  }
 
   if (client->was_connected & flag) {
     g_print ("%s disconnected from server. Reason %s status %d\n",
         flag == AUR_CLIENT_PLAYER ? "Player" : "Controller",
         msg->reason_phrase, msg->status_code);
   }
+  handle_disconnect (client, flag);
+}
+
+/* An event channel closed, other than by our cancelling it. Drop the
+ * state it carried and try again shortly */
+static void
+handle_disconnect (AurClient * client, AurClientFlags flag)
+{
+  client->connecting &= ~flag;
+
+  if (client->idle_timeout) {
+    g_source_remove (client->idle_timeout);
+    client->idle_timeout = 0;
+  }
+
   client->was_connected &= ~flag;
 
   if (flag == AUR_CLIENT_PLAYER && client->player)
@@ -182,6 +272,25 @@ handle_connection_closed_cb (G_GNUC_UNUSED SoupSession * session,
     client->player_info = NULL;
     g_signal_emit (client, signals[SIGNAL_PLAYER_INFO_CHANGED], 0);
   }
+  clear_player_deltas (client);
+
+  if (flag == AUR_CLIENT_CONTROLLER)
+    client->socket_controls = FALSE;
+
+  /* Commands sent on the lost connection won't be answered now */
+  if (flag == AUR_CLIENT_CONTROLLER &&
+      g_hash_table_size (client->pending_controls) > 0) {
+    g_print ("%u control commands went unacknowledged\n",
+        g_hash_table_size (client->pending_controls));
+    g_hash_table_remove_all (client->pending_controls);
+  }
+
+  /* Commands in the batch so far were never sent. Later ones start a
+   * new batch on the next connection */
+  if (flag == AUR_CLIENT_CONTROLLER && client->batch_started) {
+    g_print ("Controller connection lost, batch dropped\n");
+    client->batch_started = FALSE;
+  }
 
   if (client->timeout == 0) {
     client->timeout =
@@ -201,7 +310,7 @@ handle_connection_closed_cb (G_GNUC_UNUSED SoupSession * session,
 }
 
 static void
-handle_player_enrol_message (AurClient * client, GstStructure * s)
+handle_player_enrol_message (AurClient * client, const AurMsgObject * msg)
 {
   int clock_port;
   gint64 tmp;
@@ -209,17 +318,17 @@ handle_player_enrol_message (AurClient * client, GstStructure * s)
   gchar *server_ip_str = NULL;
   gdouble new_vol;
 
-  if (!aur_json_structure_get_int (s, "clock-port", &clock_port))
+  if (!aur_msg_object_get_int (msg, "clock-port", &clock_port))
     return;                     /* Invalid message */
 
-  if (!aur_json_structure_get_int64 (s, "current-time", &tmp))
+  if (!aur_msg_object_get_int64 (msg, "current-time", &tmp))
     return;                     /* Invalid message */
   cur_time = (GstClockTime) (tmp);
 
   if (client->player == NULL)
     construct_player (client);
 
-  if (aur_json_structure_get_double (s, "volume-level", &new_vol)) {
+  if (aur_msg_object_get_double (msg, "volume-level", &new_vol)) {
     if (client->player == NULL)
       construct_player (client);
 
@@ -230,8 +339,8 @@ handle_player_enrol_message (AurClient * client, GstStructure * s)
     }
   }
 
-  aur_json_structure_get_boolean (s, "enabled", &client->enabled);
-  aur_json_structure_get_boolean (s, "paused", &client->paused);
+  aur_msg_object_get_boolean (msg, "enabled", &client->enabled);
+  aur_msg_object_get_boolean (msg, "paused", &client->paused);
 
 #if GLIB_CHECK_VERSION(2,22,0)
   {
@@ -420,35 +529,36 @@ set_media (AurClient * client)
 }
 
 static void
-handle_player_set_media_message (AurClient * client, GstStructure * s)
+handle_player_set_media_message (AurClient * client, const AurMsgObject * msg)
 {
-  const gchar *protocol, *path, *language;
+  gchar *protocol, *path;
   int port;
   gint64 tmp;
 
-  protocol = gst_structure_get_string (s, "resource-protocol");
-  path = gst_structure_get_string (s, "resource-path");
+  protocol = aur_msg_object_dup_string (msg, "resource-protocol");
+  path = aur_msg_object_dup_string (msg, "resource-path");
 
   if (protocol == NULL || path == NULL)
-    return;                     /* Invalid message */
+    goto done;                  /* Invalid message */
 
-  if (!aur_json_structure_get_int (s, "resource-port", &port))
-    return;
+  if (!aur_msg_object_get_int (msg, "resource-port", &port))
+    goto done;
 
-  if (!aur_json_structure_get_int64 (s, "base-time", &tmp))
-    return;                     /* Invalid message */
+  if (!aur_msg_object_get_int64 (msg, "base-time", &tmp))
+    goto done;                  /* Invalid message */
   client->base_time = (GstClockTime) (tmp);
 
-  if (!aur_json_structure_get_int64 (s, "position", &tmp))
-    return;                     /* Invalid message */
+  if (!aur_msg_object_get_int64 (msg, "position", &tmp))
+    goto done;                  /* Invalid message */
   client->position = (GstClockTime) (tmp);
 
-  if (!aur_json_structure_get_boolean (s, "paused", &client->paused))
-    return;
+  if (!aur_msg_object_get_boolean (msg, "paused", &client->paused))
+    goto done;
 
   g_free (client->language);
-  language = gst_structure_get_string (s, "language");
-  client->language = g_strdup (language ? language : "en");
+  client->language = aur_msg_object_dup_string (msg, "language");
+  if (client->language == NULL)
+    client->language = g_strdup ("en");
 
   g_free (client->uri);
   client->uri = g_strdup_printf ("%s://%s:%d%s", protocol,
@@ -459,14 +569,18 @@ handle_player_set_media_message (AurClient * client, GstStructure * s)
 
   g_object_notify (G_OBJECT (client), "language");
   g_object_notify (G_OBJECT (client), "media-uri");
+
+done:
+  g_free (protocol);
+  g_free (path);
 }
 
 static void
-handle_player_play_message (AurClient * client, GstStructure * s)
+handle_player_play_message (AurClient * client, const AurMsgObject * msg)
 {
   gint64 tmp;
 
-  if (!aur_json_structure_get_int64 (s, "base-time", &tmp))
+  if (!aur_msg_object_get_int64 (msg, "base-time", &tmp))
     return;                     /* Invalid message */
 
   client->base_time = (GstClockTime) (tmp);
@@ -487,12 +601,12 @@ handle_player_play_message (AurClient * client, GstStructure * s)
 }
 
 static void
-handle_player_pause_message (AurClient * client, GstStructure * s)
+handle_player_pause_message (AurClient * client, const AurMsgObject * msg)
 {
   GstClockTime old_position = client->position;
   gint64 tmp;
 
-  if (!aur_json_structure_get_int64 (s, "position", &tmp))
+  if (!aur_msg_object_get_int64 (msg, "position", &tmp))
     return;                     /* Invalid message */
 
   client->position = (GstClockTime) (tmp);
@@ -514,16 +628,16 @@ handle_player_pause_message (AurClient * client, GstStructure * s)
 }
 
 static void
-handle_player_seek_message (AurClient * client, GstStructure * s)
+handle_player_seek_message (AurClient * client, const AurMsgObject * msg)
 {
   GstClockTime old_position = client->position;
   gint64 tmp;
 
-  if (!aur_json_structure_get_int64 (s, "base-time", &tmp))
+  if (!aur_msg_object_get_int64 (msg, "base-time", &tmp))
     return;                     /* Invalid message */
   client->base_time = (GstClockTime) tmp;
 
-  if (!aur_json_structure_get_int64 (s, "position", &tmp))
+  if (!aur_msg_object_get_int64 (msg, "position", &tmp))
     return;                     /* Invalid message */
   client->position = (GstClockTime) (tmp);
 
@@ -547,11 +661,11 @@ handle_player_seek_message (AurClient * client, GstStructure * s)
 }
 
 static void
-handle_player_set_volume_message (AurClient * client, GstStructure * s)
+handle_player_set_volume_message (AurClient * client, const AurMsgObject * msg)
 {
   gdouble new_vol;
 
-  if (!aur_json_structure_get_double (s, "level", &new_vol))
+  if (!aur_msg_object_get_double (msg, "level", &new_vol))
     return;
 
   if (client->player == NULL)
@@ -565,11 +679,11 @@ handle_player_set_volume_message (AurClient * client, GstStructure * s)
 }
 
 static void
-handle_player_set_client_message (AurClient * client, GstStructure * s)
+handle_player_set_client_message (AurClient * client, const AurMsgObject * msg)
 {
   gboolean enabled;
 
-  if (!aur_json_structure_get_boolean (s, "enabled", &enabled))
+  if (!aur_msg_object_get_boolean (msg, "enabled", &enabled))
     return;
 
   if (enabled == client->enabled)
@@ -588,16 +702,16 @@ handle_player_set_client_message (AurClient * client, GstStructure * s)
 }
 
 static void
-handle_player_language_message (AurClient * client, GstStructure * s)
+handle_player_language_message (AurClient * client, const AurMsgObject * msg)
 {
-  const gchar *language;
+  gchar *language;
 
-  language = gst_structure_get_string (s, "language");
+  language = aur_msg_object_dup_string (msg, "language");
   if (!language)
     return;
 
   g_free (client->language);
-  client->language = g_strdup (language);
+  client->language = language;
 
   if (client->enabled && client->player)
     set_language (client);
@@ -606,162 +720,391 @@ handle_player_language_message (AurClient * client, GstStructure * s)
 }
 
 static void
-handle_player_message (AurClient * client, GstStructure * s)
+handle_controller_enrol_message (AurClient * client, const AurMsgObject * msg)
 {
-  const gchar *msg_type;
+  if (aur_msg_object_get_double (msg, "volume-level", &client->volume))
+    g_object_notify (G_OBJECT (client), "volume");
 
-  msg_type = gst_structure_get_string (s, "msg-type");
-  if (msg_type == NULL || g_str_equal (msg_type, "ping"))
-    return;
+  if (!(client->flags & AUR_CLIENT_PLAYER)) {
+    if (aur_msg_object_get_boolean (msg, "paused", &client->paused))
+      g_object_notify (G_OBJECT (client), "paused");
+  }
 
-  if (g_str_equal (msg_type, "enrol"))
-    handle_player_enrol_message (client, s);
-  else if (g_str_equal (msg_type, "set-media"))
-    handle_player_set_media_message (client, s);
-  else if (g_str_equal (msg_type, "play"))
-    handle_player_play_message (client, s);
-  else if (g_str_equal (msg_type, "pause"))
-    handle_player_pause_message (client, s);
-  else if (g_str_equal (msg_type, "volume"))
-    handle_player_set_volume_message (client, s);
-  else if (g_str_equal (msg_type, "client-setting"))
-    handle_player_set_client_message (client, s);
-  else if (g_str_equal (msg_type, "seek"))
-    handle_player_seek_message (client, s);
-  else if (g_str_equal (msg_type, "language"))
-    handle_player_language_message (client, s);
-  else
-    g_print ("Unhandled player event of type %s\n", msg_type);
+  /* Older servers accept the controller websocket but ignore anything
+   * sent on it, so commands only go that way once the server says so */
+  if (!aur_msg_object_get_boolean (msg, "socket-control",
+          &client->socket_controls))
+    client->socket_controls = FALSE;
 }
 
-static void
-handle_controller_enrol_message (AurClient * client, GstStructure * s)
+static gboolean
+parse_player_entry (const AurMsgObject * entry, AurPlayerInfo * info)
 {
-  if (aur_json_structure_get_double (s, "volume-level", &client->volume))
-    g_object_notify (G_OBJECT (client), "volume");
+  gint64 client_id;
 
-  if (!(client->flags & AUR_CLIENT_PLAYER)) {
-    if (aur_json_structure_get_boolean (s, "paused", &client->paused))
-      g_object_notify (G_OBJECT (client), "paused");
+  if (!aur_msg_object_get_int64 (entry, "client-id", &client_id))
+    return FALSE;
+  info->id = client_id;
+
+  if (!aur_msg_object_get_boolean (entry, "enabled", &info->enabled))
+    return FALSE;
+
+  if (!aur_msg_object_get_double (entry, "volume", &info->volume))
+    return FALSE;
+
+  if (!(info->host = aur_msg_object_dup_string (entry, "host")))
+    return FALSE;
+
+  return TRUE;
+}
+
+static gint
+find_player_entry (GArray * player_info, guint id)
+{
+  guint i;
+
+  for (i = 0; i < player_info->len; i++) {
+    if (g_array_index (player_info, AurPlayerInfo, i).id == id)
+      return i;
   }
+
+  return -1;
 }
 
+/* The full player list, from the event channel or /client/player_info */
 static void
-handle_player_info (G_GNUC_UNUSED SoupSession * session, SoupMessage * msg,
-    AurClient * client)
+handle_controller_player_clients_message (AurClient * client,
+    const AurMsgObject * msg)
 {
-  SoupBuffer *buffer;
+  AurMsgIter iter;
+  AurMsgObject entry;
+  GArray *player_info = NULL;
+  gint64 seq = -1;
 
-  if (msg->status_code < 200 || msg->status_code >= 300)
+  if (!aur_msg_object_get_array (msg, "player-clients", &iter))
     return;
 
-  buffer = soup_message_body_flatten (msg->response_body);
-  if (json_parser_load_from_data (client->json, buffer->data, buffer->length,
-          NULL)) {
-    const GValue *v1;
-    GArray *player_info = NULL;
-    gsize i;
-    JsonNode *root = json_parser_get_root (client->json);
-    GstStructure *s1 = aur_json_to_gst_structure (root);
+  player_info = g_array_new (TRUE, TRUE, sizeof (AurPlayerInfo));
 
-    if (s1 == NULL)
-      return;                   /* Invalid chunk */
+  while (aur_msg_iter_next_object (&iter, &entry)) {
+    AurPlayerInfo info;
 
-    v1 = gst_structure_get_value (s1, "player-clients");
-    if (!GST_VALUE_HOLDS_ARRAY (v1))
-      goto failed;
+    if (!parse_player_entry (&entry, &info)) {
+      free_player_info (player_info);
+      return;
+    }
 
-    player_info = g_array_sized_new (TRUE, TRUE,
-        sizeof (AurPlayerInfo), gst_value_array_get_size (v1));
+    g_array_append_val (player_info, info);
+  }
 
-    for (i = 0; i < gst_value_array_get_size (v1); i++) {
-      AurPlayerInfo info;
-      const GValue *v2 = gst_value_array_get_value (v1, i);
-      const GstStructure *s2;
-      gint64 client_id;
+  /* Older servers don't number their lists, and announce changes with
+   * player-clients-changed instead */
+  aur_msg_object_get_int64 (msg, "seq", &seq);
 
-      if (!GST_VALUE_HOLDS_STRUCTURE (v2))
-        goto failed;
+  free_player_info (client->player_info);
+  client->player_info = player_info;
+  client->player_info_seq = seq;
 
-      s2 = gst_value_get_structure (v2);
-      if (!aur_json_structure_get_int64 (s2, "client-id", &client_id))
-        goto failed;
-      info.id = client_id;
+  g_signal_emit (client, signals[SIGNAL_PLAYER_INFO_CHANGED], 0);
+}
 
-      if (!aur_json_structure_get_boolean (s2, "enabled", &info.enabled))
-        goto failed;
+/* A player list delta, parsed so it can be held on to while the full
+ * list is being fetched */
+typedef struct
+{
+  gint64 seq;
+  GArray *removed;              /* client ids */
+  GArray *added;                /* AurPlayerInfo */
+  GArray *changed;              /* AurPlayerInfo */
+} AurPlayerDelta;
 
-      if (!aur_json_structure_get_double (s2, "volume", &info.volume))
-        goto failed;
+static void
+player_delta_free (AurPlayerDelta * delta)
+{
+  g_array_free (delta->removed, TRUE);
+  free_player_info (delta->added);
+  free_player_info (delta->changed);
+  g_free (delta);
+}
 
-      if (!(info.host = g_strdup (gst_structure_get_string (s2, "host"))))
-        goto failed;
+static void
+clear_player_deltas (AurClient * client)
+{
+  AurPlayerDelta *delta;
 
+  while ((delta = g_queue_pop_head (&client->player_info_deltas)))
+    player_delta_free (delta);
+}
+
+/* Parse the entries of one of a delta's arrays into player_info */
+static void
+parse_delta_entries (const AurMsgObject * msg, const gchar * fieldname,
+    GArray * player_info)
+{
+  AurMsgIter iter;
+  AurMsgObject entry;
+  AurPlayerInfo info;
+
+  if (!aur_msg_object_get_array (msg, fieldname, &iter))
+    return;
+
+  while (aur_msg_iter_next_object (&iter, &entry)) {
+    if (parse_player_entry (&entry, &info))
       g_array_append_val (player_info, info);
+  }
+}
+
+static AurPlayerDelta *
+parse_player_delta (const AurMsgObject * msg, gint64 seq)
+{
+  AurPlayerDelta *delta = g_new0 (AurPlayerDelta, 1);
+  AurMsgIter iter;
+  AurMsgObject entry;
+  gint64 client_id;
+
+  delta->seq = seq;
+  delta->removed = g_array_new (FALSE, FALSE, sizeof (guint));
+  delta->added = g_array_new (TRUE, TRUE, sizeof (AurPlayerInfo));
+  delta->changed = g_array_new (TRUE, TRUE, sizeof (AurPlayerInfo));
+
+  if (aur_msg_object_get_array (msg, "removed", &iter)) {
+    while (aur_msg_iter_next_object (&iter, &entry)) {
+      if (aur_msg_object_get_int64 (&entry, "client-id", &client_id)) {
+        guint id = client_id;
+        g_array_append_val (delta->removed, id);
+      }
     }
+  }
+  parse_delta_entries (msg, "added", delta->added);
+  parse_delta_entries (msg, "changed", delta->changed);
 
-    free_player_info (client->player_info);
-    client->player_info = player_info;
-    player_info = NULL;
+  return delta;
+}
+
+static gboolean
+apply_removed_entry (AurClient * client, guint client_id)
+{
+  gint index;
+
+  index = find_player_entry (client->player_info, client_id);
+  if (index < 0)
+    return FALSE;
+
+  g_free (g_array_index (client->player_info, AurPlayerInfo, index).host);
+  g_array_remove_index (client->player_info, index);
+
+  return TRUE;
+}
+
+static void
+apply_added_entry (AurClient * client, const AurPlayerInfo * entry)
+{
+  AurPlayerInfo info = *entry;
+  gint index;
+
+  info.host = g_strdup (entry->host);
+
+  index = find_player_entry (client->player_info, info.id);
+  if (index >= 0) {
+    AurPlayerInfo *old = &g_array_index (client->player_info,
+        AurPlayerInfo, index);
+    g_free (old->host);
+    *old = info;
+  } else {
+    g_array_append_val (client->player_info, info);
+  }
+}
+
+/* Changed volume or setting, reported through the same signals as the
+ * individual client-volume and client-setting messages */
+static void
+apply_changed_entry (AurClient * client, const AurPlayerInfo * info)
+{
+  AurPlayerInfo *cur;
+  gint index;
+
+  index = find_player_entry (client->player_info, info->id);
+  if (index < 0)
+    return;
 
+  cur = &g_array_index (client->player_info, AurPlayerInfo, index);
+  if (cur->volume != info->volume) {
+    cur->volume = info->volume;
+    g_signal_emit (client, signals[SIGNAL_CLIENT_VOLUME_CHANGED], 0,
+        cur->id, cur->volume);
+  }
+  if (cur->enabled != info->enabled) {
+    cur->enabled = info->enabled;
+    g_signal_emit (client, signals[SIGNAL_CLIENT_SETTING_CHANGED], 0,
+        cur->id, cur->enabled);
+  }
+}
+
+/* Apply a delta if it's the next change to the player list. Returns FALSE
+ * if there's a gap, and the whole list needs fetching again */
+static gboolean
+apply_player_delta (AurClient * client, const AurPlayerDelta * delta)
+{
+  gboolean changed = FALSE;
+  guint i;
+
+  if (client->player_info == NULL || client->player_info_seq < 0 ||
+      delta->seq > client->player_info_seq + 1) {
+    g_print ("Player list out of date (%" G_GINT64_FORMAT " -> %"
+        G_GINT64_FORMAT "), fetching it\n", client->player_info_seq,
+        delta->seq);
+    return FALSE;
+  }
+  if (delta->seq <= client->player_info_seq)
+    return TRUE;                /* Already included */
+
+  client->player_info_seq = delta->seq;
+
+  for (i = 0; i < delta->removed->len; i++)
+    changed |= apply_removed_entry (client,
+        g_array_index (delta->removed, guint, i));
+  for (i = 0; i < delta->added->len; i++) {
+    apply_added_entry (client,
+        &g_array_index (delta->added, AurPlayerInfo, i));
+    changed = TRUE;
+  }
+  for (i = 0; i < delta->changed->len; i++)
+    apply_changed_entry (client,
+        &g_array_index (delta->changed, AurPlayerInfo, i));
+
+  if (changed)
     g_signal_emit (client, signals[SIGNAL_PLAYER_INFO_CHANGED], 0);
 
-  failed:
-    if (player_info)
-      free_player_info (player_info);
-    gst_structure_free (s1);
+  return TRUE;
+}
+
+/* Bring a freshly fetched list up to date with the deltas that arrived
+ * while it was being fetched. The ones it already includes are skipped */
+static void
+apply_pending_player_deltas (AurClient * client)
+{
+  AurPlayerDelta *delta;
+
+  while ((delta = g_queue_pop_head (&client->player_info_deltas))) {
+    gboolean applied = apply_player_delta (client, delta);
+
+    player_delta_free (delta);
+    if (!applied) {
+      clear_player_deltas (client);
+      refresh_clients_array (client);
+      return;
+    }
   }
 }
 
+static void
+handle_player_info (G_GNUC_UNUSED SoupSession * session, SoupMessage * msg,
+    AurClient * client)
+{
+  SoupBuffer *buffer;
+  AurMsgObject list;
+  gboolean loaded;
+
+  client->player_info_fetching = FALSE;
+
+  if (msg->status_code < 200 || msg->status_code >= 300) {
+    clear_player_deltas (client);
+    return;
+  }
+
+  /* A CBOR list is read from the body in place */
+  buffer = soup_message_body_flatten (msg->response_body);
+  if (is_cbor_response (msg))
+    loaded = aur_msg_reader_load_cbor (client->reader, buffer->data,
+        buffer->length, &list);
+  else
+    loaded = aur_msg_reader_load_json (client->reader, buffer->data,
+        buffer->length, &list);
+
+  if (loaded)
+    handle_controller_player_clients_message (client, &list);
+  soup_buffer_free (buffer);
+
+  apply_pending_player_deltas (client);
+}
+
 static void
 refresh_clients_array (AurClient * client)
 {
   SoupMessage *soup_msg;
   gchar *uri;
 
-  if (client->shutting_down)
+  if (client->shutting_down || client->player_info_fetching)
     return;
 
   uri = g_strdup_printf ("http://%s:%u/client/player_info",
       client->connected_server, client->connected_port);
   soup_msg = soup_message_new ("GET", uri);
+  request_cbor (soup_msg);
   soup_session_queue_message (client->soup, soup_msg,
       (SoupSessionCallback) handle_player_info, client);
+  client->player_info_fetching = TRUE;
 
   g_free (uri);
 }
 
+/* An incremental change to the player list. Each carries the next
+ * sequence number - on a gap, start again from a full list */
+static void
+handle_controller_player_clients_delta_message (AurClient * client,
+    const AurMsgObject * msg)
+{
+  AurPlayerDelta *delta;
+  gint64 seq;
+
+  if (!aur_msg_object_get_int64 (msg, "seq", &seq))
+    return;
+
+  delta = parse_player_delta (msg, seq);
+
+  /* The list being fetched may or may not include this change, so keep
+   * it until the list is in */
+  if (client->player_info_fetching) {
+    g_queue_push_tail (&client->player_info_deltas, delta);
+    return;
+  }
+
+  if (!apply_player_delta (client, delta))
+    refresh_clients_array (client);
+  player_delta_free (delta);
+}
+
 static void
-handle_controller_set_media_message (AurClient * client, GstStructure * s)
+handle_controller_set_media_message (AurClient * client, const AurMsgObject * msg)
 {
   if (!(client->flags & AUR_CLIENT_PLAYER))
-    handle_player_set_media_message (client, s);
+    handle_player_set_media_message (client, msg);
 
 }
 
 static void
-handle_controller_play_message (AurClient * client, GstStructure * s)
+handle_controller_play_message (AurClient * client, const AurMsgObject * msg)
 {
   if (!(client->flags & AUR_CLIENT_PLAYER))
-    handle_player_play_message (client, s);
+    handle_player_play_message (client, msg);
 }
 
 static void
-handle_controller_pause_message (AurClient * client, GstStructure * s)
+handle_controller_pause_message (AurClient * client, const AurMsgObject * msg)
 {
   if (!(client->flags & AUR_CLIENT_PLAYER))
-    handle_player_pause_message (client, s);
+    handle_player_pause_message (client, msg);
 }
 
 static void
-handle_controller_seek_message (AurClient * client, GstStructure * s)
+handle_controller_seek_message (AurClient * client, const AurMsgObject * msg)
 {
   if (!(client->flags & AUR_CLIENT_PLAYER))
-    handle_player_seek_message (client, s);
+    handle_player_seek_message (client, msg);
 }
 
 static void
-handle_controller_client_volume_message (AurClient * client, GstStructure * s)
+handle_controller_client_volume_message (AurClient * client, const AurMsgObject * msg)
 {
   gint64 client_id;
   gdouble new_vol;
@@ -770,10 +1113,10 @@ handle_controller_client_volume_message (AurClient * client, GstStructure * s)
   if (!client->player_info)
     return;
 
-  if (!aur_json_structure_get_int64 (s, "client-id", &client_id))
+  if (!aur_msg_object_get_int64 (msg, "client-id", &client_id))
     return;
 
-  if (!aur_json_structure_get_double (s, "level", &new_vol))
+  if (!aur_msg_object_get_double (msg, "level", &new_vol))
     return;
 
   for (i = 0; i < client->player_info->len; i++) {
@@ -789,16 +1132,16 @@ handle_controller_client_volume_message (AurClient * client, GstStructure * s)
 }
 
 static void
-handle_controller_volume_message (AurClient * client, GstStructure * s)
+handle_controller_volume_message (AurClient * client, const AurMsgObject * msg)
 {
-  if (!aur_json_structure_get_double (s, "level", &client->volume))
+  if (!aur_msg_object_get_double (msg, "level", &client->volume))
     return;
 
   g_object_notify (G_OBJECT (client), "volume");
 }
 
 static void
-handle_controller_client_setting_message (AurClient * client, GstStructure * s)
+handle_controller_client_setting_message (AurClient * client, const AurMsgObject * msg)
 {
   gint64 client_id;
   gboolean enabled;
@@ -807,10 +1150,10 @@ handle_controller_client_setting_message (AurClient * client, GstStructure * s)
   if (!client->player_info)
     return;
 
-  if (!aur_json_structure_get_int64 (s, "client-id", &client_id))
+  if (!aur_msg_object_get_int64 (msg, "client-id", &client_id))
     return;
 
-  if (!aur_json_structure_get_boolean (s, "enabled", &enabled))
+  if (!aur_msg_object_get_boolean (msg, "enabled", &enabled))
     return;
 
   for (i = 0; i < client->player_info->len; i++) {
@@ -826,69 +1169,149 @@ handle_controller_client_setting_message (AurClient * client, GstStructure * s)
 }
 
 static void
-handle_controller_language_message (AurClient * client, GstStructure * s)
+handle_controller_language_message (AurClient * client, const AurMsgObject * msg)
 {
   if (!(client->flags & AUR_CLIENT_PLAYER))
-    handle_player_language_message (client, s);
+    handle_player_language_message (client, msg);
 }
 
+/* The server's answer to a command sent over the websocket */
 static void
-handle_controller_message (AurClient * client, GstStructure * s)
+handle_controller_control_ack_message (AurClient * client,
+    const AurMsgObject * msg)
 {
-  const gchar *msg_type;
+  const gchar *command;
+  gint64 request_id;
+  gboolean ok = TRUE;
 
-  msg_type = gst_structure_get_string (s, "msg-type");
-  if (msg_type == NULL || g_str_equal (msg_type, "ping"))
+  if (!aur_msg_object_get_int64 (msg, "request-id", &request_id))
     return;
 
-  if (g_str_equal (msg_type, "enrol"))
-    handle_controller_enrol_message (client, s);
-  else if (g_str_equal (msg_type, "player-clients-changed"))
-    refresh_clients_array (client);
-  else if (g_str_equal (msg_type, "client-setting"))
-    handle_controller_client_setting_message (client, s);
-  else if (g_str_equal (msg_type, "client-volume"))
-    handle_controller_client_volume_message (client, s);
-  else if (g_str_equal (msg_type, "volume"))
-    handle_controller_volume_message (client, s);
-  else if (g_str_equal (msg_type, "play"))
-    handle_controller_play_message (client, s);
-  else if (g_str_equal (msg_type, "pause"))
-    handle_controller_pause_message (client, s);
-  else if (g_str_equal (msg_type, "seek"))
-    handle_controller_seek_message (client, s);
-  else if (g_str_equal (msg_type, "set-media"))
-    handle_controller_set_media_message (client, s);
-  else if (g_str_equal (msg_type, "language"))
-    handle_controller_language_message (client, s);
-  else
-    g_print ("Unhandled contorller event of type %s\n", msg_type);
+  command = g_hash_table_lookup (client->pending_controls,
+      GUINT_TO_POINTER ((guint) request_id));
+  if (command == NULL)
+    return;                     /* Sent on an earlier connection */
+
+  aur_msg_object_get_boolean (msg, "ok", &ok);
+  if (!ok) {
+    gchar *error = aur_msg_object_dup_string (msg, "error");
+
+    g_print ("Server refused %s command: %s\n", command,
+        error ? error : "no reason given");
+    g_free (error);
+  }
+
+  g_hash_table_remove (client->pending_controls,
+      GUINT_TO_POINTER ((guint) request_id));
 }
 
 static void
-handle_received_chunk (SoupMessage * msg, SoupBuffer * chunk,
-    AurClient * client)
+handle_controller_player_clients_changed_message (AurClient * client,
+    G_GNUC_UNUSED const AurMsgObject * msg)
 {
-  const gchar *ptr;
-  gsize length;
-  AurClientFlags flag = get_flag_from_msg (msg);
-  JsonNode *root;
-  GstStructure *s;
-  GError *err = NULL;
-  gchar *json_str = NULL;
+  refresh_clients_array (client);
+}
 
-  if (client->was_connected & flag) {
+typedef void (*MessageHandler) (AurClient * client, const AurMsgObject * msg);
+
+typedef struct
+{
+  const gchar *msg_type;
+  MessageHandler handler;
+} MessageHandlerEntry;
+
+/* Messages each kind of event channel understands. Ping has nothing to
+ * do, but isn't unexpected */
+static const MessageHandlerEntry player_handlers[] = {
+  {"ping", NULL},
+  {"enrol", handle_player_enrol_message},
+  {"set-media", handle_player_set_media_message},
+  {"play", handle_player_play_message},
+  {"pause", handle_player_pause_message},
+  {"volume", handle_player_set_volume_message},
+  {"client-setting", handle_player_set_client_message},
+  {"seek", handle_player_seek_message},
+  {"language", handle_player_language_message},
+};
+
+static const MessageHandlerEntry controller_handlers[] = {
+  {"ping", NULL},
+  {"enrol", handle_controller_enrol_message},
+  {"player-clients", handle_controller_player_clients_message},
+  {"player-clients-delta", handle_controller_player_clients_delta_message},
+  {"player-clients-changed", handle_controller_player_clients_changed_message},
+  {"client-setting", handle_controller_client_setting_message},
+  {"client-volume", handle_controller_client_volume_message},
+  {"volume", handle_controller_volume_message},
+  {"play", handle_controller_play_message},
+  {"pause", handle_controller_pause_message},
+  {"seek", handle_controller_seek_message},
+  {"set-media", handle_controller_set_media_message},
+  {"language", handle_controller_language_message},
+  {"control-ack", handle_controller_control_ack_message},
+};
+
+/* msg-type quark -> MessageHandlerEntry, built once in class_init */
+static GHashTable *player_dispatch;
+static GHashTable *controller_dispatch;
+
+static GHashTable *
+build_dispatch_table (const MessageHandlerEntry * entries, guint n_entries)
+{
+  GHashTable *table = g_hash_table_new (NULL, NULL);
+  guint i;
+
+  for (i = 0; i < n_entries; i++) {
+    GQuark q = g_quark_from_static_string (entries[i].msg_type);
+    g_hash_table_insert (table, GUINT_TO_POINTER (q), (gpointer) & entries[i]);
+  }
+
+  return table;
+}
+
+static void
+handle_message (AurClient * client, AurClientFlags flag,
+    const AurMsgObject * msg)
+{
+  GHashTable *table;
+  const MessageHandlerEntry *entry;
+  gchar *msg_type;
+
+  table = flag == AUR_CLIENT_PLAYER ? player_dispatch : controller_dispatch;
+  entry = g_hash_table_lookup (table,
+      GUINT_TO_POINTER (aur_msg_object_get_type (msg)));
+
+  if (entry != NULL) {
+    if (entry->handler)
+      entry->handler (client, msg);
+    return;
+  }
+
+  msg_type = aur_msg_object_dup_string (msg, "msg-type");
+  if (msg_type != NULL) {
+    g_print ("Unhandled %s event of type %s\n",
+        flag == AUR_CLIENT_PLAYER ? "player" : "controller", msg_type);
+    g_free (msg_type);
+  }
+}
+
+/* Called for traffic on either kind of event channel */
+static void
+handle_server_traffic (AurClient * client, AurClientFlags flag)
+{
+  if (!(client->was_connected & flag)) {
     g_print ("Successfully connected %s to server %s:%d\n",
         flag == AUR_CLIENT_PLAYER ? "player" : "controller",
         client->connected_server, client->connected_port);
     client->was_connected |= flag;
   }
 
-  /* Set up or re-trigger 20 second idle timeout for ping messages */
-  if (client->idle_timeout)
-    g_source_remove (client->idle_timeout);
-  client->idle_timeout = g_timeout_add_seconds (20,
-      (GSourceFunc) conn_idle_timeout, client);
+  /* Any traffic, including keepalives, counts. The idle check runs
+   * periodically rather than being re-armed for every chunk */
+  client->last_activity = g_get_monotonic_time ();
+  if (client->idle_timeout == 0)
+    client->idle_timeout = g_timeout_add_seconds (CONN_IDLE_TIMEOUT / 4,
+        (GSourceFunc) conn_idle_timeout, client);
 
 #if HAVE_AVAHI
   /* Successful server connection, stop avahi discovery */
@@ -899,77 +1322,265 @@ handle_received_chunk (SoupMessage * msg, SoupBuffer * chunk,
   }
 #endif
 
-  if (client->json == NULL)
-    client->json = json_parser_new ();
-
-  ptr = memchr (chunk->data, '\0', chunk->length);
-  if (!ptr)
-    return;
+  if (client->reader == NULL)
+    client->reader = aur_msg_reader_new ();
+}
 
-  /* Save remaining portion */
-  ptr += 1;
-  length = (chunk->length - (ptr - chunk->data));
+/* Parse a NUL-terminated JSON message. Passing no length avoids the
+ * UTF-8 validation bug in json-glib 1.0.2 */
+static gboolean
+load_json_message (AurClient * client, const gchar * json_str,
+    AurMsgObject * msg)
+{
+#if 0
+  g_print ("%s\n", json_str);
+#endif
 
-  chunk = soup_message_body_flatten (msg->response_body);
+  if (!aur_msg_reader_load_json (client->reader, json_str, -1, msg)) {
+    g_print ("Failed to parse message '%s'\n", json_str);
+    return FALSE;
+  }
 
-  // Ignore null string chunks
-  if (chunk->length < 2)
-    goto end;
+  return TRUE;
+}
 
-  /* Workaround: Copy to a string to avoid stupid
-   * UTF-8 validation bug in json-glib 1.0.2 */
-  json_str = g_strndup (chunk->data, chunk->length);
+static gboolean
+load_cbor_message (AurClient * client, const guint8 * data, gsize len,
+    AurMsgObject * msg)
+{
+  if (!aur_msg_reader_load_cbor (client->reader, data, len, msg)) {
+    g_print ("Failed to parse binary message of %" G_GSIZE_FORMAT
+        " bytes\n", len);
+    return FALSE;
+  }
 
-#if 0
-  g_print ("%s\n", json_str);
-#endif
+  return TRUE;
+}
 
-  if (!json_parser_load_from_data (client->json, json_str, -1,
-          &err) || err != NULL)
-    goto fail;
+/* Websocket messages arrive whole, in the buffer the parser read them
+ * into */
+static void
+handle_socket_message (AurClientSocket * sock, gchar * data, guint64 len,
+    AurClient * client)
+{
+  AurClientFlags flag = sock == client->player_socket ?
+      AUR_CLIENT_PLAYER : AUR_CLIENT_CONTROLLER;
+  AurMsgObject msg;
+  gboolean loaded;
 
-  root = json_parser_get_root (client->json);
-  s = aur_json_to_gst_structure (root);
+  handle_server_traffic (client, flag);
 
-  if (s == NULL)
-    goto fail;                  /* Invalid chunk */
+  /* Empty messages are keepalives */
+  if (len == 0)
+    return;
 
-  if (flag == AUR_CLIENT_PLAYER)
-    handle_player_message (client, s);
+  /* The parser NUL-terminates a JSON payload */
+  if (sock->cbor)
+    loaded = load_cbor_message (client, (const guint8 *) data, len, &msg);
   else
-    handle_controller_message (client, s);
+    loaded = load_json_message (client, data, &msg);
 
-  gst_structure_free (s);
+  if (loaded)
+    handle_message (client, flag, &msg);
+}
 
-end:
-  g_free (json_str);
+static void
+handle_socket_connected (AurClientSocket * sock, AurClient * client)
+{
+  handle_server_traffic (client, sock == client->player_socket ?
+      AUR_CLIENT_PLAYER : AUR_CLIENT_CONTROLLER);
+}
 
-  soup_message_body_truncate (msg->response_body);
-  /* Put back remaining part */
-  if (length)
-    soup_message_body_append (msg->response_body, SOUP_MEMORY_COPY, ptr,
-        length);
-  return;
+static void
+handle_socket_closed (AurClientSocket * sock, gboolean rejected,
+    AurClient * client)
+{
+  AurClientFlags flag = sock == client->player_socket ?
+      AUR_CLIENT_PLAYER : AUR_CLIENT_CONTROLLER;
 
-fail:{
-    g_print ("Failed to parse message '%s'\n", json_str);
-    if (err) {
-      g_print ("Error: %s\n", err->message);
-      g_error_free (err);
+  drop_socket (client, flag);
+
+  /* An older server, or something in between that doesn't pass the
+   * upgrade through. Fall back to chunked HTTP straight away */
+  if (rejected) {
+    g_print ("Using chunked HTTP for server %s:%d\n",
+        client->connected_server, client->connected_port);
+    client->websocket_refused = TRUE;
+    client->connecting &= ~flag;
+    connect_to_server (client, client->connected_server,
+        client->connected_port);
+    return;
+  }
+
+  if (client->was_connected & flag) {
+    g_print ("%s disconnected from server\n",
+        flag == AUR_CLIENT_PLAYER ? "Player" : "Controller");
+  }
+  handle_disconnect (client, flag);
+}
+
+/* Messages arriving on a chunked event channel. Chunk boundaries don't
+ * follow message boundaries, so bytes collect here until a message is
+ * complete. Kept with the SoupMessage, which doesn't accumulate the body
+ * itself */
+typedef struct
+{
+  GByteArray *buf;
+  /* How much of buf has already been searched for a terminator */
+  gsize scanned;
+} ChunkStream;
+
+static void
+chunk_stream_free (ChunkStream * stream)
+{
+  g_byte_array_free (stream->buf, TRUE);
+  g_free (stream);
+}
+
+/* JSON messages are each followed by a NUL, which also terminates them
+ * in place for the parser. Returns how many bytes were used */
+static gsize
+dispatch_json_messages (AurClient * client, AurClientFlags flag,
+    ChunkStream * stream)
+{
+  gchar *data = (gchar *) stream->buf->data;
+  gchar *end = data + stream->buf->len;
+  gchar *start = data, *ptr = data + stream->scanned;
+
+  while ((ptr = memchr (ptr, '\0', end - ptr)) != NULL) {
+    /* An empty message is a keepalive */
+    if (ptr > start) {
+      AurMsgObject msg;
+
+      if (load_json_message (client, start, &msg))
+        handle_message (client, flag, &msg);
     }
-    goto end;
+    start = ++ptr;
   }
+
+  return start - data;
+}
+
+/* Binary messages each come with a 4 byte big-endian length. Returns
+ * how many bytes were used */
+static gsize
+dispatch_cbor_messages (AurClient * client, AurClientFlags flag,
+    ChunkStream * stream)
+{
+  const guint8 *data = stream->buf->data;
+  gsize used = 0, avail = stream->buf->len;
+
+  while (avail - used >= 4) {
+    guint32 len = GST_READ_UINT32_BE (data + used);
+    AurMsgObject msg;
+
+    if (avail - used - 4 < len)
+      break;
+
+    /* Empty messages are keepalives */
+    if (len > 0 && load_cbor_message (client, data + used + 4, len, &msg))
+      handle_message (client, flag, &msg);
+
+    used += 4 + len;
+  }
+
+  return used;
 }
 
 static void
-connect_to_server (AurClient * client, const gchar * server, int port)
+handle_received_chunk (SoupMessage * msg, SoupBuffer * chunk,
+    AurClient * client)
 {
+  AurClientFlags flag = get_flag_from_msg (msg);
+  ChunkStream *stream = g_object_get_data (G_OBJECT (msg), "aur-stream");
+  gsize used;
+
+  handle_server_traffic (client, flag);
+
+  if (stream == NULL) {
+    stream = g_new0 (ChunkStream, 1);
+    stream->buf = g_byte_array_new ();
+    g_object_set_data_full (G_OBJECT (msg), "aur-stream", stream,
+        (GDestroyNotify) chunk_stream_free);
+  }
+
+  g_byte_array_append (stream->buf, (const guint8 *) chunk->data,
+      chunk->length);
+
+  /* Handlers can cancel the message, which would free the stream */
+  g_object_ref (msg);
+
+  /* Everything that's complete goes out now - several messages can
+   * arrive in one chunk */
+  if (is_cbor_response (msg))
+    used = dispatch_cbor_messages (client, flag, stream);
+  else
+    used = dispatch_json_messages (client, flag, stream);
+
+  /* Keep the start of any partial message, already searched */
+  if (used > 0)
+    g_byte_array_remove_range (stream->buf, 0, used);
+  stream->scanned = stream->buf->len;
+
+  g_object_unref (msg);
+}
+
+/* Open one event channel. Websocket where the server supports it,
+ * otherwise a chunked HTTP response that stays open */
+static void
+connect_event_channel (AurClient * client, AurClientFlags flag,
+    const gchar * server, int port)
+{
+  const gchar *path = flag == AUR_CLIENT_PLAYER ?
+      "/client/player_events" : "/client/control_events";
   SoupMessage *msg;
   char *uri;
 
+  client->connecting |= flag;
+
+  if (!client->websocket_refused) {
+    AurClientSocket *sock;
+
+    drop_socket (client, flag);
+    sock = aur_client_socket_new (client->context, server, port, path);
+    g_signal_connect (sock, "message-received",
+        G_CALLBACK (handle_socket_message), client);
+    g_signal_connect (sock, "connected",
+        G_CALLBACK (handle_socket_connected), client);
+    g_signal_connect (sock, "closed", G_CALLBACK (handle_socket_closed),
+        client);
+    *get_socket_for_flag (client, flag) = sock;
+    return;
+  }
+
+  uri = g_strdup_printf ("http://%s:%u%s", server, port, path);
+  msg = soup_message_new ("GET", uri);
+  request_cbor (msg);
+  /* handle_received_chunk() keeps what it needs */
+  soup_message_body_set_accumulate (msg->response_body, FALSE);
+  g_signal_connect (msg, "got-chunk", (GCallback) handle_received_chunk,
+      client);
+  soup_session_queue_message (client->soup, msg,
+      (SoupSessionCallback) handle_connection_closed_cb, client);
+  g_free (uri);
+}
+
+static void
+connect_to_server (AurClient * client, const gchar * server, int port)
+{
+  gchar *new_server;
+
+  /* Try websockets afresh with each new server */
+  if (g_strcmp0 (server, client->connected_server) != 0 ||
+      port != client->connected_port)
+    client->websocket_refused = FALSE;
+
+  /* server may be the existing connected_server */
+  new_server = g_strdup (server);
   g_free (client->connected_server);
-  client->connected_server = g_strdup (server);
+  client->connected_server = new_server;
   client->connected_port = port;
+  server = new_server;
 
   if (client->shutting_down)
     return;
@@ -979,30 +1590,14 @@ connect_to_server (AurClient * client, const gchar * server, int port)
 
   if (client->flags & AUR_CLIENT_PLAYER
       && !(client->connecting & AUR_CLIENT_PLAYER)) {
-    client->connecting |= AUR_CLIENT_PLAYER;
-
-    uri = g_strdup_printf ("http://%s:%u/client/player_events", server, port);
     g_print ("Attemping to connect player to server %s:%d\n", server, port);
-    msg = soup_message_new ("GET", uri);
-    g_signal_connect (msg, "got-chunk", (GCallback) handle_received_chunk,
-        client);
-    soup_session_queue_message (client->soup, msg,
-        (SoupSessionCallback) handle_connection_closed_cb, client);
-    g_free (uri);
+    connect_event_channel (client, AUR_CLIENT_PLAYER, server, port);
   }
 
   if (client->flags & AUR_CLIENT_CONTROLLER
       && !(client->connecting & AUR_CLIENT_CONTROLLER)) {
     g_print ("Attemping to connect controller to server %s:%d\n", server, port);
-    client->connecting |= AUR_CLIENT_CONTROLLER;
-
-    uri = g_strdup_printf ("http://%s:%u/client/control_events", server, port);
-    msg = soup_message_new ("GET", uri);
-    g_signal_connect (msg, "got-chunk", (GCallback) handle_received_chunk,
-        client);
-    soup_session_queue_message (client->soup, msg,
-        (SoupSessionCallback) handle_connection_closed_cb, client);
-    g_free (uri);
+    connect_event_channel (client, AUR_CLIENT_CONTROLLER, server, port);
   }
 
   g_object_notify (G_OBJECT (client), "connected-server");
@@ -1013,6 +1608,8 @@ aur_client_init (AurClient * client)
 {
   client->server_port = 5457;
   client->paused = TRUE;
+  client->pending_controls = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+  g_queue_init (&client->player_info_deltas);
 }
 
 static void
@@ -1032,7 +1629,7 @@ aur_client_constructed (GObject * object)
     soup_session_add_feature (client->soup,
         SOUP_SESSION_FEATURE (soup_logger_new (SOUP_LOGGER_LOG_BODY, -1)));
 
-  /* Set a 20 second timeout on pings from the server */
+  /* Set a 20 second timeout on traffic from the server */
   g_object_set (G_OBJECT (client->soup), "idle-timeout", 20, NULL);
   /* 5 second timeout before retrying with new connections */
   g_object_set (G_OBJECT (client->soup), "timeout", 5, NULL);
@@ -1134,6 +1731,11 @@ aur_client_class_init (AurClientClass * client_class)
   signals[SIGNAL_PLAYER_INFO_CHANGED] = g_signal_new ("player-info-changed",
       G_TYPE_FROM_CLASS (client_class), G_SIGNAL_RUN_LAST, 0, NULL, NULL,
       NULL, G_TYPE_NONE, 0);
+
+  player_dispatch = build_dispatch_table (player_handlers,
+      G_N_ELEMENTS (player_handlers));
+  controller_dispatch = build_dispatch_table (controller_handlers,
+      G_N_ELEMENTS (controller_handlers));
 }
 
 static void
@@ -1154,8 +1756,11 @@ aur_client_finalize (GObject * object)
     gst_object_unref (client->net_clock);
   if (client->soup)
     g_object_unref (client->soup);
-  if (client->json)
-    g_object_unref (client->json);
+  if (client->reader)
+    aur_msg_reader_free (client->reader);
+  if (client->writer)
+    aur_msg_writer_free (client->writer);
+  g_hash_table_destroy (client->pending_controls);
   if (client->player) {
     gst_object_unref (client->player);
   }
@@ -1167,6 +1772,7 @@ aur_client_finalize (GObject * object)
   g_free (client->uri);
   g_free (client->language);
   free_player_info (client->player_info);
+  clear_player_deltas (client);
 
   G_OBJECT_CLASS (aur_client_parent_class)->finalize (object);
 }
@@ -1178,6 +1784,8 @@ aur_client_dispose (GObject * object)
 
   client->shutting_down = TRUE;
 
+  drop_socket (client, AUR_CLIENT_PLAYER);
+  drop_socket (client, AUR_CLIENT_CONTROLLER);
   if (client->soup)
     soup_session_abort (client->soup);
   if (client->player)
@@ -1448,23 +2056,168 @@ aur_client_submit_msg (AurClient * client, SoupMessage * msg)
     soup_session_queue_message (client->soup, msg, NULL, NULL);
 }
 
-void
-aur_client_set_media (AurClient * client, const gchar * id)
+/* Send a control command as its own HTTP request, with the NULL
+ * terminated name/value pairs as a form */
+static void
+submit_control_request (AurClient * client, const gchar * command,
+    const gchar * first_field, ...)
 {
   SoupMessage *soup_msg;
-  gchar *uri = g_strdup_printf ("http://%s:%u/control/next",
-      client->connected_server, client->connected_port);
+  gchar *uri = g_strdup_printf ("http://%s:%u/control/%s",
+      client->connected_server, client->connected_port, command);
 
-  if (id)
-    soup_msg = soup_form_request_new ("POST", uri, "id", id, NULL);
-  else
+  if (first_field) {
+    gchar *form;
+    va_list args;
+
+    va_start (args, first_field);
+    form = soup_form_encode_valist (first_field, args);
+    va_end (args);
+
+    soup_msg = soup_message_new ("POST", uri);
+    soup_message_set_request (soup_msg, SOUP_FORM_MIME_TYPE_URLENCODED,
+        SOUP_MEMORY_TAKE, form, strlen (form));
+  } else {
     soup_msg = soup_message_new ("GET", uri);
+  }
 
   aur_client_submit_msg (client, soup_msg);
 
   g_free (uri);
 }
 
+static void
+finish_socket_control (AurClient * client, const gchar * command)
+{
+  AurClientSocket *sock = client->controller_socket;
+  const gchar *data;
+  GBytes *bytes;
+  gsize len;
+
+  aur_msg_writer_end (client->writer);
+  bytes = aur_msg_writer_get_bytes (client->writer,
+      sock->cbor ? AUR_MSG_WRITER_CBOR : AUR_MSG_WRITER_JSON);
+  data = g_bytes_get_data (bytes, &len);
+
+  /* The NUL after JSON text isn't part of a websocket message */
+  if (!sock->cbor)
+    len--;
+
+  /* On failure the socket closes, and reports it */
+  if (aur_client_socket_send_message (sock, data, len))
+    g_hash_table_insert (client->pending_controls,
+        GUINT_TO_POINTER (client->last_request_id), g_strdup (command));
+
+  g_bytes_unref (bytes);
+}
+
+static void
+start_socket_control (AurClient * client, const gchar * command)
+{
+  AurClientSocket *sock = client->controller_socket;
+
+  if (client->writer == NULL)
+    client->writer = aur_msg_writer_new ();
+
+  client->last_request_id++;
+  aur_msg_writer_begin (client->writer,
+      sock->cbor ? AUR_MSG_WRITER_CBOR : AUR_MSG_WRITER_JSON, "control");
+  aur_msg_writer_add_string (client->writer, "command", command);
+  aur_msg_writer_add_int64 (client->writer, "request-id",
+      client->last_request_id);
+}
+
+/* Start a control command for the controller websocket. The server
+ * acknowledges it with the same request-id. Returns NULL if there's no
+ * websocket, or the server hasn't said it takes commands on it, and the
+ * command has to be an HTTP request instead.
+ * Inside a batch the command becomes the next entry in its list */
+static AurMsgWriter *
+begin_socket_control (AurClient * client, const gchar * command)
+{
+  AurClientSocket *sock = client->controller_socket;
+
+  if (client->shutting_down || sock == NULL || !sock->connected ||
+      !client->socket_controls)
+    return NULL;
+
+  if (client->batching) {
+    if (!client->batch_started) {
+      start_socket_control (client, "batch");
+      aur_msg_writer_begin_array (client->writer, "commands");
+      client->batch_started = TRUE;
+    }
+    aur_msg_writer_begin_object (client->writer, NULL);
+    aur_msg_writer_add_string (client->writer, "command", command);
+    return client->writer;
+  }
+
+  start_socket_control (client, command);
+
+  return client->writer;
+}
+
+static void
+send_socket_control (AurClient * client, const gchar * command)
+{
+  if (client->batching)
+    aur_msg_writer_end_object (client->writer);
+  else
+    finish_socket_control (client, command);
+}
+
+/* Collect the control commands made until aur_client_end_batch () and
+ * send them as one batch, which the server applies all together or not
+ * at all. Without a controller websocket the commands are still sent
+ * one by one */
+void
+aur_client_begin_batch (AurClient * client)
+{
+  g_return_if_fail (!client->batching);
+
+  client->batching = TRUE;
+  client->batch_started = FALSE;
+}
+
+void
+aur_client_end_batch (AurClient * client)
+{
+  AurClientSocket *sock = client->controller_socket;
+
+  g_return_if_fail (client->batching);
+
+  client->batching = FALSE;
+  if (!client->batch_started)
+    return;
+  client->batch_started = FALSE;
+
+  if (client->shutting_down || sock == NULL || !sock->connected) {
+    g_print ("Controller connection lost, batch not sent\n");
+    return;
+  }
+
+  aur_msg_writer_end_array (client->writer);
+  finish_socket_control (client, "batch");
+}
+
+void
+aur_client_set_media (AurClient * client, const gchar * id)
+{
+  AurMsgWriter *w = begin_socket_control (client, "next");
+
+  if (w != NULL) {
+    if (id)
+      aur_msg_writer_add_string (w, "id", id);
+    send_socket_control (client, "next");
+    return;
+  }
+
+  if (id)
+    submit_control_request (client, "next", "id", id, NULL);
+  else
+    submit_control_request (client, "next", NULL);
+}
+
 void
 aur_client_next (AurClient * client, guint id)
 {
@@ -1478,63 +2231,52 @@ aur_client_next (AurClient * client, guint id)
 void
 aur_client_play (AurClient * client)
 {
-  SoupMessage *soup_msg;
-  gchar *uri;
-
-  uri = g_strdup_printf ("http://%s:%u/control/play",
-      client->connected_server, client->connected_port);
-  soup_msg = soup_message_new ("GET", uri);
-  aur_client_submit_msg (client, soup_msg);
-
-  g_free (uri);
+  if (begin_socket_control (client, "play") != NULL)
+    send_socket_control (client, "play");
+  else
+    submit_control_request (client, "play", NULL);
 }
 
 void
 aur_client_pause (AurClient * client)
 {
-  SoupMessage *soup_msg;
-  gchar *uri;
-
-  uri = g_strdup_printf ("http://%s:%u/control/pause",
-      client->connected_server, client->connected_port);
-  soup_msg = soup_message_new ("GET", uri);
-  aur_client_submit_msg (client, soup_msg);
-
-  g_free (uri);
+  if (begin_socket_control (client, "pause") != NULL)
+    send_socket_control (client, "pause");
+  else
+    submit_control_request (client, "pause", NULL);
 }
 
 void
 aur_client_seek (AurClient * client, GstClockTime position)
 {
-  SoupMessage *soup_msg;
+  AurMsgWriter *w = begin_socket_control (client, "seek");
   gchar *position_str;
-  gchar *uri;
 
-  uri = g_strdup_printf ("http://%s:%u/control/seek",
-      client->connected_server, client->connected_port);
-  position_str = g_strdup_printf ("%" G_GUINT64_FORMAT, position);
-  soup_msg = soup_form_request_new ("POST", uri, "position", position_str,
-      NULL);
-  aur_client_submit_msg (client, soup_msg);
+  if (w != NULL) {
+    aur_msg_writer_add_int64 (w, "position", position);
+    send_socket_control (client, "seek");
+    return;
+  }
 
+  position_str = g_strdup_printf ("%" G_GUINT64_FORMAT, position);
+  submit_control_request (client, "seek", "position", position_str, NULL);
   g_free (position_str);
-  g_free (uri);
 }
 
 void
 aur_client_set_volume (AurClient * client, gdouble volume)
 {
-  SoupMessage *soup_msg;
+  AurMsgWriter *w = begin_socket_control (client, "volume");
   gchar volume_str[G_ASCII_DTOSTR_BUF_SIZE];
-  gchar *uri;
 
-  uri = g_strdup_printf ("http://%s:%u/control/volume",
-      client->connected_server, client->connected_port);
-  g_ascii_dtostr (volume_str, sizeof (volume_str), volume);
-  soup_msg = soup_form_request_new ("POST", uri, "level", volume_str, NULL);
-  aur_client_submit_msg (client, soup_msg);
+  if (w != NULL) {
+    aur_msg_writer_add_double (w, "level", volume);
+    send_socket_control (client, "volume");
+    return;
+  }
 
-  g_free (uri);
+  g_ascii_dtostr (volume_str, sizeof (volume_str), volume);
+  submit_control_request (client, "volume", "level", volume_str, NULL);
 }
 
 const GArray *
@@ -1562,51 +2304,54 @@ aur_client_get_player_enabled (AurClient * client, guint id)
 void
 aur_client_set_player_enabled (AurClient * client, guint id, gboolean enabled)
 {
-  gchar *uri;
+  AurMsgWriter *w = begin_socket_control (client, "setclient");
   gchar *id_str;
-  SoupMessage *soup_msg;
 
-  uri = g_strdup_printf ("http://%s:%u/control/setclient",
-      client->connected_server, client->connected_port);
-  id_str = g_strdup_printf ("%u", id);
-  soup_msg =
-      soup_form_request_new ("POST", uri, "client_id", id_str, "enable",
-      enabled ? "1" : "0", NULL);
-  aur_client_submit_msg (client, soup_msg);
+  if (w != NULL) {
+    aur_msg_writer_add_int64 (w, "client_id", id);
+    aur_msg_writer_add_boolean (w, "enable", enabled);
+    send_socket_control (client, "setclient");
+    return;
+  }
 
+  id_str = g_strdup_printf ("%u", id);
+  submit_control_request (client, "setclient", "client_id", id_str,
+      "enable", enabled ? "1" : "0", NULL);
   g_free (id_str);
-  g_free (uri);
 }
 
 void
 aur_client_set_player_volume (AurClient * client, guint id, gdouble volume)
 {
-  gchar *uri;
+  AurMsgWriter *w = begin_socket_control (client, "volume");
   gchar volume_str[G_ASCII_DTOSTR_BUF_SIZE];
   gchar *id_str;
-  SoupMessage *soup_msg;
 
-  uri = g_strdup_printf ("http://%s:%u/control/volume",
-      client->connected_server, client->connected_port);
+  if (w != NULL) {
+    aur_msg_writer_add_int64 (w, "client_id", id);
+    aur_msg_writer_add_double (w, "level", volume);
+    send_socket_control (client, "volume");
+    return;
+  }
+
   id_str = g_strdup_printf ("%u", id);
   g_ascii_dtostr (volume_str, sizeof (volume_str), volume);
-  soup_msg = soup_form_request_new ("POST", uri, "client_id", id_str, "level",
-      volume_str, NULL);
-  aur_client_submit_msg (client, soup_msg);
-
+  submit_control_request (client, "volume", "client_id", id_str,
+      "level", volume_str, NULL);
   g_free (id_str);
-  g_free (uri);
 }
 
 void
 aur_client_set_language (AurClient * client, const gchar * language_code)
 {
-  gchar *uri;
-  SoupMessage *soup_msg;
-  uri = g_strdup_printf ("http://%s:%u/control/language",
-      client->connected_server, client->connected_port);
-  soup_msg = soup_form_request_new ("POST", uri, "language", language_code,
+  AurMsgWriter *w = begin_socket_control (client, "language");
+
+  if (w != NULL) {
+    aur_msg_writer_add_string (w, "language", language_code);
+    send_socket_control (client, "language");
+    return;
+  }
+
+  submit_control_request (client, "language", "language", language_code,
       NULL);
-  aur_client_submit_msg (client, soup_msg);
-  g_free (uri);
 }
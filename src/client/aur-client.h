@@ -62,6 +62,11 @@ struct _AurClient
   AurClientFlags flags;
   gdouble volume;
   GArray *player_info;
+  /* Sequence number of the last change included in player_info */
+  gint64 player_info_seq;
+  gboolean player_info_fetching;
+  /* Deltas received while player_info is being fetched */
+  GQueue player_info_deltas;
 
   gboolean enabled;
   gboolean paused;
@@ -76,7 +81,25 @@ struct _AurClient
 
   SoupSession *soup;
   SoupMessage *msg;
-  JsonParser *json;
+  AurMsgReader *reader;
+
+  /* Control commands sent over the controller websocket, by request-id,
+   * until the server acknowledges them */
+  AurMsgWriter *writer;
+  guint last_request_id;
+  GHashTable *pending_controls;
+  /* The server announced, in its enrol message, that it takes commands
+   * on the controller websocket */
+  gboolean socket_controls;
+  /* Between aur_client_begin_batch () and aur_client_end_batch ().
+   * batch_started once the batch message is begun in the writer */
+  gboolean batching;
+  gboolean batch_started;
+
+  /* Event channels, unless the server doesn't do websockets */
+  AurClientSocket *player_socket;
+  AurClientSocket *controller_socket;
+  gboolean websocket_refused;
 
   GMainContext * context;
 
@@ -85,6 +108,7 @@ struct _AurClient
 
   guint timeout;
   guint idle_timeout;
+  gint64 last_activity;
 
   gboolean connecting;
   gboolean was_connected;
@@ -122,6 +146,8 @@ gboolean aur_client_get_player_enabled (AurClient * client, guint id);
 void aur_client_set_player_enabled (AurClient * client, guint id, gboolean enabled);
 void aur_client_set_player_volume (AurClient * client, guint id, gdouble volume);
 void aur_client_set_language (AurClient * client, const gchar *language_code);
+void aur_client_begin_batch (AurClient * client);
+void aur_client_end_batch (AurClient * client);
 
 G_END_DECLS
 #endif
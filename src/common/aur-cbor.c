@@ -0,0 +1,739 @@
+/* GStreamer
+ * Copyright (C) 2012-2014 Jan Schmidt <thaytan@noraisin.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Compact binary (CBOR, RFC 7049) encoding of the messages otherwise sent
+ * as JSON. A message structure becomes a map from field name to value,
+ * with the same value types the JSON conversion produces on the way back
+ * in: integers as gint64, floating point as gdouble, booleans, strings,
+ * nested structures and arrays. Null values are left out.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <math.h>
+#include <string.h>
+#include <gst/gst.h>
+
+#include <src/common/aur-cbor.h>
+
+#define CBOR_UINT 0
+#define CBOR_NEGINT 1
+#define CBOR_BYTES 2
+#define CBOR_TEXT 3
+#define CBOR_ARRAY AUR_CBOR_MAJOR_ARRAY
+#define CBOR_MAP AUR_CBOR_MAJOR_MAP
+#define CBOR_TAG 6
+#define CBOR_SIMPLE 7
+
+#define CBOR_FALSE 0xf4
+#define CBOR_TRUE 0xf5
+#define CBOR_NULL 0xf6
+#define CBOR_FLOAT64 0xfb
+
+/* Deepest nesting of maps and arrays accepted when decoding */
+#define MAX_DEPTH 16
+
+typedef struct _CborReader CborReader;
+
+struct _CborReader
+{
+  const guint8 *data;
+  const guint8 *end;
+  guint depth;
+};
+
+static void cbor_put_structure (GByteArray * out, const GstStructure * s);
+static GstStructure *cbor_get_map (CborReader * r, guint64 n_fields);
+
+/* Encode the initial byte(s) of an item - major type plus length or
+ * value - into buf, which must have room for 9 bytes. Returns the number
+ * of bytes used */
+gsize
+aur_cbor_encode_head (guint8 * buf, guint8 major, guint64 val)
+{
+  gsize len;
+
+  if (val < 24) {
+    buf[0] = (major << 5) | val;
+    len = 1;
+  } else if (val <= G_MAXUINT8) {
+    buf[0] = (major << 5) | 24;
+    buf[1] = val;
+    len = 2;
+  } else if (val <= G_MAXUINT16) {
+    buf[0] = (major << 5) | 25;
+    GST_WRITE_UINT16_BE (buf + 1, val);
+    len = 3;
+  } else if (val <= G_MAXUINT32) {
+    buf[0] = (major << 5) | 26;
+    GST_WRITE_UINT32_BE (buf + 1, val);
+    len = 5;
+  } else {
+    buf[0] = (major << 5) | 27;
+    GST_WRITE_UINT64_BE (buf + 1, val);
+    len = 9;
+  }
+
+  return len;
+}
+
+static void
+cbor_put_head (GByteArray * out, guint8 major, guint64 val)
+{
+  guint8 buf[9];
+
+  g_byte_array_append (out, buf, aur_cbor_encode_head (buf, major, val));
+}
+
+static void
+cbor_put_byte (GByteArray * out, guint8 b)
+{
+  g_byte_array_append (out, &b, 1);
+}
+
+void
+aur_cbor_put_int (GByteArray * out, gint64 val)
+{
+  if (val >= 0)
+    cbor_put_head (out, CBOR_UINT, val);
+  else
+    cbor_put_head (out, CBOR_NEGINT, (guint64) (-(val + 1)));
+}
+
+void
+aur_cbor_put_double (GByteArray * out, gdouble val)
+{
+  guint8 buf[9];
+
+  buf[0] = CBOR_FLOAT64;
+  GST_WRITE_DOUBLE_BE (buf + 1, val);
+  g_byte_array_append (out, buf, 9);
+}
+
+void
+aur_cbor_put_boolean (GByteArray * out, gboolean val)
+{
+  cbor_put_byte (out, val ? CBOR_TRUE : CBOR_FALSE);
+}
+
+void
+aur_cbor_put_text (GByteArray * out, const gchar * str)
+{
+  gsize len = strlen (str);
+
+  cbor_put_head (out, CBOR_TEXT, len);
+  g_byte_array_append (out, (const guint8 *) str, len);
+}
+
+static void
+cbor_put_value (GByteArray * out, const GValue * value)
+{
+  GType type = G_VALUE_TYPE (value);
+
+  if (GST_VALUE_HOLDS_STRUCTURE (value)) {
+    cbor_put_structure (out, gst_value_get_structure (value));
+  } else if (GST_VALUE_HOLDS_ARRAY (value)) {
+    guint count = gst_value_array_get_size (value);
+    guint i;
+
+    cbor_put_head (out, CBOR_ARRAY, count);
+    for (i = 0; i < count; i++)
+      cbor_put_value (out, gst_value_array_get_value (value, i));
+  } else if (type == G_TYPE_BOOLEAN) {
+    aur_cbor_put_boolean (out, g_value_get_boolean (value));
+  } else if (type == G_TYPE_INT) {
+    aur_cbor_put_int (out, g_value_get_int (value));
+  } else if (type == G_TYPE_UINT) {
+    cbor_put_head (out, CBOR_UINT, g_value_get_uint (value));
+  } else if (type == G_TYPE_INT64) {
+    aur_cbor_put_int (out, g_value_get_int64 (value));
+  } else if (type == G_TYPE_UINT64) {
+    cbor_put_head (out, CBOR_UINT, g_value_get_uint64 (value));
+  } else if (type == G_TYPE_DOUBLE) {
+    aur_cbor_put_double (out, g_value_get_double (value));
+  } else if (type == G_TYPE_FLOAT) {
+    aur_cbor_put_double (out, g_value_get_float (value));
+  } else if (type == G_TYPE_STRING && g_value_get_string (value) != NULL) {
+    aur_cbor_put_text (out, g_value_get_string (value));
+  } else {
+    /* Nothing sensible to send. Decodes to a missing field */
+    cbor_put_byte (out, CBOR_NULL);
+  }
+}
+
+static gboolean
+cbor_put_field (GQuark field_id, const GValue * value, GByteArray * out)
+{
+  aur_cbor_put_text (out, g_quark_to_string (field_id));
+  cbor_put_value (out, value);
+  return TRUE;
+}
+
+static void
+cbor_put_structure (GByteArray * out, const GstStructure * s)
+{
+  cbor_put_head (out, CBOR_MAP, gst_structure_n_fields (s));
+  gst_structure_foreach (s, (GstStructureForeachFunc) cbor_put_field, out);
+}
+
+GBytes *
+aur_cbor_from_gst_structure (const GstStructure * s)
+{
+  GByteArray *out = g_byte_array_sized_new (128);
+
+  cbor_put_structure (out, s);
+
+  return g_byte_array_free_to_bytes (out);
+}
+
+/* Decoding */
+
+static gboolean
+cbor_get_head (CborReader * r, guint8 * major, guint8 * info, guint64 * val)
+{
+  gsize len;
+
+  if (r->data >= r->end)
+    return FALSE;
+
+  *major = *r->data >> 5;
+  *info = *r->data & 0x1f;
+  r->data++;
+
+  if (*info < 24) {
+    *val = *info;
+    return TRUE;
+  }
+
+  /* Indefinite lengths and reserved values aren't supported */
+  if (*info > 27)
+    return FALSE;
+
+  len = 1 << (*info - 24);
+  if ((gsize) (r->end - r->data) < len)
+    return FALSE;
+
+  switch (len) {
+    case 1:
+      *val = r->data[0];
+      break;
+    case 2:
+      *val = GST_READ_UINT16_BE (r->data);
+      break;
+    case 4:
+      *val = GST_READ_UINT32_BE (r->data);
+      break;
+    default:
+      *val = GST_READ_UINT64_BE (r->data);
+      break;
+  }
+  r->data += len;
+
+  return TRUE;
+}
+
+static gdouble
+cbor_half_to_double (guint16 half)
+{
+  gint exponent = (half >> 10) & 0x1f;
+  gint mantissa = half & 0x3ff;
+  gdouble val;
+
+  if (exponent == 0)
+    val = ldexp (mantissa, -24);
+  else if (exponent != 31)
+    val = ldexp (mantissa + 1024, exponent - 25);
+  else
+    val = mantissa == 0 ? INFINITY : NAN;
+
+  return (half & 0x8000) ? -val : val;
+}
+
+/* Read one value into v. Null and undefined leave v unset */
+static gboolean
+cbor_get_value (CborReader * r, GValue * v)
+{
+  guint8 major, info;
+  guint64 val;
+
+  /* Tags only qualify the value that follows. Step over them here rather
+   * than recursing, so a long run of them can't exhaust the stack */
+  do {
+    if (!cbor_get_head (r, &major, &info, &val))
+      return FALSE;
+  } while (major == CBOR_TAG);
+
+  switch (major) {
+    case CBOR_UINT:
+      if (val <= G_MAXINT64) {
+        g_value_init (v, G_TYPE_INT64);
+        g_value_set_int64 (v, val);
+      } else {
+        g_value_init (v, G_TYPE_UINT64);
+        g_value_set_uint64 (v, val);
+      }
+      return TRUE;
+    case CBOR_NEGINT:
+      if (val > G_MAXINT64)
+        return FALSE;
+      g_value_init (v, G_TYPE_INT64);
+      g_value_set_int64 (v, -1 - (gint64) val);
+      return TRUE;
+    case CBOR_TEXT:
+      if (val > (guint64) (r->end - r->data))
+        return FALSE;
+      g_value_init (v, G_TYPE_STRING);
+      g_value_take_string (v, g_strndup ((const gchar *) r->data, val));
+      r->data += val;
+      return TRUE;
+    case CBOR_ARRAY:{
+      guint64 i;
+
+      /* Every element takes at least a byte */
+      if (val > (guint64) (r->end - r->data) || r->depth >= MAX_DEPTH)
+        return FALSE;
+
+      r->depth++;
+      g_value_init (v, GST_TYPE_ARRAY);
+      for (i = 0; i < val; i++) {
+        GValue element = G_VALUE_INIT;
+
+        if (!cbor_get_value (r, &element)) {
+          g_value_unset (v);
+          return FALSE;
+        }
+        if (G_IS_VALUE (&element)) {
+          gst_value_array_append_value (v, &element);
+          g_value_unset (&element);
+        }
+      }
+      r->depth--;
+      return TRUE;
+    }
+    case CBOR_MAP:{
+      GstStructure *s = cbor_get_map (r, val);
+
+      if (s == NULL)
+        return FALSE;
+      g_value_init (v, GST_TYPE_STRUCTURE);
+      g_value_take_boxed (v, s);
+      return TRUE;
+    }
+    case CBOR_SIMPLE:
+      switch (info) {
+        case 20:
+        case 21:
+          g_value_init (v, G_TYPE_BOOLEAN);
+          g_value_set_boolean (v, info == 21);
+          return TRUE;
+        case 22:
+        case 23:
+          return TRUE;
+        case 25:
+          g_value_init (v, G_TYPE_DOUBLE);
+          g_value_set_double (v, cbor_half_to_double (val));
+          return TRUE;
+        case 26:{
+          guint32 bits = val;
+          gfloat f;
+
+          memcpy (&f, &bits, sizeof (f));
+          g_value_init (v, G_TYPE_DOUBLE);
+          g_value_set_double (v, f);
+          return TRUE;
+        }
+        case 27:{
+          gdouble d;
+
+          memcpy (&d, &val, sizeof (d));
+          g_value_init (v, G_TYPE_DOUBLE);
+          g_value_set_double (v, d);
+          return TRUE;
+        }
+        default:
+          return FALSE;
+      }
+    default:
+      /* Byte strings aren't part of any message */
+      return FALSE;
+  }
+}
+
+static GstStructure *
+cbor_get_map (CborReader * r, guint64 n_fields)
+{
+  GstStructure *s;
+  guint64 i;
+
+  /* Every key and value takes at least a byte */
+  if (n_fields > (guint64) (r->end - r->data) / 2 || r->depth >= MAX_DEPTH)
+    return NULL;
+
+  r->depth++;
+  s = gst_structure_new_empty ("json");
+
+  for (i = 0; i < n_fields; i++) {
+    GValue v = G_VALUE_INIT;
+    gchar short_key[64], *key;
+    guint8 major, info;
+    guint64 len;
+
+    if (!cbor_get_head (r, &major, &info, &len) || major != CBOR_TEXT ||
+        len > (guint64) (r->end - r->data))
+      goto fail;
+
+    /* Field names are short, avoid allocating them */
+    key = len < sizeof (short_key) ? short_key : g_malloc (len + 1);
+    memcpy (key, r->data, len);
+    key[len] = '\0';
+    r->data += len;
+
+    if (!cbor_get_value (r, &v)) {
+      if (key != short_key)
+        g_free (key);
+      goto fail;
+    }
+
+    if (G_IS_VALUE (&v))
+      gst_structure_id_take_value (s, g_quark_from_string (key), &v);
+
+    if (key != short_key)
+      g_free (key);
+  }
+
+  r->depth--;
+  return s;
+
+fail:
+  gst_structure_free (s);
+  return NULL;
+}
+
+/* Decode a complete message. Returns NULL if it isn't a valid CBOR map */
+GstStructure *
+aur_cbor_to_gst_structure (gconstpointer data, gsize len)
+{
+  CborReader r;
+  GstStructure *s;
+  guint8 major, info;
+  guint64 n_fields;
+
+  r.data = data;
+  r.end = r.data + len;
+  r.depth = 0;
+
+  if (!cbor_get_head (&r, &major, &info, &n_fields) || major != CBOR_MAP)
+    return NULL;
+
+  s = cbor_get_map (&r, n_fields);
+  if (s != NULL && r.data != r.end) {
+    /* Trailing garbage */
+    gst_structure_free (s);
+    return NULL;
+  }
+
+  return s;
+}
+
+/* Reading in place */
+
+/* Step over one item, checking it's well-formed */
+static gboolean
+cbor_skip_item (CborReader * r)
+{
+  guint8 major, info;
+  guint64 val, i;
+
+  /* Tags only qualify the item that follows */
+  do {
+    if (!cbor_get_head (r, &major, &info, &val))
+      return FALSE;
+  } while (major == CBOR_TAG);
+
+  switch (major) {
+    case CBOR_UINT:
+    case CBOR_NEGINT:
+    case CBOR_SIMPLE:
+      return TRUE;
+    case CBOR_BYTES:
+    case CBOR_TEXT:
+      if (val > (guint64) (r->end - r->data))
+        return FALSE;
+      r->data += val;
+      return TRUE;
+    default:
+      /* Arrays and maps. Every item takes at least a byte */
+      if (major == CBOR_MAP) {
+        if (val > G_MAXUINT64 / 2)
+          return FALSE;
+        val *= 2;
+      }
+      if (val > (guint64) (r->end - r->data) || r->depth >= MAX_DEPTH)
+        return FALSE;
+
+      r->depth++;
+      for (i = 0; i < val; i++) {
+        if (!cbor_skip_item (r))
+          return FALSE;
+      }
+      r->depth--;
+      return TRUE;
+  }
+}
+
+/* Check a complete message is a well-formed map, and point fields at its
+ * first key. Items inside it can then be read without further checks on
+ * the overall structure */
+gboolean
+aur_cbor_open_message (gconstpointer data, gsize len, AurCborCursor * fields,
+    guint64 * n_fields)
+{
+  CborReader r;
+  guint8 major, info;
+
+  r.data = data;
+  r.end = r.data + len;
+  r.depth = 0;
+
+  if (!cbor_get_head (&r, &major, &info, n_fields) || major != CBOR_MAP)
+    return FALSE;
+
+  fields->data = r.data;
+  fields->end = r.end;
+
+  /* Walk the whole map from the start, and don't allow trailing
+   * garbage */
+  r.data = data;
+  return cbor_skip_item (&r) && r.data == r.end;
+}
+
+gboolean
+aur_cbor_skip (AurCborCursor * cursor)
+{
+  CborReader r = { cursor->data, cursor->end, 0 };
+
+  if (!cbor_skip_item (&r))
+    return FALSE;
+
+  cursor->data = r.data;
+  return TRUE;
+}
+
+/* Find the value for key among a map's fields */
+gboolean
+aur_cbor_map_find (const AurCborCursor * fields, guint64 n_fields,
+    const gchar * key, AurCborCursor * value)
+{
+  CborReader r = { fields->data, fields->end, 0 };
+  gsize key_len = strlen (key);
+  guint64 i;
+
+  for (i = 0; i < n_fields; i++) {
+    const guint8 *key_start = r.data;
+    guint8 major, info;
+    guint64 len;
+
+    if (!cbor_get_head (&r, &major, &info, &len))
+      return FALSE;
+
+    if (major == CBOR_TEXT && len <= (guint64) (r.end - r.data)) {
+      gboolean match = len == key_len && memcmp (r.data, key, len) == 0;
+
+      r.data += len;
+      if (match) {
+        value->data = r.data;
+        value->end = r.end;
+        return TRUE;
+      }
+    } else {
+      /* Messages only have text keys, but step over anything else */
+      r.data = key_start;
+      if (!cbor_skip_item (&r))
+        return FALSE;
+    }
+
+    if (!cbor_skip_item (&r))
+      return FALSE;
+  }
+
+  return FALSE;
+}
+
+/* Get the head of value, after any tags */
+static gboolean
+cbor_read_head (const AurCborCursor * value, CborReader * r, guint8 * major,
+    guint8 * info, guint64 * val)
+{
+  r->data = value->data;
+  r->end = value->end;
+  r->depth = 0;
+
+  do {
+    if (!cbor_get_head (r, major, info, val))
+      return FALSE;
+  } while (*major == CBOR_TAG);
+
+  return TRUE;
+}
+
+/* Point items at the first element of an array or map value. A map has
+ * n_items keys, each followed by its value */
+gboolean
+aur_cbor_read_container (const AurCborCursor * value, guint8 major,
+    AurCborCursor * items, guint64 * n_items)
+{
+  CborReader r;
+  guint8 item_major, info;
+
+  if (!cbor_read_head (value, &r, &item_major, &info, n_items) ||
+      item_major != major)
+    return FALSE;
+
+  items->data = r.data;
+  items->end = r.end;
+  return TRUE;
+}
+
+/* Text isn't NUL-terminated in the message */
+gboolean
+aur_cbor_read_text (const AurCborCursor * value, const gchar ** str,
+    gsize * len)
+{
+  CborReader r;
+  guint8 major, info;
+  guint64 val;
+
+  if (!cbor_read_head (value, &r, &major, &info, &val) ||
+      major != CBOR_TEXT || val > (guint64) (r.end - r.data))
+    return FALSE;
+
+  *str = (const gchar *) r.data;
+  *len = val;
+  return TRUE;
+}
+
+typedef enum
+{
+  CBOR_SCALAR_INT,
+  CBOR_SCALAR_DOUBLE,
+  CBOR_SCALAR_BOOLEAN
+} CborScalarType;
+
+/* Read a number or boolean. Callers convert between them the way
+ * GValue transforms do for the GstStructure form */
+static gboolean
+cbor_read_scalar (const AurCborCursor * value, CborScalarType * type,
+    gint64 * i, gdouble * d)
+{
+  CborReader r;
+  guint8 major, info;
+  guint64 val;
+
+  if (!cbor_read_head (value, &r, &major, &info, &val))
+    return FALSE;
+
+  switch (major) {
+    case CBOR_UINT:
+      if (val > G_MAXINT64)
+        return FALSE;
+      *type = CBOR_SCALAR_INT;
+      *i = val;
+      return TRUE;
+    case CBOR_NEGINT:
+      if (val > G_MAXINT64)
+        return FALSE;
+      *type = CBOR_SCALAR_INT;
+      *i = -1 - (gint64) val;
+      return TRUE;
+    case CBOR_SIMPLE:
+      switch (info) {
+        case 20:
+        case 21:
+          *type = CBOR_SCALAR_BOOLEAN;
+          *i = info == 21;
+          return TRUE;
+        case 25:
+          *type = CBOR_SCALAR_DOUBLE;
+          *d = cbor_half_to_double (val);
+          return TRUE;
+        case 26:{
+          guint32 bits = val;
+          gfloat f;
+
+          memcpy (&f, &bits, sizeof (f));
+          *type = CBOR_SCALAR_DOUBLE;
+          *d = f;
+          return TRUE;
+        }
+        case 27:
+          memcpy (d, &val, sizeof (*d));
+          *type = CBOR_SCALAR_DOUBLE;
+          return TRUE;
+        default:
+          return FALSE;
+      }
+    default:
+      return FALSE;
+  }
+}
+
+gboolean
+aur_cbor_read_int64 (const AurCborCursor * value, gint64 * v)
+{
+  CborScalarType type;
+  gint64 i;
+  gdouble d;
+
+  if (!cbor_read_scalar (value, &type, &i, &d))
+    return FALSE;
+
+  *v = type == CBOR_SCALAR_DOUBLE ? (gint64) d : i;
+  return TRUE;
+}
+
+gboolean
+aur_cbor_read_double (const AurCborCursor * value, gdouble * v)
+{
+  CborScalarType type;
+  gint64 i;
+  gdouble d;
+
+  if (!cbor_read_scalar (value, &type, &i, &d))
+    return FALSE;
+
+  *v = type == CBOR_SCALAR_DOUBLE ? d : (gdouble) i;
+  return TRUE;
+}
+
+gboolean
+aur_cbor_read_boolean (const AurCborCursor * value, gboolean * v)
+{
+  CborScalarType type;
+  gint64 i;
+  gdouble d;
+
+  if (!cbor_read_scalar (value, &type, &i, &d))
+    return FALSE;
+
+  *v = type == CBOR_SCALAR_DOUBLE ? d != 0.0 : i != 0;
+  return TRUE;
+}
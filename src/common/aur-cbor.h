@@ -0,0 +1,70 @@
+/* GStreamer
+ * Copyright (C) 2012-2014 Jan Schmidt <thaytan@noraisin.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __AUR_CBOR_H__
+#define __AUR_CBOR_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/* Media type of CBOR messages on HTTP channels, and the websocket
+ * subprotocol that carries them as binary frames */
+#define AUR_CBOR_CONTENT_TYPE "application/cbor"
+#define AUR_CBOR_WEBSOCKET_PROTOCOL "aurena-cbor"
+
+#define AUR_CBOR_MAJOR_ARRAY 4
+#define AUR_CBOR_MAJOR_MAP 5
+
+GBytes *aur_cbor_from_gst_structure (const GstStructure *s);
+GstStructure *aur_cbor_to_gst_structure (gconstpointer data, gsize len);
+
+/* Low level encoding, for writing messages without a GstStructure */
+gsize aur_cbor_encode_head (guint8 *buf, guint8 major, guint64 val);
+void aur_cbor_put_int (GByteArray *out, gint64 val);
+void aur_cbor_put_double (GByteArray *out, gdouble val);
+void aur_cbor_put_boolean (GByteArray *out, gboolean val);
+void aur_cbor_put_text (GByteArray *out, const gchar *str);
+
+/* Low level decoding, for reading fields in place. A cursor points at
+ * an item inside a message checked with aur_cbor_open_message() */
+typedef struct _AurCborCursor AurCborCursor;
+
+struct _AurCborCursor
+{
+  const guint8 *data;
+  const guint8 *end;
+};
+
+gboolean aur_cbor_open_message (gconstpointer data, gsize len,
+    AurCborCursor *fields, guint64 *n_fields);
+gboolean aur_cbor_skip (AurCborCursor *cursor);
+gboolean aur_cbor_map_find (const AurCborCursor *fields, guint64 n_fields,
+    const gchar *key, AurCborCursor *value);
+gboolean aur_cbor_read_container (const AurCborCursor *value, guint8 major,
+    AurCborCursor *items, guint64 *n_items);
+gboolean aur_cbor_read_text (const AurCborCursor *value, const gchar **str,
+    gsize *len);
+gboolean aur_cbor_read_int64 (const AurCborCursor *value, gint64 *v);
+gboolean aur_cbor_read_double (const AurCborCursor *value, gdouble *v);
+gboolean aur_cbor_read_boolean (const AurCborCursor *value, gboolean *v);
+
+G_END_DECLS
+
+#endif
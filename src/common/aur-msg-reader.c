@@ -0,0 +1,332 @@
+/* GStreamer
+ * Copyright (C) 2012-2014 Jan Schmidt <thaytan@noraisin.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Reads messages in either encoding straight from the parsed JSON object
+ * or the CBOR bytes, without converting them to a GstStructure first.
+ * Fields are fetched by name with typed getters, which convert between
+ * numbers and booleans the way GValue transforms do:
+ *
+ *   if (aur_msg_reader_load_json (r, text, -1, &msg) &&
+ *       aur_msg_object_get_type (&msg) == volume_quark)
+ *     aur_msg_object_get_double (&msg, "level", &level);
+ *
+ * Message types come back as quarks. A type that was never interned
+ * can't be one anything handles, and comes back as 0.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include <src/common/aur-msg-reader.h>
+
+struct _AurMsgReader
+{
+  /* Reused for each JSON message. It owns the objects handed out */
+  JsonParser *parser;
+};
+
+AurMsgReader *
+aur_msg_reader_new (void)
+{
+  AurMsgReader *reader = g_new0 (AurMsgReader, 1);
+
+  reader->parser = json_parser_new ();
+
+  return reader;
+}
+
+void
+aur_msg_reader_free (AurMsgReader * reader)
+{
+  g_object_unref (reader->parser);
+  g_free (reader);
+}
+
+/* Parse a JSON message. Pass len as -1 for NUL-terminated text */
+gboolean
+aur_msg_reader_load_json (AurMsgReader * reader, const gchar * data,
+    gssize len, AurMsgObject * msg)
+{
+  JsonNode *root;
+
+  if (!json_parser_load_from_data (reader->parser, data, len, NULL))
+    return FALSE;
+
+  root = json_parser_get_root (reader->parser);
+  if (root == NULL || !JSON_NODE_HOLDS_OBJECT (root))
+    return FALSE;
+
+  msg->json = json_node_get_object (root);
+  return TRUE;
+}
+
+/* Check a CBOR message. Its fields are read from data in place, so data
+ * has to stay valid while they're read */
+gboolean
+aur_msg_reader_load_cbor (G_GNUC_UNUSED AurMsgReader * reader,
+    gconstpointer data, gsize len, AurMsgObject * msg)
+{
+  msg->json = NULL;
+  return aur_cbor_open_message (data, len, &msg->fields, &msg->n_fields);
+}
+
+static JsonNode *
+json_get_value (const AurMsgObject * obj, const gchar * name)
+{
+  JsonNode *node = json_object_get_member (obj->json, name);
+
+  if (node == NULL || !JSON_NODE_HOLDS_VALUE (node))
+    return NULL;
+
+  return node;
+}
+
+GQuark
+aur_msg_object_get_type (const AurMsgObject * msg)
+{
+  gchar buf[64];
+  const gchar *str;
+  gsize len;
+
+  if (msg->json) {
+    JsonNode *node = json_get_value (msg, "msg-type");
+
+    if (node == NULL || json_node_get_value_type (node) != G_TYPE_STRING)
+      return 0;
+    return g_quark_try_string (json_node_get_string (node));
+  } else {
+    AurCborCursor value;
+
+    if (!aur_cbor_map_find (&msg->fields, msg->n_fields, "msg-type", &value)
+        || !aur_cbor_read_text (&value, &str, &len) || len >= sizeof (buf))
+      return 0;
+
+    /* Types are short. Terminate a copy rather than allocating */
+    memcpy (buf, str, len);
+    buf[len] = '\0';
+    return g_quark_try_string (buf);
+  }
+}
+
+gboolean
+aur_msg_object_get_int64 (const AurMsgObject * obj, const gchar * name,
+    gint64 * value)
+{
+  if (obj->json) {
+    JsonNode *node = json_get_value (obj, name);
+
+    if (node == NULL)
+      return FALSE;
+
+    switch (json_node_get_value_type (node)) {
+      case G_TYPE_INT64:
+        *value = json_node_get_int (node);
+        return TRUE;
+      case G_TYPE_DOUBLE:
+        *value = (gint64) json_node_get_double (node);
+        return TRUE;
+      case G_TYPE_BOOLEAN:
+        *value = json_node_get_boolean (node);
+        return TRUE;
+      default:
+        return FALSE;
+    }
+  } else {
+    AurCborCursor v;
+
+    return aur_cbor_map_find (&obj->fields, obj->n_fields, name, &v) &&
+        aur_cbor_read_int64 (&v, value);
+  }
+}
+
+gboolean
+aur_msg_object_get_int (const AurMsgObject * obj, const gchar * name,
+    gint * value)
+{
+  gint64 tmp;
+
+  if (!aur_msg_object_get_int64 (obj, name, &tmp))
+    return FALSE;
+
+  *value = (gint) tmp;
+  return TRUE;
+}
+
+gboolean
+aur_msg_object_get_double (const AurMsgObject * obj, const gchar * name,
+    gdouble * value)
+{
+  if (obj->json) {
+    JsonNode *node = json_get_value (obj, name);
+
+    if (node == NULL)
+      return FALSE;
+
+    switch (json_node_get_value_type (node)) {
+      case G_TYPE_INT64:
+        *value = json_node_get_int (node);
+        return TRUE;
+      case G_TYPE_DOUBLE:
+        *value = json_node_get_double (node);
+        return TRUE;
+      case G_TYPE_BOOLEAN:
+        *value = json_node_get_boolean (node) ? 1.0 : 0.0;
+        return TRUE;
+      default:
+        return FALSE;
+    }
+  } else {
+    AurCborCursor v;
+
+    return aur_cbor_map_find (&obj->fields, obj->n_fields, name, &v) &&
+        aur_cbor_read_double (&v, value);
+  }
+}
+
+gboolean
+aur_msg_object_get_boolean (const AurMsgObject * obj, const gchar * name,
+    gboolean * value)
+{
+  if (obj->json) {
+    JsonNode *node = json_get_value (obj, name);
+
+    if (node == NULL)
+      return FALSE;
+
+    switch (json_node_get_value_type (node)) {
+      case G_TYPE_INT64:
+        *value = json_node_get_int (node) != 0;
+        return TRUE;
+      case G_TYPE_DOUBLE:
+        *value = json_node_get_double (node) != 0.0;
+        return TRUE;
+      case G_TYPE_BOOLEAN:
+        *value = json_node_get_boolean (node);
+        return TRUE;
+      default:
+        return FALSE;
+    }
+  } else {
+    AurCborCursor v;
+
+    return aur_cbor_map_find (&obj->fields, obj->n_fields, name, &v) &&
+        aur_cbor_read_boolean (&v, value);
+  }
+}
+
+/* Returns NULL if there's no such string field */
+gchar *
+aur_msg_object_dup_string (const AurMsgObject * obj, const gchar * name)
+{
+  if (obj->json) {
+    JsonNode *node = json_get_value (obj, name);
+
+    if (node == NULL || json_node_get_value_type (node) != G_TYPE_STRING)
+      return NULL;
+    return g_strdup (json_node_get_string (node));
+  } else {
+    AurCborCursor v;
+    const gchar *str;
+    gsize len;
+
+    if (!aur_cbor_map_find (&obj->fields, obj->n_fields, name, &v) ||
+        !aur_cbor_read_text (&v, &str, &len))
+      return NULL;
+    return g_strndup (str, len);
+  }
+}
+
+/* Start iterating over the objects in an array field */
+gboolean
+aur_msg_object_get_array (const AurMsgObject * obj, const gchar * name,
+    AurMsgIter * iter)
+{
+  if (obj->json) {
+    JsonNode *node = json_object_get_member (obj->json, name);
+
+    if (node == NULL || !JSON_NODE_HOLDS_ARRAY (node))
+      return FALSE;
+
+    iter->json = json_node_get_array (node);
+    iter->index = 0;
+    return TRUE;
+  } else {
+    AurCborCursor v;
+
+    iter->json = NULL;
+    return aur_cbor_map_find (&obj->fields, obj->n_fields, name, &v) &&
+        aur_cbor_read_container (&v, AUR_CBOR_MAJOR_ARRAY, &iter->items,
+        &iter->n_items);
+  }
+}
+
+/* Step to the next element of the array, whatever it holds. is_object
+ * says whether it's an object, in which case obj is filled in. Returns
+ * FALSE at the end of the array */
+gboolean
+aur_msg_iter_next_element (AurMsgIter * iter, AurMsgObject * obj,
+    gboolean * is_object)
+{
+  AurCborCursor item;
+
+  if (iter->json) {
+    JsonNode *node;
+
+    if (iter->index >= json_array_get_length (iter->json))
+      return FALSE;
+
+    node = json_array_get_element (iter->json, iter->index++);
+    *is_object = JSON_NODE_HOLDS_OBJECT (node);
+    if (*is_object)
+      obj->json = json_node_get_object (node);
+    return TRUE;
+  }
+
+  if (iter->n_items == 0)
+    return FALSE;
+
+  item = iter->items;
+  iter->n_items--;
+  if (!aur_cbor_skip (&iter->items))
+    return FALSE;
+
+  *is_object = aur_cbor_read_container (&item, AUR_CBOR_MAJOR_MAP,
+      &obj->fields, &obj->n_fields);
+  if (*is_object)
+    obj->json = NULL;
+  return TRUE;
+}
+
+/* Get the next object in the array. Other elements are skipped */
+gboolean
+aur_msg_iter_next_object (AurMsgIter * iter, AurMsgObject * obj)
+{
+  gboolean is_object;
+
+  while (aur_msg_iter_next_element (iter, obj, &is_object)) {
+    if (is_object)
+      return TRUE;
+  }
+
+  return FALSE;
+}
@@ -0,0 +1,84 @@
+/* GStreamer
+ * Copyright (C) 2012-2014 Jan Schmidt <thaytan@noraisin.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __AUR_MSG_READER_H__
+#define __AUR_MSG_READER_H__
+
+#include <glib.h>
+#include <json-glib/json-glib.h>
+
+#include <src/common/aur-cbor.h>
+#include <src/common/aur-types.h>
+
+G_BEGIN_DECLS
+
+typedef struct _AurMsgObject AurMsgObject;
+typedef struct _AurMsgIter AurMsgIter;
+
+/* An object inside a loaded message - the message itself, or one nested
+ * in an array. Only valid until the reader loads another message */
+struct _AurMsgObject
+{
+  JsonObject *json;
+
+  /* CBOR, if json is NULL */
+  AurCborCursor fields;
+  guint64 n_fields;
+};
+
+/* Position in an array of objects */
+struct _AurMsgIter
+{
+  JsonArray *json;
+  guint index;
+
+  AurCborCursor items;
+  guint64 n_items;
+};
+
+AurMsgReader *aur_msg_reader_new (void);
+void aur_msg_reader_free (AurMsgReader *reader);
+
+gboolean aur_msg_reader_load_json (AurMsgReader *reader, const gchar *data,
+    gssize len, AurMsgObject *msg);
+gboolean aur_msg_reader_load_cbor (AurMsgReader *reader, gconstpointer data,
+    gsize len, AurMsgObject *msg);
+
+GQuark aur_msg_object_get_type (const AurMsgObject *msg);
+
+gboolean aur_msg_object_get_int (const AurMsgObject *obj,
+    const gchar *name, gint *value);
+gboolean aur_msg_object_get_int64 (const AurMsgObject *obj,
+    const gchar *name, gint64 *value);
+gboolean aur_msg_object_get_double (const AurMsgObject *obj,
+    const gchar *name, gdouble *value);
+gboolean aur_msg_object_get_boolean (const AurMsgObject *obj,
+    const gchar *name, gboolean *value);
+gchar *aur_msg_object_dup_string (const AurMsgObject *obj,
+    const gchar *name);
+
+gboolean aur_msg_object_get_array (const AurMsgObject *obj,
+    const gchar *name, AurMsgIter *iter);
+gboolean aur_msg_iter_next_element (AurMsgIter *iter, AurMsgObject *obj,
+    gboolean *is_object);
+gboolean aur_msg_iter_next_object (AurMsgIter *iter, AurMsgObject *obj);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,338 @@
+/* GStreamer
+ * Copyright (C) 2012-2014 Jan Schmidt <thaytan@noraisin.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Writes messages straight into JSON text and/or CBOR, without building
+ * a GstStructure and JsonNode tree first. The output buffers belong to
+ * the writer and are reused from one message to the next, so the only
+ * allocation per message once they've grown is the GBytes handed out.
+ *
+ * Fields are added with typed appenders. name is the member name inside
+ * an object, and must be NULL inside an array:
+ *
+ *   aur_msg_writer_begin (w, AUR_MSG_WRITER_JSON, "volume");
+ *   aur_msg_writer_add_double (w, "level", 0.5);
+ *   aur_msg_writer_end (w);
+ *   bytes = aur_msg_writer_get_bytes (w, AUR_MSG_WRITER_JSON);
+ *
+ * gives {"msg-type":"volume","level":0.5}
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <math.h>
+#include <string.h>
+
+#include <src/common/aur-cbor.h>
+#include <src/common/aur-msg-writer.h>
+
+/* Deepest nesting of objects and arrays, including the message itself */
+#define MAX_DEPTH 8
+
+typedef struct _WriterLevel WriterLevel;
+
+struct _WriterLevel
+{
+  gboolean is_object;
+  guint n_items;
+  /* Offset of the CBOR head byte, filled in with the item count once
+   * it's known */
+  gsize cbor_head;
+};
+
+struct _AurMsgWriter
+{
+  guint formats;
+
+  GString *json;
+  GByteArray *cbor;
+
+  WriterLevel levels[MAX_DEPTH];
+  guint depth;
+};
+
+AurMsgWriter *
+aur_msg_writer_new (void)
+{
+  AurMsgWriter *writer = g_new0 (AurMsgWriter, 1);
+
+  writer->json = g_string_sized_new (256);
+  writer->cbor = g_byte_array_sized_new (256);
+
+  return writer;
+}
+
+void
+aur_msg_writer_free (AurMsgWriter * writer)
+{
+  g_string_free (writer->json, TRUE);
+  g_byte_array_free (writer->cbor, TRUE);
+  g_free (writer);
+}
+
+static void
+json_append_string (GString * s, const gchar * str)
+{
+  const gchar *run = str, *p;
+
+  g_string_append_c (s, '"');
+
+  for (p = str; *p != '\0'; p++) {
+    guchar c = *p;
+    const gchar *escape;
+    gchar buf[8];
+
+    switch (c) {
+      case '"':
+        escape = "\\\"";
+        break;
+      case '\\':
+        escape = "\\\\";
+        break;
+      case '\n':
+        escape = "\\n";
+        break;
+      case '\r':
+        escape = "\\r";
+        break;
+      case '\t':
+        escape = "\\t";
+        break;
+      default:
+        if (c >= 0x20)
+          continue;
+        g_snprintf (buf, sizeof (buf), "\\u%04x", c);
+        escape = buf;
+        break;
+    }
+
+    /* Copy the plain run up to here in one go */
+    g_string_append_len (s, run, p - run);
+    g_string_append (s, escape);
+    run = p + 1;
+  }
+
+  g_string_append_len (s, run, p - run);
+  g_string_append_c (s, '"');
+}
+
+/* Start a new member or array element */
+static void
+write_name (AurMsgWriter * writer, const gchar * name)
+{
+  WriterLevel *level;
+
+  g_return_if_fail (writer->depth > 0);
+  level = &writer->levels[writer->depth - 1];
+  g_return_if_fail (level->is_object == (name != NULL));
+
+  if (writer->formats & AUR_MSG_WRITER_JSON) {
+    if (level->n_items > 0)
+      g_string_append_c (writer->json, ',');
+    if (name) {
+      json_append_string (writer->json, name);
+      g_string_append_c (writer->json, ':');
+    }
+  }
+  if ((writer->formats & AUR_MSG_WRITER_CBOR) && name)
+    aur_cbor_put_text (writer->cbor, name);
+
+  level->n_items++;
+}
+
+static void
+open_level (AurMsgWriter * writer, gboolean is_object)
+{
+  WriterLevel *level;
+  guint8 placeholder = 0;
+
+  g_return_if_fail (writer->depth < MAX_DEPTH);
+  level = &writer->levels[writer->depth++];
+
+  level->is_object = is_object;
+  level->n_items = 0;
+  level->cbor_head = writer->cbor->len;
+
+  if (writer->formats & AUR_MSG_WRITER_JSON)
+    g_string_append_c (writer->json, is_object ? '{' : '[');
+  if (writer->formats & AUR_MSG_WRITER_CBOR)
+    g_byte_array_append (writer->cbor, &placeholder, 1);
+}
+
+static void
+close_level (AurMsgWriter * writer)
+{
+  WriterLevel *level;
+
+  g_return_if_fail (writer->depth > 0);
+  level = &writer->levels[--writer->depth];
+
+  if (writer->formats & AUR_MSG_WRITER_JSON)
+    g_string_append_c (writer->json, level->is_object ? '}' : ']');
+
+  if (writer->formats & AUR_MSG_WRITER_CBOR) {
+    guint8 head[9];
+    gsize head_len, tail_len;
+
+    head_len = aur_cbor_encode_head (head, level->is_object ?
+        AUR_CBOR_MAJOR_MAP : AUR_CBOR_MAJOR_ARRAY, level->n_items);
+
+    /* Up to 23 items fit in the placeholder byte, which covers every
+     * message but long player lists */
+    if (head_len > 1) {
+      tail_len = writer->cbor->len - level->cbor_head - 1;
+      g_byte_array_set_size (writer->cbor, writer->cbor->len + head_len - 1);
+      memmove (writer->cbor->data + level->cbor_head + head_len,
+          writer->cbor->data + level->cbor_head + 1, tail_len);
+    }
+    memcpy (writer->cbor->data + level->cbor_head, head, head_len);
+  }
+}
+
+/* Start a message, discarding whatever was written before */
+void
+aur_msg_writer_begin (AurMsgWriter * writer, guint formats,
+    const gchar * msg_type)
+{
+  writer->formats = formats;
+  writer->depth = 0;
+  g_string_truncate (writer->json, 0);
+  g_byte_array_set_size (writer->cbor, 0);
+
+  open_level (writer, TRUE);
+  aur_msg_writer_add_string (writer, "msg-type", msg_type);
+}
+
+/* Finish the message, closing anything still open */
+void
+aur_msg_writer_end (AurMsgWriter * writer)
+{
+  while (writer->depth > 0)
+    close_level (writer);
+}
+
+guint
+aur_msg_writer_get_formats (AurMsgWriter * writer)
+{
+  return writer->formats;
+}
+
+/* A copy of the finished message in one of the formats it was written
+ * in. JSON text keeps its NUL terminator, as the message separator on
+ * chunked connections */
+GBytes *
+aur_msg_writer_get_bytes (AurMsgWriter * writer, guint format)
+{
+  g_return_val_if_fail (writer->depth == 0, NULL);
+  g_return_val_if_fail (writer->formats & format, NULL);
+
+  if (format == AUR_MSG_WRITER_CBOR)
+    return g_bytes_new (writer->cbor->data, writer->cbor->len);
+
+  return g_bytes_new (writer->json->str, writer->json->len + 1);
+}
+
+void
+aur_msg_writer_begin_object (AurMsgWriter * writer, const gchar * name)
+{
+  write_name (writer, name);
+  open_level (writer, TRUE);
+}
+
+void
+aur_msg_writer_end_object (AurMsgWriter * writer)
+{
+  close_level (writer);
+}
+
+void
+aur_msg_writer_begin_array (AurMsgWriter * writer, const gchar * name)
+{
+  write_name (writer, name);
+  open_level (writer, FALSE);
+}
+
+void
+aur_msg_writer_end_array (AurMsgWriter * writer)
+{
+  close_level (writer);
+}
+
+void
+aur_msg_writer_add_string (AurMsgWriter * writer, const gchar * name,
+    const gchar * value)
+{
+  if (value == NULL)
+    return;                     /* Same as the field being absent */
+
+  write_name (writer, name);
+  if (writer->formats & AUR_MSG_WRITER_JSON)
+    json_append_string (writer->json, value);
+  if (writer->formats & AUR_MSG_WRITER_CBOR)
+    aur_cbor_put_text (writer->cbor, value);
+}
+
+void
+aur_msg_writer_add_int64 (AurMsgWriter * writer, const gchar * name,
+    gint64 value)
+{
+  write_name (writer, name);
+  if (writer->formats & AUR_MSG_WRITER_JSON) {
+    gchar buf[24];
+    gint len = g_snprintf (buf, sizeof (buf), "%" G_GINT64_FORMAT, value);
+    g_string_append_len (writer->json, buf, len);
+  }
+  if (writer->formats & AUR_MSG_WRITER_CBOR)
+    aur_cbor_put_int (writer->cbor, value);
+}
+
+void
+aur_msg_writer_add_double (AurMsgWriter * writer, const gchar * name,
+    gdouble value)
+{
+  /* JSON has no NaN or infinities */
+  if (!isfinite (value))
+    value = 0;
+
+  write_name (writer, name);
+  if (writer->formats & AUR_MSG_WRITER_JSON) {
+    gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+    g_ascii_dtostr (buf, sizeof (buf), value);
+    g_string_append (writer->json, buf);
+    /* Keep it a double for the reader */
+    if (strpbrk (buf, ".eE") == NULL)
+      g_string_append (writer->json, ".0");
+  }
+  if (writer->formats & AUR_MSG_WRITER_CBOR)
+    aur_cbor_put_double (writer->cbor, value);
+}
+
+void
+aur_msg_writer_add_boolean (AurMsgWriter * writer, const gchar * name,
+    gboolean value)
+{
+  write_name (writer, name);
+  if (writer->formats & AUR_MSG_WRITER_JSON)
+    g_string_append (writer->json, value ? "true" : "false");
+  if (writer->formats & AUR_MSG_WRITER_CBOR)
+    aur_cbor_put_boolean (writer->cbor, value);
+}
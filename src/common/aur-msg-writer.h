@@ -0,0 +1,58 @@
+/* GStreamer
+ * Copyright (C) 2012-2014 Jan Schmidt <thaytan@noraisin.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __AUR_MSG_WRITER_H__
+#define __AUR_MSG_WRITER_H__
+
+#include <glib.h>
+
+#include <src/common/aur-types.h>
+
+G_BEGIN_DECLS
+
+/* Encodings to produce a message in. Either or both */
+#define AUR_MSG_WRITER_JSON (1 << 0)
+#define AUR_MSG_WRITER_CBOR (1 << 1)
+
+AurMsgWriter *aur_msg_writer_new (void);
+void aur_msg_writer_free (AurMsgWriter *writer);
+
+void aur_msg_writer_begin (AurMsgWriter *writer, guint formats,
+    const gchar *msg_type);
+void aur_msg_writer_end (AurMsgWriter *writer);
+guint aur_msg_writer_get_formats (AurMsgWriter *writer);
+GBytes *aur_msg_writer_get_bytes (AurMsgWriter *writer, guint format);
+
+void aur_msg_writer_begin_object (AurMsgWriter *writer, const gchar *name);
+void aur_msg_writer_end_object (AurMsgWriter *writer);
+void aur_msg_writer_begin_array (AurMsgWriter *writer, const gchar *name);
+void aur_msg_writer_end_array (AurMsgWriter *writer);
+
+void aur_msg_writer_add_string (AurMsgWriter *writer, const gchar *name,
+    const gchar *value);
+void aur_msg_writer_add_int64 (AurMsgWriter *writer, const gchar *name,
+    gint64 value);
+void aur_msg_writer_add_double (AurMsgWriter *writer, const gchar *name,
+    gdouble value);
+void aur_msg_writer_add_boolean (AurMsgWriter *writer, const gchar *name,
+    gboolean value);
+
+G_END_DECLS
+
+#endif
@@ -23,12 +23,20 @@
 
 G_BEGIN_DECLS
 
+typedef struct _AurAssetCache AurAssetCache;
 typedef struct _AurAvahi AurAvahi;
 typedef struct _AurClient AurClient;
+typedef struct _AurClientSocket AurClientSocket;
 typedef struct _AurConfig AurConfig;
 typedef struct _AurHttpResource AurHttpResource;
 typedef struct _AurManager AurManager;
 typedef struct _AurMediaDB AurMediaDB;
+typedef struct _AurMsgReader AurMsgReader;
+typedef struct _AurMsgWriter AurMsgWriter;
+typedef struct _AurPlayerRegistry AurPlayerRegistry;
+typedef struct _AurPrefetch AurPrefetch;
+typedef struct _AurResourceBuffer AurResourceBuffer;
+typedef struct _AurResourceCache AurResourceCache;
 typedef struct _AurServer AurServer;
 typedef struct _AurServerClient AurServerClient;
 
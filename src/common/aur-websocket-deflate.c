@@ -0,0 +1,242 @@
+/* GStreamer
+ * Copyright (C) 2012-2015 Jan Schmidt <jan@centricular.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * permessage-deflate (RFC 7692) helpers: extension negotiation, and
+ * compressing / decompressing whole messages with raw deflate. Each
+ * message is compressed with a sync flush, and the 00 00 ff ff the
+ * flush ends with is left off on the wire.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "aur-websocket-deflate.h"
+
+static const guint8 sync_tail[] = { 0x00, 0x00, 0xff, 0xff };
+
+/* Check a single extension offer, e.g.
+ *   permessage-deflate; client_max_window_bits; server_no_context_takeover
+ */
+static gboolean
+parse_deflate_offer (gchar * offer, AurWebSocketDeflateParams * params)
+{
+  gchar **parts = g_strsplit (offer, ";", 0);
+  gboolean ok = TRUE;
+  gint i;
+
+  memset (params, 0, sizeof (AurWebSocketDeflateParams));
+
+  if (g_ascii_strcasecmp (g_strstrip (parts[0]), "permessage-deflate") != 0) {
+    g_strfreev (parts);
+    return FALSE;
+  }
+
+  for (i = 1; parts[i] != NULL && ok; i++) {
+    gchar **param = g_strsplit (parts[i], "=", 2);
+    gchar *name = g_strstrip (param[0]);
+    gchar *value = param[1] ? g_strstrip (param[1]) : NULL;
+
+    if (value && value[0] == '"') {
+      gsize len = strlen (value);
+      if (len > 1 && value[len - 1] == '"')
+        value[len - 1] = '\0';
+      value++;
+    }
+
+    if (g_ascii_strcasecmp (name, "server_no_context_takeover") == 0)
+      params->server_no_context_takeover = TRUE;
+    else if (g_ascii_strcasecmp (name, "client_no_context_takeover") == 0)
+      params->client_no_context_takeover = TRUE;
+    else if (g_ascii_strcasecmp (name, "server_max_window_bits") == 0) {
+      /* GZlibCompressor always uses the full 32KB window */
+      if (value == NULL || atoi (value) != 15)
+        ok = FALSE;
+    } else if (g_ascii_strcasecmp (name, "client_max_window_bits") == 0) {
+      /* Fine - we decompress with the full window either way */
+    } else if (name[0] != '\0') {
+      ok = FALSE;
+    }
+
+    g_strfreev (param);
+  }
+
+  g_strfreev (parts);
+  return ok;
+}
+
+/* Pick the first permessage-deflate offer from a Sec-WebSocket-Extensions
+ * request header that we can support. On success, fills in the parameters
+ * and returns the value for the response header */
+gboolean
+aur_websocket_deflate_negotiate (const gchar * offers,
+    AurWebSocketDeflateParams * params, gchar ** response)
+{
+  gchar **offer_list;
+  gboolean found = FALSE;
+  gint i;
+
+  if (offers == NULL)
+    return FALSE;
+
+  offer_list = g_strsplit (offers, ",", 0);
+  for (i = 0; offer_list[i] != NULL && !found; i++)
+    found = parse_deflate_offer (offer_list[i], params);
+  g_strfreev (offer_list);
+
+  if (!found)
+    return FALSE;
+
+  if (response) {
+    GString *s = g_string_new ("permessage-deflate");
+
+    if (params->server_no_context_takeover)
+      g_string_append (s, "; server_no_context_takeover");
+    if (params->client_no_context_takeover)
+      g_string_append (s, "; client_no_context_takeover");
+
+    *response = g_string_free (s, FALSE);
+  }
+
+  return TRUE;
+}
+
+GConverter *
+aur_websocket_deflate_new_compressor (void)
+{
+  return G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW,
+          -1));
+}
+
+GConverter *
+aur_websocket_deflate_new_decompressor (void)
+{
+  return G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW));
+}
+
+/* Compress one message. The compressor keeps its state for the next
+ * message - reset it first if context takeover is off */
+GBytes *
+aur_websocket_deflate_message (GConverter * compressor, const gchar * data,
+    gsize len)
+{
+  GByteArray *out;
+  gsize used = 0, chunk = len + 64;
+  GConverterResult res;
+
+  out = g_byte_array_new ();
+
+  do {
+    GError *error = NULL;
+    gsize bytes_read = 0, bytes_written = 0;
+
+    g_byte_array_set_size (out, used + chunk);
+    res = g_converter_convert (compressor, data, len, out->data + used,
+        chunk, G_CONVERTER_FLUSH, &bytes_read, &bytes_written, &error);
+
+    if (res == G_CONVERTER_ERROR) {
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE)) {
+        g_error_free (error);
+        chunk *= 2;
+        continue;
+      }
+      g_warning ("Failed to compress websocket message: %s", error->message);
+      g_error_free (error);
+      g_byte_array_free (out, TRUE);
+      return NULL;
+    }
+
+    data += bytes_read;
+    len -= bytes_read;
+    used += bytes_written;
+  } while (res != G_CONVERTER_FLUSHED);
+
+  /* Drop the empty block the sync flush ends with */
+  if (used >= 4 && memcmp (out->data + used - 4, sync_tail, 4) == 0)
+    used -= 4;
+  g_byte_array_set_size (out, used);
+
+  return g_byte_array_free_to_bytes (out);
+}
+
+/* Decompress one message, appending it to out. Fails if the message is
+ * corrupt or would inflate to more than max_len bytes */
+gboolean
+aur_websocket_inflate_message (GConverter * decompressor, const gchar * data,
+    gsize len, gsize max_len, GByteArray * out)
+{
+  gsize start = out->len, used = out->len;
+  gsize chunk = MAX (4 * len, 1024);
+  gboolean in_tail = FALSE;
+  GConverterResult res;
+
+  do {
+    GError *error = NULL;
+    gsize bytes_read = 0, bytes_written = 0;
+
+    /* Feed the message, then the sync flush marker it was sent without */
+    if (len == 0 && !in_tail) {
+      data = (const gchar *) sync_tail;
+      len = sizeof (sync_tail);
+      in_tail = TRUE;
+    }
+
+    g_byte_array_set_size (out, used + chunk);
+    res = g_converter_convert (decompressor, data, len, out->data + used,
+        chunk, G_CONVERTER_FLUSH, &bytes_read, &bytes_written, &error);
+
+    if (res == G_CONVERTER_ERROR) {
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE)) {
+        g_error_free (error);
+        chunk *= 2;
+        continue;
+      }
+      g_warning ("Failed to decompress websocket message: %s",
+          error->message);
+      g_error_free (error);
+      g_byte_array_set_size (out, start);
+      return FALSE;
+    }
+
+    data += bytes_read;
+    len -= bytes_read;
+    used += bytes_written;
+
+    if (used - start > max_len) {
+      g_warning ("Compressed websocket message too large");
+      g_byte_array_set_size (out, start);
+      return FALSE;
+    }
+
+    /* The peer ended its deflate stream, the next message starts a new
+     * one */
+    if (res == G_CONVERTER_FINISHED) {
+      g_converter_reset (decompressor);
+      break;
+    }
+  } while (res != G_CONVERTER_FLUSHED || len > 0 || !in_tail);
+
+  g_byte_array_set_size (out, used);
+
+  return TRUE;
+}
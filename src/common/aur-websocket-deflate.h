@@ -0,0 +1,52 @@
+/* GStreamer
+ * Copyright (C) 2012-2015 Jan Schmidt <jan@centricular.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __AUR_WEBSOCKET_DEFLATE_H__
+#define __AUR_WEBSOCKET_DEFLATE_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* RFC 7692 permessage-deflate. Compressed messages have RSV1 set on
+ * their first frame */
+#define AUR_WEBSOCKET_RSV1 0x40
+
+typedef struct _AurWebSocketDeflateParams AurWebSocketDeflateParams;
+
+struct _AurWebSocketDeflateParams
+{
+  /* The sender resets its compression context after each message */
+  gboolean server_no_context_takeover;
+  gboolean client_no_context_takeover;
+};
+
+gboolean aur_websocket_deflate_negotiate (const gchar *offers,
+    AurWebSocketDeflateParams *params, gchar **response);
+
+GConverter *aur_websocket_deflate_new_compressor (void);
+GConverter *aur_websocket_deflate_new_decompressor (void);
+
+GBytes *aur_websocket_deflate_message (GConverter *compressor,
+    const gchar *data, gsize len);
+gboolean aur_websocket_inflate_message (GConverter *decompressor,
+    const gchar *data, gsize len, gsize max_len, GByteArray *out);
+
+G_END_DECLS
+#endif
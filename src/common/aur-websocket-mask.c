@@ -0,0 +1,199 @@
+/* GStreamer
+ * Copyright (C) 2012-2015 Jan Schmidt <jan@centricular.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * XOR masking of websocket payloads. The mask is 4 bytes long and applies
+ * cyclically from the start of the payload - offset gives the position
+ * in the payload that data starts at, so a payload can be masked in
+ * pieces. The SIMD kernel for the running CPU is picked the first time
+ * it's used.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#if defined(__GNUC__) && defined(__SSE2__)
+#define HAVE_MASK_SSE2 1
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__))
+#define HAVE_MASK_AVX2 1
+#include <immintrin.h>
+#endif
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_MASK_NEON 1
+#include <arm_neon.h>
+#endif
+
+#include "aur-websocket-mask.h"
+
+static void aur_websocket_mask_init (gchar * data, gsize len,
+    const gchar * mask, gsize offset);
+
+static AurWebSocketMaskFunc mask_func = aur_websocket_mask_init;
+static const gchar *mask_impl_name = "scalar";
+
+/* The mask, rotated to start at offset, as a 32-bit word in memory
+ * order */
+static guint32
+rotated_mask (const gchar * mask, gsize offset)
+{
+  guint8 bytes[4];
+  guint32 ret;
+  gint i;
+
+  for (i = 0; i < 4; i++)
+    bytes[i] = mask[(offset + i) & 3];
+  memcpy (&ret, bytes, 4);
+
+  return ret;
+}
+
+void
+aur_websocket_mask_scalar (gchar * data, gsize len, const gchar * mask,
+    gsize offset)
+{
+  guint32 m = rotated_mask (mask, offset);
+  gsize i = 0;
+
+  /* A word at a time, then the tail */
+  for (; i + 4 <= len; i += 4) {
+    guint32 w;
+    memcpy (&w, data + i, 4);
+    w ^= m;
+    memcpy (data + i, &w, 4);
+  }
+  for (; i < len; i++)
+    data[i] ^= mask[(offset + i) & 3];
+}
+
+#ifdef HAVE_MASK_SSE2
+static void
+aur_websocket_mask_sse2 (gchar * data, gsize len, const gchar * mask,
+    gsize offset)
+{
+  __m128i m = _mm_set1_epi32 ((gint32) rotated_mask (mask, offset));
+  gsize i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128 ((const __m128i *) (data + i));
+    _mm_storeu_si128 ((__m128i *) (data + i), _mm_xor_si128 (v, m));
+  }
+
+  /* i is a multiple of 4, so the mask phase is unchanged */
+  aur_websocket_mask_scalar (data + i, len - i, mask, offset);
+}
+#endif
+
+#ifdef HAVE_MASK_AVX2
+__attribute__ ((target ("avx2")))
+static void
+aur_websocket_mask_avx2 (gchar * data, gsize len, const gchar * mask,
+    gsize offset)
+{
+  __m256i m = _mm256_set1_epi32 ((gint32) rotated_mask (mask, offset));
+  gsize i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256 ((const __m256i *) (data + i));
+    _mm256_storeu_si256 ((__m256i *) (data + i), _mm256_xor_si256 (v, m));
+  }
+
+  aur_websocket_mask_scalar (data + i, len - i, mask, offset);
+}
+#endif
+
+#ifdef HAVE_MASK_NEON
+static void
+aur_websocket_mask_neon (gchar * data, gsize len, const gchar * mask,
+    gsize offset)
+{
+  uint8x16_t m =
+      vreinterpretq_u8_u32 (vdupq_n_u32 (rotated_mask (mask, offset)));
+  gsize i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    uint8x16_t v = vld1q_u8 ((const uint8_t *) (data + i));
+    vst1q_u8 ((uint8_t *) (data + i), veorq_u8 (v, m));
+  }
+
+  aur_websocket_mask_scalar (data + i, len - i, mask, offset);
+}
+#endif
+
+static void
+aur_websocket_mask_select (void)
+{
+  mask_func = aur_websocket_mask_scalar;
+  mask_impl_name = "scalar";
+
+#ifdef HAVE_MASK_SSE2
+  mask_func = aur_websocket_mask_sse2;
+  mask_impl_name = "sse2";
+#endif
+#ifdef HAVE_MASK_AVX2
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2")) {
+    mask_func = aur_websocket_mask_avx2;
+    mask_impl_name = "avx2";
+  }
+#endif
+#ifdef HAVE_MASK_NEON
+  mask_func = aur_websocket_mask_neon;
+  mask_impl_name = "neon";
+#endif
+}
+
+static void
+aur_websocket_mask_init (gchar * data, gsize len, const gchar * mask,
+    gsize offset)
+{
+  aur_websocket_mask_select ();
+  mask_func (data, len, mask, offset);
+}
+
+void
+aur_websocket_mask (gchar * data, gsize len, const gchar * mask,
+    gsize offset)
+{
+  /* Not worth the call overhead for tiny payloads */
+  if (len < 16) {
+    gsize i;
+    for (i = 0; i < len; i++)
+      data[i] ^= mask[(offset + i) & 3];
+    return;
+  }
+
+  mask_func (data, len, mask, offset);
+}
+
+const gchar *
+aur_websocket_mask_get_impl_name (void)
+{
+  if (mask_func == aur_websocket_mask_init)
+    aur_websocket_mask_select ();
+
+  return mask_impl_name;
+}
@@ -0,0 +1,38 @@
+/* GStreamer
+ * Copyright (C) 2012-2015 Jan Schmidt <jan@centricular.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __AUR_WEBSOCKET_MASK_H__
+#define __AUR_WEBSOCKET_MASK_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef void (*AurWebSocketMaskFunc) (gchar *data, gsize len,
+    const gchar *mask, gsize offset);
+
+void aur_websocket_mask (gchar *data, gsize len, const gchar *mask,
+    gsize offset);
+void aur_websocket_mask_scalar (gchar *data, gsize len, const gchar *mask,
+    gsize offset);
+
+const gchar *aur_websocket_mask_get_impl_name (void);
+
+G_END_DECLS
+#endif
@@ -24,6 +24,8 @@
 #include <libsoup/soup-server.h>
 #include <string.h>
 
+#include "aur-websocket-deflate.h"
+#include "aur-websocket-mask.h"
 #include "aur-websocket-parser.h"
 
 enum
@@ -36,6 +38,9 @@ G_DEFINE_TYPE (AurWebSocketParser, aur_websocket_parser, G_TYPE_OBJECT);
 
 static guint aur_websocket_parser_signals[LAST_SIGNAL] = { 0 };
 
+/* Largest (reassembled) message accepted from the peer */
+#define MAX_MESSAGE_SIZE (16 * 1024 * 1024)
+
 static void aur_websocket_parser_finalize (GObject * object);
 
 AurWebSocketParser *
@@ -62,7 +67,8 @@ aur_websocket_parser_class_init (AurWebSocketParserClass * parser_class)
   aur_websocket_parser_signals[MSG_RECEIVED] =
       g_signal_new ("message-received", G_TYPE_FROM_CLASS (parser_class),
       G_SIGNAL_RUN_LAST, G_STRUCT_OFFSET (AurWebSocketParserClass, message_received), NULL, NULL,
-      g_cclosure_marshal_generic, G_TYPE_NONE, 2, G_TYPE_CHAR, G_TYPE_UINT64);
+      g_cclosure_marshal_generic, G_TYPE_NONE, 2, G_TYPE_POINTER,
+      G_TYPE_UINT64);
 }
 
 static void
@@ -71,93 +77,280 @@ aur_websocket_parser_finalize (GObject * object)
   AurWebSocketParser *parser = (AurWebSocketParser *) (object);
 
   g_free (parser->in_buf);
+  if (parser->frag_buf)
+    g_byte_array_free (parser->frag_buf, TRUE);
+  if (parser->inflate_buf)
+    g_byte_array_free (parser->inflate_buf, TRUE);
+  if (parser->inflater)
+    g_object_unref (parser->inflater);
 
   G_OBJECT_CLASS (aur_websocket_parser_parent_class)->finalize (object);
 }
 
-static gboolean
+static void
+emit_message (AurWebSocketParser * parser, gchar * data, guint64 len)
+{
+  gchar saved;
+
+  /* Handlers get the payload in place, NUL-terminated. There's always
+   * at least one spare byte after it in the buffer, see read_io() */
+  saved = data[len];
+  data[len] = '\0';
+  g_signal_emit (parser, aur_websocket_parser_signals[MSG_RECEIVED], 0,
+      data, len);
+  data[len] = saved;
+}
+
+/* Decompress a permessage-deflate message and hand it on */
+static GIOStatus
+emit_compressed_message (AurWebSocketParser * parser, gchar * data,
+    guint64 len)
+{
+  guint msg_len;
+
+  /* Without context takeover, the peer starts each message afresh */
+  if (parser->inflate_no_context_takeover)
+    g_converter_reset (parser->inflater);
+
+  if (parser->inflate_buf == NULL)
+    parser->inflate_buf = g_byte_array_new ();
+  g_byte_array_set_size (parser->inflate_buf, 0);
+
+  if (!aur_websocket_inflate_message (parser->inflater, data, len,
+          MAX_MESSAGE_SIZE, parser->inflate_buf))
+    return G_IO_STATUS_ERROR;
+
+  msg_len = parser->inflate_buf->len;
+  g_byte_array_set_size (parser->inflate_buf, msg_len + 1);
+  emit_message (parser, (gchar *) parser->inflate_buf->data, msg_len);
+
+  return G_IO_STATUS_NORMAL;
+}
+
+static GIOStatus
+handle_control_frame (AurWebSocketParser * parser, guint8 opcode,
+    gchar * data, guint64 len)
+{
+  AurWebSocketParserClass *klass = AUR_WEBSOCKET_PARSER_GET_CLASS (parser);
+
+  switch (opcode) {
+    case AUR_WEBSOCKET_OP_PING:
+      if (klass->send_frame)
+        klass->send_frame (parser, AUR_WEBSOCKET_OP_PONG, data, len);
+      break;
+    case AUR_WEBSOCKET_OP_PONG:
+      if (klass->pong_received)
+        klass->pong_received (parser, data, len);
+      break;
+    case AUR_WEBSOCKET_OP_CLOSE:
+      /* Echo the status code back and finish up */
+      if (klass->send_frame)
+        klass->send_frame (parser, AUR_WEBSOCKET_OP_CLOSE, data,
+            MIN (len, 2));
+      return G_IO_STATUS_EOF;
+    default:
+      g_warning ("Unknown websocket control frame 0x%x", opcode);
+      return G_IO_STATUS_ERROR;
+  }
+
+  return G_IO_STATUS_NORMAL;
+}
+
+static GIOStatus
+handle_data_frame (AurWebSocketParser * parser, guint8 opcode,
+    gboolean fin, gboolean compressed, gchar * data, guint64 len)
+{
+  switch (opcode) {
+    case AUR_WEBSOCKET_OP_CONTINUATION:
+    case AUR_WEBSOCKET_OP_TEXT:
+    case AUR_WEBSOCKET_OP_BINARY:
+      break;
+    default:
+      /* Reserved for future data frame types. RFC 6455 says to fail the
+       * connection */
+      g_warning ("Unknown websocket data frame 0x%x", opcode);
+      return G_IO_STATUS_ERROR;
+  }
+
+  if (opcode != AUR_WEBSOCKET_OP_CONTINUATION) {
+    if (parser->in_fragment) {
+      g_warning ("New websocket message inside a fragmented one");
+      return G_IO_STATUS_ERROR;
+    }
+
+    /* The common case - a whole message in one frame, delivered straight
+     * from the input buffer */
+    if (fin) {
+      if (compressed)
+        return emit_compressed_message (parser, data, len);
+      emit_message (parser, data, len);
+      return G_IO_STATUS_NORMAL;
+    }
+
+    if (parser->frag_buf == NULL)
+      parser->frag_buf = g_byte_array_new ();
+    g_byte_array_set_size (parser->frag_buf, 0);
+    parser->frag_opcode = opcode;
+    parser->frag_compressed = compressed;
+    parser->in_fragment = TRUE;
+  } else if (!parser->in_fragment) {
+    g_warning ("Websocket continuation frame with no message to continue");
+    return G_IO_STATUS_ERROR;
+  }
+
+  if (parser->frag_buf->len + len > MAX_MESSAGE_SIZE) {
+    g_warning ("Fragmented websocket message too large");
+    return G_IO_STATUS_ERROR;
+  }
+  g_byte_array_append (parser->frag_buf, (guint8 *) data, len);
+
+  if (fin) {
+    guint msg_len = parser->frag_buf->len;
+
+    if (parser->frag_compressed) {
+      parser->in_fragment = FALSE;
+      return emit_compressed_message (parser,
+          (gchar *) parser->frag_buf->data, msg_len);
+    }
+
+    /* Leave room for the terminator */
+    g_byte_array_set_size (parser->frag_buf, msg_len + 1);
+    parser->in_fragment = FALSE;
+    emit_message (parser, (gchar *) parser->frag_buf->data, msg_len);
+  }
+
+  return G_IO_STATUS_NORMAL;
+}
+
+/* Parse one frame from the input buffer. Returns G_IO_STATUS_AGAIN if
+ * the frame isn't complete yet */
+static GIOStatus
 try_parse_websocket_fragment (AurWebSocketParser * parser)
 {
   guint64 frag_size;
   gchar *header, *outptr;
-  gchar *mask;
-  gchar *decoded;
-  gsize i, avail;
-  GIOStatus status = G_IO_STATUS_NORMAL;
+  gchar *mask = NULL;
+  gsize avail;
+  guint8 opcode;
+  gboolean fin, compressed;
+  GIOStatus status;
 
-  //g_print ("Got %u bytes to parse\n", (guint) parser->in_bufavail);
   if (parser->in_bufavail < 2)
     return G_IO_STATUS_AGAIN;
 
   header = outptr = parser->in_bufptr;
   avail = parser->in_bufavail;
 
-#if 0
-  if (header[0] & 0x80)
-    g_print ("FIN flag. Payload type 0x%x\n", header[0] & 0xf);
-#endif
+  fin = (header[0] & 0x80) != 0;
+  opcode = header[0] & 0x0f;
+
+  /* RSV1 marks the first frame of a compressed message, and only means
+   * anything once permessage-deflate has been negotiated */
+  compressed = (header[0] & AUR_WEBSOCKET_RSV1) != 0;
+  if ((header[0] & 0x70 & ~AUR_WEBSOCKET_RSV1) || (compressed &&
+          (parser->inflater == NULL || (opcode & 0x8) ||
+              opcode == AUR_WEBSOCKET_OP_CONTINUATION))) {
+    g_warning ("Websocket frame uses reserved bits. Dropping connection");
+    return G_IO_STATUS_ERROR;
+  }
 
   frag_size = header[1] & 0x7f;
   outptr += 2;
+  avail -= 2;
 
-  if (frag_size < 126) {
-    avail -= 2;
-  } else if (frag_size == 126) {
-    if (avail < 4)
-      return FALSE;
+  if (frag_size == 126) {
+    if (avail < 2)
+      return G_IO_STATUS_AGAIN;
     frag_size = GST_READ_UINT16_BE (outptr);
     outptr += 2;
-    avail -= 8;
-  } else {
-    if (avail < 10)
-      return FALSE;
+    avail -= 2;
+  } else if (frag_size == 127) {
+    if (avail < 8)
+      return G_IO_STATUS_AGAIN;
     frag_size = GST_READ_UINT64_BE (outptr);
     outptr += 8;
     avail -= 8;
   }
 
-  if ((header[1] & 0x80) == 0) {
+  if (frag_size > MAX_MESSAGE_SIZE) {
+    g_warning ("Websocket frame too large. Dropping connection");
+    return G_IO_STATUS_ERROR;
+  }
+
+  if (header[1] & 0x80) {
+    if (avail < 4)
+      return G_IO_STATUS_AGAIN;
+    mask = outptr;
+    outptr += 4;
+    avail -= 4;
+  } else if (parser->require_mask) {
     g_warning ("Received packet not masked. Dropping connection");
-    status = G_IO_STATUS_ERROR;
-    goto skip_out;
+    return G_IO_STATUS_ERROR;
   }
 
-  if (avail < 4 + frag_size) {
+  if (avail < frag_size) {
     /* Wait for more data */
     return G_IO_STATUS_AGAIN;
   }
 
-  /* Consume the 4 mask bytes */
-  mask = outptr;
-  outptr += 4;
-  avail -= 4;
-
-  decoded = g_malloc (frag_size + 1);
-  for (i = 0; i < frag_size; i++) {
-    decoded[i] = outptr[i] ^ mask[i % 4];
+  if (mask)
+    aur_websocket_mask (outptr, frag_size, mask, 0);
+
+  if (opcode & 0x8) {
+    /* Control frames can't be fragmented, but can arrive in the middle
+     * of a fragmented message */
+    if (!fin || frag_size > 125) {
+      g_warning ("Invalid websocket control frame. Dropping connection");
+      return G_IO_STATUS_ERROR;
+    }
+    status = handle_control_frame (parser, opcode, outptr, frag_size);
+  } else {
+    status =
+        handle_data_frame (parser, opcode, fin, compressed, outptr,
+        frag_size);
   }
-  decoded[frag_size] = 0;
 
-  /* Fire a signal to get this packet processed */
-#if 0
-  g_print ("Have websocket msg of size %" G_GUINT64_FORMAT "\n",
-      frag_size);
-#endif
-  g_signal_emit (parser, aur_websocket_parser_signals[MSG_RECEIVED], 0,
-      decoded, (guint64) (frag_size));
+  outptr += frag_size;
+  parser->in_bufavail -= outptr - parser->in_bufptr;
+  parser->in_bufptr = outptr;
+
+  return status;
+}
+
+/* Make room for at least len more bytes of input. There's always a
+ * spare byte kept after the data, for NUL-terminating the payload of
+ * the last frame in place */
+static void
+ensure_input_space (AurWebSocketParser * p, gsize len)
+{
+  gsize cur_offs = p->in_bufptr - p->in_buf;
 
-  g_free (decoded);
+  if (p->in_bufsize > cur_offs + p->in_bufavail + len)
+    return;
 
-skip_out:
-  {
-    gsize consumed;
+  while (p->in_bufsize <= cur_offs + p->in_bufavail + len)
+    p->in_bufsize *= 2;
+  g_print ("Growing io_buf to %" G_GSIZE_FORMAT " bytes\n", p->in_bufsize);
 
-    outptr += frag_size;
+  p->in_buf = g_renew (gchar, p->in_buf, p->in_bufsize);
+  p->in_bufptr = p->in_buf + cur_offs;
+}
 
-    consumed = outptr - parser->in_bufptr;
+/* Parse all the complete frames in the input buffer */
+static GIOStatus
+parse_input (AurWebSocketParser * p)
+{
+  GIOStatus status = G_IO_STATUS_NORMAL;
 
-    parser->in_bufavail -= consumed;
-    parser->in_bufptr = outptr;
+  while (p->in_bufavail > 0 && status == G_IO_STATUS_NORMAL)
+    status = try_parse_websocket_fragment (p);
+
+  if (status == G_IO_STATUS_AGAIN)
+    status = G_IO_STATUS_NORMAL;
+
+  if (p->in_buf != p->in_bufptr) {
+    memmove (p->in_buf, p->in_bufptr, p->in_bufavail);
+    p->in_bufptr = p->in_buf;
   }
 
   return status;
@@ -169,37 +362,48 @@ aur_websocket_parser_read_io (AurWebSocketParser * p, GIOChannel * io)
   GIOStatus status;
   gsize bread = 0;
 
-  if (p->in_bufsize <= p->in_bufavail) {
-    gsize cur_offs = p->in_bufptr - p->in_buf;
-
-    p->in_bufsize *= 2;
-    g_print ("Growing io_buf to %" G_GSIZE_FORMAT " bytes\n", p->in_bufsize);
+  ensure_input_space (p, 1);
 
-    p->in_buf = g_renew (gchar, p->in_buf, p->in_bufsize);
-    p->in_bufptr = p->in_buf + cur_offs;
-  }
+  status = g_io_channel_read_chars (io, p->in_bufptr + p->in_bufavail,
+      p->in_bufsize - (p->in_bufptr - p->in_buf) - p->in_bufavail - 1,
+      &bread, NULL);
 
-  do {
-    status =
-      g_io_channel_read_chars (io,
-      p->in_buf + p->in_bufavail, p->in_bufsize - p->in_bufavail, &bread, NULL);
-  } while (status == G_IO_STATUS_AGAIN);
+  /* Spurious wakeup, nothing to read after all */
+  if (status == G_IO_STATUS_AGAIN)
+    return G_IO_STATUS_NORMAL;
 
   if (status != G_IO_STATUS_NORMAL)
     return status;
 
   p->in_bufavail += bread;
 
-  while (p->in_bufavail > 0 && status == G_IO_STATUS_NORMAL)
-    status = try_parse_websocket_fragment (p);
+  return parse_input (p);
+}
 
-  if (status == G_IO_STATUS_AGAIN)
-    status = G_IO_STATUS_NORMAL;
+/* Parse data that was read some other way - such as what arrived along
+ * with the end of a handshake response */
+GIOStatus
+aur_websocket_parser_push_data (AurWebSocketParser * p, const gchar * data,
+    gsize len)
+{
+  if (len == 0)
+    return G_IO_STATUS_NORMAL;
 
-  if (p->in_buf != p->in_bufptr) {
-    memmove (p->in_buf, p->in_bufptr, p->in_bufavail);
-    p->in_bufptr = p->in_buf;
-  }
+  ensure_input_space (p, len);
+  memcpy (p->in_bufptr + p->in_bufavail, data, len);
+  p->in_bufavail += len;
 
-  return status;
+  return parse_input (p);
+}
+
+/* Accept permessage-deflate compressed messages from the peer.
+ * no_context_takeover is set if the peer resets its compressor between
+ * messages */
+void
+aur_websocket_parser_enable_deflate (AurWebSocketParser * p,
+    gboolean no_context_takeover)
+{
+  if (p->inflater == NULL)
+    p->inflater = aur_websocket_deflate_new_decompressor ();
+  p->inflate_no_context_takeover = no_context_takeover;
 }
@@ -20,6 +20,7 @@
 #ifndef __AUR_WEBSOCKET_PARSER_H__
 #define __AUR_WEBSOCKET_PARSER_H__
 
+#include <gio/gio.h>
 #include <gst/gst.h>
 
 #include <src/common/aur-types.h>
@@ -31,6 +32,7 @@ G_BEGIN_DECLS
 #define AUR_WEBSOCKET_PARSER_CLASS(klass) (G_TYPE_CHECK_CLASS_CAST((klass),AUR_TYPE_WEBSOCKET_PARSER, AurWebSocketParser))
 #define AUR_IS_WEBSOCKET_PARSER(obj) (G_TYPE_CHECK_INSTANCE_TYPE((obj),AUR_TYPE_WEBSOCKET_PARSER))
 #define AUR_IS_WEBSOCKET_PARSER_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE((klass),AUR_TYPE_WEBSOCKET_PARSER))
+#define AUR_WEBSOCKET_PARSER_GET_CLASS(obj) (G_TYPE_INSTANCE_GET_CLASS((obj),AUR_TYPE_WEBSOCKET_PARSER, AurWebSocketParserClass))
 #define AUR_WEBSOCKET_PARSER_CAST(obj) ((AurWebSocketParser*)(obj))
 
 GType aur_websocket_parser_get_type(void);
@@ -45,6 +47,14 @@ enum _AurWebSocketParserResult {
   AUR_WEBSOCKET_PARSER_ERROR
 };
 
+/* RFC 6455 frame opcodes */
+#define AUR_WEBSOCKET_OP_CONTINUATION 0x0
+#define AUR_WEBSOCKET_OP_TEXT 0x1
+#define AUR_WEBSOCKET_OP_BINARY 0x2
+#define AUR_WEBSOCKET_OP_CLOSE 0x8
+#define AUR_WEBSOCKET_OP_PING 0x9
+#define AUR_WEBSOCKET_OP_PONG 0xA
+
 struct _AurWebSocketParser
 {
   GObject parent;
@@ -53,15 +63,42 @@ struct _AurWebSocketParser
   gchar *in_bufptr;
   gsize in_bufsize;
   gsize in_bufavail;
+
+  /* Frames from clients must be masked, frames from servers must not */
+  gboolean require_mask;
+
+  /* Reassembly of fragmented messages */
+  GByteArray *frag_buf;
+  guint8 frag_opcode;
+  gboolean in_fragment;
+  gboolean frag_compressed;
+
+  /* permessage-deflate, once negotiated */
+  GConverter *inflater;
+  gboolean inflate_no_context_takeover;
+  GByteArray *inflate_buf;
 };
 
 struct _AurWebSocketParserClass
 {
   GObjectClass parent;
 
+  /* Signal. data is only valid for the duration of the emission, and is
+   * NUL-terminated */
   void (*message_received) (AurWebSocketParser *parser, gchar *data, guint64 len);
+
+  /* Virtual methods, for control frame handling. send_frame is used to
+   * answer pings and close frames */
+  void (*send_frame) (AurWebSocketParser *parser, guint8 opcode,
+      const gchar *data, gsize len);
+  void (*pong_received) (AurWebSocketParser *parser, const gchar *data,
+      gsize len);
 };
 
 AurWebSocketParser *aur_websocket_parser_new ();
 GIOStatus aur_websocket_parser_read_io (AurWebSocketParser *p, GIOChannel *io);
+GIOStatus aur_websocket_parser_push_data (AurWebSocketParser *p,
+    const gchar *data, gsize len);
+void aur_websocket_parser_enable_deflate (AurWebSocketParser *p,
+    gboolean no_context_takeover);
 #endif
@@ -0,0 +1,289 @@
+/* GStreamer
+ * Copyright (C) 2012-2014 Jan Schmidt <thaytan@noraisin.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The static files for the web UI, loaded into memory once at startup.
+ * Each asset is kept along with a gzipped copy (if that's smaller) and
+ * its validators, so a request costs a hash lookup and, for a client
+ * that already has it, a 304.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+
+#include "aur-resource.h"
+#include "aur-asset-cache.h"
+
+/* HTML is revalidated every time, so a new version shows up on reload.
+ * Everything else can be used for a while without asking */
+#define HTML_CACHE_CONTROL "no-cache"
+#define ASSET_CACHE_CONTROL "max-age=3600"
+
+typedef struct _AurAsset AurAsset;
+
+struct _AurAsset
+{
+  GBytes *data;
+  GBytes *gzip_data;
+  const gchar *mime_type;
+  const gchar *cache_control;
+  gchar *etag;
+  gchar *last_modified;
+  time_t mtime;
+};
+
+struct _AurAssetCache
+{
+  /* Path relative to the root (with leading '/') -> AurAsset */
+  GHashTable *assets;
+};
+
+static void
+aur_asset_free (AurAsset * asset)
+{
+  g_bytes_unref (asset->data);
+  if (asset->gzip_data)
+    g_bytes_unref (asset->gzip_data);
+  g_free (asset->etag);
+  g_free (asset->last_modified);
+  g_free (asset);
+}
+
+static GBytes *
+aur_asset_compress (GBytes * data)
+{
+  GConverter *compressor;
+  GOutputStream *mem, *out;
+  GBytes *ret = NULL;
+  gsize written;
+
+  compressor =
+      G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, 9));
+  mem = g_memory_output_stream_new_resizable ();
+  out = g_converter_output_stream_new (mem, compressor);
+
+  if (g_output_stream_write_all (out, g_bytes_get_data (data, NULL),
+          g_bytes_get_size (data), &written, NULL, NULL) &&
+      g_output_stream_close (out, NULL, NULL))
+    ret = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (mem));
+
+  g_object_unref (out);
+  g_object_unref (mem);
+  g_object_unref (compressor);
+
+  /* Only worth keeping if it saves something - images are already
+   * compressed */
+  if (ret && g_bytes_get_size (ret) >= g_bytes_get_size (data)) {
+    g_bytes_unref (ret);
+    ret = NULL;
+  }
+
+  return ret;
+}
+
+static AurAsset *
+aur_asset_load (const gchar * filename)
+{
+  AurAsset *asset;
+  GStatBuf st;
+  SoupDate *date;
+  gchar *contents, *checksum;
+  gsize size;
+
+  if (g_stat (filename, &st) < 0 ||
+      !g_file_get_contents (filename, &contents, &size, NULL))
+    return NULL;
+
+  asset = g_new0 (AurAsset, 1);
+  asset->data = g_bytes_new_take (contents, size);
+  asset->gzip_data = aur_asset_compress (asset->data);
+  asset->mime_type = aur_resource_get_mime_type (filename);
+  asset->cache_control = g_str_equal (asset->mime_type, "text/html") ?
+      HTML_CACHE_CONTROL : ASSET_CACHE_CONTROL;
+
+  checksum = g_compute_checksum_for_bytes (G_CHECKSUM_MD5, asset->data);
+  asset->etag = g_strdup_printf ("\"%s\"", checksum);
+  g_free (checksum);
+
+  asset->mtime = st.st_mtime;
+  date = soup_date_new_from_time_t (st.st_mtime);
+  asset->last_modified = soup_date_to_string (date, SOUP_DATE_HTTP);
+  soup_date_free (date);
+
+  return asset;
+}
+
+static void
+aur_asset_cache_load_dir (AurAssetCache * cache, const gchar * dir_path,
+    const gchar * rel_path)
+{
+  const gchar *name;
+  GDir *dir;
+
+  dir = g_dir_open (dir_path, 0, NULL);
+  if (dir == NULL)
+    return;
+
+  while ((name = g_dir_read_name (dir)) != NULL) {
+    gchar *filename = g_build_filename (dir_path, name, NULL);
+    gchar *path = g_strconcat (rel_path, "/", name, NULL);
+
+    if (g_file_test (filename, G_FILE_TEST_IS_DIR)) {
+      aur_asset_cache_load_dir (cache, filename, path);
+    } else if (!g_str_has_prefix (name, "Makefile")) {
+      AurAsset *asset = aur_asset_load (filename);
+
+      if (asset) {
+        g_hash_table_insert (cache->assets, path, asset);
+        path = NULL;
+      }
+    }
+
+    g_free (path);
+    g_free (filename);
+  }
+
+  g_dir_close (dir);
+}
+
+AurAssetCache *
+aur_asset_cache_new (const gchar * root_dir)
+{
+  AurAssetCache *cache = g_new0 (AurAssetCache, 1);
+
+  cache->assets = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      (GDestroyNotify) aur_asset_free);
+
+  if (root_dir)
+    aur_asset_cache_load_dir (cache, root_dir, "");
+
+  g_print ("Loaded %u UI files from %s\n", g_hash_table_size (cache->assets),
+      root_dir ? root_dir : "(nowhere)");
+
+  return cache;
+}
+
+void
+aur_asset_cache_free (AurAssetCache * cache)
+{
+  g_hash_table_destroy (cache->assets);
+  g_free (cache);
+}
+
+static gboolean
+aur_asset_not_modified (AurAsset * asset, SoupMessage * msg)
+{
+  const gchar *header;
+
+  /* If-None-Match takes precedence when both are present */
+  header = soup_message_headers_get_list (msg->request_headers,
+      "If-None-Match");
+  if (header) {
+    return g_str_equal (header, "*") ||
+        strstr (header, asset->etag) != NULL;
+  }
+
+  header = soup_message_headers_get_one (msg->request_headers,
+      "If-Modified-Since");
+  if (header) {
+    SoupDate *date = soup_date_new_from_string (header);
+    gboolean ret = FALSE;
+
+    if (date) {
+      ret = asset->mtime <= soup_date_to_time_t (date);
+      soup_date_free (date);
+    }
+    return ret;
+  }
+
+  return FALSE;
+}
+
+static gboolean
+aur_asset_accepts_gzip (SoupMessage * msg)
+{
+  const gchar *header;
+  GSList *codings, *cur;
+  gboolean ret = FALSE;
+
+  header = soup_message_headers_get_list (msg->request_headers,
+      "Accept-Encoding");
+  if (header == NULL)
+    return FALSE;
+
+  codings = soup_header_parse_quality_list (header, NULL);
+  for (cur = codings; cur != NULL; cur = cur->next) {
+    if (g_ascii_strcasecmp (cur->data, "gzip") == 0) {
+      ret = TRUE;
+      break;
+    }
+  }
+  soup_header_free_list (codings);
+
+  return ret;
+}
+
+/* Fill in the response for the asset at path. Returns FALSE if there's
+ * no such asset */
+gboolean
+aur_asset_cache_serve (AurAssetCache * cache, SoupMessage * msg,
+    const gchar * path)
+{
+  AurAsset *asset = g_hash_table_lookup (cache->assets, path);
+  SoupMessageHeaders *headers = msg->response_headers;
+  SoupBuffer *buffer;
+  GBytes *data;
+
+  if (asset == NULL)
+    return FALSE;
+
+  soup_message_headers_replace (headers, "ETag", asset->etag);
+  soup_message_headers_replace (headers, "Last-Modified",
+      asset->last_modified);
+  soup_message_headers_replace (headers, "Cache-Control",
+      asset->cache_control);
+  if (asset->gzip_data)
+    soup_message_headers_replace (headers, "Vary", "Accept-Encoding");
+
+  if (aur_asset_not_modified (asset, msg)) {
+    soup_message_set_status (msg, SOUP_STATUS_NOT_MODIFIED);
+    return TRUE;
+  }
+
+  data = asset->data;
+  if (asset->gzip_data && aur_asset_accepts_gzip (msg)) {
+    data = asset->gzip_data;
+    soup_message_headers_replace (headers, "Content-Encoding", "gzip");
+  }
+
+  soup_message_headers_set_content_type (headers, asset->mime_type, NULL);
+  buffer = soup_buffer_new_with_owner (g_bytes_get_data (data, NULL),
+      g_bytes_get_size (data), g_bytes_ref (data),
+      (GDestroyNotify) g_bytes_unref);
+  soup_message_body_append_buffer (msg->response_body, buffer);
+  soup_buffer_free (buffer);
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+
+  return TRUE;
+}
@@ -0,0 +1,38 @@
+/* GStreamer
+ * Copyright (C) 2012-2014 Jan Schmidt <thaytan@noraisin.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __AUR_ASSET_CACHE_H__
+#define __AUR_ASSET_CACHE_H__
+
+#include <glib.h>
+#include <libsoup/soup.h>
+
+#include <src/common/aur-types.h>
+
+G_BEGIN_DECLS
+
+AurAssetCache *aur_asset_cache_new (const gchar *root_dir);
+void aur_asset_cache_free (AurAssetCache *cache);
+
+gboolean aur_asset_cache_serve (AurAssetCache *cache, SoupMessage *msg,
+    const gchar *path);
+
+G_END_DECLS
+
+#endif
@@ -36,6 +36,14 @@ enum
   PROP_RTSP_PORT,
   PROP_DATABASE,
   PROP_PLAYLIST,
+  PROP_TRANSFER_MODE,
+  PROP_STREAM_WINDOW_SIZE,
+  PROP_STREAM_WINDOWS,
+  PROP_RESOURCE_CACHE_ENTRIES,
+  PROP_RESOURCE_CACHE_SIZE,
+  PROP_RESOURCE_CACHE_IDLE,
+  PROP_PREFETCH_SIZE,
+  PROP_PROXY_MEMORY,
   PROP_LAST
 };
 
@@ -44,6 +52,15 @@ static void aur_config_set_property (GObject * object, guint prop_id,
 static void aur_config_get_property (GObject * object, guint prop_id,
     GValue * value, GParamSpec * pspec);
 
+#define DEFAULT_TRANSFER_MODE "sendfile"
+#define DEFAULT_STREAM_WINDOW_SIZE (256 * 1024)
+#define DEFAULT_STREAM_WINDOWS 4
+#define DEFAULT_RESOURCE_CACHE_ENTRIES 256
+#define DEFAULT_RESOURCE_CACHE_SIZE 256
+#define DEFAULT_RESOURCE_CACHE_IDLE 600
+#define DEFAULT_PREFETCH_SIZE 64
+#define DEFAULT_PROXY_MEMORY 32
+
 static void aur_config_finalize(GObject *object);
 static void aur_config_dispose(GObject *object);
 
@@ -76,6 +93,14 @@ aur_config_init (AurConfig *config)
   config->rtsp_port = 5458;
   config->database_location = get_default_db_location();
   config->playlist_location = get_default_playlist_location();
+  config->transfer_mode = g_strdup (DEFAULT_TRANSFER_MODE);
+  config->stream_window_size = DEFAULT_STREAM_WINDOW_SIZE;
+  config->stream_windows = DEFAULT_STREAM_WINDOWS;
+  config->resource_cache_entries = DEFAULT_RESOURCE_CACHE_ENTRIES;
+  config->resource_cache_size = DEFAULT_RESOURCE_CACHE_SIZE;
+  config->resource_cache_idle = DEFAULT_RESOURCE_CACHE_IDLE;
+  config->prefetch_size = DEFAULT_PREFETCH_SIZE;
+  config->proxy_memory = DEFAULT_PROXY_MEMORY;
 }
 
 static void
@@ -136,6 +161,17 @@ load_config (G_GNUC_UNUSED AurConfig *config)
   try_read_int(kf, "server", "rtsp-port", &config->aur_port);
   try_read_string(kf, "server", "database", &config->database_location);
   try_read_string(kf, "server", "playlist", &config->playlist_location);
+  try_read_string(kf, "server", "transfer-mode", &config->transfer_mode);
+  try_read_int(kf, "server", "stream-window-size", &config->stream_window_size);
+  try_read_int(kf, "server", "stream-windows", &config->stream_windows);
+  try_read_int(kf, "server", "resource-cache-entries",
+      &config->resource_cache_entries);
+  try_read_int(kf, "server", "resource-cache-size",
+      &config->resource_cache_size);
+  try_read_int(kf, "server", "resource-cache-idle",
+      &config->resource_cache_idle);
+  try_read_int(kf, "server", "prefetch-size", &config->prefetch_size);
+  try_read_int(kf, "server", "proxy-memory", &config->proxy_memory);
   make_abs_path(&config->database_location, config->config_file);
   make_abs_path(&config->playlist_location, config->config_file);
   
@@ -204,6 +240,49 @@ aur_config_class_init (AurConfigClass *config_class)
                          location, G_PARAM_READWRITE));
   g_free(location);
 
+  g_object_class_install_property (gobject_class, PROP_TRANSFER_MODE,
+    g_param_spec_string ("transfer-mode", "transfer mode",
+                         "How /resource downloads are sent to players "
+                         "(\"sendfile\", \"stream\" or \"mmap\")",
+                         DEFAULT_TRANSFER_MODE, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_STREAM_WINDOW_SIZE,
+    g_param_spec_int ("stream-window-size", "stream window size",
+                         "Size in bytes of each read window for streaming "
+                         "transfers",
+                         4096, G_MAXINT, DEFAULT_STREAM_WINDOW_SIZE,
+                         G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_STREAM_WINDOWS,
+    g_param_spec_int ("stream-windows", "stream windows",
+                         "Number of read windows buffered per streaming "
+                         "transfer",
+                         1, 64, DEFAULT_STREAM_WINDOWS,
+                         G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_RESOURCE_CACHE_ENTRIES,
+    g_param_spec_int ("resource-cache-entries", "resource cache entries",
+                         "Maximum number of resources kept in the cache",
+                         1, G_MAXINT, DEFAULT_RESOURCE_CACHE_ENTRIES,
+                         G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_RESOURCE_CACHE_SIZE,
+    g_param_spec_int ("resource-cache-size", "resource cache size",
+                         "Maximum memory held by cached resources, in MB",
+                         0, G_MAXINT, DEFAULT_RESOURCE_CACHE_SIZE,
+                         G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_RESOURCE_CACHE_IDLE,
+    g_param_spec_int ("resource-cache-idle", "resource cache idle time",
+                         "Seconds after which unused resources are evicted",
+                         1, G_MAXINT, DEFAULT_RESOURCE_CACHE_IDLE,
+                         G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_PREFETCH_SIZE,
+    g_param_spec_int ("prefetch-size", "prefetch size",
+                         "MB of the next track to read ahead, 0 to disable",
+                         0, G_MAXINT, DEFAULT_PREFETCH_SIZE,
+                         G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_PROXY_MEMORY,
+    g_param_spec_int ("proxy-memory", "proxy memory",
+                         "MB of each proxied resource to hold in memory "
+                         "before spilling to disk",
+                         0, G_MAXINT, DEFAULT_PROXY_MEMORY,
+                         G_PARAM_READWRITE));
 }
 
 static void
@@ -214,6 +293,7 @@ aur_config_finalize(GObject *object)
   g_free (config->config_file);
   g_free (config->database_location);
   g_free (config->playlist_location);
+  g_free (config->transfer_mode);
 
   G_OBJECT_CLASS (aur_config_parent_class)->finalize (object);
 }
@@ -258,6 +338,33 @@ aur_config_set_property (GObject * object, guint prop_id,
       if (config->playlist_location == NULL)
         config->playlist_location = get_default_playlist_location();
       break;
+    case PROP_TRANSFER_MODE:
+      g_free (config->transfer_mode);
+      config->transfer_mode = g_value_dup_string (value);
+      if (config->transfer_mode == NULL)
+        config->transfer_mode = g_strdup (DEFAULT_TRANSFER_MODE);
+      break;
+    case PROP_STREAM_WINDOW_SIZE:
+      config->stream_window_size = g_value_get_int (value);
+      break;
+    case PROP_STREAM_WINDOWS:
+      config->stream_windows = g_value_get_int (value);
+      break;
+    case PROP_RESOURCE_CACHE_ENTRIES:
+      config->resource_cache_entries = g_value_get_int (value);
+      break;
+    case PROP_RESOURCE_CACHE_SIZE:
+      config->resource_cache_size = g_value_get_int (value);
+      break;
+    case PROP_RESOURCE_CACHE_IDLE:
+      config->resource_cache_idle = g_value_get_int (value);
+      break;
+    case PROP_PREFETCH_SIZE:
+      config->prefetch_size = g_value_get_int (value);
+      break;
+    case PROP_PROXY_MEMORY:
+      config->proxy_memory = g_value_get_int (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -286,6 +393,30 @@ aur_config_get_property (GObject * object, guint prop_id,
     case PROP_PLAYLIST:
       g_value_set_string (value, config->playlist_location);
       break;
+    case PROP_TRANSFER_MODE:
+      g_value_set_string (value, config->transfer_mode);
+      break;
+    case PROP_STREAM_WINDOW_SIZE:
+      g_value_set_int (value, config->stream_window_size);
+      break;
+    case PROP_STREAM_WINDOWS:
+      g_value_set_int (value, config->stream_windows);
+      break;
+    case PROP_RESOURCE_CACHE_ENTRIES:
+      g_value_set_int (value, config->resource_cache_entries);
+      break;
+    case PROP_RESOURCE_CACHE_SIZE:
+      g_value_set_int (value, config->resource_cache_size);
+      break;
+    case PROP_RESOURCE_CACHE_IDLE:
+      g_value_set_int (value, config->resource_cache_idle);
+      break;
+    case PROP_PREFETCH_SIZE:
+      g_value_set_int (value, config->prefetch_size);
+      break;
+    case PROP_PROXY_MEMORY:
+      g_value_set_int (value, config->proxy_memory);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
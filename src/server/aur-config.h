@@ -42,6 +42,16 @@ struct _AurConfig
 
   gchar *database_location;
   gchar *playlist_location;
+
+  gchar *transfer_mode;
+  int stream_window_size;
+  int stream_windows;
+
+  int resource_cache_entries;
+  int resource_cache_size;
+  int resource_cache_idle;
+  int prefetch_size;
+  int proxy_memory;
 };
 
 struct _AurConfigClass
@@ -21,13 +21,23 @@
 #include "config.h"
 #endif
 
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#include <glib/gstdio.h>
 #include <libsoup/soup-server.h>
+#include <libsoup/soup-session-async.h>
 #include <libsoup/soup-message.h>
 #include <libsoup/soup-socket.h>
 #include <libsoup/soup-address.h>
 
+#include "aur-config.h"
 #include "aur-resource.h"
+#include "aur-resource-buffer.h"
 #include "aur-http-resource.h"
 
 #if 0
@@ -47,50 +57,104 @@ enum
 
 static gint resources_open = 0;
 
+/* Session used to fetch remote resources, shared by all of them */
+static SoupSession *proxy_session = NULL;
+
 static void aur_http_resource_set_property (GObject * object, guint prop_id,
     const GValue * value, GParamSpec * pspec);
 static void aur_http_resource_get_property (GObject * object, guint prop_id,
     GValue * value, GParamSpec * pspec);
+static void aur_http_resource_finalize (GObject * object);
+
+/* Maximum number of bytes handed to a single sendfile() call, so one fast
+ * player can't monopolise the main loop */
+#define SENDFILE_MAX_CHUNK (1024 * 1024)
+
+/* A range request starting further than this beyond what's been fetched
+ * into the shared buffer gets its own stream seeked to the start of the
+ * range (or its own ranged request, for HTTP), rather than waiting for
+ * the fetch to get there */
+#define DIRECT_SEEK_THRESHOLD (4 * 1024 * 1024)
 
-typedef struct _AurTransfer
+typedef struct _AurTransfer AurTransfer;
+typedef struct _AurTransferWindow AurTransferWindow;
+
+struct _AurTransferWindow
 {
-  AurHttpResource *resource;
-} AurTransfer;
+  AurTransfer *transfer;
+  gchar *data;
+  gboolean in_use;
+};
 
-static gboolean
-aur_http_resource_open (AurHttpResource * resource)
+struct _AurTransfer
 {
-  if (resource->data == NULL) {
-    GError *error = NULL;
+  AurHttpResource *resource;
 
-    resources_open++;
+  /* Zero-copy transfers take over the socket once libsoup has written
+   * the response headers. Other transfers only use it to drop the
+   * connection if the body falls short */
+  SoupServer *soup;
+  SoupMessage *msg;
+  GSocket *socket;
+  GIOChannel *io;
+  guint io_watch;
+  gulong wrote_headers_sig;
+  gulong finished_sig;
 
-    if (g_file_is_native (resource->source_file)) {
-      gchar *local_path;
+  gint fd;
+  goffset offset;
+  goffset remaining;
 
-      local_path = g_file_get_path (resource->source_file);
-      g_assert (local_path != NULL);
+  /* Streaming transfers read the file window by window into a small ring
+   * of buffers, which are handed to libsoup one chunk at a time */
+  AurTransferWindow *windows;
+  guint n_windows;
+  gsize window_size;
+  guint n_outstanding;
+  gulong wrote_chunk_sig;
+  gboolean finished;
 
-      DEBUG_PRINT ("Opening resource %s. %d now open\n", local_path,
-          resources_open);
+  /* Proxied transfers read from the resource's shared buffer */
+  AurResourceBuffer *buffer;
+  gboolean unknown_length;
+  gboolean body_complete;
+
+  /* ... or from a stream or ranged request of their own, for far seeks */
+  GInputStream *stream;
+  GCancellable *cancel;
+  SoupMessage *range_msg;
+  gboolean range_ok;
+};
 
-      resource->data = g_mapped_file_new (local_path, FALSE, &error);
+static gboolean
+aur_http_resource_open (AurHttpResource * resource, gboolean map_data)
+{
+  if (map_data && resource->data == NULL &&
+      g_file_is_native (resource->source_file)) {
+    GError *error = NULL;
+    gchar *local_path;
+
+    local_path = g_file_get_path (resource->source_file);
+    g_assert (local_path != NULL);
 
-      if (resource->data == NULL) {
-        g_message ("Failed to open resource %s: %s", local_path,
-            error->message);
-        g_error_free (error);
-        g_free (local_path);
-        resources_open--;
+    resources_open++;
+
+    DEBUG_PRINT ("Opening resource %s. %d now open\n", local_path,
+        resources_open);
 
-        return FALSE;
-      }
+    resource->data = g_mapped_file_new (local_path, FALSE, &error);
 
+    if (resource->data == NULL) {
+      g_message ("Failed to open resource %s: %s", local_path,
+          error->message);
+      g_error_free (error);
       g_free (local_path);
-    } else {
-      /* Non-native files can't be mmap()ped. */
-      resource->data = NULL;
+      resources_open--;
+
+      return FALSE;
     }
+
+    g_free (local_path);
   }
   g_object_ref (resource);
   resource->use_count++;
@@ -102,46 +166,37 @@ aur_http_resource_close (AurHttpResource * resource)
 {
   if (resource->use_count) {
     resource->use_count--;
-    if (resource->use_count == 0) {
+    if (resource->use_count == 0 && resource->data != NULL) {
       resources_open--;
 
-      if (g_file_is_native (resource->source_file)) {
-        gchar *local_path;
-
-        /* Release the mmap() on the local file. */
-        local_path = g_file_get_path (resource->source_file);
-        DEBUG_PRINT ("Releasing resource %s. %d now open\n", local_path,
-            resources_open);
+      /* Release the mmap() on the local file. */
+      DEBUG_PRINT ("Releasing resource %p. %d now open\n", resource,
+          resources_open);
 #if GLIB_CHECK_VERSION(2,22,0)
-        g_mapped_file_unref (resource->data);
+      g_mapped_file_unref (resource->data);
 #else
-        g_mapped_file_free (resource->data);
+      g_mapped_file_free (resource->data);
 #endif
-        resource->data = NULL;
-
-        DEBUG_PRINT ("closed resource %s (%p) use count now %d\n",
-            local_path, resource, resource->use_count);
-        g_free (local_path);
-      } else {
-        /* Non-native file. */
-        resource->data = NULL;
-      }
+      resource->data = NULL;
     }
   }
 
   g_object_unref (resource);
 }
 
+/* Transfers that stream the file themselves don't need it mapped, but
+ * still hold a use on the resource while in progress */
 static AurTransfer *
-aur_transfer_new (AurHttpResource *resource)
+aur_transfer_new (AurHttpResource *resource, gboolean map_data)
 {
   AurTransfer *transfer;
 
-  if (!aur_http_resource_open (resource))
+  if (!aur_http_resource_open (resource, map_data))
     return NULL;
 
   transfer = g_new0 (AurTransfer, 1);
   transfer->resource = g_object_ref (resource);
+  transfer->fd = -1;
 
   DEBUG_PRINT ("Started transfer with resource %p use count now %d\n",
       resource, resource->use_count);
@@ -152,6 +207,9 @@ aur_transfer_new (AurHttpResource *resource)
 static void
 aur_transfer_free (AurTransfer *transfer)
 {
+  g_clear_object (&transfer->stream);
+  g_clear_object (&transfer->cancel);
+
   aur_http_resource_close (transfer->resource);
 
   DEBUG_PRINT ("Completed transfer of %p. Use count now %d\n",
@@ -161,8 +219,1212 @@ aur_transfer_free (AurTransfer *transfer)
   g_free (transfer);
 }
 
+/* Work out which part of the file was requested. Returns FALSE if the
+ * request can't be served as a single contiguous block (multiple ranges),
+ * in which case the caller should let libsoup build the response. */
+static gboolean
+aur_http_resource_get_range (SoupMessage * msg, goffset total_length,
+    goffset * start, goffset * length, gboolean * partial,
+    gboolean * satisfiable)
+{
+  SoupRange *ranges;
+  gint n_ranges;
+
+  *start = 0;
+  *length = total_length;
+  *partial = FALSE;
+  *satisfiable = TRUE;
+
+  if (soup_message_headers_get_one (msg->request_headers, "Range") == NULL)
+    return TRUE;
+
+  if (!soup_message_headers_get_ranges (msg->request_headers, total_length,
+          &ranges, &n_ranges)) {
+    *satisfiable = FALSE;
+    return TRUE;
+  }
+
+  if (n_ranges != 1) {
+    soup_message_headers_free_ranges (msg->request_headers, ranges);
+    return FALSE;
+  }
+
+  *start = ranges[0].start;
+  *length = ranges[0].end - ranges[0].start + 1;
+  *partial = TRUE;
+
+  soup_message_headers_free_ranges (msg->request_headers, ranges);
+  return TRUE;
+}
+
+/* Fill in the status and length headers for a (possibly partial) response */
+static void
+aur_http_resource_set_range_headers (SoupMessage * msg, goffset start,
+    goffset length, goffset total_length, gboolean partial)
+{
+  soup_message_headers_replace (msg->response_headers, "Accept-Ranges",
+      "bytes");
+  soup_message_headers_set_content_length (msg->response_headers, length);
+
+  if (partial) {
+    soup_message_headers_set_content_range (msg->response_headers,
+        start, start + length - 1, total_length);
+    soup_message_set_status (msg, SOUP_STATUS_PARTIAL_CONTENT);
+  } else {
+    soup_message_set_status (msg, SOUP_STATUS_OK);
+  }
+}
+
+#ifdef HAVE_SYS_SENDFILE_H
+static void
+aur_transfer_sendfile_release (AurTransfer * transfer)
+{
+  if (transfer->io_watch) {
+    g_source_remove (transfer->io_watch);
+    transfer->io_watch = 0;
+  }
+  if (transfer->io) {
+    g_io_channel_unref (transfer->io);
+    transfer->io = NULL;
+  }
+  if (transfer->wrote_headers_sig) {
+    g_signal_handler_disconnect (transfer->msg, transfer->wrote_headers_sig);
+    transfer->wrote_headers_sig = 0;
+  }
+  if (transfer->finished_sig) {
+    g_signal_handler_disconnect (transfer->msg, transfer->finished_sig);
+    transfer->finished_sig = 0;
+  }
+  if (transfer->fd >= 0) {
+    close (transfer->fd);
+    transfer->fd = -1;
+  }
+
+  g_object_unref (transfer->msg);
+  aur_transfer_free (transfer);
+}
+
+static void
+aur_transfer_sendfile_done (AurTransfer * transfer, gboolean success)
+{
+  SoupServer *soup = transfer->soup;
+  SoupMessage *msg = g_object_ref (transfer->msg);
+
+  DEBUG_PRINT ("sendfile transfer of %p done, success %d\n",
+      transfer->resource, success);
+
+  /* If the body didn't make it out intact, the HTTP stream is out of
+   * sync, so the connection can't be reused */
+  if (!success)
+    g_socket_shutdown (transfer->socket, TRUE, TRUE, NULL);
+
+  aur_transfer_sendfile_release (transfer);
+
+  /* The body has already gone out behind libsoup's back, so all that's
+   * left is to let it finish the (empty) message body */
+  soup_message_body_complete (msg->response_body);
+  soup_server_unpause_message (soup, msg);
+  g_object_unref (msg);
+}
+
+static gboolean
+aur_transfer_sendfile_cb (G_GNUC_UNUSED GIOChannel * source,
+    GIOCondition condition, AurTransfer * transfer)
+{
+  off_t offset = transfer->offset;
+  ssize_t sent;
+
+  if (condition & (G_IO_HUP | G_IO_ERR)) {
+    transfer->io_watch = 0;
+    aur_transfer_sendfile_done (transfer, FALSE);
+    return FALSE;
+  }
+
+  do {
+    sent = sendfile (g_socket_get_fd (transfer->socket), transfer->fd,
+        &offset, MIN (transfer->remaining, SENDFILE_MAX_CHUNK));
+  } while (sent < 0 && errno == EINTR);
+
+  if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return TRUE;                /* Wait for the socket to drain */
+
+  if (sent <= 0) {
+    /* Error, or the file got shorter underneath us */
+    transfer->io_watch = 0;
+    aur_transfer_sendfile_done (transfer, FALSE);
+    return FALSE;
+  }
+
+  transfer->offset = offset;
+  transfer->remaining -= sent;
+
+  if (transfer->remaining > 0)
+    return TRUE;
+
+  transfer->io_watch = 0;
+  aur_transfer_sendfile_done (transfer, TRUE);
+  return FALSE;
+}
+
+static void
+aur_transfer_sendfile_wrote_headers (SoupMessage * msg,
+    AurTransfer * transfer)
+{
+  /* Stop libsoup touching the socket while we own it */
+  soup_server_pause_message (transfer->soup, msg);
+
+  if (transfer->remaining == 0) {
+    aur_transfer_sendfile_done (transfer, TRUE);
+    return;
+  }
+
+  transfer->io = g_io_channel_unix_new (g_socket_get_fd (transfer->socket));
+  transfer->io_watch = g_io_add_watch (transfer->io,
+      G_IO_OUT | G_IO_HUP | G_IO_ERR,
+      (GIOFunc) (aur_transfer_sendfile_cb), transfer);
+}
+
+static void
+aur_transfer_sendfile_finished (G_GNUC_UNUSED SoupMessage * msg,
+    AurTransfer * transfer)
+{
+  /* Connection went away before we were done */
+  DEBUG_PRINT ("sendfile transfer of %p aborted\n", transfer->resource);
+  aur_transfer_sendfile_release (transfer);
+}
+
+/* Serve a local file by writing the response headers through libsoup,
+ * then streaming the body straight from the page cache to the socket with
+ * sendfile(). Returns FALSE if the request should be handled by the
+ * regular mmap path instead. */
+static gboolean
+aur_http_resource_sendfile_transfer (AurHttpResource * resource,
+    SoupServer * soup, SoupMessage * msg, SoupClientContext * context,
+    const gchar * local_path)
+{
+  AurTransfer *transfer;
+  GSocket *socket;
+  GStatBuf st;
+  goffset start, length;
+  gboolean partial, satisfiable;
+  gint fd;
+
+  if (msg->method != SOUP_METHOD_GET)
+    return FALSE;
+
+  socket = soup_client_context_get_gsocket (context);
+  if (socket == NULL)
+    return FALSE;
+
+  fd = g_open (local_path, O_RDONLY, 0);
+  if (fd < 0)
+    return FALSE;
+
+  if (fstat (fd, &st) < 0 || !S_ISREG (st.st_mode))
+    goto fallback;
+
+  if (!aur_http_resource_get_range (msg, st.st_size, &start, &length,
+          &partial, &satisfiable))
+    goto fallback;
+
+  if (!satisfiable) {
+    close (fd);
+    soup_message_headers_set_content_range (msg->response_headers,
+        0, st.st_size - 1, st.st_size);
+    soup_message_set_status (msg, SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE);
+    return TRUE;
+  }
+
+  transfer = aur_transfer_new (resource, FALSE);
+  transfer->soup = soup;
+  transfer->msg = g_object_ref (msg);
+  transfer->socket = socket;
+  transfer->fd = fd;
+  transfer->offset = start;
+  transfer->remaining = length;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise (fd, start, length, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  aur_http_resource_set_range_headers (msg, start, length, st.st_size,
+      partial);
+  soup_message_headers_replace (msg->response_headers,
+      "Content-Type", aur_resource_get_mime_type (local_path));
+
+  transfer->wrote_headers_sig = g_signal_connect (msg, "wrote-headers",
+      G_CALLBACK (aur_transfer_sendfile_wrote_headers), transfer);
+  transfer->finished_sig = g_signal_connect (msg, "finished",
+      G_CALLBACK (aur_transfer_sendfile_finished), transfer);
+
+  DEBUG_PRINT ("Started sendfile transfer of %s offset %" G_GINT64_FORMAT
+      " length %" G_GINT64_FORMAT "\n", local_path, (gint64) start,
+      (gint64) length);
+
+  return TRUE;
+
+fallback:
+  close (fd);
+  return FALSE;
+}
+#endif
+
+static void
+aur_transfer_stream_free (AurTransfer * transfer)
+{
+  guint i;
+
+  if (transfer->fd >= 0) {
+    close (transfer->fd);
+    transfer->fd = -1;
+  }
+  for (i = 0; i < transfer->n_windows; i++)
+    g_free (transfer->windows[i].data);
+  g_free (transfer->windows);
+
+  aur_transfer_free (transfer);
+}
+
+static void
+aur_transfer_stream_window_done (AurTransferWindow * window)
+{
+  AurTransfer *transfer = window->transfer;
+
+  /* libsoup has written (or discarded) this chunk, so the buffer can be
+   * refilled */
+  window->in_use = FALSE;
+  transfer->n_outstanding--;
+
+  if (transfer->finished && transfer->n_outstanding == 0)
+    aur_transfer_stream_free (transfer);
+}
+
+static void
+aur_transfer_stream_fill (AurTransfer * transfer)
+{
+  gboolean appended = FALSE;
+  guint i;
+
+  for (i = 0; i < transfer->n_windows && transfer->remaining > 0; i++) {
+    AurTransferWindow *window = transfer->windows + i;
+    gsize to_read = MIN ((goffset) transfer->window_size, transfer->remaining);
+    SoupBuffer *buffer;
+    gssize bread;
+
+    if (window->in_use)
+      continue;
+
+    if (window->data == NULL)
+      window->data = g_malloc (transfer->window_size);
+
+    do {
+      bread = pread (transfer->fd, window->data, to_read, transfer->offset);
+    } while (bread < 0 && errno == EINTR);
+
+    if (bread <= 0) {
+      /* Read error, or the file got shorter underneath us. The body will
+       * fall short of the Content-Length already sent, which leaves the
+       * HTTP stream out of sync, so the connection can't be reused */
+      g_message ("Failed to read resource at offset %" G_GINT64_FORMAT,
+          (gint64) transfer->offset);
+      if (transfer->socket)
+        g_socket_shutdown (transfer->socket, TRUE, TRUE, NULL);
+      transfer->remaining = 0;
+      break;
+    }
+
+    transfer->offset += bread;
+    transfer->remaining -= bread;
+
+#ifdef POSIX_FADV_WILLNEED
+    /* Ask the kernel to start reading the window after the ring ahead of
+     * time, so the next pread() doesn't block the main loop */
+    if (transfer->remaining > 0) {
+      posix_fadvise (transfer->fd,
+          transfer->offset + transfer->window_size * (transfer->n_windows - 1),
+          transfer->window_size, POSIX_FADV_WILLNEED);
+    }
+#endif
+
+    window->in_use = TRUE;
+    transfer->n_outstanding++;
+
+    buffer = soup_buffer_new_with_owner (window->data, bread, window,
+        (GDestroyNotify) aur_transfer_stream_window_done);
+    soup_message_body_append_buffer (transfer->msg->response_body, buffer);
+    soup_buffer_free (buffer);
+    appended = TRUE;
+  }
+
+  if (transfer->remaining == 0 && transfer->fd >= 0) {
+    close (transfer->fd);
+    transfer->fd = -1;
+    soup_message_body_complete (transfer->msg->response_body);
+    appended = TRUE;
+  }
+
+  if (appended)
+    soup_server_unpause_message (transfer->soup, transfer->msg);
+}
+
+static void
+aur_transfer_stream_wrote_chunk (G_GNUC_UNUSED SoupMessage * msg,
+    AurTransfer * transfer)
+{
+  aur_transfer_stream_fill (transfer);
+}
+
+static void
+aur_transfer_stream_finished (SoupMessage * msg, AurTransfer * transfer)
+{
+  g_signal_handler_disconnect (msg, transfer->wrote_chunk_sig);
+  g_signal_handler_disconnect (msg, transfer->finished_sig);
+  transfer->wrote_chunk_sig = transfer->finished_sig = 0;
+
+  DEBUG_PRINT ("Streaming transfer of %p finished, %u windows outstanding\n",
+      transfer->resource, transfer->n_outstanding);
+
+  /* Buffers still queued in the message body get released when the
+   * message is freed, so drop our ref and only clean up once they're all
+   * back */
+  g_object_unref (transfer->msg);
+  transfer->msg = NULL;
+  transfer->finished = TRUE;
+  if (transfer->n_outstanding == 0)
+    aur_transfer_stream_free (transfer);
+}
+
+/* Serve a local file in fixed-size windows read with pread(), so the
+ * memory used by a transfer is bounded by the configured ring size
+ * instead of the size of the file. Returns FALSE if the request should
+ * be handled by the regular mmap path instead. */
+static gboolean
+aur_http_resource_stream_transfer (AurHttpResource * resource,
+    SoupServer * soup, SoupMessage * msg, SoupClientContext * context,
+    AurConfig * config, const gchar * local_path)
+{
+  AurTransfer *transfer;
+  GStatBuf st;
+  goffset start, length;
+  gboolean partial, satisfiable;
+  gint fd;
+
+  if (msg->method != SOUP_METHOD_GET && msg->method != SOUP_METHOD_HEAD)
+    return FALSE;
+
+  fd = g_open (local_path, O_RDONLY, 0);
+  if (fd < 0)
+    return FALSE;
+
+  if (fstat (fd, &st) < 0 || !S_ISREG (st.st_mode))
+    goto fallback;
+
+  if (!aur_http_resource_get_range (msg, st.st_size, &start, &length,
+          &partial, &satisfiable))
+    goto fallback;
+
+  if (!satisfiable) {
+    close (fd);
+    soup_message_headers_set_content_range (msg->response_headers,
+        0, st.st_size - 1, st.st_size);
+    soup_message_set_status (msg, SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE);
+    return TRUE;
+  }
+
+  aur_http_resource_set_range_headers (msg, start, length, st.st_size,
+      partial);
+  soup_message_headers_replace (msg->response_headers,
+      "Content-Type", aur_resource_get_mime_type (local_path));
+
+  if (msg->method == SOUP_METHOD_HEAD || length == 0) {
+    close (fd);
+    return TRUE;
+  }
+
+  transfer = aur_transfer_new (resource, FALSE);
+  transfer->soup = soup;
+  transfer->msg = g_object_ref (msg);
+  transfer->socket = soup_client_context_get_gsocket (context);
+  transfer->fd = fd;
+  transfer->offset = start;
+  transfer->remaining = length;
+  transfer->window_size = MAX (config->stream_window_size, 4096);
+  transfer->n_windows = CLAMP (config->stream_windows, 1, 64);
+  transfer->windows = g_new0 (AurTransferWindow, transfer->n_windows);
+  {
+    guint i;
+    for (i = 0; i < transfer->n_windows; i++)
+      transfer->windows[i].transfer = transfer;
+  }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise (fd, start, length, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  /* Let libsoup drop each chunk once written */
+  soup_message_body_set_accumulate (msg->response_body, FALSE);
+
+  transfer->wrote_chunk_sig = g_signal_connect (msg, "wrote-chunk",
+      G_CALLBACK (aur_transfer_stream_wrote_chunk), transfer);
+  transfer->finished_sig = g_signal_connect (msg, "finished",
+      G_CALLBACK (aur_transfer_stream_finished), transfer);
+
+  DEBUG_PRINT ("Started streaming transfer of %s offset %" G_GINT64_FORMAT
+      " length %" G_GINT64_FORMAT " (%u x %" G_GSIZE_FORMAT " byte windows)\n",
+      local_path, (gint64) start, (gint64) length, transfer->n_windows,
+      transfer->window_size);
+
+  aur_transfer_stream_fill (transfer);
+
+  return TRUE;
+
+fallback:
+  close (fd);
+  return FALSE;
+}
+
+static void
+aur_http_resource_fetch_got_headers (SoupMessage * msg,
+    AurHttpResource * resource)
+{
+  gint64 length = -1;
+  const gchar *content_type;
+  gchar *uri;
+
+  /* This also fires for redirects and auth challenges that the session
+   * handles by itself before the final response, so success or failure
+   * is only decided once the fetch is done */
+  if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
+    return;
+
+  if (soup_message_headers_get_encoding (msg->response_headers) ==
+      SOUP_ENCODING_CONTENT_LENGTH)
+    length = soup_message_headers_get_content_length (msg->response_headers);
+
+  content_type = soup_message_headers_get_content_type (msg->response_headers,
+      NULL);
+  if (content_type == NULL) {
+    uri = g_file_get_uri (resource->source_file);
+    aur_resource_buffer_set_info (resource->buffer, length,
+        aur_resource_get_mime_type (uri));
+    g_free (uri);
+  } else {
+    aur_resource_buffer_set_info (resource->buffer, length, content_type);
+  }
+}
+
+static void
+aur_http_resource_fetch_got_chunk (SoupMessage * msg, SoupBuffer * chunk,
+    AurHttpResource * resource)
+{
+  if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
+    return;
+
+  aur_resource_buffer_append (resource->buffer, chunk->data, chunk->length);
+
+  /* Nowhere left to put the data, so stop fetching it */
+  if (aur_resource_buffer_is_failed (resource->buffer)) {
+    g_message ("Failed to buffer proxied resource. Cancelling fetch");
+    soup_session_cancel_message (proxy_session, msg, SOUP_STATUS_CANCELLED);
+  }
+}
+
+static void
+aur_http_resource_fetch_done (G_GNUC_UNUSED SoupSession * session,
+    SoupMessage * msg, AurHttpResource * resource)
+{
+  gboolean success = SOUP_STATUS_IS_SUCCESSFUL (msg->status_code);
+
+  DEBUG_PRINT ("Fetch of %p done, status %u, %" G_GUINT64_FORMAT " bytes\n",
+      resource, msg->status_code,
+      aur_resource_buffer_get_available (resource->buffer));
+
+  if (!success && msg->status_code != SOUP_STATUS_CANCELLED) {
+    gchar *uri = g_file_get_uri (resource->source_file);
+    g_message ("Failed to fetch %s: %u %s", uri, msg->status_code,
+        msg->reason_phrase);
+    g_free (uri);
+  }
+
+  resource->fetch_msg = NULL;
+  aur_resource_buffer_finish (resource->buffer, success);
+
+  /* Release the ref held for the duration of the fetch */
+  g_object_unref (resource);
+}
+
+static void
+aur_http_resource_fetch_stream_done (AurHttpResource * resource,
+    gboolean success)
+{
+  DEBUG_PRINT ("Fetch of %p done, success %d, %" G_GUINT64_FORMAT
+      " bytes\n", resource, success,
+      aur_resource_buffer_get_available (resource->buffer));
+
+  g_clear_object (&resource->fetch_stream);
+  g_clear_object (&resource->fetch_cancel);
+  aur_resource_buffer_finish (resource->buffer, success);
+
+  /* Release the ref held for the duration of the fetch */
+  g_object_unref (resource);
+}
+
+static void
+aur_http_resource_fetch_read_cb (GInputStream * stream, GAsyncResult * res,
+    AurHttpResource * resource)
+{
+  GError *error = NULL;
+  GBytes *bytes;
+
+  bytes = g_input_stream_read_bytes_finish (stream, res, &error);
+  if (bytes == NULL) {
+    if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      g_message ("Failed to read resource: %s", error->message);
+    g_error_free (error);
+    aur_http_resource_fetch_stream_done (resource, FALSE);
+    return;
+  }
+
+  if (g_bytes_get_size (bytes) == 0) {
+    g_bytes_unref (bytes);
+    aur_http_resource_fetch_stream_done (resource, TRUE);
+    return;
+  }
+
+  aur_resource_buffer_append (resource->buffer,
+      g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes));
+  g_bytes_unref (bytes);
+
+  if (aur_resource_buffer_is_failed (resource->buffer)) {
+    aur_http_resource_fetch_stream_done (resource, FALSE);
+    return;
+  }
+
+  /* Keep reading ahead until the whole resource is in */
+  g_input_stream_read_bytes_async (stream, resource->fetch_read_size,
+      G_PRIORITY_DEFAULT, resource->fetch_cancel,
+      (GAsyncReadyCallback) aur_http_resource_fetch_read_cb, resource);
+}
+
+static void
+aur_http_resource_fetch_info_cb (GFileInputStream * stream,
+    GAsyncResult * res, AurHttpResource * resource)
+{
+  GFileInfo *info;
+  gint64 length = -1;
+  gchar *uri;
+
+  /* Not all backends can tell the size, in which case it's found out at
+   * the end */
+  info = g_file_input_stream_query_info_finish (stream, res, NULL);
+  if (info != NULL) {
+    if (g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_STANDARD_SIZE))
+      length = g_file_info_get_size (info);
+    g_object_unref (info);
+  }
+
+  uri = g_file_get_uri (resource->source_file);
+  aur_resource_buffer_set_info (resource->buffer, length,
+      aur_resource_get_mime_type (uri));
+  g_free (uri);
+
+  g_input_stream_read_bytes_async (G_INPUT_STREAM (stream),
+      resource->fetch_read_size, G_PRIORITY_DEFAULT, resource->fetch_cancel,
+      (GAsyncReadyCallback) aur_http_resource_fetch_read_cb, resource);
+}
+
+static void
+aur_http_resource_fetch_opened_cb (GFile * file, GAsyncResult * res,
+    AurHttpResource * resource)
+{
+  GFileInputStream *stream;
+  GError *error = NULL;
+  gchar *uri;
+
+  stream = g_file_read_finish (file, res, &error);
+  if (stream == NULL) {
+    if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+      uri = g_file_get_uri (file);
+      g_message ("Failed to open %s: %s", uri, error->message);
+      g_free (uri);
+    }
+    g_error_free (error);
+    aur_http_resource_fetch_stream_done (resource, FALSE);
+    return;
+  }
+
+  resource->fetch_stream = G_INPUT_STREAM (stream);
+  g_file_input_stream_query_info_async (stream,
+      G_FILE_ATTRIBUTE_STANDARD_SIZE, G_PRIORITY_DEFAULT,
+      resource->fetch_cancel,
+      (GAsyncReadyCallback) aur_http_resource_fetch_info_cb, resource);
+}
+
+static gboolean
+aur_http_resource_is_http (AurHttpResource * resource)
+{
+  return g_file_has_uri_scheme (resource->source_file, "http") ||
+      g_file_has_uri_scheme (resource->source_file, "https");
+}
+
+/* Start fetching the resource into the shared buffer, unless that's
+ * already happening or done. A failed fetch is retried. HTTP resources
+ * are fetched with libsoup, anything else GIO can open (smb://, sftp://
+ * and so on through GVfs) with async stream reads */
+static void
+aur_http_resource_fetch (AurHttpResource * resource, AurConfig * config)
+{
+  gchar *uri;
+
+  if (resource->buffer != NULL) {
+    if (!aur_resource_buffer_is_failed (resource->buffer) ||
+        resource->use_count > 0)
+      return;
+    aur_resource_buffer_free (resource->buffer);
+  }
+
+  resource->buffer =
+      aur_resource_buffer_new ((guint64) config->proxy_memory * 1024 * 1024);
+
+  uri = g_file_get_uri (resource->source_file);
+  g_print ("Fetching %s\n", uri);
+
+  if (!aur_http_resource_is_http (resource)) {
+    g_free (uri);
+    resource->fetch_read_size = MAX (config->stream_window_size, 4096);
+    resource->fetch_cancel = g_cancellable_new ();
+    g_file_read_async (resource->source_file, G_PRIORITY_DEFAULT,
+        resource->fetch_cancel,
+        (GAsyncReadyCallback) aur_http_resource_fetch_opened_cb,
+        g_object_ref (resource));
+    return;
+  }
+
+  if (proxy_session == NULL)
+    proxy_session = soup_session_async_new ();
+
+  resource->fetch_msg = soup_message_new (SOUP_METHOD_GET, uri);
+  g_free (uri);
+
+  if (resource->fetch_msg == NULL) {
+    aur_resource_buffer_finish (resource->buffer, FALSE);
+    return;
+  }
+
+  /* The shared buffer keeps the data, not libsoup */
+  soup_message_body_set_accumulate (resource->fetch_msg->response_body,
+      FALSE);
+  g_signal_connect (resource->fetch_msg, "got-headers",
+      G_CALLBACK (aur_http_resource_fetch_got_headers), resource);
+  g_signal_connect (resource->fetch_msg, "got-chunk",
+      G_CALLBACK (aur_http_resource_fetch_got_chunk), resource);
+
+  soup_session_queue_message (proxy_session, resource->fetch_msg,
+      (SoupSessionCallback) aur_http_resource_fetch_done,
+      g_object_ref (resource));
+}
+
+/* Stop fetching the resource into the shared buffer. The fetch holds a
+ * ref on the resource, so this has to happen explicitly when the
+ * resource is dropped from the cache, or the fetch would carry on (and a
+ * new request would start a second one) */
+void
+aur_http_resource_cancel_fetch (AurHttpResource * resource)
+{
+  if (resource->fetch_msg != NULL) {
+    DEBUG_PRINT ("Cancelling fetch of %p\n", resource);
+    soup_session_cancel_message (proxy_session, resource->fetch_msg,
+        SOUP_STATUS_CANCELLED);
+  }
+  if (resource->fetch_cancel != NULL)
+    g_cancellable_cancel (resource->fetch_cancel);
+}
+
+static void aur_transfer_proxy_data_ready (AurResourceBuffer * buffer,
+    AurTransfer * transfer);
+
+/* The body fell short of what the response headers promised. The client
+ * can only tell from the connection closing, and the HTTP stream is out
+ * of sync anyway, so the connection can't be reused. Completing the body
+ * afterwards just lets libsoup finish the message - the terminating
+ * chunk of a chunked response never goes out */
+static void
+aur_transfer_truncate (AurTransfer * transfer)
+{
+  if (transfer->socket)
+    g_socket_shutdown (transfer->socket, TRUE, TRUE, NULL);
+}
+
+/* Append the next piece of the body, or wait for it to arrive */
+static void
+aur_transfer_proxy_fill (AurTransfer * transfer)
+{
+  AurResourceBuffer *buffer = transfer->buffer;
+  gsize to_read, bread;
+  gchar *data;
+
+  if (transfer->remaining > 0) {
+    to_read = transfer->window_size;
+    if (!transfer->unknown_length)
+      to_read = MIN ((goffset) to_read, transfer->remaining);
+
+    data = g_malloc (to_read);
+    bread = aur_resource_buffer_read (buffer, transfer->offset, data,
+        to_read);
+
+    if (bread > 0) {
+      transfer->offset += bread;
+      if (!transfer->unknown_length)
+        transfer->remaining -= bread;
+      soup_message_body_append (transfer->msg->response_body,
+          SOUP_MEMORY_TAKE, data, bread);
+      soup_server_unpause_message (transfer->soup, transfer->msg);
+      return;
+    }
+    g_free (data);
+
+    if (!aur_resource_buffer_is_complete (buffer)) {
+      aur_resource_buffer_wait (buffer,
+          (AurResourceBufferFunc) aur_transfer_proxy_data_ready, transfer);
+      return;
+    }
+
+    /* The fetch ended. If it failed part way, or came up short of the
+     * length it announced, the client gets a truncated body */
+    if (aur_resource_buffer_is_failed (buffer) || !transfer->unknown_length) {
+      g_message ("Proxied resource ended early at offset %" G_GINT64_FORMAT,
+          (gint64) transfer->offset);
+      aur_transfer_truncate (transfer);
+    }
+    transfer->remaining = 0;
+  }
+
+  if (transfer->body_complete)
+    return;
+  transfer->body_complete = TRUE;
+  soup_message_body_complete (transfer->msg->response_body);
+  soup_server_unpause_message (transfer->soup, transfer->msg);
+}
+
+static void
+aur_transfer_direct_read_cb (GInputStream * stream, GAsyncResult * res,
+    AurTransfer * transfer)
+{
+  GError *error = NULL;
+  SoupBuffer *buffer;
+  GBytes *bytes;
+
+  bytes = g_input_stream_read_bytes_finish (stream, res, &error);
+  transfer->n_outstanding--;
+
+  if (transfer->finished) {
+    /* The client went away while the read was in flight */
+    if (bytes)
+      g_bytes_unref (bytes);
+    g_clear_error (&error);
+    aur_transfer_free (transfer);
+    return;
+  }
+
+  if (bytes == NULL || g_bytes_get_size (bytes) == 0) {
+    if (error) {
+      g_message ("Failed to read resource at offset %" G_GINT64_FORMAT
+          ": %s", (gint64) transfer->offset, error->message);
+      g_error_free (error);
+    }
+    if (bytes)
+      g_bytes_unref (bytes);
+    /* Short body. Only read while more was expected */
+    aur_transfer_truncate (transfer);
+    transfer->remaining = 0;
+    transfer->body_complete = TRUE;
+    soup_message_body_complete (transfer->msg->response_body);
+    soup_server_unpause_message (transfer->soup, transfer->msg);
+    return;
+  }
+
+  transfer->offset += g_bytes_get_size (bytes);
+  transfer->remaining -= g_bytes_get_size (bytes);
+
+  buffer = soup_buffer_new_with_owner (g_bytes_get_data (bytes, NULL),
+      g_bytes_get_size (bytes), bytes, (GDestroyNotify) g_bytes_unref);
+  soup_message_body_append_buffer (transfer->msg->response_body, buffer);
+  soup_buffer_free (buffer);
+  soup_server_unpause_message (transfer->soup, transfer->msg);
+}
+
+/* Read the next piece of the body from the transfer's own stream */
+static void
+aur_transfer_direct_fill (AurTransfer * transfer)
+{
+  if (transfer->remaining == 0) {
+    if (!transfer->body_complete) {
+      transfer->body_complete = TRUE;
+      soup_message_body_complete (transfer->msg->response_body);
+      soup_server_unpause_message (transfer->soup, transfer->msg);
+    }
+    return;
+  }
+
+  transfer->n_outstanding++;
+  g_input_stream_read_bytes_async (transfer->stream,
+      MIN ((goffset) transfer->window_size, transfer->remaining),
+      G_PRIORITY_DEFAULT, transfer->cancel,
+      (GAsyncReadyCallback) aur_transfer_direct_read_cb, transfer);
+}
+
+static void
+aur_transfer_direct_open_thread (GTask * task, GFile * file,
+    AurTransfer * transfer, GCancellable * cancel)
+{
+  GFileInputStream *stream;
+  GError *error = NULL;
+
+  /* Opening and seeking are blocking calls for remote backends, so do
+   * them off the main loop */
+  stream = g_file_read (file, cancel, &error);
+  if (stream == NULL) {
+    g_task_return_error (task, error);
+    return;
+  }
+
+  if (!g_seekable_can_seek (G_SEEKABLE (stream)) ||
+      !g_seekable_seek (G_SEEKABLE (stream), transfer->offset, G_SEEK_SET,
+          cancel, &error)) {
+    if (error == NULL)
+      error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+          "Stream is not seekable");
+    g_object_unref (stream);
+    g_task_return_error (task, error);
+    return;
+  }
+
+  g_task_return_pointer (task, stream, g_object_unref);
+}
+
+static void
+aur_transfer_direct_opened_cb (GFile * file, GAsyncResult * res,
+    AurTransfer * transfer)
+{
+  GError *error = NULL;
+
+  transfer->stream = g_task_propagate_pointer (G_TASK (res), &error);
+  transfer->n_outstanding--;
+
+  if (transfer->finished) {
+    g_clear_error (&error);
+    aur_transfer_free (transfer);
+    return;
+  }
+
+  if (transfer->stream == NULL) {
+    gchar *uri = g_file_get_uri (file);
+
+    /* Wait for the shared fetch to get there instead */
+    DEBUG_PRINT ("Can't seek in %s (%s), using the shared buffer\n", uri,
+        error->message);
+    g_free (uri);
+    g_error_free (error);
+    aur_transfer_proxy_fill (transfer);
+    return;
+  }
+
+  aur_transfer_direct_fill (transfer);
+}
+
+/* Serve the rest of the transfer from a seeked stream of its own */
+static void
+aur_transfer_direct_start (AurTransfer * transfer)
+{
+  GTask *task;
+
+  DEBUG_PRINT ("Opening seeked stream for %p at %" G_GINT64_FORMAT "\n",
+      transfer->resource, (gint64) transfer->offset);
+
+  transfer->cancel = g_cancellable_new ();
+  transfer->n_outstanding++;
+
+  task = g_task_new (transfer->resource->source_file, transfer->cancel,
+      (GAsyncReadyCallback) aur_transfer_direct_opened_cb, transfer);
+  g_task_set_task_data (task, transfer, NULL);
+  g_task_run_in_thread (task,
+      (GTaskThreadFunc) aur_transfer_direct_open_thread);
+  g_object_unref (task);
+}
+
+static void
+aur_transfer_range_got_headers (SoupMessage * msg, AurTransfer * transfer)
+{
+  goffset start, end;
+
+  if (msg->status_code == SOUP_STATUS_PARTIAL_CONTENT &&
+      soup_message_headers_get_content_range (msg->response_headers,
+          &start, &end, NULL) && start == transfer->offset) {
+    transfer->range_ok = TRUE;
+    return;
+  }
+
+  /* A server that ignores the range sends the whole file from the start,
+   * which the shared fetch is already doing. Redirects and auth
+   * challenges are handled by the session, and errors are dealt with
+   * when the request is done */
+  if (SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
+    soup_session_cancel_message (proxy_session, msg, SOUP_STATUS_CANCELLED);
+}
+
+static void
+aur_transfer_range_got_chunk (SoupMessage * msg, SoupBuffer * chunk,
+    AurTransfer * transfer)
+{
+  gsize length;
+
+  if (!transfer->range_ok || transfer->finished || transfer->remaining == 0)
+    return;
+
+  length = MIN ((goffset) chunk->length, transfer->remaining);
+  transfer->offset += length;
+  transfer->remaining -= length;
+
+  soup_message_body_append (transfer->msg->response_body, SOUP_MEMORY_COPY,
+      chunk->data, length);
+  soup_server_unpause_message (transfer->soup, transfer->msg);
+
+  /* Don't read further ahead of the client than this chunk */
+  soup_session_pause_message (proxy_session, msg);
+}
+
+static void
+aur_transfer_range_done (G_GNUC_UNUSED SoupSession * session,
+    SoupMessage * msg, AurTransfer * transfer)
+{
+  transfer->range_msg = NULL;
+  transfer->n_outstanding--;
+
+  if (transfer->finished) {
+    /* The client went away while the request was in flight */
+    aur_transfer_free (transfer);
+    return;
+  }
+
+  if (!transfer->range_ok) {
+    /* Wait for the shared fetch to get there instead */
+    DEBUG_PRINT ("Ranged request for %p failed (%u), using the shared "
+        "buffer\n", transfer->resource, msg->status_code);
+    aur_transfer_proxy_fill (transfer);
+    return;
+  }
+
+  if (transfer->remaining > 0) {
+    g_message ("Ranged request ended early at offset %" G_GINT64_FORMAT,
+        (gint64) transfer->offset);
+    aur_transfer_truncate (transfer);
+    transfer->remaining = 0;
+  }
+
+  transfer->body_complete = TRUE;
+  soup_message_body_complete (transfer->msg->response_body);
+  soup_server_unpause_message (transfer->soup, transfer->msg);
+}
+
+/* Serve the rest of the transfer from a ranged request of its own to the
+ * origin server */
+static void
+aur_transfer_range_start (AurTransfer * transfer)
+{
+  SoupMessage *msg;
+  gchar *uri;
+
+  uri = g_file_get_uri (transfer->resource->source_file);
+  msg = soup_message_new (SOUP_METHOD_GET, uri);
+  g_free (uri);
+
+  if (msg == NULL) {
+    aur_transfer_proxy_fill (transfer);
+    return;
+  }
+
+  DEBUG_PRINT ("Requesting range of %p at %" G_GINT64_FORMAT "\n",
+      transfer->resource, (gint64) transfer->offset);
+
+  soup_message_headers_set_range (msg->request_headers, transfer->offset,
+      transfer->offset + transfer->remaining - 1);
+  soup_message_body_set_accumulate (msg->response_body, FALSE);
+  g_signal_connect (msg, "got-headers",
+      G_CALLBACK (aur_transfer_range_got_headers), transfer);
+  g_signal_connect (msg, "got-chunk",
+      G_CALLBACK (aur_transfer_range_got_chunk), transfer);
+
+  transfer->range_msg = msg;
+  transfer->n_outstanding++;
+  soup_session_queue_message (proxy_session, msg,
+      (SoupSessionCallback) aur_transfer_range_done, transfer);
+}
+
+static void
+aur_transfer_proxy_data_ready (G_GNUC_UNUSED AurResourceBuffer * buffer,
+    AurTransfer * transfer)
+{
+  aur_transfer_proxy_fill (transfer);
+}
+
+static void
+aur_transfer_proxy_wrote_chunk (G_GNUC_UNUSED SoupMessage * msg,
+    AurTransfer * transfer)
+{
+  if (transfer->range_msg)
+    soup_session_unpause_message (proxy_session, transfer->range_msg);
+  else if (transfer->stream)
+    aur_transfer_direct_fill (transfer);
+  else
+    aur_transfer_proxy_fill (transfer);
+}
+
+/* Once the length and type of the resource are known, work out the
+ * response headers and start sending */
+static void
+aur_transfer_proxy_start (AurResourceBuffer * buffer, AurTransfer * transfer)
+{
+  SoupMessage *msg = transfer->msg;
+  goffset start, length;
+  gboolean partial, satisfiable;
+  gint64 total_length;
+
+  if (!aur_resource_buffer_have_info (buffer) &&
+      !aur_resource_buffer_is_complete (buffer)) {
+    aur_resource_buffer_wait (buffer,
+        (AurResourceBufferFunc) aur_transfer_proxy_start, transfer);
+    return;
+  }
+
+  if (!aur_resource_buffer_have_info (buffer)) {
+    soup_message_set_status (msg, SOUP_STATUS_BAD_GATEWAY);
+    soup_message_body_complete (msg->response_body);
+    soup_server_unpause_message (transfer->soup, msg);
+    return;
+  }
+
+  soup_message_headers_replace (msg->response_headers, "Content-Type",
+      aur_resource_buffer_get_content_type (buffer));
+
+  total_length = aur_resource_buffer_get_length (buffer);
+  if (total_length < 0) {
+    /* Length not known until the fetch completes, so ranges can't be
+     * honoured. Send everything, chunked */
+    soup_message_headers_set_encoding (msg->response_headers,
+        SOUP_ENCODING_CHUNKED);
+    soup_message_set_status (msg, SOUP_STATUS_OK);
+    /* remaining is just kept non-zero until the end of the data */
+    transfer->unknown_length = TRUE;
+    transfer->offset = 0;
+    transfer->remaining = 1;
+  } else if (!aur_http_resource_get_range (msg, total_length, &start,
+          &length, &partial, &satisfiable)) {
+    /* Multiple ranges - just send the whole thing */
+    aur_http_resource_set_range_headers (msg, 0, total_length, total_length,
+        FALSE);
+    transfer->offset = 0;
+    transfer->remaining = total_length;
+  } else if (!satisfiable) {
+    soup_message_headers_set_content_range (msg->response_headers,
+        0, total_length - 1, total_length);
+    soup_message_set_status (msg, SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE);
+    soup_message_body_complete (msg->response_body);
+    soup_server_unpause_message (transfer->soup, msg);
+    return;
+  } else {
+    aur_http_resource_set_range_headers (msg, start, length, total_length,
+        partial);
+    transfer->offset = start;
+    transfer->remaining = length;
+  }
+
+  if (msg->method == SOUP_METHOD_HEAD)
+    transfer->remaining = 0;
+
+  /* Don't make a seek wait for the whole file up to that point to be
+   * fetched, if the source can seek. HTTP sources get a ranged request */
+  if (transfer->remaining > 0 && !aur_resource_buffer_is_complete (buffer)
+      && transfer->offset > (goffset) (aur_resource_buffer_get_available
+          (buffer) + DIRECT_SEEK_THRESHOLD)) {
+    if (aur_http_resource_is_http (transfer->resource))
+      aur_transfer_range_start (transfer);
+    else
+      aur_transfer_direct_start (transfer);
+    return;
+  }
+
+  aur_transfer_proxy_fill (transfer);
+}
+
+static void
+aur_transfer_proxy_finished (SoupMessage * msg, AurTransfer * transfer)
+{
+  g_signal_handler_disconnect (msg, transfer->wrote_chunk_sig);
+  g_signal_handler_disconnect (msg, transfer->finished_sig);
+
+  DEBUG_PRINT ("Proxied transfer of %p finished at offset %" G_GINT64_FORMAT
+      "\n", transfer->resource, (gint64) transfer->offset);
+
+  aur_resource_buffer_cancel_wait (transfer->buffer,
+      (AurResourceBufferFunc) aur_transfer_proxy_start, transfer);
+  aur_resource_buffer_cancel_wait (transfer->buffer,
+      (AurResourceBufferFunc) aur_transfer_proxy_data_ready, transfer);
+
+  g_object_unref (transfer->msg);
+  transfer->msg = NULL;
+  transfer->finished = TRUE;
+
+  /* Outstanding async operations free the transfer when they return */
+  if (transfer->n_outstanding > 0) {
+    if (transfer->range_msg)
+      soup_session_cancel_message (proxy_session, transfer->range_msg,
+          SOUP_STATUS_CANCELLED);
+    else
+      g_cancellable_cancel (transfer->cancel);
+    return;
+  }
+
+  aur_transfer_free (transfer);
+}
+
+/* Serve a non-local resource from the shared buffer, so that however
+ * many players ask for it, it's only fetched once */
+static void
+aur_http_resource_proxy_transfer (AurHttpResource * resource,
+    SoupServer * soup, SoupMessage * msg, SoupClientContext * context,
+    AurConfig * config)
+{
+  AurTransfer *transfer;
+
+  if (msg->method != SOUP_METHOD_GET && msg->method != SOUP_METHOD_HEAD) {
+    soup_message_set_status (msg, SOUP_STATUS_NOT_IMPLEMENTED);
+    return;
+  }
+
+  aur_http_resource_fetch (resource, config);
+
+  transfer = aur_transfer_new (resource, FALSE);
+  transfer->soup = soup;
+  transfer->msg = g_object_ref (msg);
+  transfer->socket = soup_client_context_get_gsocket (context);
+  transfer->buffer = resource->buffer;
+  transfer->window_size = MAX (config->stream_window_size, 4096);
+
+  soup_message_body_set_accumulate (msg->response_body, FALSE);
+
+  transfer->wrote_chunk_sig = g_signal_connect (msg, "wrote-chunk",
+      G_CALLBACK (aur_transfer_proxy_wrote_chunk), transfer);
+  transfer->finished_sig = g_signal_connect (msg, "finished",
+      G_CALLBACK (aur_transfer_proxy_finished), transfer);
+
+  /* Nothing can be sent until the upstream headers are in */
+  soup_server_pause_message (soup, msg);
+  aur_transfer_proxy_start (resource->buffer, transfer);
+}
+
 void
-aur_http_resource_new_transfer (AurHttpResource * resource, SoupMessage * msg)
+aur_http_resource_new_transfer (AurHttpResource * resource, SoupServer * soup,
+    SoupMessage * msg, SoupClientContext * context, AurConfig * config)
 {
   /* Create a new transfer structure, and pass the contents of our
    * resource to it */
@@ -170,31 +1432,43 @@ aur_http_resource_new_transfer (AurHttpResource * resource, SoupMessage * msg)
   SoupBuffer *buffer;
   gchar *local_path;
 
-  /* Non-local files are implemented as a HTTP redirect.
-   *
-   * FIXME: This isn't an ideal solution, as clients may not be able to access
-   * exactly the same resources as the server (due to network configuration or
-   * access restrictions). It would be better to proxy the file through the
-   * daemon, but that's an order of magnitude more complex than a simple HTTP
-   * redirect. */
+  /* Non-local files are proxied through the daemon, so clients don't
+   * need access to the origin (or to understand its URI scheme) and it's
+   * only fetched once */
   if (!g_file_is_native (resource->source_file)) {
-    gchar *resource_uri = g_file_get_uri (resource->source_file);
-    soup_message_set_redirect (msg, SOUP_STATUS_TEMPORARY_REDIRECT, resource_uri);
-    g_free (resource_uri);
+    aur_http_resource_proxy_transfer (resource, soup, msg, context,
+        config);
+    return;
+  }
 
+  local_path = g_file_get_path (resource->source_file);
+  g_assert (local_path != NULL);
+
+  if (g_str_equal (config->transfer_mode, "stream") &&
+      aur_http_resource_stream_transfer (resource, soup, msg, context,
+          config, local_path)) {
+    g_free (local_path);
     return;
   }
+#ifdef HAVE_SYS_SENDFILE_H
+  if (g_str_equal (config->transfer_mode, "sendfile") &&
+      aur_http_resource_sendfile_transfer (resource, soup, msg, context,
+          local_path)) {
+    g_free (local_path);
+    return;
+  }
+#else
+  (void) context;
+#endif
 
-  transfer = aur_transfer_new (resource);
+  transfer = aur_transfer_new (resource, TRUE);
 
   if (!transfer) {
     soup_message_set_status (msg, SOUP_STATUS_INTERNAL_SERVER_ERROR);
+    g_free (local_path);
     return;
   }
 
-  local_path = g_file_get_path (resource->source_file);
-  g_assert (local_path != NULL);
-
   buffer = soup_buffer_new_with_owner (
       g_mapped_file_get_contents (transfer->resource->data),
       g_mapped_file_get_length (transfer->resource->data),
@@ -209,11 +1483,45 @@ aur_http_resource_new_transfer (AurHttpResource * resource, SoupMessage * msg)
   g_free (local_path);
 }
 
+gboolean
+aur_http_resource_is_in_use (AurHttpResource * resource)
+{
+  return resource->use_count > 0;
+}
+
+/* Number of bytes of the resource currently held in memory */
+guint64
+aur_http_resource_get_cached_size (AurHttpResource * resource)
+{
+  guint64 size = 0;
+
+  if (resource->data)
+    size += g_mapped_file_get_length (resource->data);
+  if (resource->buffer)
+    size += aur_resource_buffer_get_memory_size (resource->buffer);
+
+  return size;
+}
+
 static void
 aur_http_resource_init (G_GNUC_UNUSED AurHttpResource * resource)
 {
 }
 
+static void
+aur_http_resource_finalize (GObject * object)
+{
+  AurHttpResource *resource = (AurHttpResource *) (object);
+
+  /* The fetch holds a ref, so can't still be running here. The cache
+   * cancels it when dropping the resource */
+  if (resource->buffer)
+    aur_resource_buffer_free (resource->buffer);
+  g_clear_object (&resource->source_file);
+
+  G_OBJECT_CLASS (aur_http_resource_parent_class)->finalize (object);
+}
+
 static void
 aur_http_resource_class_init (AurHttpResourceClass * resource_class)
 {
@@ -221,6 +1529,7 @@ aur_http_resource_class_init (AurHttpResourceClass * resource_class)
 
   gobject_class->set_property = aur_http_resource_set_property;
   gobject_class->get_property = aur_http_resource_get_property;
+  gobject_class->finalize = aur_http_resource_finalize;
 
   g_object_class_install_property (gobject_class, PROP_SOURCE_FILE,
       g_param_spec_object ("source-file", "Source File",
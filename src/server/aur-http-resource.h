@@ -39,6 +39,14 @@ struct _AurHttpResource
   GFile *source_file;
   guint use_count;
   GMappedFile *data;
+
+  /* Non-local resources are fetched once into a shared buffer, over
+   * HTTP or through GIO */
+  AurResourceBuffer *buffer;
+  SoupMessage *fetch_msg;
+  GInputStream *fetch_stream;
+  GCancellable *fetch_cancel;
+  gsize fetch_read_size;
 };
 
 struct _AurHttpResourceClass
@@ -48,7 +56,13 @@ struct _AurHttpResourceClass
 
 GType aur_http_resource_get_type(void);
 
-void aur_http_resource_new_transfer (AurHttpResource *resource, SoupMessage *msg);
+void aur_http_resource_new_transfer (AurHttpResource *resource,
+    SoupServer *soup, SoupMessage *msg, SoupClientContext *context,
+    AurConfig *config);
+
+gboolean aur_http_resource_is_in_use (AurHttpResource *resource);
+guint64 aur_http_resource_get_cached_size (AurHttpResource *resource);
+void aur_http_resource_cancel_fetch (AurHttpResource *resource);
 
 G_END_DECLS
 #endif
@@ -29,20 +29,29 @@
 #include "config.h"
 #endif
 
+#include <string.h>
 #include <json-glib/json-glib.h>
 
+#include <src/common/aur-cbor.h>
 #include <src/common/aur-json.h>
+#include <src/common/aur-msg-reader.h>
+#include <src/common/aur-msg-writer.h>
 
 #include "aur-config.h"
 #include "aur-http-resource.h"
 #include "aur-manager.h"
 #include "aur-media-db.h"
+#include "aur-player-registry.h"
 #include "aur-server.h"
 #include "aur-server-client.h"
 
 /* Set to 0 to walk the playlist linearly */
 #define RANDOM_SHUFFLE 1
 
+/* Volume and setting changes arriving within this many milliseconds of
+ * each other go out as one message per recipient, with the latest value */
+#define COALESCE_INTERVAL_MS 20
+
 enum
 {
   PROP_0,
@@ -50,17 +59,6 @@ enum
   PROP_LAST
 };
 
-typedef struct _AurPlayerInfo AurPlayerInfo;
-struct _AurPlayerInfo
-{
-  guint id;
-  gchar *host;
-  AurServerClient *conn;
-
-  gdouble volume;
-  gboolean enabled;
-};
-
 typedef enum _AurControlEvent AurControlEvent;
 enum _AurControlEvent
 {
@@ -73,7 +71,8 @@ enum _AurControlEvent
   AUR_CONTROL_VOLUME,
   AUR_CONTROL_CLIENT_SETTING,
   AUR_CONTROL_SEEK,
-  AUR_CONTROL_LANGUAGE
+  AUR_CONTROL_LANGUAGE,
+  AUR_CONTROL_BATCH
 };
 
 static const struct
@@ -90,16 +89,20 @@ static const struct
   "volume", AUR_CONTROL_VOLUME}, {
   "setclient", AUR_CONTROL_CLIENT_SETTING}, {
   "seek", AUR_CONTROL_SEEK}, {
-  "language", AUR_CONTROL_LANGUAGE}
+  "language", AUR_CONTROL_LANGUAGE}, {
+  "batch", AUR_CONTROL_BATCH}
 };
 
 static const gint N_CONTROL_EVENTS = G_N_ELEMENTS (control_event_names);
 
+/* msg-type of commands arriving over a controller's websocket */
+static GQuark control_quark;
+
 G_DEFINE_TYPE (AurManager, aur_manager, G_TYPE_OBJECT);
 
 static void aur_manager_dispose (GObject * object);
 static void aur_manager_finalize (GObject * object);
-static AurHttpResource *aur_manager_get_resource_cb (AurServer * server,
+static GFile *aur_manager_get_resource_cb (AurServer * server,
     guint resource_id, void *userdata);
 static void aur_manager_set_property (GObject * object, guint prop_id,
     const GValue * value, GParamSpec * pspec);
@@ -115,16 +118,15 @@ static void aur_manager_adjust_client_volume (AurManager * manager,
     guint client_id, gdouble volume);
 static void aur_manager_adjust_client_setting (AurManager * manager,
     guint client_id, gboolean enable);
-static GstStructure *manager_make_set_media_msg (AurManager * manager,
-    guint resource_id);
-static GstStructure *manager_make_player_clients_changed_msg
-    (AurManager * manager);
-static AurPlayerInfo *get_player_info_by_id (AurManager * manager,
-    guint client_id);
+static void manager_send_set_media_msg (AurManager * manager,
+    AurServerClient * client, gint send_to_mask, guint resource_id);
 static void aur_manager_send_seek (AurManager * manager,
     AurServerClient * client, GstClockTime position);
+static void manager_flush_pending_updates (AurManager * manager);
 static void aur_manager_send_language (AurManager * manager,
     AurServerClient * client, const gchar * language);
+static void manager_ctrl_message_received (AurServerClient * client,
+    gchar * data, guint64 len, AurManager * manager);
 
 #define SEND_MSG_TO_PLAYERS 1
 #define SEND_MSG_TO_DISABLED_PLAYERS 2
@@ -135,6 +137,11 @@ static void aur_manager_send_language (AurManager * manager,
 static void
 manager_send_msg_to_client (AurManager * manager, AurServerClient * client,
     gint send_to_mask, GstStructure * msg);
+static AurMsgWriter *manager_begin_msg (AurManager * manager,
+    AurServerClient * client, gint send_to_mask, const gchar * msg_type);
+static void manager_send_written_msg (AurManager * manager,
+    AurServerClient * client, gint send_to_mask, const gchar * coalesce_key,
+    gboolean droppable);
 
 static GstNetTimeProvider *
 create_net_clock ()
@@ -175,13 +182,14 @@ failed:
 }
 #endif
 
-static GstStructure *
-manager_make_enrol_msg (AurManager * manager, AurPlayerInfo * info)
+static void
+manager_send_enrol_msg (AurManager * manager, AurServerClient * client,
+    AurPlayerInfo * info)
 {
   int clock_port;
   GstClock *clock;
   GstClockTime cur_time;
-  GstStructure *msg;
+  AurMsgWriter *w;
   gdouble volume = manager->current_volume;
 
   g_object_get (manager->net_clock, "clock", &clock, NULL);
@@ -193,80 +201,166 @@ manager_make_enrol_msg (AurManager * manager, AurPlayerInfo * info)
   if (info != NULL)             /* Is a player message */
     volume *= info->volume;
 
-  msg = gst_structure_new ("json",
-      "msg-type", G_TYPE_STRING, "enrol",
-      "resource-id", G_TYPE_INT64, (gint64) manager->current_resource,
-      "clock-port", G_TYPE_INT, clock_port,
-      "current-time", G_TYPE_INT64, (gint64) (cur_time),
-      "volume-level", G_TYPE_DOUBLE, volume,
-      "paused", G_TYPE_BOOLEAN, manager->paused, NULL);
+  w = manager_begin_msg (manager, client, SEND_MSG_TO_ALL, "enrol");
+  aur_msg_writer_add_int64 (w, "resource-id", manager->current_resource);
+  aur_msg_writer_add_int64 (w, "clock-port", clock_port);
+  aur_msg_writer_add_int64 (w, "current-time", (gint64) (cur_time));
+  aur_msg_writer_add_double (w, "volume-level", volume);
+  aur_msg_writer_add_boolean (w, "paused", manager->paused);
 
   if (info != NULL)             /* Is a player message */
-    gst_structure_set (msg, "enabled", G_TYPE_BOOLEAN, info->enabled, NULL);
+    aur_msg_writer_add_boolean (w, "enabled", info->enabled);
+  else                          /* Controllers can send commands back */
+    aur_msg_writer_add_boolean (w, "socket-control", TRUE);
 
-  return msg;
+  manager_send_written_msg (manager, client, SEND_MSG_TO_ALL, NULL, FALSE);
 }
 
-static GstStructure *
-make_player_clients_list_msg (AurManager * manager)
+static void
+write_player_entry (AurMsgWriter * w, AurPlayerInfo * info)
 {
-  GstStructure *msg;
-  GValue p = G_VALUE_INIT;
-  GList *cur;
+  aur_msg_writer_begin_object (w, NULL);
+  aur_msg_writer_add_int64 (w, "client-id", info->id);
+  aur_msg_writer_add_boolean (w, "enabled", info->enabled);
+  aur_msg_writer_add_double (w, "volume", info->volume);
+  aur_msg_writer_add_string (w, "host", info->host);
+  aur_msg_writer_end_object (w);
+}
 
-  g_value_init (&p, GST_TYPE_ARRAY);
-
-  msg = gst_structure_new ("json",
-      "msg-type", G_TYPE_STRING, "player-clients", NULL);
-
-  for (cur = manager->player_info; cur != NULL; cur = g_list_next (cur)) {
-    AurPlayerInfo *info = (AurPlayerInfo *) (cur->data);
-    if (info->conn != NULL) {
-      GValue tmp = G_VALUE_INIT;
-      GstStructure *cur_struct = gst_structure_new ("client",
-          "client-id", G_TYPE_INT64, (gint64) info->id,
-          "enabled", G_TYPE_BOOLEAN, info->enabled,
-          "volume", G_TYPE_DOUBLE, info->volume,
-          "host", G_TYPE_STRING, info->host,
-          NULL);
-
-      g_value_init (&tmp, GST_TYPE_STRUCTURE);
-      gst_value_set_structure (&tmp, cur_struct);
-      gst_value_array_append_value (&p, &tmp);
-      g_value_unset (&tmp);
-      gst_structure_free (cur_struct);
-    }
-  }
-  gst_structure_take_value (msg, "player-clients", &p);
+/* The full list of connected players, with the sequence number of the
+ * last delta it includes */
+static void
+write_player_clients (AurManager * manager, AurMsgWriter * w)
+{
+  AurPlayerInfo **players;
+  guint i, n_players;
 
-  return msg;
+  aur_msg_writer_add_int64 (w, "seq", manager->player_clients_seq);
+  aur_msg_writer_begin_array (w, "player-clients");
+
+  players = aur_player_registry_get_connected (manager->players, &n_players);
+  for (i = 0; i < n_players; i++)
+    write_player_entry (w, players[i]);
+  aur_msg_writer_end_array (w);
 }
 
-static gint
-find_player_info_by_client (const AurPlayerInfo * info,
+/* Sent to controllers as they enrol */
+static void
+manager_send_player_clients_msg (AurManager * manager,
     AurServerClient * client)
 {
-  if (info->conn == client)
-    return 0;
+  AurMsgWriter *w;
+
+  w = manager_begin_msg (manager, client, 0, "player-clients");
+  write_player_clients (manager, w);
+  manager_send_written_msg (manager, client, 0, NULL, FALSE);
+}
+
+static void
+manager_drop_player_info (AurManager * manager)
+{
+  if (manager->player_info_json) {
+    g_bytes_unref (manager->player_info_json);
+    manager->player_info_json = NULL;
+  }
+  if (manager->player_info_cbor) {
+    g_bytes_unref (manager->player_info_cbor);
+    manager->player_info_cbor = NULL;
+  }
+}
+
+/* Start a change to the player list for the controllers. The caller adds
+ * "added", "removed" and/or "changed" arrays of entries - removed ones
+ * only have a client-id - and sends it with manager_send_written_msg().
+ * A controller that sees a gap in the sequence fetches the full list */
+static AurMsgWriter *
+manager_begin_player_clients_delta (AurManager * manager)
+{
+  AurMsgWriter *w;
+
+  /* Every change to the list goes through here, so the served copy
+   * only needs dropping here */
+  manager_drop_player_info (manager);
+
+  w = manager_begin_msg (manager, NULL, SEND_MSG_TO_CONTROLLERS,
+      "player-clients-delta");
+  aur_msg_writer_add_int64 (w, "seq", ++manager->player_clients_seq);
+
+  return w;
+}
+
+/* Answer /client/player_info from the copy of the list for the current
+ * seq, writing it first if there isn't one. Pollers that already have
+ * this seq get a 304 with no body. The seq restarts with the server,
+ * so the ETag also carries the time the server started */
+static void
+manager_serve_player_info (AurManager * manager, SoupMessage * msg)
+{
+  SoupMessageHeaders *headers = msg->response_headers;
+  gboolean cbor = aur_server_client_http_accepts_cbor (msg);
+  guint format = cbor ? AUR_MSG_WRITER_CBOR : AUR_MSG_WRITER_JSON;
+  GBytes **cached = cbor ? &manager->player_info_cbor :
+      &manager->player_info_json;
+  const gchar *if_none_match;
+  SoupBuffer *buffer;
+  gchar *etag;
+  gsize len;
+
+  etag = g_strdup_printf ("\"%" G_GINT64_MODIFIER "x-%u-%s\"",
+      manager->player_info_epoch, manager->player_clients_seq,
+      cbor ? "cbor" : "json");
+  soup_message_headers_replace (headers, "ETag", etag);
+  soup_message_headers_replace (headers, "Cache-Control", "no-cache");
+  soup_message_headers_replace (headers, "Vary", "Accept");
+
+  if_none_match = soup_message_headers_get_list (msg->request_headers,
+      "If-None-Match");
+  if (if_none_match && strstr (if_none_match, etag) != NULL) {
+    soup_message_set_status (msg, SOUP_STATUS_NOT_MODIFIED);
+    g_free (etag);
+    return;
+  }
+  g_free (etag);
+
+  if (*cached == NULL) {
+    aur_msg_writer_begin (manager->writer, format, "player-clients");
+    write_player_clients (manager, manager->writer);
+    aur_msg_writer_end (manager->writer);
+    *cached = aur_msg_writer_get_bytes (manager->writer, format);
+  }
 
-  return -1;
+  /* Leave off the NUL that ends a JSON message */
+  len = g_bytes_get_size (*cached);
+  if (!cbor)
+    len--;
+
+  soup_message_headers_set_content_type (headers,
+      cbor ? AUR_CBOR_CONTENT_TYPE : "application/json", NULL);
+  buffer = soup_buffer_new_with_owner (g_bytes_get_data (*cached, NULL),
+      len, g_bytes_ref (*cached), (GDestroyNotify) g_bytes_unref);
+  soup_message_body_append_buffer (msg->response_body, buffer);
+  soup_buffer_free (buffer);
+  soup_message_set_status (msg, SOUP_STATUS_OK);
 }
 
 static void
 manager_player_client_disconnect (AurServerClient * client,
     AurManager * manager)
 {
-  GList *item = g_list_find_custom (manager->player_info, client, (GCompareFunc)(find_player_info_by_client));
-  if (item) {
-    AurPlayerInfo *info = (AurPlayerInfo *)(item->data);
+  AurPlayerInfo *info = aur_player_registry_detach (manager->players, client);
+  AurMsgWriter *w;
 
+  if (info) {
     g_print ("Disconnecting player client %u\n", info->id);
 
-    g_object_unref (client);
-    info->conn = NULL;
-
-    manager_send_msg_to_client (manager, NULL, SEND_MSG_TO_CONTROLLERS,
-        manager_make_player_clients_changed_msg (manager));
+    w = manager_begin_player_clients_delta (manager);
+    aur_msg_writer_begin_array (w, "removed");
+    aur_msg_writer_begin_object (w, NULL);
+    aur_msg_writer_add_int64 (w, "client-id", info->id);
+    aur_msg_writer_end_object (w);
+    aur_msg_writer_end_array (w);
+    manager_send_written_msg (manager, NULL, SEND_MSG_TO_CONTROLLERS, NULL,
+        FALSE);
   }
 }
 
@@ -283,111 +377,82 @@ manager_ctrl_client_disconnect (AurServerClient * client,
 }
 
 static void
-manager_status_client_disconnect (AurServerClient * client,
-    G_GNUC_UNUSED AurManager * manager)
+append_client_stats (GValue * array, AurServerClient * client)
 {
-  g_object_unref (client);
+  GstStructure *stats = aur_server_client_get_stats (client);
+  GValue tmp = G_VALUE_INIT;
+
+  g_value_init (&tmp, GST_TYPE_STRUCTURE);
+  gst_value_set_structure (&tmp, stats);
+  gst_value_array_append_value (array, &tmp);
+  g_value_unset (&tmp);
+  gst_structure_free (stats);
 }
 
-static gboolean
-handle_ping_timeout (AurManager *manager)
+static GstStructure *
+make_stats_msg (AurManager * manager)
 {
   GstStructure *msg;
+  GValue clients = G_VALUE_INIT;
+  AurPlayerInfo **players;
+  guint i, n_players;
+  GList *cur;
 
-  if (manager->ping_timeout == 0)
-    return FALSE;
-
-  /* Send a ping to each client */
-  msg = gst_structure_new ("json",
-      "msg-type", G_TYPE_STRING, "ping", NULL);
-  manager_send_msg_to_client (manager, NULL,
-     SEND_MSG_TO_ALL, msg);
-
-  return TRUE;
-}
-
-static void
-send_enrol_events (AurManager * manager, AurServerClient * client,
-    AurPlayerInfo *info)
-{
-  manager_send_msg_to_client (manager, client, SEND_MSG_TO_ALL,
-      manager_make_enrol_msg (manager, info));
+  msg = gst_structure_new ("json", "msg-type", G_TYPE_STRING, "stats", NULL);
+  aur_server_get_stats (manager->server, msg);
 
-  if (manager->current_resource) {
-    manager_send_msg_to_client (manager, client, SEND_MSG_TO_ALL,
-        manager_make_set_media_msg (manager, manager->current_resource));
-  }
-  if (info == NULL) {
-    manager_send_msg_to_client (manager, client, SEND_MSG_TO_CONTROLLERS,
-        manager_make_player_clients_changed_msg (manager));
-  }
+  /* Send queue state of each connected player and controller */
+  g_value_init (&clients, GST_TYPE_ARRAY);
+  players = aur_player_registry_get_connected (manager->players, &n_players);
+  for (i = 0; i < n_players; i++)
+    append_client_stats (&clients, players[i]->conn);
+  for (cur = manager->ctrl_clients; cur != NULL; cur = g_list_next (cur))
+    append_client_stats (&clients, (AurServerClient *) (cur->data));
 
-  if (manager->ping_timeout == 0) {
-    manager->ping_timeout = g_timeout_add_seconds (2,  (GSourceFunc) handle_ping_timeout, manager);
-  }
-}
+  gst_structure_take_value (msg, "clients", &clients);
+  gst_structure_set (msg, "queue-overflows", G_TYPE_INT,
+      (gint) aur_server_client_get_overflow_count (), NULL);
 
-static gint
-find_unlinked_player_info_by_host (const AurPlayerInfo *p, const gchar *host)
-{
-  if (p->conn == NULL && g_str_equal (p->host, host))
-    return 0;
-  return -1;
+  return msg;
 }
 
-static gint
-find_player_info_by_client_id (const AurPlayerInfo *p, const gpointer cid_ptr)
+static void
+manager_status_client_disconnect (AurServerClient * client,
+    G_GNUC_UNUSED AurManager * manager)
 {
-  const guint client_id = GPOINTER_TO_INT(cid_ptr);
-  if (p->id == client_id)
-    return 0;
-  return -1;
+  g_object_unref (client);
 }
 
-static AurPlayerInfo *
-get_player_info_by_id (AurManager *manager, guint client_id)
+/* Connections keep themselves alive with their own heartbeats, so this
+ * only tidies up players that have been gone a while */
+static gboolean
+handle_expire_timeout (AurManager *manager)
 {
-  GList *entry;
-  AurPlayerInfo *info = NULL;
+  if (manager->expire_timeout == 0)
+    return FALSE;
 
-  /* See if there's a player instance that matches */
-  entry = g_list_find_custom (manager->player_info, GINT_TO_POINTER (client_id), (GCompareFunc) find_player_info_by_client_id);
-  if (entry)
-    info = (AurPlayerInfo *)(entry->data);
+  aur_player_registry_expire (manager->players, g_get_monotonic_time ());
 
-  return info;
+  return TRUE;
 }
 
-static AurPlayerInfo *
-get_player_info_for_client (AurManager *manager, AurServerClient *client)
+static void
+send_enrol_events (AurManager * manager, AurServerClient * client,
+    AurPlayerInfo *info)
 {
-  GList *entry;
-  AurPlayerInfo *info = NULL;
-  const gchar *host;
-
-  /* See if there's a disconnected player instance that matches */
-  host = aur_server_client_get_host (client);
-  entry = g_list_find_custom (manager->player_info, host, (GCompareFunc) find_unlinked_player_info_by_host);
-  if (entry == NULL) {
-    info = g_new0 (AurPlayerInfo, 1);
-    /* Init the player info */
-    info->host = g_strdup (host);
-    info->id = manager->next_player_id++;
-    info->volume = 1.0;
-    /* FIXME: Disable new clients if playing, otherwise enable */
-    info->enabled = manager->paused;
-    manager->player_info = entry = g_list_prepend (manager->player_info, info);
+  manager_send_enrol_msg (manager, client, info);
 
-    g_print ("New player id %u\n", info->id);
-  }
-  else {
-    info = (AurPlayerInfo *)(entry->data);
-    g_print ("Player id %u rejoining\n", info->id);
+  if (manager->current_resource) {
+    manager_send_set_media_msg (manager, client, SEND_MSG_TO_ALL,
+        manager->current_resource);
   }
+  if (info == NULL)
+    manager_send_player_clients_msg (manager, client);
 
-  info->conn = client;
-
-  return info;
+  if (manager->expire_timeout == 0) {
+    manager->expire_timeout = g_timeout_add_seconds (60,
+        (GSourceFunc) handle_expire_timeout, manager);
+  }
 }
 
 static void
@@ -406,28 +471,53 @@ manager_client_cb (SoupServer * soup, SoupMessage * msg,
 
   if (g_str_equal (parts[2], "player_events")) {
     AurPlayerInfo *info;
+    AurMsgWriter *w;
+    gboolean created;
 
     client_conn = aur_server_client_new (soup, msg, ctx);
     g_signal_connect (client_conn, "connection-lost",
         G_CALLBACK (manager_player_client_disconnect), manager);
 
-    info = get_player_info_for_client (manager, client_conn);
+    /* A player reconnecting from the same host picks up where it left
+     * off */
+    info = aur_player_registry_attach (manager->players, client_conn,
+        aur_server_client_get_host (client_conn), &created);
+    if (created) {
+      info->volume = 1.0;
+      /* FIXME: Disable new clients if playing, otherwise enable */
+      info->enabled = manager->paused;
+      g_print ("New player id %u\n", info->id);
+    } else {
+      g_print ("Player id %u rejoining\n", info->id);
+    }
+    /* The enrol message carries the current values */
+    info->volume_changed = info->setting_changed = FALSE;
 
     send_enrol_events (manager, client_conn, info);
-    manager_send_msg_to_client (manager, NULL, SEND_MSG_TO_CONTROLLERS,
-        manager_make_player_clients_changed_msg (manager));
+
+    w = manager_begin_player_clients_delta (manager);
+    aur_msg_writer_begin_array (w, "added");
+    write_player_entry (w, info);
+    aur_msg_writer_end_array (w);
+    manager_send_written_msg (manager, NULL, SEND_MSG_TO_CONTROLLERS, NULL,
+        FALSE);
   } else if (g_str_equal (parts[2], "control_events")) {
     client_conn = aur_server_client_new (soup, msg, ctx);
     g_signal_connect (client_conn, "connection-lost",
         G_CALLBACK (manager_ctrl_client_disconnect), manager);
+    /* Websocket controllers can send their commands back the same way */
+    g_signal_connect (client_conn, "message-received",
+        G_CALLBACK (manager_ctrl_message_received), manager);
     manager->ctrl_clients = g_list_prepend (manager->ctrl_clients, client_conn);
     send_enrol_events (manager, client_conn, NULL);
   } else if (g_str_equal (parts[2], "player_info")) {
+    manager_serve_player_info (manager, msg);
+  } else if (g_str_equal (parts[2], "stats")) {
     client_conn = aur_server_client_new_single (soup, msg, ctx);
     g_signal_connect (client_conn, "connection-lost",
         G_CALLBACK (manager_status_client_disconnect), manager);
     manager_send_msg_to_client (manager, client_conn, 0,
-        make_player_clients_list_msg (manager));
+        make_stats_msg (manager));
   } else {
     soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
   }
@@ -436,9 +526,34 @@ done:
   g_strfreev (parts);
 }
 
-static void
-manager_send_msg_to_client (AurManager * manager, AurServerClient * client,
-    gint send_to_mask, GstStructure * msg)
+/* Work out how a message may be treated if a client's send queue backs
+ * up. Level updates only matter in their latest version. Everything else
+ * has to get through. Messages written directly pass the same keys to
+ * manager_send_written_msg() */
+static gchar *
+manager_get_coalesce_key (const GstStructure * msg, gboolean * droppable)
+{
+  const gchar *msg_type = gst_structure_get_string (msg, "msg-type");
+  gint64 client_id;
+
+  *droppable = FALSE;
+
+  if (msg_type == NULL)
+    return NULL;
+
+  if (g_str_equal (msg_type, "volume") ||
+      g_str_equal (msg_type, "client-volume") ||
+      g_str_equal (msg_type, "client-setting")) {
+    if (gst_structure_get_int64 (msg, "client-id", &client_id))
+      return g_strdup_printf ("%s:%" G_GINT64_FORMAT, msg_type, client_id);
+    return g_strdup (msg_type);
+  }
+
+  return NULL;
+}
+
+static GBytes *
+manager_encode_json (const GstStructure * msg)
 {
   JsonGenerator *gen;
   JsonNode *root;
@@ -446,7 +561,6 @@ manager_send_msg_to_client (AurManager * manager, AurServerClient * client,
   gsize len;
 
   root = aur_json_from_gst_structure (msg);
-  gst_structure_free (msg);
 
   gen = json_generator_new ();
 
@@ -457,26 +571,158 @@ manager_send_msg_to_client (AurManager * manager, AurServerClient * client,
   g_object_unref (gen);
   json_node_free (root);
 
+  /* The generated text is NUL-terminated, which is kept as the message
+   * separator */
+  return g_bytes_new_take (body, len + 1);
+}
+
+/* Call func for each recipient of a message - the given client, or if
+ * that's NULL, every client send_to_mask selects */
+static void
+manager_foreach_recipient (AurManager * manager, AurServerClient * client,
+    gint send_to_mask, GFunc func, gpointer user_data)
+{
+  GList *cur;
+
   if (client) {
-    aur_server_client_send_message (client, body, len);
-  } else {
-    /* client == NULL - send to all clients */
-    GList *cur;
-    if (send_to_mask & SEND_MSG_TO_PLAYERS) {
-      for (cur = manager->player_info; cur != NULL; cur = g_list_next (cur)) {
-        AurPlayerInfo *info = (AurPlayerInfo *) (cur->data);
-        if (info->conn)
-          aur_server_client_send_message (info->conn, body, len);
-      }
+    func (client, user_data);
+    return;
+  }
+
+  if (send_to_mask & SEND_MSG_TO_PLAYERS) {
+    AurPlayerInfo **players;
+    guint i, n_players;
+
+    /* Backwards, as a player disconnecting during the send swaps the
+     * last one into its place */
+    players = aur_player_registry_get_connected (manager->players, &i);
+    while (i-- > 0) {
+      func (players[i]->conn, user_data);
+      players = aur_player_registry_get_connected (manager->players,
+          &n_players);
+      i = MIN (i, n_players);
     }
-    if (send_to_mask & SEND_MSG_TO_CONTROLLERS) {
-      for (cur = manager->ctrl_clients; cur != NULL; cur = g_list_next (cur)) {
-        client = (AurServerClient *) (cur->data);
-        aur_server_client_send_message (client, body, len);
-      }
+  }
+  if (send_to_mask & SEND_MSG_TO_CONTROLLERS) {
+    GList *next;
+
+    /* A controller that falls too far behind is disconnected during the
+     * send, which frees its link */
+    for (cur = manager->ctrl_clients; cur != NULL; cur = next) {
+      next = g_list_next (cur);
+      func (cur->data, user_data);
     }
   }
-  g_free (body);
+}
+
+static void
+collect_msg_format (AurServerClient * client, guint * formats)
+{
+  if (aur_server_client_get_encoding (client) == AUR_SERVER_CLIENT_CBOR)
+    *formats |= AUR_MSG_WRITER_CBOR;
+  else
+    *formats |= AUR_MSG_WRITER_JSON;
+}
+
+/* A message serialised once in each encoding its recipients need, and
+ * shared by all of them */
+typedef struct _ManagerDelivery ManagerDelivery;
+
+struct _ManagerDelivery
+{
+  GBytes *json;
+  GBytes *cbor;
+  const gchar *coalesce_key;
+  gboolean droppable;
+};
+
+static void
+deliver_msg (AurServerClient * client, ManagerDelivery * d)
+{
+  if (aur_server_client_get_encoding (client) == AUR_SERVER_CLIENT_CBOR)
+    aur_server_client_send_bytes (client, d->cbor, d->coalesce_key,
+        d->droppable);
+  else
+    aur_server_client_send_bytes (client, d->json, d->coalesce_key,
+        d->droppable);
+}
+
+static void
+manager_deliver (AurManager * manager, AurServerClient * client,
+    gint send_to_mask, ManagerDelivery * d)
+{
+  manager_foreach_recipient (manager, client, send_to_mask,
+      (GFunc) deliver_msg, d);
+
+  if (d->json)
+    g_bytes_unref (d->json);
+  if (d->cbor)
+    g_bytes_unref (d->cbor);
+}
+
+/* Send a message built as a GstStructure. Only used for messages too
+ * irregular to be worth writing directly, like the stats */
+static void
+manager_send_msg_to_client (AurManager * manager, AurServerClient * client,
+    gint send_to_mask, GstStructure * msg)
+{
+  ManagerDelivery d = { NULL, };
+  guint formats = 0;
+  gchar *key;
+
+  manager_foreach_recipient (manager, client, send_to_mask,
+      (GFunc) collect_msg_format, &formats);
+
+  key = manager_get_coalesce_key (msg, &d.droppable);
+  d.coalesce_key = key;
+
+  if (formats & AUR_MSG_WRITER_JSON)
+    d.json = manager_encode_json (msg);
+  if (formats & AUR_MSG_WRITER_CBOR)
+    d.cbor = aur_cbor_from_gst_structure (msg);
+  gst_structure_free (msg);
+
+  manager_deliver (manager, client, send_to_mask, &d);
+  g_free (key);
+}
+
+/* Start writing a message for the given recipients, in just the encodings
+ * they use. Finish it with manager_send_written_msg() */
+static AurMsgWriter *
+manager_begin_msg (AurManager * manager, AurServerClient * client,
+    gint send_to_mask, const gchar * msg_type)
+{
+  guint formats = 0;
+
+  manager_foreach_recipient (manager, client, send_to_mask,
+      (GFunc) collect_msg_format, &formats);
+  aur_msg_writer_begin (manager->writer, formats, msg_type);
+
+  return manager->writer;
+}
+
+/* Send the message written since manager_begin_msg(). See
+ * manager_get_coalesce_key() for the meaning of coalesce_key and
+ * droppable */
+static void
+manager_send_written_msg (AurManager * manager, AurServerClient * client,
+    gint send_to_mask, const gchar * coalesce_key, gboolean droppable)
+{
+  AurMsgWriter *writer = manager->writer;
+  ManagerDelivery d = { NULL, NULL, coalesce_key, droppable };
+  guint formats;
+
+  aur_msg_writer_end (writer);
+  formats = aur_msg_writer_get_formats (writer);
+
+  /* Copied out before sending, as a client disconnecting during the send
+   * can lead to another message being written */
+  if (formats & AUR_MSG_WRITER_JSON)
+    d.json = aur_msg_writer_get_bytes (writer, AUR_MSG_WRITER_JSON);
+  if (formats & AUR_MSG_WRITER_CBOR)
+    d.cbor = aur_msg_writer_get_bytes (writer, AUR_MSG_WRITER_CBOR);
+
+  manager_deliver (manager, client, send_to_mask, &d);
 }
 
 static AurControlEvent
@@ -497,20 +743,130 @@ get_playlist_len (AurManager * mgr)
   return aur_media_db_get_file_count (mgr->media_db);
 }
 
+static guint
+aur_manager_pick_next_resource (AurManager * manager)
+{
+  guint len = get_playlist_len (manager);
+
+  if (len == 0)
+    return 0;
+
+#if RANDOM_SHUFFLE
+  return (guint) g_random_int_range (0, len) + 1;
+#else
+  return (guint) (manager->current_resource % len) + 1;
+#endif
+}
+
+/* Where a control command's parameters come from - the query and form
+ * of an HTTP request, or the fields of an event channel message */
+typedef struct _ControlParams ControlParams;
+
+struct _ControlParams
+{
+  GHashTable *query;
+  GHashTable *post;
+  const AurMsgObject *msg;
+};
+
 static const gchar *
-find_param_str (const gchar * param_name, GHashTable * query_params,
-    GHashTable * post_params)
+find_param_str (const gchar * param_name, const ControlParams * params)
 {
   gchar *out = NULL;
 
-  if (query_params)
-    out = g_hash_table_lookup (query_params, param_name);
-  if (out == NULL && post_params)
-    out = g_hash_table_lookup (post_params, param_name);
+  if (params->query)
+    out = g_hash_table_lookup (params->query, param_name);
+  if (out == NULL && params->post)
+    out = g_hash_table_lookup (params->post, param_name);
 
   return out;
 }
 
+/* Message fields are typed, except that a resource id can be a number or
+ * a URI - numbers come back formatted as strings */
+static gchar *
+control_param_dup_string (const ControlParams * params, const gchar * name)
+{
+  gchar *str;
+  gint64 num;
+
+  if (params->msg == NULL)
+    return g_strdup (find_param_str (name, params));
+
+  str = aur_msg_object_dup_string (params->msg, name);
+  if (str == NULL && aur_msg_object_get_int64 (params->msg, name, &num))
+    str = g_strdup_printf ("%" G_GINT64_FORMAT, num);
+
+  return str;
+}
+
+static gboolean
+control_param_get_uint64 (const ControlParams * params, const gchar * name,
+    guint64 * value)
+{
+  const gchar *str;
+  gint64 num;
+
+  if (params->msg) {
+    if (!aur_msg_object_get_int64 (params->msg, name, &num) || num < 0)
+      return FALSE;
+    *value = num;
+    return TRUE;
+  }
+
+  str = find_param_str (name, params);
+  return str != NULL && sscanf (str, "%" G_GUINT64_FORMAT, value) == 1;
+}
+
+static gboolean
+control_param_get_uint (const ControlParams * params, const gchar * name,
+    guint * value)
+{
+  guint64 num;
+
+  if (!control_param_get_uint64 (params, name, &num) || num > G_MAXUINT)
+    return FALSE;
+
+  *value = num;
+  return TRUE;
+}
+
+static gboolean
+control_param_get_double (const ControlParams * params, const gchar * name,
+    gdouble * value)
+{
+  const gchar *str;
+
+  if (params->msg)
+    return aur_msg_object_get_double (params->msg, name, value);
+
+  str = find_param_str (name, params);
+  if (str == NULL)
+    return FALSE;
+
+  *value = g_ascii_strtod (str, NULL);
+  return TRUE;
+}
+
+/* Forms give 0 or 1 */
+static gboolean
+control_param_get_boolean (const ControlParams * params, const gchar * name,
+    gboolean * value)
+{
+  const gchar *str;
+  gint num;
+
+  if (params->msg)
+    return aur_msg_object_get_boolean (params->msg, name, value);
+
+  str = find_param_str (name, params);
+  if (str == NULL || !sscanf (str, "%d", &num))
+    return FALSE;
+
+  *value = num != 0;
+  return TRUE;
+}
+
 static gboolean
 is_allowed_uri (const gchar *uri)
 {
@@ -521,31 +877,18 @@ is_allowed_uri (const gchar *uri)
   return FALSE;
 }
 
-static void
-control_callback (G_GNUC_UNUSED SoupServer * soup, SoupMessage * msg,
-    const char *path, GHashTable * query,
-    G_GNUC_UNUSED SoupClientContext * client, AurManager * manager)
-{
-  gchar **parts = g_strsplit (path, "/", 3);
-  guint n_parts = g_strv_length (parts);
-  AurControlEvent event_type;
-  GHashTable *post_params = NULL;
-  const gchar *content_type;
-
-  if (n_parts < 3 || !g_str_equal ("control", parts[1]))
-    goto done;                  /* Invalid request */
-
-  event_type = str_to_control_event_type (parts[2]);
-  content_type =
-      soup_message_headers_get_content_type (msg->request_headers, NULL);
-  if (g_str_equal (msg->method, "POST") &&
-      content_type &&
-      g_str_equal (content_type, SOUP_FORM_MIME_TYPE_URLENCODED))
-    post_params = soup_form_decode (msg->request_body->data);
+static gboolean manager_handle_batch (AurManager * manager,
+    const ControlParams * params, gchar ** error);
 
+/* Carry out a control command. On failure, returns FALSE with the reason
+ * in error */
+static gboolean
+manager_handle_control (AurManager * manager, AurControlEvent event_type,
+    const ControlParams * params, gchar ** error)
+{
   switch (event_type) {
     case AUR_CONTROL_NEXT:{
-      const gchar *id_str = find_param_str ("id", query, post_params);
+      gchar *id_str = control_param_dup_string (params, "id");
       guint resource_id;
 
       g_print ("Next ID %s\n", id_str);
@@ -559,8 +902,10 @@ control_callback (G_GNUC_UNUSED SoupServer * soup, SoupMessage * msg,
        * '/').
        */
       if (id_str && !g_ascii_isdigit (id_str[0])) {
-        if (!is_allowed_uri (id_str))
+        if (!is_allowed_uri (id_str)) {
+          g_free (id_str);
           break;
+        }
         resource_id = G_MAXUINT;
         g_clear_object (&manager->custom_file);
         manager->custom_file = g_file_new_for_commandline_arg (id_str);
@@ -568,17 +913,15 @@ control_callback (G_GNUC_UNUSED SoupServer * soup, SoupMessage * msg,
         resource_id = 0;
       } else if (id_str == NULL || !id_str[0]
           || !sscanf (id_str, "%d", &resource_id)) {
-        /* No or invalid resource id: skip to next track */
-#if RANDOM_SHUFFLE
-        resource_id =
-          (guint) g_random_int_range (0, get_playlist_len (manager)) + 1;
-#else
-        resource_id =
-          (guint) (manager->current_resource % get_playlist_len (manager)) + 1;
-#endif
+        /* No or invalid resource id: skip to the next track, which was
+         * picked (and prefetched) when the current one started */
+        resource_id = manager->next_resource;
+        if (resource_id < 1 || resource_id > get_playlist_len (manager))
+          resource_id = aur_manager_pick_next_resource (manager);
       } else {
         resource_id = CLAMP (resource_id, 1, get_playlist_len (manager));
       }
+      g_free (id_str);
       manager->paused = FALSE;
       aur_manager_play_resource (manager, resource_id);
       break;
@@ -606,16 +949,12 @@ control_callback (G_GNUC_UNUSED SoupServer * soup, SoupMessage * msg,
       break;
     }
     case AUR_CONTROL_VOLUME:{
-      const gchar *vol_str = find_param_str ("level", query, post_params);
-      const gchar *id_str = find_param_str ("client_id", query, post_params);
       guint client_id = 0;
       gdouble new_vol;
 
-      if (id_str != NULL)
-        sscanf (id_str, "%u", &client_id);
+      control_param_get_uint (params, "client_id", &client_id);
 
-      if (vol_str) {
-        new_vol = g_ascii_strtod (vol_str, NULL);
+      if (control_param_get_double (params, "level", &new_vol)) {
         new_vol = CLAMP (new_vol, 0.0, 10.0);
         if (client_id == 0)
           aur_manager_adjust_volume (manager, new_vol);
@@ -626,50 +965,278 @@ control_callback (G_GNUC_UNUSED SoupServer * soup, SoupMessage * msg,
       break;
     }
     case AUR_CONTROL_CLIENT_SETTING:{
-      const gchar *set_str = find_param_str ("enable", query, post_params);
-      const gchar *id_str = find_param_str ("client_id", query, post_params);
       guint client_id = 0;
-      gint enable = 1;
+      gboolean enable;
 
-      if (id_str != NULL)
-        sscanf (id_str, "%u", &client_id);
+      control_param_get_uint (params, "client_id", &client_id);
 
-      if (set_str && sscanf (set_str, "%d", &enable)) {
+      if (control_param_get_boolean (params, "enable", &enable)) {
         if (client_id > 0)
-          aur_manager_adjust_client_setting (manager, client_id, enable != 0);
+          aur_manager_adjust_client_setting (manager, client_id, enable);
       }
 
       break;
     }
     case AUR_CONTROL_SEEK:{
-      const gchar *pos_str = find_param_str ("position", query, post_params);
       GstClockTime position = 0;
 
-      if (pos_str != NULL)
-        sscanf (pos_str, "%" G_GUINT64_FORMAT, &position);
+      control_param_get_uint64 (params, "position", &position);
 
       aur_manager_send_seek (manager, NULL, position);
       break;
     }
     case AUR_CONTROL_LANGUAGE:{
-      const gchar *language = find_param_str ("language", query, post_params);
+      gchar *language = control_param_dup_string (params, "language");
       aur_manager_send_language (manager, NULL, language);
+      g_free (language);
       break;
     }
+    case AUR_CONTROL_BATCH:
+      return manager_handle_batch (manager, params, error);
     default:
-      g_message ("Ignoring unknown/unimplemented control %s\n", parts[2]);
-      soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
-      goto done;
+      *error = g_strdup ("unknown command");
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Why a command in a batch couldn't be carried out, or NULL if it can.
+ * Commands on their own are more forgiving, and ignore what they can't
+ * use */
+static const gchar *
+manager_check_control (AurManager * manager, AurControlEvent event_type,
+    const ControlParams * params)
+{
+  guint client_id = 0;
+  gboolean enable, allowed;
+  gdouble level;
+  gchar *id_str;
+
+  switch (event_type) {
+    case AUR_CONTROL_NEXT:
+      id_str = control_param_dup_string (params, "id");
+      allowed = id_str == NULL || g_ascii_isdigit (id_str[0]) ||
+          is_allowed_uri (id_str);
+      g_free (id_str);
+      return allowed ? NULL : "URI not allowed";
+    case AUR_CONTROL_VOLUME:
+      if (!control_param_get_double (params, "level", &level))
+        return "no level";
+      control_param_get_uint (params, "client_id", &client_id);
+      if (client_id != 0 &&
+          aur_player_registry_lookup_id (manager->players, client_id) == NULL)
+        return "no such client";
+      return NULL;
+    case AUR_CONTROL_CLIENT_SETTING:
+      if (!control_param_get_boolean (params, "enable", &enable))
+        return "no enable setting";
+      if (!control_param_get_uint (params, "client_id", &client_id) ||
+          aur_player_registry_lookup_id (manager->players, client_id) == NULL)
+        return "no such client";
+      return NULL;
+    case AUR_CONTROL_PLAY:
+    case AUR_CONTROL_PAUSE:
+    case AUR_CONTROL_SEEK:
+    case AUR_CONTROL_LANGUAGE:
+      return NULL;
+    case AUR_CONTROL_BATCH:
+      return "batches can't be nested";
+    default:
+      return "unknown command";
+  }
+}
+
+static AurControlEvent
+get_msg_control_event_type (const AurMsgObject * msg)
+{
+  gchar *command = aur_msg_object_dup_string (msg, "command");
+  AurControlEvent event_type = AUR_CONTROL_NONE;
+
+  if (command != NULL)
+    event_type = str_to_control_event_type (command);
+  g_free (command);
+
+  return event_type;
+}
+
+/* An ordered list of commands, applied together or not at all:
+ *   {"commands": [{"command": "setclient", "client_id": 3, "enable": true},
+ *       {"command": "volume", "client_id": 3, "level": 0.8},
+ *       {"command": "next", "id": 42}]}
+ * Every command is checked before any is applied. The level and setting
+ * changes go out once, at the end, as a single message to each recipient
+ * whatever order they came in */
+static gboolean
+manager_handle_batch (AurManager * manager, const ControlParams * params,
+    gchar ** error)
+{
+  AurMsgObject entry;
+  ControlParams entry_params = { NULL, NULL, &entry };
+  AurMsgIter iter;
+  const gchar *reason;
+  gboolean is_object;
+  guint n = 0;
+
+  if (params->msg == NULL ||
+      !aur_msg_object_get_array (params->msg, "commands", &iter)) {
+    *error = g_strdup ("no commands list");
+    return FALSE;
+  }
+
+  /* Every element has to be a valid command for any of them to be
+   * applied */
+  while (aur_msg_iter_next_element (&iter, &entry, &is_object)) {
+    if (!is_object) {
+      *error = g_strdup_printf ("command %u: not an object", n);
+      return FALSE;
+    }
+    reason = manager_check_control (manager,
+        get_msg_control_event_type (&entry), &entry_params);
+    if (reason != NULL) {
+      *error = g_strdup_printf ("command %u: %s", n, reason);
+      return FALSE;
+    }
+    n++;
+  }
+
+  manager->in_batch = TRUE;
+
+  aur_msg_object_get_array (params->msg, "commands", &iter);
+  while (aur_msg_iter_next_object (&iter, &entry)) {
+    gchar *unused = NULL;
+
+    manager_handle_control (manager, get_msg_control_event_type (&entry),
+        &entry_params, &unused);
+    g_free (unused);
+  }
+
+  manager->in_batch = FALSE;
+  if (manager->updates_pending)
+    manager_flush_pending_updates (manager);
+
+  g_print ("Applied a batch of %u commands\n", n);
+
+  return TRUE;
+}
+
+static void
+control_callback (G_GNUC_UNUSED SoupServer * soup, SoupMessage * msg,
+    const char *path, GHashTable * query,
+    G_GNUC_UNUSED SoupClientContext * client, AurManager * manager)
+{
+  gchar **parts = g_strsplit (path, "/", 3);
+  guint n_parts = g_strv_length (parts);
+  ControlParams params = { query, NULL, NULL };
+  AurControlEvent event_type;
+  AurMsgObject body;
+  const gchar *content_type;
+  gchar *error = NULL;
+  gboolean loaded = TRUE;
+
+  if (n_parts < 3 || !g_str_equal ("control", parts[1]))
+    goto done;                  /* Invalid request */
+
+  event_type = str_to_control_event_type (parts[2]);
+  if (event_type == AUR_CONTROL_NONE) {
+    g_message ("Ignoring unknown/unimplemented control %s\n", parts[2]);
+    soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+    goto done;
+  }
+
+  /* Parameters come as a form, or as a message like those sent over
+   * the event channel - which is the only way to give a batch */
+  content_type =
+      soup_message_headers_get_content_type (msg->request_headers, NULL);
+  if (g_str_equal (msg->method, "POST") && content_type) {
+    if (g_str_equal (content_type, SOUP_FORM_MIME_TYPE_URLENCODED)) {
+      params.post = soup_form_decode (msg->request_body->data);
+    } else if (g_ascii_strcasecmp (content_type, "application/json") == 0) {
+      loaded = aur_msg_reader_load_json (manager->reader,
+          msg->request_body->data, msg->request_body->length, &body);
+      params.msg = &body;
+    } else if (g_ascii_strcasecmp (content_type,
+            AUR_CBOR_CONTENT_TYPE) == 0) {
+      loaded = aur_msg_reader_load_cbor (manager->reader,
+          msg->request_body->data, msg->request_body->length, &body);
+      params.msg = &body;
+    }
+  }
+
+  if (!loaded)
+    error = g_strdup ("invalid request body");
+  else if (!manager_handle_control (manager, event_type, &params, &error))
+    g_message ("Control %s failed: %s\n", parts[2], error);
+
+  if (error != NULL) {
+    soup_message_set_response (msg, "text/plain", SOUP_MEMORY_TAKE, error,
+        strlen (error));
+    soup_message_set_status (msg, SOUP_STATUS_BAD_REQUEST);
+    goto done;
   }
 
   soup_message_set_response (msg, "text/plain", SOUP_MEMORY_STATIC, " ", 1);
   soup_message_set_status (msg, SOUP_STATUS_OK);
 done:
-  if (post_params)
-    g_hash_table_destroy (post_params);
+  if (params.post)
+    g_hash_table_destroy (params.post);
   g_strfreev (parts);
 }
 
+/* A command from a controller over its websocket:
+ *   {"msg-type": "control", "command": "volume", "request-id": 7,
+ *    "level": 0.5}
+ * with parameters named as for /control/volume. If there's a request-id,
+ * the controller gets a control-ack carrying it once the command is done */
+static void
+manager_ctrl_message_received (AurServerClient * client, gchar * data,
+    guint64 len, AurManager * manager)
+{
+  AurMsgObject msg;
+  ControlParams params = { NULL, NULL, &msg };
+  AurMsgWriter *w;
+  gchar *error = NULL;
+  gint64 request_id = -1;
+  gboolean loaded, ok;
+
+  /* A command can't be answered once the connection is gone */
+  if (client->fired_conn_lost)
+    return;
+
+  /* Controllers send in the encoding they were answered in */
+  if (aur_server_client_get_encoding (client) == AUR_SERVER_CLIENT_CBOR)
+    loaded = aur_msg_reader_load_cbor (manager->reader, data, len, &msg);
+  else
+    loaded = aur_msg_reader_load_json (manager->reader, data, -1, &msg);
+
+  if (!loaded || aur_msg_object_get_type (&msg) != control_quark) {
+    g_print ("Ignoring unexpected message from control client %u\n",
+        client->conn_id);
+    return;
+  }
+
+  aur_msg_object_get_int64 (&msg, "request-id", &request_id);
+
+  g_object_ref (client);
+
+  ok = manager_handle_control (manager, get_msg_control_event_type (&msg),
+      &params, &error);
+  if (!ok)
+    g_message ("Control from client %u failed: %s\n", client->conn_id,
+        error);
+
+  if (request_id >= 0) {
+    w = manager_begin_msg (manager, client, 0, "control-ack");
+    aur_msg_writer_add_int64 (w, "request-id", request_id);
+    aur_msg_writer_add_boolean (w, "ok", ok);
+    if (!ok)
+      aur_msg_writer_add_string (w, "error", error);
+    manager_send_written_msg (manager, client, 0, NULL, FALSE);
+  }
+
+  g_object_unref (client);
+  g_free (error);
+}
 
 static void
 aur_manager_init (AurManager * manager)
@@ -684,7 +1251,12 @@ aur_manager_init (AurManager * manager)
   manager->current_volume = 0.1;
 
   manager->current_resource = 0;
-  manager->next_player_id = 1;
+  manager->next_resource = 0;
+  manager->players = aur_player_registry_new ();
+  manager->player_info_epoch = g_get_real_time ();
+
+  manager->writer = aur_msg_writer_new ();
+  manager->reader = aur_msg_reader_new ();
 }
 
 static void
@@ -736,15 +1308,8 @@ aur_manager_class_init (AurManagerClass * manager_class)
       g_param_spec_object ("config", "config",
           "Aurena service configuration object",
           AUR_TYPE_CONFIG, G_PARAM_READWRITE | G_PARAM_CONSTRUCT));
-}
 
-static void
-free_player_info (AurPlayerInfo *info)
-{
-  if (info->conn)
-    g_object_unref (info->conn);
-  g_free (info->host);
-  g_free (info);
+  control_quark = g_quark_from_static_string ("control");
 }
 
 static void
@@ -756,14 +1321,20 @@ aur_manager_dispose (GObject * object)
   g_list_free (manager->ctrl_clients);
   manager->ctrl_clients = NULL;
 
-  g_list_foreach (manager->player_info, (GFunc) free_player_info, NULL);
-  g_list_free (manager->player_info);
-  manager->player_info = NULL;
+  if (manager->players) {
+    aur_player_registry_free (manager->players);
+    manager->players = NULL;
+  }
 
-  if (manager->ping_timeout) {
-    g_source_remove (manager->ping_timeout);
-    manager->ping_timeout = 0;
+  if (manager->expire_timeout) {
+    g_source_remove (manager->expire_timeout);
+    manager->expire_timeout = 0;
+  }
+  if (manager->pending_timeout) {
+    g_source_remove (manager->pending_timeout);
+    manager->pending_timeout = 0;
   }
+  manager_drop_player_info (manager);
 
   G_OBJECT_CLASS (aur_manager_parent_class)->dispose (object);
 }
@@ -784,6 +1355,9 @@ aur_manager_finalize (GObject * object)
 
   g_clear_object (&manager->custom_file);
   g_free (manager->language);
+
+  aur_msg_writer_free (manager->writer);
+  aur_msg_reader_free (manager->reader);
 }
 
 static void
@@ -932,52 +1506,54 @@ aur_manager_new (const char *config_file)
   return manager;
 }
 
-static AurHttpResource *
+static GFile *
 aur_manager_get_resource_cb (G_GNUC_UNUSED AurServer * server,
     guint resource_id, void *userdata)
 {
   AurManager *manager = (AurManager *) (userdata);
-  AurHttpResource *ret;
-  GFile *file;
-  gchar *file_uri;
 
   if (resource_id == G_MAXUINT && manager->custom_file)
-    return g_object_new (AUR_TYPE_HTTP_RESOURCE, "source-file",
-        manager->custom_file, NULL);
+    return g_object_ref (manager->custom_file);
 
   if (resource_id < 1 || resource_id > get_playlist_len (manager))
     return NULL;
 
-  file = aur_media_db_get_file_by_id (manager->media_db, resource_id);
-  if (file == NULL)
-    return NULL;
-
-  file_uri = g_file_get_uri (file);
-  g_print ("Creating resource %u for %s\n", resource_id, file_uri);
-  g_free (file_uri);
-
-  ret = g_object_new (AUR_TYPE_HTTP_RESOURCE, "source-file", file, NULL);
-  g_object_unref (file);
-
-  return ret;
+  return aur_media_db_get_file_by_id (manager->media_db, resource_id);
 }
 
 static void
 aur_manager_play_resource (AurManager * manager, guint resource_id)
 {
+  if (resource_id != 0) {
+    gboolean cached =
+        aur_server_check_resource_cached (manager->server, resource_id);
+    g_print ("Switching to resource %u (%s)\n", resource_id,
+        cached ? "cached" : "not cached");
+  }
+
   manager->current_resource = resource_id;
   manager->base_time = GST_CLOCK_TIME_NONE;
   manager->position = 0;
 
-  manager_send_msg_to_client (manager, NULL, SEND_MSG_TO_ALL,
-      manager_make_set_media_msg (manager, manager->current_resource));
+  manager_send_set_media_msg (manager, NULL, SEND_MSG_TO_ALL,
+      manager->current_resource);
+
+  /* Decide what comes next now, so it can be read ahead while
+   * this one plays */
+  manager->next_resource = aur_manager_pick_next_resource (manager);
+  if (manager->next_resource != 0 &&
+      manager->next_resource != manager->current_resource)
+    aur_server_prefetch_resource (manager->server, manager->next_resource);
 }
 
 static void
 aur_manager_send_play (AurManager * manager, AurServerClient * client)
 {
   GstClock *clock;
-  GstStructure *msg;
+  AurMsgWriter *w;
+
+  /* Anything still pending happened first */
+  manager_flush_pending_updates (manager);
 
   /* Update base time to match length of time paused */
   g_object_get (manager->net_clock, "clock", &clock, NULL);
@@ -985,11 +1561,9 @@ aur_manager_send_play (AurManager * manager, AurServerClient * client)
   gst_object_unref (clock);
   manager->position = 0;
 
-  msg = gst_structure_new ("json",
-      "msg-type", G_TYPE_STRING, "play",
-      "base-time", G_TYPE_INT64, (gint64) (manager->base_time), NULL);
-
-  manager_send_msg_to_client (manager, client, SEND_MSG_TO_ALL, msg);
+  w = manager_begin_msg (manager, client, SEND_MSG_TO_ALL, "play");
+  aur_msg_writer_add_int64 (w, "base-time", (gint64) (manager->base_time));
+  manager_send_written_msg (manager, client, SEND_MSG_TO_ALL, NULL, FALSE);
 }
 
 static void
@@ -997,7 +1571,9 @@ aur_manager_send_pause (AurManager * manager, AurServerClient * client)
 {
   GstClock *clock;
   GstClockTime now;
-  GstStructure *msg;
+  AurMsgWriter *w;
+
+  manager_flush_pending_updates (manager);
 
   g_object_get (manager->net_clock, "clock", &clock, NULL);
   now = gst_clock_get_time (clock);
@@ -1008,84 +1584,141 @@ aur_manager_send_pause (AurManager * manager, AurServerClient * client)
   g_print ("Storing position %" GST_TIME_FORMAT "\n",
       GST_TIME_ARGS (manager->position));
 
-  msg = gst_structure_new ("json",
-      "msg-type", G_TYPE_STRING, "pause",
-      "position", G_TYPE_INT64, (gint64) manager->position,
-      NULL);
+  w = manager_begin_msg (manager, client, SEND_MSG_TO_ALL, "pause");
+  aur_msg_writer_add_int64 (w, "position", (gint64) manager->position);
+  manager_send_written_msg (manager, client, SEND_MSG_TO_ALL, NULL, FALSE);
+}
 
-  manager_send_msg_to_client (manager, client, SEND_MSG_TO_ALL, msg);
+/* Send what changed since the last flush: one message to the
+ * controllers per kind of change, and a single message to each affected
+ * player with its resulting volume or setting */
+static void
+manager_flush_pending_updates (AurManager * manager)
+{
+  gboolean volume_changed = manager->volume_changed;
+  AurPlayerInfo **players;
+  AurMsgWriter *w = NULL;
+  guint i, n_players;
+
+  /* A batch sends everything at its end */
+  if (manager->in_batch)
+    return;
+
+  if (manager->pending_timeout) {
+    g_source_remove (manager->pending_timeout);
+    manager->pending_timeout = 0;
+  }
+  manager->updates_pending = FALSE;
+
+  manager->volume_changed = FALSE;
+  if (volume_changed) {
+    w = manager_begin_msg (manager, NULL, SEND_MSG_TO_CONTROLLERS, "volume");
+    aur_msg_writer_add_double (w, "level", manager->current_volume);
+    manager_send_written_msg (manager, NULL, SEND_MSG_TO_CONTROLLERS,
+        "volume", FALSE);
+    w = NULL;
+  }
+
+  players = aur_player_registry_get_connected (manager->players, &n_players);
+  for (i = 0; i < n_players; i++) {
+    if (!players[i]->volume_changed && !players[i]->setting_changed)
+      continue;
+    if (w == NULL) {
+      w = manager_begin_player_clients_delta (manager);
+      aur_msg_writer_begin_array (w, "changed");
+    }
+    write_player_entry (w, players[i]);
+  }
+  if (w != NULL) {
+    aur_msg_writer_end_array (w);
+    manager_send_written_msg (manager, NULL, SEND_MSG_TO_CONTROLLERS, NULL,
+        FALSE);
+  }
+
+  /* Backwards, as in manager_foreach_recipient() */
+  players = aur_player_registry_get_connected (manager->players, &i);
+  while (i-- > 0) {
+    AurPlayerInfo *info = players[i];
+    gboolean info_volume_changed = info->volume_changed;
+    gboolean setting_changed = info->setting_changed;
+
+    info->volume_changed = info->setting_changed = FALSE;
+
+    /* Tell the player which volume to set */
+    if (volume_changed || info_volume_changed) {
+      w = manager_begin_msg (manager, info->conn, 0, "volume");
+      aur_msg_writer_add_double (w, "level",
+          info->volume * manager->current_volume);
+      manager_send_written_msg (manager, info->conn, 0, "volume", FALSE);
+    }
+    if (setting_changed && info->conn) {
+      w = manager_begin_msg (manager, info->conn, 0, "client-setting");
+      aur_msg_writer_add_boolean (w, "enabled", info->enabled);
+      manager_send_written_msg (manager, info->conn, 0, "client-setting",
+          FALSE);
+    }
+
+    players = aur_player_registry_get_connected (manager->players,
+        &n_players);
+    i = MIN (i, n_players);
+  }
+}
+
+static gboolean
+handle_pending_timeout (AurManager * manager)
+{
+  manager->pending_timeout = 0;
+  manager_flush_pending_updates (manager);
+  return FALSE;
+}
+
+/* Hold back level updates briefly, so a burst of them - like from
+ * dragging a volume slider - only sends the last */
+static void
+manager_schedule_pending_updates (AurManager * manager)
+{
+  manager->updates_pending = TRUE;
+  if (manager->pending_timeout == 0 && !manager->in_batch)
+    manager->pending_timeout = g_timeout_add (COALESCE_INTERVAL_MS,
+        (GSourceFunc) handle_pending_timeout, manager);
 }
 
 static void
 aur_manager_adjust_client_volume (AurManager * manager, guint client_id,
     gdouble volume)
 {
-  GstStructure *msg = NULL;
   AurPlayerInfo *info;
 
-  info = get_player_info_by_id (manager, client_id);
+  info = aur_player_registry_lookup_id (manager->players, client_id);
   if (info == NULL)
     return;
 
   info->volume = volume;
-  msg = gst_structure_new ("json",
-          "msg-type", G_TYPE_STRING, "client-volume",
-          "client-id", G_TYPE_INT64, (gint64) client_id,
-          "level", G_TYPE_DOUBLE, volume, NULL);
-  manager_send_msg_to_client (manager, NULL, SEND_MSG_TO_CONTROLLERS, msg);
-
-  /* Tell the player which volume to set */
-  msg = gst_structure_new ("json",
-           "msg-type", G_TYPE_STRING, "volume",
-           "level", G_TYPE_DOUBLE, volume * manager->current_volume, NULL);
-  manager_send_msg_to_client (manager, info->conn, 0, msg);
+  info->volume_changed = TRUE;
+  manager_schedule_pending_updates (manager);
 }
 
 static void
 aur_manager_adjust_client_setting (AurManager * manager, guint client_id,
     gboolean enable)
 {
-  GstStructure *msg = NULL;
   AurPlayerInfo *info;
 
-  info = get_player_info_by_id (manager, client_id);
+  info = aur_player_registry_lookup_id (manager->players, client_id);
   if (info == NULL)
     return;
 
   info->enabled = enable;
-  msg = gst_structure_new ("json",
-          "msg-type", G_TYPE_STRING, "client-setting",
-          "client-id", G_TYPE_INT64, (gint64) client_id,
-          "enabled", G_TYPE_BOOLEAN, enable, NULL);
-  manager_send_msg_to_client (manager, NULL, SEND_MSG_TO_CONTROLLERS, msg);
-
-  /* Tell the player which volume to set */
-  msg = gst_structure_new ("json",
-           "msg-type", G_TYPE_STRING, "client-setting",
-           "enabled", G_TYPE_BOOLEAN, enable, NULL);
-  manager_send_msg_to_client (manager, info->conn, 0, msg);
+  info->setting_changed = TRUE;
+  manager_schedule_pending_updates (manager);
 }
 
 static void
 aur_manager_adjust_volume (AurManager * manager, gdouble volume)
 {
-  GstStructure *msg = NULL;
-  GList *cur;
-
   manager->current_volume = volume;
-  msg = gst_structure_new ("json",
-      "msg-type", G_TYPE_STRING, "volume",
-      "level", G_TYPE_DOUBLE, volume, NULL);
-  manager_send_msg_to_client (manager, NULL, SEND_MSG_TO_CONTROLLERS, msg);
-
-  /* Send a volume adjustment to each player */
-  for (cur = manager->player_info; cur != NULL; cur = cur->next) {
-    AurPlayerInfo *info = (AurPlayerInfo *)(cur->data);
-    msg = gst_structure_new ("json",
-           "msg-type", G_TYPE_STRING, "volume",
-           "level", G_TYPE_DOUBLE, info->volume * volume, NULL);
-    manager_send_msg_to_client (manager, info->conn, 0, msg);
-  }
+  manager->volume_changed = TRUE;
+  manager_schedule_pending_updates (manager);
 }
 
 static void
@@ -1094,7 +1727,9 @@ aur_manager_send_seek (AurManager * manager, AurServerClient * client,
 {
   GstClock *clock;
   GstClockTime now;
-  GstStructure *msg;
+  AurMsgWriter *w;
+
+  manager_flush_pending_updates (manager);
 
   g_object_get (manager->net_clock, "clock", &clock, NULL);
   now = gst_clock_get_time (clock);
@@ -1104,46 +1739,42 @@ aur_manager_send_seek (AurManager * manager, AurServerClient * client,
   if (manager->paused)
     manager->position = position;
 
-  msg = gst_structure_new ("json",
-      "msg-type", G_TYPE_STRING, "seek",
-      "base-time", G_TYPE_INT64, (gint64) manager->base_time,
-      "position", G_TYPE_INT64, (gint64) position,
-      NULL);
-
-  manager_send_msg_to_client (manager, client, SEND_MSG_TO_ALL, msg);
+  w = manager_begin_msg (manager, client, SEND_MSG_TO_ALL, "seek");
+  aur_msg_writer_add_int64 (w, "base-time", (gint64) manager->base_time);
+  aur_msg_writer_add_int64 (w, "position", (gint64) position);
+  manager_send_written_msg (manager, client, SEND_MSG_TO_ALL, NULL, FALSE);
 }
 
 static void
 aur_manager_send_language (AurManager * manager, AurServerClient * client,
     const gchar * language)
 {
-  GstStructure *msg;
+  AurMsgWriter *w;
 
   g_free (manager->language);
   manager->language = g_strdup (language ? language : "en");
 
-  msg = gst_structure_new ("json",
-      "msg-type", G_TYPE_STRING, "language",
-      "language", G_TYPE_STRING, manager->language,
-      NULL);
-
-  manager_send_msg_to_client (manager, client, SEND_MSG_TO_ALL, msg);
+  w = manager_begin_msg (manager, client, SEND_MSG_TO_ALL, "language");
+  aur_msg_writer_add_string (w, "language", manager->language);
+  manager_send_written_msg (manager, client, SEND_MSG_TO_ALL, NULL, FALSE);
 }
 
-static GstStructure *
-manager_make_set_media_msg (AurManager * manager, guint resource_id)
+static void
+manager_send_set_media_msg (AurManager * manager, AurServerClient * client,
+    gint send_to_mask, guint resource_id)
 {
   GstClock *clock;
   GstClockTime cur_time, position;
-  gchar *resource_path;
-  GstStructure *msg;
+  gchar resource_path[32];
+  AurMsgWriter *w;
   gint port;
 
   g_object_get (manager->net_clock, "clock", &clock, NULL);
   cur_time = gst_clock_get_time (clock);
   gst_object_unref (clock);
 
-  resource_path = g_strdup_printf ("/resource/%u", resource_id);
+  g_snprintf (resource_path, sizeof (resource_path), "/resource/%u",
+      resource_id);
 
   if (manager->base_time == GST_CLOCK_TIME_NONE) {
     // configure a base time 0.25 seconds in the future
@@ -1163,31 +1794,18 @@ manager_make_set_media_msg (AurManager * manager, guint resource_id)
   else
     position = manager->position;
 
-  msg = gst_structure_new ("json", "msg-type", G_TYPE_STRING, "set-media",
-      "resource-id", G_TYPE_INT64, (gint64) resource_id,
+  w = manager_begin_msg (manager, client, send_to_mask, "set-media");
+  aur_msg_writer_add_int64 (w, "resource-id", resource_id);
 #if 1
-      "resource-protocol", G_TYPE_STRING, "http",
-      "resource-port", G_TYPE_INT, port,
+  aur_msg_writer_add_string (w, "resource-protocol", "http");
 #else
-      "resource-protocol", G_TYPE_STRING, "rtsp",
-      "resource-port", G_TYPE_INT, port,
+  aur_msg_writer_add_string (w, "resource-protocol", "rtsp");
 #endif
-      "resource-path", G_TYPE_STRING, resource_path,
-      "base-time", G_TYPE_INT64, (gint64) (manager->base_time),
-      "position", G_TYPE_INT64, (gint64) (position),
-      "paused", G_TYPE_BOOLEAN, manager->paused,
-      "language", G_TYPE_STRING, manager->language, NULL);
-
-  g_free (resource_path);
-
-  return msg;
-}
-
-static GstStructure *
-manager_make_player_clients_changed_msg (G_GNUC_UNUSED AurManager * manager)
-{
-  GstStructure *msg;
-  msg = gst_structure_new ("json",
-      "msg-type", G_TYPE_STRING, "player-clients-changed", NULL);
-  return msg;
+  aur_msg_writer_add_int64 (w, "resource-port", port);
+  aur_msg_writer_add_string (w, "resource-path", resource_path);
+  aur_msg_writer_add_int64 (w, "base-time", (gint64) (manager->base_time));
+  aur_msg_writer_add_int64 (w, "position", (gint64) (position));
+  aur_msg_writer_add_boolean (w, "paused", manager->paused);
+  aur_msg_writer_add_string (w, "language", manager->language);
+  manager_send_written_msg (manager, client, send_to_mask, NULL, FALSE);
 }
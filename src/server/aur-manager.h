@@ -56,11 +56,18 @@ struct _AurManager
   GPtrArray *playlist;
   gboolean paused;
   guint current_resource;
+  guint next_resource;
   GFile *custom_file;
   gchar *language;
 
-  guint next_player_id;
-  GList *player_info;
+  AurPlayerRegistry *players;
+  /* Bumped for each player-clients-delta sent to controllers */
+  guint player_clients_seq;
+  /* The list as served on /client/player_info, built on demand for
+   * the current seq and dropped at the next delta */
+  GBytes *player_info_json;
+  GBytes *player_info_cbor;
+  gint64 player_info_epoch;
 
   GList *ctrl_clients;
 
@@ -69,7 +76,20 @@ struct _AurManager
 
   gdouble current_volume;
 
-  guint ping_timeout;
+  guint expire_timeout;
+
+  /* Coalesced volume/setting changes waiting to go out */
+  gboolean volume_changed;
+  gboolean updates_pending;
+  guint pending_timeout;
+  /* Set while applying a batch of control commands, which sends its
+   * changes once at the end */
+  gboolean in_batch;
+
+  /* Reused to write every outgoing message */
+  AurMsgWriter *writer;
+  /* And to read commands arriving over controller websockets */
+  AurMsgReader *reader;
 };
 
 struct _AurManagerClass
@@ -0,0 +1,245 @@
+/* GStreamer
+ * Copyright (C) 2012-2014 Jan Schmidt <thaytan@noraisin.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Players known to the manager, connected or not. A player that
+ * reconnects from the same host gets its old id, volume and setting
+ * back, so entries outlive their connection for a while.
+ *
+ * Entries are indexed by id and by connection, and disconnected ones by
+ * host, so every lookup is a hash lookup. Connected players are also
+ * kept in a dense array for broadcasts. Removal from it swaps the last
+ * entry into the gap, so a walk from the end stays valid when the
+ * current player disconnects during a send.
+ *
+ * Disconnected entries are evicted oldest first once there are more than
+ * MAX_IDLE_PLAYERS of them, or once they've been gone IDLE_EXPIRY. That
+ * only happens in aur_player_registry_attach() and
+ * aur_player_registry_expire(), never while a disconnect is handled, so
+ * callers walking the registry while sending don't lose entries.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "aur-player-registry.h"
+#include "aur-server-client.h"
+
+/* Most disconnected players remembered */
+#define MAX_IDLE_PLAYERS 256
+/* How long a disconnected player is remembered */
+#define IDLE_EXPIRY (60 * 60 * G_USEC_PER_SEC)
+
+struct _AurPlayerRegistry
+{
+  guint next_id;
+
+  /* id -> AurPlayerInfo, owning */
+  GHashTable *by_id;
+  /* AurServerClient -> AurPlayerInfo */
+  GHashTable *by_conn;
+  /* host -> GQueue of disconnected AurPlayerInfo, newest first */
+  GHashTable *idle_by_host;
+
+  /* Connected players, in no particular order */
+  GPtrArray *connected;
+  /* Disconnected players, newest first */
+  GQueue idle;
+};
+
+static void
+free_player_info (AurPlayerInfo * info)
+{
+  if (info->conn)
+    g_object_unref (info->conn);
+  g_free (info->host);
+  g_free (info);
+}
+
+static void
+free_host_queue (GQueue * queue)
+{
+  g_queue_free (queue);
+}
+
+AurPlayerRegistry *
+aur_player_registry_new (void)
+{
+  AurPlayerRegistry *registry = g_new0 (AurPlayerRegistry, 1);
+
+  registry->next_id = 1;
+  registry->by_id = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+      NULL, (GDestroyNotify) free_player_info);
+  registry->by_conn = g_hash_table_new (g_direct_hash, g_direct_equal);
+  registry->idle_by_host = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) free_host_queue);
+  registry->connected = g_ptr_array_new ();
+  g_queue_init (&registry->idle);
+
+  return registry;
+}
+
+void
+aur_player_registry_free (AurPlayerRegistry * registry)
+{
+  g_hash_table_destroy (registry->idle_by_host);
+  g_hash_table_destroy (registry->by_conn);
+  g_hash_table_destroy (registry->by_id);
+  g_ptr_array_free (registry->connected, TRUE);
+  g_queue_clear (&registry->idle);
+  g_free (registry);
+}
+
+/* Drop the oldest disconnected player */
+static void
+evict_oldest_idle (AurPlayerRegistry * registry)
+{
+  AurPlayerInfo *info = g_queue_pop_tail (&registry->idle);
+  GQueue *host_queue = g_hash_table_lookup (registry->idle_by_host,
+      info->host);
+
+  /* Being the oldest overall, it's the oldest for its host too */
+  g_queue_pop_tail (host_queue);
+  if (g_queue_is_empty (host_queue))
+    g_hash_table_remove (registry->idle_by_host, info->host);
+
+  g_print ("Forgetting player id %u\n", info->id);
+  g_hash_table_remove (registry->by_id, GUINT_TO_POINTER (info->id));
+}
+
+/* Take a disconnected player from the same host if there is one,
+ * otherwise create a new entry. created says which happened, so the
+ * caller can set up a new player's volume and setting */
+AurPlayerInfo *
+aur_player_registry_attach (AurPlayerRegistry * registry,
+    AurServerClient * conn, const gchar * host, gboolean * created)
+{
+  GQueue *host_queue;
+  AurPlayerInfo *info = NULL;
+
+  host_queue = g_hash_table_lookup (registry->idle_by_host, host);
+  if (host_queue) {
+    info = g_queue_pop_head (host_queue);
+    if (g_queue_is_empty (host_queue))
+      g_hash_table_remove (registry->idle_by_host, host);
+    g_queue_delete_link (&registry->idle, info->idle_link);
+    info->idle_link = NULL;
+    *created = FALSE;
+  } else {
+    while (registry->idle.length >= MAX_IDLE_PLAYERS)
+      evict_oldest_idle (registry);
+
+    info = g_new0 (AurPlayerInfo, 1);
+    info->id = registry->next_id++;
+    info->host = g_strdup (host);
+    g_hash_table_insert (registry->by_id, GUINT_TO_POINTER (info->id), info);
+    *created = TRUE;
+  }
+
+  info->conn = conn;
+  info->connected_index = registry->connected->len;
+  g_ptr_array_add (registry->connected, info);
+  g_hash_table_insert (registry->by_conn, conn, info);
+
+  return info;
+}
+
+/* Mark the player on conn as disconnected, dropping the reference to the
+ * connection. Returns the player, or NULL if conn isn't one */
+AurPlayerInfo *
+aur_player_registry_detach (AurPlayerRegistry * registry,
+    AurServerClient * conn)
+{
+  AurPlayerInfo *info, *moved;
+  GQueue *host_queue;
+  guint index;
+
+  info = g_hash_table_lookup (registry->by_conn, conn);
+  if (info == NULL)
+    return NULL;
+
+  g_hash_table_remove (registry->by_conn, conn);
+
+  index = info->connected_index;
+  g_ptr_array_remove_index_fast (registry->connected, index);
+  if (index < registry->connected->len) {
+    moved = g_ptr_array_index (registry->connected, index);
+    moved->connected_index = index;
+  }
+
+  g_object_unref (info->conn);
+  info->conn = NULL;
+  info->disconnect_time = g_get_monotonic_time ();
+
+  g_queue_push_head (&registry->idle, info);
+  info->idle_link = registry->idle.head;
+
+  host_queue = g_hash_table_lookup (registry->idle_by_host, info->host);
+  if (host_queue == NULL) {
+    host_queue = g_queue_new ();
+    g_hash_table_insert (registry->idle_by_host, g_strdup (info->host),
+        host_queue);
+  }
+  g_queue_push_head (host_queue, info);
+
+  return info;
+}
+
+AurPlayerInfo *
+aur_player_registry_lookup_id (AurPlayerRegistry * registry, guint id)
+{
+  return g_hash_table_lookup (registry->by_id, GUINT_TO_POINTER (id));
+}
+
+AurPlayerInfo *
+aur_player_registry_lookup_conn (AurPlayerRegistry * registry,
+    AurServerClient * conn)
+{
+  return g_hash_table_lookup (registry->by_conn, conn);
+}
+
+/* The connected players. The array is only valid until a player
+ * connects or disconnects - see above for walking it while sending */
+AurPlayerInfo **
+aur_player_registry_get_connected (AurPlayerRegistry * registry,
+    guint * n_players)
+{
+  *n_players = registry->connected->len;
+  return (AurPlayerInfo **) registry->connected->pdata;
+}
+
+/* Evict disconnected players that have been gone too long. Returns how
+ * many were */
+guint
+aur_player_registry_expire (AurPlayerRegistry * registry, gint64 now)
+{
+  guint n_evicted = 0;
+
+  while (registry->idle.tail != NULL) {
+    AurPlayerInfo *info = registry->idle.tail->data;
+
+    if (now - info->disconnect_time < IDLE_EXPIRY)
+      break;
+    evict_oldest_idle (registry);
+    n_evicted++;
+  }
+
+  return n_evicted;
+}
@@ -0,0 +1,73 @@
+/* GStreamer
+ * Copyright (C) 2012-2014 Jan Schmidt <thaytan@noraisin.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __AUR_PLAYER_REGISTRY_H__
+#define __AUR_PLAYER_REGISTRY_H__
+
+#include <glib.h>
+
+#include <src/common/aur-types.h>
+
+G_BEGIN_DECLS
+
+/* Not in aur-types.h, as the client library has its own, simpler
+ * AurPlayerInfo */
+typedef struct _AurPlayerInfo AurPlayerInfo;
+
+struct _AurPlayerInfo
+{
+  guint id;
+  gchar *host;
+  /* Owned reference, or NULL while the player is disconnected */
+  AurServerClient *conn;
+
+  gdouble volume;
+  gboolean enabled;
+
+  /* Changed since the last flush of pending updates */
+  gboolean volume_changed;
+  gboolean setting_changed;
+
+  /* Registry bookkeeping */
+  guint connected_index;
+  GList *idle_link;
+  gint64 disconnect_time;
+};
+
+AurPlayerRegistry *aur_player_registry_new (void);
+void aur_player_registry_free (AurPlayerRegistry *registry);
+
+AurPlayerInfo *aur_player_registry_attach (AurPlayerRegistry *registry,
+    AurServerClient *conn, const gchar *host, gboolean *created);
+AurPlayerInfo *aur_player_registry_detach (AurPlayerRegistry *registry,
+    AurServerClient *conn);
+
+AurPlayerInfo *aur_player_registry_lookup_id (AurPlayerRegistry *registry,
+    guint id);
+AurPlayerInfo *aur_player_registry_lookup_conn (AurPlayerRegistry *registry,
+    AurServerClient *conn);
+
+AurPlayerInfo **aur_player_registry_get_connected (AurPlayerRegistry *registry,
+    guint *n_players);
+
+guint aur_player_registry_expire (AurPlayerRegistry *registry, gint64 now);
+
+G_END_DECLS
+
+#endif
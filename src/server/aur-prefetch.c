@@ -0,0 +1,212 @@
+/* GStreamer
+ * Copyright (C) 2012-2014 Jan Schmidt <thaytan@noraisin.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Read-ahead of upcoming resources. When a track starts, the manager
+ * asks for the track it expects to play next to be pulled into the page
+ * cache on a worker thread, so that when all players request it at once
+ * the read doesn't stall on a cold disk.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_MINCORE
+#include <sys/mman.h>
+#endif
+
+#include <glib/gstdio.h>
+
+#include "aur-prefetch.h"
+
+/* Size of each read when falling back to reading the data in */
+#define PREFETCH_READ_SIZE (256 * 1024)
+
+struct _AurPrefetch
+{
+  GThreadPool *pool;
+  guint64 max_bytes;
+
+  gint prefetches;
+  gint completed;
+  gint switches;
+  gint cached_switches;
+};
+
+static void
+aur_prefetch_run (gchar * path, AurPrefetch * prefetch)
+{
+  struct stat st;
+  off_t length;
+  int fd;
+
+  fd = g_open (path, O_RDONLY, 0);
+  if (fd < 0) {
+    g_print ("Failed to open %s for prefetch: %s\n", path,
+        g_strerror (errno));
+    g_free (path);
+    return;
+  }
+
+  if (fstat (fd, &st) == 0) {
+    length = MIN ((guint64) st.st_size, prefetch->max_bytes);
+
+#ifdef POSIX_FADV_WILLNEED
+    /* Asynchronous readahead of the whole range is all we need */
+    posix_fadvise (fd, 0, length, POSIX_FADV_WILLNEED);
+#else
+    {
+      gchar *buf = g_malloc (PREFETCH_READ_SIZE);
+      off_t offset = 0;
+      ssize_t n;
+
+      while (offset < length &&
+          (n = pread (fd, buf, PREFETCH_READ_SIZE, offset)) > 0)
+        offset += n;
+      g_free (buf);
+    }
+#endif
+    g_atomic_int_inc (&prefetch->completed);
+  }
+
+  close (fd);
+  g_free (path);
+}
+
+AurPrefetch *
+aur_prefetch_new (guint64 max_bytes)
+{
+  AurPrefetch *prefetch = g_new0 (AurPrefetch, 1);
+
+  prefetch->max_bytes = max_bytes;
+  /* A single thread - prefetching several files in parallel would just
+   * make the disk seek between them */
+  prefetch->pool = g_thread_pool_new ((GFunc) aur_prefetch_run, prefetch,
+      1, FALSE, NULL);
+
+  return prefetch;
+}
+
+void
+aur_prefetch_free (AurPrefetch * prefetch)
+{
+  g_thread_pool_free (prefetch->pool, TRUE, TRUE);
+  g_free (prefetch);
+}
+
+void
+aur_prefetch_file (AurPrefetch * prefetch, GFile * file)
+{
+  gchar *path;
+
+  if (prefetch->max_bytes == 0)
+    return;
+
+  /* Only local files can be pulled into the page cache */
+  path = g_file_get_path (file);
+  if (path == NULL)
+    return;
+
+  g_print ("Prefetching %s\n", path);
+  prefetch->prefetches++;
+  g_thread_pool_push (prefetch->pool, path, NULL);
+}
+
+/* Check whether the start of the file is resident in the page cache and
+ * count the result for the stats. Called when switching track. */
+gboolean
+aur_prefetch_check_cached (AurPrefetch * prefetch, GFile * file)
+{
+  gboolean cached = FALSE;
+#ifdef HAVE_MINCORE
+  struct stat st;
+  gchar *path;
+  gsize length, page_size, n_pages, i;
+  guchar *vec;
+  void *map;
+  int fd;
+
+  path = g_file_get_path (file);
+  if (path == NULL)
+    return FALSE;
+
+  fd = g_open (path, O_RDONLY, 0);
+  g_free (path);
+  if (fd < 0)
+    return FALSE;
+
+  prefetch->switches++;
+
+  if (fstat (fd, &st) != 0 || st.st_size == 0)
+    goto done;
+
+  length = MIN ((guint64) st.st_size, prefetch->max_bytes);
+  if (length == 0)
+    goto done;
+
+  /* Mapping the file doesn't fault any pages in, so mincore() reports
+   * what was already cached */
+  map = mmap (NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    goto done;
+
+  page_size = sysconf (_SC_PAGESIZE);
+  n_pages = (length + page_size - 1) / page_size;
+  vec = g_malloc (n_pages);
+
+  if (mincore (map, length, (void *) vec) == 0) {
+    cached = TRUE;
+    for (i = 0; i < n_pages; i++) {
+      if (!(vec[i] & 1)) {
+        cached = FALSE;
+        break;
+      }
+    }
+  }
+
+  g_free (vec);
+  munmap (map, length);
+
+  if (cached)
+    prefetch->cached_switches++;
+
+done:
+  close (fd);
+#else
+  (void) prefetch;
+  (void) file;
+#endif
+
+  return cached;
+}
+
+GstStructure *
+aur_prefetch_get_stats (AurPrefetch * prefetch)
+{
+  return gst_structure_new ("prefetch",
+      "prefetches", G_TYPE_INT, prefetch->prefetches,
+      "completed", G_TYPE_INT, g_atomic_int_get (&prefetch->completed),
+      "switches", G_TYPE_INT, prefetch->switches,
+      "cached-switches", G_TYPE_INT, prefetch->cached_switches, NULL);
+}
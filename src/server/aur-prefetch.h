@@ -0,0 +1,40 @@
+/* GStreamer
+ * Copyright (C) 2012-2014 Jan Schmidt <thaytan@noraisin.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __AUR_PREFETCH_H__
+#define __AUR_PREFETCH_H__
+
+#include <gst/gst.h>
+#include <gio/gio.h>
+
+#include <src/common/aur-types.h>
+
+G_BEGIN_DECLS
+
+AurPrefetch *aur_prefetch_new (guint64 max_bytes);
+void aur_prefetch_free (AurPrefetch *prefetch);
+
+void aur_prefetch_file (AurPrefetch *prefetch, GFile *file);
+gboolean aur_prefetch_check_cached (AurPrefetch *prefetch, GFile *file);
+
+GstStructure *aur_prefetch_get_stats (AurPrefetch *prefetch);
+
+G_END_DECLS
+
+#endif
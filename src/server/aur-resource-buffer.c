@@ -0,0 +1,320 @@
+/* GStreamer
+ * Copyright (C) 2012-2014 Jan Schmidt <thaytan@noraisin.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * A growing buffer holding the contents of a resource that's being
+ * fetched from elsewhere, shared by every transfer of that resource.
+ * The first memory_limit bytes are kept in memory and anything beyond
+ * that spills to an (unlinked) temporary file. Readers that get ahead of
+ * the fetch register a one-shot wait callback, which is called the next
+ * time data arrives or the fetch ends.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+#include "aur-resource-buffer.h"
+
+#define BLOCK_SIZE (64 * 1024)
+
+typedef struct _AurResourceBufferWaiter AurResourceBufferWaiter;
+
+struct _AurResourceBufferWaiter
+{
+  AurResourceBufferFunc func;
+  gpointer user_data;
+};
+
+struct _AurResourceBuffer
+{
+  /* In-memory part, in BLOCK_SIZE blocks */
+  GPtrArray *blocks;
+  guint64 memory_limit;
+
+  gint spill_fd;
+
+  guint64 available;
+  gint64 length;
+  gchar *content_type;
+
+  gboolean have_info;
+  gboolean complete;
+  gboolean failed;
+
+  GList *waiters;
+};
+
+AurResourceBuffer *
+aur_resource_buffer_new (guint64 memory_limit)
+{
+  AurResourceBuffer *buffer = g_new0 (AurResourceBuffer, 1);
+
+  buffer->blocks = g_ptr_array_new_with_free_func (g_free);
+  buffer->memory_limit =
+      (memory_limit + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+  buffer->spill_fd = -1;
+  buffer->length = -1;
+
+  return buffer;
+}
+
+void
+aur_resource_buffer_free (AurResourceBuffer * buffer)
+{
+  g_list_free_full (buffer->waiters, g_free);
+  g_ptr_array_free (buffer->blocks, TRUE);
+  if (buffer->spill_fd >= 0)
+    close (buffer->spill_fd);
+  g_free (buffer->content_type);
+  g_free (buffer);
+}
+
+static void
+aur_resource_buffer_notify (AurResourceBuffer * buffer)
+{
+  GList *waiters = buffer->waiters;
+  GList *cur;
+
+  /* Waiters are one-shot, and may register again from the callback */
+  buffer->waiters = NULL;
+
+  for (cur = waiters; cur != NULL; cur = g_list_next (cur)) {
+    AurResourceBufferWaiter *waiter = cur->data;
+    waiter->func (buffer, waiter->user_data);
+  }
+
+  g_list_free_full (waiters, g_free);
+}
+
+/* Set once the total length (-1 if unknown) and type are known */
+void
+aur_resource_buffer_set_info (AurResourceBuffer * buffer, gint64 length,
+    const gchar * content_type)
+{
+  buffer->length = length;
+  g_free (buffer->content_type);
+  buffer->content_type = g_strdup (content_type);
+  buffer->have_info = TRUE;
+
+  aur_resource_buffer_notify (buffer);
+}
+
+static gboolean
+aur_resource_buffer_spill (AurResourceBuffer * buffer, const gchar * data,
+    gsize size)
+{
+  off_t offset = buffer->available - buffer->memory_limit;
+
+  if (buffer->spill_fd < 0) {
+    GError *error = NULL;
+    gchar *path;
+
+    buffer->spill_fd = g_file_open_tmp ("aurena-XXXXXX", &path, &error);
+    if (buffer->spill_fd < 0) {
+      g_message ("Failed to create spill file: %s", error->message);
+      g_error_free (error);
+      return FALSE;
+    }
+    /* Only the fd is needed, and this way the file is cleaned up however
+     * we exit */
+    g_unlink (path);
+    g_free (path);
+  }
+
+  while (size > 0) {
+    ssize_t written = pwrite (buffer->spill_fd, data, size, offset);
+
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0) {
+      g_message ("Failed to write spill file: %s", g_strerror (errno));
+      return FALSE;
+    }
+
+    data += written;
+    size -= written;
+    offset += written;
+    buffer->available += written;
+  }
+
+  return TRUE;
+}
+
+void
+aur_resource_buffer_append (AurResourceBuffer * buffer, const gchar * data,
+    gsize size)
+{
+  if (buffer->complete || size == 0)
+    return;
+
+  while (size > 0 && buffer->available < buffer->memory_limit) {
+    gsize block_offset = buffer->available % BLOCK_SIZE;
+    gsize to_copy = MIN (size, BLOCK_SIZE - block_offset);
+    gchar *block;
+
+    if (block_offset == 0)
+      g_ptr_array_add (buffer->blocks, g_malloc (BLOCK_SIZE));
+    block = g_ptr_array_index (buffer->blocks, buffer->blocks->len - 1);
+
+    memcpy (block + block_offset, data, to_copy);
+    data += to_copy;
+    size -= to_copy;
+    buffer->available += to_copy;
+  }
+
+  if (size > 0 && !aur_resource_buffer_spill (buffer, data, size)) {
+    aur_resource_buffer_finish (buffer, FALSE);
+    return;
+  }
+
+  aur_resource_buffer_notify (buffer);
+}
+
+/* Called when the fetch is over. On success, the available data is the
+ * whole resource */
+void
+aur_resource_buffer_finish (AurResourceBuffer * buffer, gboolean success)
+{
+  if (buffer->complete)
+    return;
+
+  buffer->complete = TRUE;
+  buffer->failed = !success;
+  if (success) {
+    buffer->length = buffer->available;
+    buffer->have_info = TRUE;
+  }
+
+  aur_resource_buffer_notify (buffer);
+}
+
+gboolean
+aur_resource_buffer_have_info (AurResourceBuffer * buffer)
+{
+  return buffer->have_info;
+}
+
+gint64
+aur_resource_buffer_get_length (AurResourceBuffer * buffer)
+{
+  return buffer->length;
+}
+
+const gchar *
+aur_resource_buffer_get_content_type (AurResourceBuffer * buffer)
+{
+  return buffer->content_type;
+}
+
+guint64
+aur_resource_buffer_get_available (AurResourceBuffer * buffer)
+{
+  return buffer->available;
+}
+
+gboolean
+aur_resource_buffer_is_complete (AurResourceBuffer * buffer)
+{
+  return buffer->complete;
+}
+
+gboolean
+aur_resource_buffer_is_failed (AurResourceBuffer * buffer)
+{
+  return buffer->failed;
+}
+
+guint64
+aur_resource_buffer_get_memory_size (AurResourceBuffer * buffer)
+{
+  return (guint64) buffer->blocks->len * BLOCK_SIZE;
+}
+
+/* Copy up to size bytes starting at offset. Returns the number of bytes
+ * copied, which is 0 if nothing at offset has arrived yet */
+gsize
+aur_resource_buffer_read (AurResourceBuffer * buffer, guint64 offset,
+    gchar * dest, gsize size)
+{
+  gsize copied = 0;
+
+  if (offset >= buffer->available)
+    return 0;
+  size = MIN (size, buffer->available - offset);
+
+  while (copied < size && offset < buffer->memory_limit) {
+    const gchar *block = g_ptr_array_index (buffer->blocks,
+        offset / BLOCK_SIZE);
+    gsize block_offset = offset % BLOCK_SIZE;
+    gsize to_copy = MIN (size - copied, BLOCK_SIZE - block_offset);
+
+    memcpy (dest + copied, block + block_offset, to_copy);
+    copied += to_copy;
+    offset += to_copy;
+  }
+
+  while (copied < size) {
+    ssize_t bread = pread (buffer->spill_fd, dest + copied, size - copied,
+        offset - buffer->memory_limit);
+
+    if (bread < 0 && errno == EINTR)
+      continue;
+    if (bread <= 0)
+      break;
+
+    copied += bread;
+    offset += bread;
+  }
+
+  return copied;
+}
+
+void
+aur_resource_buffer_wait (AurResourceBuffer * buffer,
+    AurResourceBufferFunc func, gpointer user_data)
+{
+  AurResourceBufferWaiter *waiter = g_new0 (AurResourceBufferWaiter, 1);
+
+  waiter->func = func;
+  waiter->user_data = user_data;
+  buffer->waiters = g_list_append (buffer->waiters, waiter);
+}
+
+void
+aur_resource_buffer_cancel_wait (AurResourceBuffer * buffer,
+    AurResourceBufferFunc func, gpointer user_data)
+{
+  GList *cur;
+
+  for (cur = buffer->waiters; cur != NULL; cur = g_list_next (cur)) {
+    AurResourceBufferWaiter *waiter = cur->data;
+
+    if (waiter->func == func && waiter->user_data == user_data) {
+      buffer->waiters = g_list_delete_link (buffer->waiters, cur);
+      g_free (waiter);
+      return;
+    }
+  }
+}
@@ -0,0 +1,59 @@
+/* GStreamer
+ * Copyright (C) 2012-2014 Jan Schmidt <thaytan@noraisin.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __AUR_RESOURCE_BUFFER_H__
+#define __AUR_RESOURCE_BUFFER_H__
+
+#include <glib.h>
+
+#include <src/common/aur-types.h>
+
+G_BEGIN_DECLS
+
+typedef void (*AurResourceBufferFunc) (AurResourceBuffer *buffer,
+    gpointer user_data);
+
+AurResourceBuffer *aur_resource_buffer_new (guint64 memory_limit);
+void aur_resource_buffer_free (AurResourceBuffer *buffer);
+
+void aur_resource_buffer_set_info (AurResourceBuffer *buffer, gint64 length,
+    const gchar *content_type);
+void aur_resource_buffer_append (AurResourceBuffer *buffer,
+    const gchar *data, gsize size);
+void aur_resource_buffer_finish (AurResourceBuffer *buffer, gboolean success);
+
+gboolean aur_resource_buffer_have_info (AurResourceBuffer *buffer);
+gint64 aur_resource_buffer_get_length (AurResourceBuffer *buffer);
+const gchar *aur_resource_buffer_get_content_type (AurResourceBuffer *buffer);
+guint64 aur_resource_buffer_get_available (AurResourceBuffer *buffer);
+gboolean aur_resource_buffer_is_complete (AurResourceBuffer *buffer);
+gboolean aur_resource_buffer_is_failed (AurResourceBuffer *buffer);
+guint64 aur_resource_buffer_get_memory_size (AurResourceBuffer *buffer);
+
+gsize aur_resource_buffer_read (AurResourceBuffer *buffer, guint64 offset,
+    gchar *dest, gsize size);
+
+void aur_resource_buffer_wait (AurResourceBuffer *buffer,
+    AurResourceBufferFunc func, gpointer user_data);
+void aur_resource_buffer_cancel_wait (AurResourceBuffer *buffer,
+    AurResourceBufferFunc func, gpointer user_data);
+
+G_END_DECLS
+
+#endif
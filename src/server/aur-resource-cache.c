@@ -0,0 +1,296 @@
+/* GStreamer
+ * Copyright (C) 2012-2014 Jan Schmidt <thaytan@noraisin.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The resource cache keeps the AurHttpResource objects for recently
+ * requested media around, keyed by URI. Entries for media DB resources
+ * are also indexed by resource id, so repeat requests can be served
+ * without going back to the database. It's bounded both
+ * by number of entries and by the number of bytes the cached resources
+ * hold in memory. Resources are only ever evicted while no transfer is
+ * using them.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "aur-http-resource.h"
+#include "aur-resource-cache.h"
+
+typedef struct _AurResourceCacheEntry AurResourceCacheEntry;
+
+struct _AurResourceCacheEntry
+{
+  gchar *key;
+  AurHttpResource *resource;
+  GList link;
+  gboolean has_id;
+  guint id;
+  gint64 last_used;
+};
+
+struct _AurResourceCache
+{
+  GHashTable *entries;
+  /* Resource id -> entry, for entries that have one */
+  GHashTable *ids;
+  /* Most recently used at the head */
+  GQueue lru;
+
+  guint max_entries;
+  guint64 max_bytes;
+
+  guint64 hits;
+  guint64 misses;
+  guint64 evictions;
+};
+
+static void
+aur_resource_cache_entry_free (AurResourceCacheEntry * entry)
+{
+  /* Once dropped from the cache, no new transfer can pick the resource
+   * up, so an upstream fetch still running for it would only fill a
+   * buffer no one will read */
+  if (!aur_http_resource_is_in_use (entry->resource))
+    aur_http_resource_cancel_fetch (entry->resource);
+  g_object_unref (entry->resource);
+  g_free (entry->key);
+  g_free (entry);
+}
+
+AurResourceCache *
+aur_resource_cache_new (guint max_entries, guint64 max_bytes)
+{
+  AurResourceCache *cache = g_new0 (AurResourceCache, 1);
+
+  cache->entries = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+      (GDestroyNotify) aur_resource_cache_entry_free);
+  cache->ids = g_hash_table_new (NULL, NULL);
+  g_queue_init (&cache->lru);
+  cache->max_entries = max_entries;
+  cache->max_bytes = max_bytes;
+
+  return cache;
+}
+
+void
+aur_resource_cache_free (AurResourceCache * cache)
+{
+  g_queue_clear (&cache->lru);
+  g_hash_table_destroy (cache->ids);
+  g_hash_table_destroy (cache->entries);
+  g_free (cache);
+}
+
+static void
+aur_resource_cache_unindex_id (AurResourceCache * cache,
+    AurResourceCacheEntry * entry)
+{
+  if (!entry->has_id)
+    return;
+
+  if (g_hash_table_lookup (cache->ids, GUINT_TO_POINTER (entry->id)) == entry)
+    g_hash_table_remove (cache->ids, GUINT_TO_POINTER (entry->id));
+  entry->has_id = FALSE;
+}
+
+static void
+aur_resource_cache_remove (AurResourceCache * cache,
+    AurResourceCacheEntry * entry)
+{
+  aur_resource_cache_unindex_id (cache, entry);
+  g_queue_unlink (&cache->lru, &entry->link);
+  g_hash_table_remove (cache->entries, entry->key);
+}
+
+static void
+aur_resource_cache_evict (AurResourceCache * cache,
+    AurResourceCacheEntry * entry)
+{
+  g_print ("Evicting resource %s from cache\n", entry->key);
+
+  cache->evictions++;
+  aur_resource_cache_remove (cache, entry);
+}
+
+static guint64
+aur_resource_cache_get_size (AurResourceCache * cache)
+{
+  guint64 total = 0;
+  GList *cur;
+
+  for (cur = cache->lru.head; cur != NULL; cur = cur->next) {
+    AurResourceCacheEntry *entry = cur->data;
+    total += aur_http_resource_get_cached_size (entry->resource);
+  }
+
+  return total;
+}
+
+/* Evict idle entries, least recently used first, until the cache is back
+ * within its budget (or everything left is busy) */
+static void
+aur_resource_cache_trim (AurResourceCache * cache)
+{
+  guint64 size = aur_resource_cache_get_size (cache);
+  GList *cur = cache->lru.tail;
+
+  while (cur != NULL && (cache->lru.length > cache->max_entries
+          || size > cache->max_bytes)) {
+    AurResourceCacheEntry *entry = cur->data;
+
+    cur = cur->prev;
+
+    if (aur_http_resource_is_in_use (entry->resource))
+      continue;
+
+    size -= aur_http_resource_get_cached_size (entry->resource);
+    aur_resource_cache_evict (cache, entry);
+  }
+}
+
+static AurHttpResource *
+aur_resource_cache_hit (AurResourceCache * cache,
+    AurResourceCacheEntry * entry)
+{
+  cache->hits++;
+  entry->last_used = g_get_monotonic_time ();
+
+  /* Move to the front of the LRU */
+  g_queue_unlink (&cache->lru, &entry->link);
+  g_queue_push_head_link (&cache->lru, &entry->link);
+
+  return g_object_ref (entry->resource);
+}
+
+/* Returns a new ref to the cached resource for key, or NULL */
+AurHttpResource *
+aur_resource_cache_lookup (AurResourceCache * cache, const gchar * key)
+{
+  AurResourceCacheEntry *entry = g_hash_table_lookup (cache->entries, key);
+
+  if (entry == NULL) {
+    cache->misses++;
+    return NULL;
+  }
+
+  return aur_resource_cache_hit (cache, entry);
+}
+
+/* Returns a new ref to the cached resource indexed under the media DB
+ * resource id, or NULL. A miss isn't counted, as the caller goes on to
+ * look the resource up by URI */
+AurHttpResource *
+aur_resource_cache_lookup_id (AurResourceCache * cache, guint id)
+{
+  AurResourceCacheEntry *entry =
+      g_hash_table_lookup (cache->ids, GUINT_TO_POINTER (id));
+
+  if (entry == NULL)
+    return NULL;
+
+  return aur_resource_cache_hit (cache, entry);
+}
+
+/* Takes ownership of the passed resource */
+void
+aur_resource_cache_insert (AurResourceCache * cache, const gchar * key,
+    AurHttpResource * resource)
+{
+  AurResourceCacheEntry *entry = g_hash_table_lookup (cache->entries, key);
+
+  if (entry != NULL)
+    aur_resource_cache_remove (cache, entry);
+
+  entry = g_new0 (AurResourceCacheEntry, 1);
+  entry->key = g_strdup (key);
+  entry->resource = resource;
+  entry->link.data = entry;
+  entry->last_used = g_get_monotonic_time ();
+
+  g_hash_table_insert (cache->entries, entry->key, entry);
+  g_queue_push_head_link (&cache->lru, &entry->link);
+
+  aur_resource_cache_trim (cache);
+}
+
+/* Index the entry for key under a media DB resource id as well */
+void
+aur_resource_cache_set_id (AurResourceCache * cache, const gchar * key,
+    guint id)
+{
+  AurResourceCacheEntry *entry = g_hash_table_lookup (cache->entries, key);
+  AurResourceCacheEntry *old;
+
+  if (entry == NULL || (entry->has_id && entry->id == id))
+    return;
+
+  aur_resource_cache_unindex_id (cache, entry);
+
+  /* The id now refers to a different file */
+  old = g_hash_table_lookup (cache->ids, GUINT_TO_POINTER (id));
+  if (old != NULL)
+    old->has_id = FALSE;
+
+  entry->id = id;
+  entry->has_id = TRUE;
+  g_hash_table_insert (cache->ids, GUINT_TO_POINTER (id), entry);
+}
+
+/* Evict every idle entry that hasn't been used for max_idle microseconds,
+ * and trim back to the budget in case cached resources have grown.
+ * Returns the number of entries evicted. */
+guint
+aur_resource_cache_expire (AurResourceCache * cache, gint64 max_idle)
+{
+  gint64 now = g_get_monotonic_time ();
+  guint64 evictions = cache->evictions;
+  GList *cur = cache->lru.tail;
+
+  while (cur != NULL) {
+    AurResourceCacheEntry *entry = cur->data;
+
+    /* Everything further up the list was used more recently */
+    if (now - entry->last_used < max_idle)
+      break;
+
+    cur = cur->prev;
+
+    if (!aur_http_resource_is_in_use (entry->resource))
+      aur_resource_cache_evict (cache, entry);
+  }
+
+  aur_resource_cache_trim (cache);
+
+  return cache->evictions - evictions;
+}
+
+GstStructure *
+aur_resource_cache_get_stats (AurResourceCache * cache)
+{
+  return gst_structure_new ("resource-cache",
+      "entries", G_TYPE_INT, (gint) cache->lru.length,
+      "max-entries", G_TYPE_INT, (gint) cache->max_entries,
+      "bytes", G_TYPE_INT64, (gint64) aur_resource_cache_get_size (cache),
+      "max-bytes", G_TYPE_INT64, (gint64) cache->max_bytes,
+      "hits", G_TYPE_INT64, (gint64) cache->hits,
+      "misses", G_TYPE_INT64, (gint64) cache->misses,
+      "evictions", G_TYPE_INT64, (gint64) cache->evictions, NULL);
+}
@@ -0,0 +1,47 @@
+/* GStreamer
+ * Copyright (C) 2012-2014 Jan Schmidt <thaytan@noraisin.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __AUR_RESOURCE_CACHE_H__
+#define __AUR_RESOURCE_CACHE_H__
+
+#include <gst/gst.h>
+
+#include <src/common/aur-types.h>
+
+G_BEGIN_DECLS
+
+AurResourceCache *aur_resource_cache_new (guint max_entries,
+    guint64 max_bytes);
+void aur_resource_cache_free (AurResourceCache *cache);
+
+AurHttpResource *aur_resource_cache_lookup (AurResourceCache *cache,
+    const gchar *key);
+AurHttpResource *aur_resource_cache_lookup_id (AurResourceCache *cache,
+    guint id);
+void aur_resource_cache_insert (AurResourceCache *cache, const gchar *key,
+    AurHttpResource *resource);
+void aur_resource_cache_set_id (AurResourceCache *cache, const gchar *key,
+    guint id);
+guint aur_resource_cache_expire (AurResourceCache *cache, gint64 max_idle);
+
+GstStructure *aur_resource_cache_get_stats (AurResourceCache *cache);
+
+G_END_DECLS
+
+#endif
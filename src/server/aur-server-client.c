@@ -24,6 +24,9 @@
 #include <libsoup/soup-server.h>
 #include <string.h>
 
+#include <src/common/aur-cbor.h>
+#include <src/common/aur-websocket-deflate.h>
+
 #include "aur-server-client.h"
 
 G_DEFINE_TYPE (AurServerClient, aur_server_client, AUR_TYPE_WEBSOCKET_PARSER);
@@ -36,33 +39,103 @@ enum
 
 static guint aur_server_client_signals[LAST_SIGNAL] = { 0 };
 
-typedef struct _PendingMsg PendingMsg;
+/* A websocket client whose queued frames exceed this is too far behind
+ * to catch up, and gets disconnected */
+#define MAX_OUT_QUEUE_BYTES (256 * 1024)
+
+/* Number of buffers handed to a single vectored write - 2 per frame */
+#define MAX_WRITE_VECTORS 32
+
+/* Messages smaller than this aren't worth compressing */
+#define DEFLATE_MIN_SIZE 128
+
+/* Heartbeat interval bounds, in seconds. Websocket clients are pinged at
+ * the minimum interval until they answer promptly, then progressively
+ * less often. The maximum stays below the 20 second idle timeout
+ * clients apply */
+#define HEARTBEAT_MIN_INTERVAL 2
+#define HEARTBEAT_MAX_INTERVAL 16
+/* A websocket client that hasn't answered a ping for this long is gone */
+#define HEARTBEAT_TIMEOUT (30 * G_USEC_PER_SEC)
+
+/* Chunked clients read the event stream through libsoup, which gives up
+ * on a read after 5 seconds. They get a keepalive once nothing else has
+ * been sent for KEEPALIVE_INTERVAL seconds, checked every KEEPALIVE_TICK
+ * seconds, so the stream is never silent for more than 3 seconds */
+#define KEEPALIVE_INTERVAL 2
+#define KEEPALIVE_TICK 1
+
+/* Keepalives for chunked clients: an empty message in either encoding,
+ * which clients skip */
+static const gchar keepalive_json[1] = { '\0' };
+static const gchar keepalive_cbor[4] = { 0, 0, 0, 0 };
+
+typedef struct _OutMsg OutMsg;
 
-struct _PendingMsg
+struct _OutMsg
 {
-  gchar *body;
+  /* The frame header is built per client, the payload is shared by every
+   * client the message is broadcast to */
+  gchar header[10];
+  gsize header_len;
+  GBytes *payload;
+  gsize payload_len;
+
   gsize len;
+  gsize sent;
+
+  /* Compress the payload just before it starts going out, so messages
+   * pass through the compression context in the order they're sent */
+  gboolean deflate;
+
+  /* A newer message with the same key replaces this one if it hasn't
+   * started going out yet */
+  gchar *coalesce_key;
 };
 
 static guint next_conn_id = 1;
+static guint n_overflows = 0;
 
 static void aur_server_client_finalize (GObject * object);
 static void aur_server_client_dispose (GObject * object);
+static void aur_server_client_send_frame (AurWebSocketParser * parser,
+    guint8 opcode, const gchar * data, gsize len);
+static void aur_server_client_pong_received (AurWebSocketParser * parser,
+    const gchar * data, gsize len);
+static void aur_server_client_start_heartbeat (AurServerClient * client,
+    guint interval);
+static void aur_server_client_stop_heartbeat (AurServerClient * client);
+
+static void
+out_msg_free (OutMsg * msg)
+{
+  g_bytes_unref (msg->payload);
+  g_free (msg->coalesce_key);
+  g_free (msg);
+}
 
 static void
 aur_server_client_init (AurServerClient * client)
 {
   client->conn_id = next_conn_id++;
+  g_queue_init (&client->out_queue);
+
+  AUR_WEBSOCKET_PARSER (client)->require_mask = TRUE;
 }
 
 static void
 aur_server_client_class_init (AurServerClientClass * client_class)
 {
   GObjectClass *gobject_class = (GObjectClass *) (client_class);
+  AurWebSocketParserClass *parser_class =
+      (AurWebSocketParserClass *) (client_class);
 
   gobject_class->dispose = aur_server_client_dispose;
   gobject_class->finalize = aur_server_client_finalize;
 
+  parser_class->send_frame = aur_server_client_send_frame;
+  parser_class->pong_received = aur_server_client_pong_received;
+
   aur_server_client_signals[CONNECTION_LOST] =
       g_signal_new ("connection-lost", G_TYPE_FROM_CLASS (client_class),
       G_SIGNAL_RUN_LAST, 0, NULL, NULL,
@@ -96,7 +169,11 @@ aur_server_client_finalize (GObject * object)
 
   g_free (client->host);
 
-  g_free (client->out_buf);
+  if (client->deflater)
+    g_object_unref (client->deflater);
+
+  g_queue_foreach (&client->out_queue, (GFunc) out_msg_free, NULL);
+  g_queue_clear (&client->out_queue);
 
   G_OBJECT_CLASS (aur_server_client_parent_class)->finalize (object);
 }
@@ -106,6 +183,13 @@ aur_server_client_dispose (GObject * object)
 {
   AurServerClient *client = (AurServerClient *) (object);
 
+  aur_server_client_stop_heartbeat (client);
+
+  if (client->out_watch) {
+    g_source_remove (client->out_watch);
+    client->out_watch = 0;
+  }
+
   if (client->io) {
     g_source_remove (client->io_watch);
     g_io_channel_shutdown (client->io, TRUE, NULL);
@@ -125,6 +209,13 @@ aur_server_connection_lost (AurServerClient * client)
 
   g_print ("Lost connection for client %u\n", client->conn_id);
 
+  aur_server_client_stop_heartbeat (client);
+
+  if (client->out_watch) {
+    g_source_remove (client->out_watch);
+    client->out_watch = 0;
+  }
+
   if (client->io) {
     g_source_remove (client->io_watch);
     g_io_channel_shutdown (client->io, TRUE, NULL);
@@ -173,6 +264,7 @@ aur_server_client_io_cb (G_GNUC_UNUSED GIOChannel * source,
     GIOCondition condition, AurServerClient * client)
 {
   GIOStatus status = G_IO_STATUS_NORMAL;
+  gboolean keep_watch;
 #if 0
   g_print ("Got IO callback for client %p w/ condition %u\n", client,
       (guint) (condition));
@@ -183,6 +275,10 @@ aur_server_client_io_cb (G_GNUC_UNUSED GIOChannel * source,
     return FALSE;
   }
 
+  /* Messages from the client are handled during the read, and a handler
+   * can drop the last other reference */
+  g_object_ref (client);
+
   if (condition & G_IO_IN) {
     status = aur_websocket_parser_read_io (AUR_WEBSOCKET_PARSER (client), client->io);
   }
@@ -190,17 +286,22 @@ aur_server_client_io_cb (G_GNUC_UNUSED GIOChannel * source,
   if (status == G_IO_STATUS_EOF || status == G_IO_STATUS_ERROR) {
     // no more data
     aur_server_connection_lost (client);
+    g_object_unref (client);
     return FALSE;
   }
 
-  return TRUE;
+  /* The watch is already gone if a handler closed the connection */
+  keep_watch = client->io != NULL;
+  g_object_unref (client);
+
+  return keep_watch;
 }
 
+static void aur_server_client_flush (AurServerClient * client);
+
 static void
 aur_server_client_wrote_headers (SoupMessage * msg, AurServerClient * client)
 {
-  GList *cur;
-
   /* Pause the message so Soup doesn't do any more responding */
   soup_server_pause_message (client->soup, msg);
 
@@ -212,20 +313,16 @@ aur_server_client_wrote_headers (SoupMessage * msg, AurServerClient * client)
   client->io_watch = g_io_add_watch (client->io, G_IO_IN | G_IO_HUP,
       (GIOFunc) (aur_server_client_io_cb), client);
 
-  /* Send any pending messages */
-  while ((cur = client->pending_msgs)) {
-    GList *next;
-    PendingMsg *msg = (PendingMsg *) (cur->data);
-
-    next = g_list_next (cur);
+  /* We write to the socket ourselves from now on, and never want to
+   * block the main loop doing it */
+  g_socket_set_blocking (client->socket, FALSE);
 
-    aur_server_client_send_message (client, msg->body, msg->len);
-    client->pending_msgs = g_list_delete_link (client->pending_msgs, cur);
-    g_free (msg->body);
-    g_free (msg);
+  aur_server_client_start_heartbeat (client, HEARTBEAT_MIN_INTERVAL);
 
-    cur = next;
-  }
+  /* Send any messages queued before the handshake completed */
+  g_object_ref (client);
+  aur_server_client_flush (client);
+  g_object_unref (client);
 }
 
 static gchar *
@@ -273,6 +370,56 @@ http_list_contains_value (const gchar * val, const gchar * needle)
   return found_needle;
 }
 
+/* Check whether an Accept header lists a media type, ignoring any
+ * parameters */
+static gboolean
+http_accepts (const gchar * val, const gchar * media_type)
+{
+  gchar **tmp;
+  gchar **cur;
+  gboolean found = FALSE;
+
+  if (val == NULL)
+    return FALSE;
+
+  tmp = g_strsplit (val, ",", 0);
+  for (cur = tmp; *cur != NULL; cur++) {
+    gchar *params = strchr (*cur, ';');
+    if (params)
+      *params = '\0';
+    g_strstrip (*cur);
+    if (g_ascii_strcasecmp (*cur, media_type) == 0) {
+      found = TRUE;
+      break;
+    }
+  }
+  g_strfreev (tmp);
+  return found;
+}
+
+/* Clients that can decode CBOR messages ask for them */
+gboolean
+aur_server_client_http_accepts_cbor (SoupMessage * msg)
+{
+  const gchar *val = soup_message_headers_get_list (msg->request_headers,
+      "Accept");
+
+  return http_accepts (val, AUR_CBOR_CONTENT_TYPE);
+}
+
+static void
+choose_http_encoding (AurServerClient * client)
+{
+  SoupMessage *msg = client->event_pipe;
+
+  client->encoding = AUR_SERVER_CLIENT_JSON;
+  if (aur_server_client_http_accepts_cbor (msg)) {
+    client->encoding = AUR_SERVER_CLIENT_CBOR;
+    soup_message_headers_set_content_type (msg->response_headers,
+        AUR_CBOR_CONTENT_TYPE, NULL);
+  }
+}
+
 static gboolean
 is_websocket_client (AurServerClient * client)
 {
@@ -280,7 +427,7 @@ is_websocket_client (AurServerClient * client)
    * Upgrade: websocket
    * Connection: Upgrade, Keep-Alive
    * Sec-WebSocket-Key: XYZABC123
-   * Sec-WebSocket-Protocol: aurena
+   * Sec-WebSocket-Protocol: aurena-cbor, aurena
    * Sec-WebSocket-Version: 13
    */
   SoupMessage *msg = client->event_pipe;
@@ -307,7 +454,12 @@ is_websocket_client (AurServerClient * client)
               "Sec-WebSocket-Protocol")) == NULL)
     return FALSE;
 
-  if (!http_list_contains_value (val, "aurena"))
+  /* Binary messages if the client can take them, JSON otherwise */
+  if (http_list_contains_value (val, AUR_CBOR_WEBSOCKET_PROTOCOL))
+    client->encoding = AUR_SERVER_CLIENT_CBOR;
+  else if (http_list_contains_value (val, "aurena"))
+    client->encoding = AUR_SERVER_CLIENT_JSON;
+  else
     return FALSE;
 
   /* Requested protocol version must be 13 or 8 */
@@ -334,8 +486,9 @@ aur_server_client_new (SoupServer * soup, SoupMessage * msg,
     SoupClientContext * context)
 {
   AurServerClient *client = g_object_new (AUR_TYPE_SERVER_CLIENT, NULL);
-  const gchar *accept_challenge;
-  gchar *accept_reply;
+  AurWebSocketDeflateParams deflate_params;
+  const gchar *accept_challenge, *extensions;
+  gchar *accept_reply, *extensions_reply;
 
   client->soup = soup;
   client->event_pipe = msg;
@@ -352,7 +505,9 @@ aur_server_client_new (SoupServer * soup, SoupMessage * msg,
 
     soup_message_headers_set_encoding (msg->response_headers,
         SOUP_ENCODING_CHUNKED);
+    choose_http_encoding (client);
     soup_message_set_status (msg, SOUP_STATUS_OK);
+    aur_server_client_start_heartbeat (client, KEEPALIVE_TICK);
     return client;
   }
 
@@ -375,10 +530,28 @@ aur_server_client_new (SoupServer * soup, SoupMessage * msg,
   soup_message_headers_replace (msg->response_headers, "Sec-WebSocket-Accept",
       accept_reply);
   soup_message_headers_replace (msg->response_headers, "Sec-WebSocket-Protocol",
-      "aurena");
+      client->encoding == AUR_SERVER_CLIENT_CBOR ?
+      AUR_CBOR_WEBSOCKET_PROTOCOL : "aurena");
 
   g_free (accept_reply);
 
+  extensions = soup_message_headers_get_list (msg->request_headers,
+      "Sec-WebSocket-Extensions");
+  if (aur_websocket_deflate_negotiate (extensions, &deflate_params,
+          &extensions_reply)) {
+    g_print ("Client %u: using permessage-deflate\n", client->conn_id);
+
+    client->deflater = aur_websocket_deflate_new_compressor ();
+    client->deflate_no_context_takeover =
+        deflate_params.server_no_context_takeover;
+    aur_websocket_parser_enable_deflate (AUR_WEBSOCKET_PARSER (client),
+        deflate_params.client_no_context_takeover);
+
+    soup_message_headers_replace (msg->response_headers,
+        "Sec-WebSocket-Extensions", extensions_reply);
+    g_free (extensions_reply);
+  }
+
   client->wrote_info_sig = g_signal_connect (msg, "wrote-informational",
       G_CALLBACK (aur_server_client_wrote_headers), client);
 
@@ -405,127 +578,562 @@ aur_server_client_new_single (SoupServer * soup, SoupMessage * msg,
   client->type = AUR_SERVER_CLIENT_SINGLE;
   client->need_body_complete = TRUE;
 
+  choose_http_encoding (client);
   soup_message_set_status (msg, SOUP_STATUS_OK);
   soup_server_pause_message (client->soup, msg);
 
   return client;
 }
 
-static GIOStatus
-write_to_io_channel (GIOChannel * io, const gchar * buf, gsize len)
+static void
+set_frame_header (OutMsg * msg, guint8 first_byte, gsize len)
 {
-  GIOStatus status;
-  gsize tot_written = 0;
+  /* Server to client frames are never masked */
+  msg->header[0] = first_byte;
+  if (len < 126) {
+    msg->header[1] = len;
+    msg->header_len = 2;
+  } else if (len < 65536) {
+    msg->header[1] = 126;
+    GST_WRITE_UINT16_BE (msg->header + 2, (guint16) (len));
+    msg->header_len = 4;
+  } else {
+    msg->header[1] = 127;
+    GST_WRITE_UINT64_BE (msg->header + 2, (guint64) (len));
+    msg->header_len = 10;
+  }
 
-  do {
-    gsize written = 0;
-    status = g_io_channel_write_chars (io, buf, len, &written, NULL);
+  msg->payload_len = len;
+  msg->len = msg->header_len + len;
+}
 
-    if (status == G_IO_STATUS_ERROR || status == G_IO_STATUS_EOF)
-      return status;
+static OutMsg *
+make_frame (guint8 opcode, GBytes * payload, gsize len)
+{
+  OutMsg *msg = g_new0 (OutMsg, 1);
 
-    tot_written += written;
-    buf += written;
-  } while (tot_written < len && status == G_IO_STATUS_AGAIN);
+  set_frame_header (msg, 0x80 | opcode, len);
+  msg->payload = g_bytes_ref (payload);
 
-  return G_IO_STATUS_NORMAL;
+  return msg;
 }
 
+/* Swap a queued message's payload for its compressed form. The payload
+ * is no longer shared with other clients after this */
 static void
-write_fragment (AurServerClient * client, gchar * body, gsize len)
+deflate_out_msg (AurServerClient * client, OutMsg * msg)
 {
-  gchar header[14];
-  gsize header_len, i;
-  const guint8 masking = 0x00;  // 0x80 to enable masking
-  GIOStatus status;
+  GBytes *compressed;
+  gsize len;
 
-  union
-  {
-    gchar bytes[4];
-    guint32 val;
-  } mask;
+  msg->deflate = FALSE;
 
-  header[0] = 0x81;
-  header_len = 2;
-  if (len < 126) {
-    header[1] = masking | len;
-  } else if (len < 65536) {
-    header[1] = masking | 126;
-    GST_WRITE_UINT16_BE (header + 2, (guint16) (len));
-    header_len += 2;
-  } else {
-    header[1] = masking | 127;
-    GST_WRITE_UINT64_BE (header + 2, (guint64) (len));
-    header_len += 8;
-  }
-  /* Add a random mask word. */
-  if (masking) {
-    mask.val = g_random_int ();
-    memcpy (header + header_len, mask.bytes, 4);
-    header_len += 4;
-  }
-
-  /* Write WebSocket frame header */
-  status = write_to_io_channel (client->io, header, header_len);
-  if (status != G_IO_STATUS_NORMAL)
-    goto done;
-
-  /* Mask the body, and send it */
-  if (masking) {
-    if (len > client->out_bufsize) {
-      client->out_bufsize = len;
-      client->out_buf = g_realloc (client->out_buf, client->out_bufsize);
+  if (client->deflate_no_context_takeover)
+    g_converter_reset (client->deflater);
+
+  compressed = aur_websocket_deflate_message (client->deflater,
+      g_bytes_get_data (msg->payload, NULL), msg->payload_len);
+  if (compressed == NULL) {
+    /* Resetting only loses history, the client can still follow, so
+     * send this one uncompressed and start afresh with the next */
+    g_converter_reset (client->deflater);
+    return;
+  }
+
+  len = g_bytes_get_size (compressed);
+  client->n_deflated++;
+  client->deflate_bytes_in += msg->payload_len;
+  client->deflate_bytes_out += len;
+
+  client->out_queue_bytes -= msg->len;
+  g_bytes_unref (msg->payload);
+  msg->payload = compressed;
+  set_frame_header (msg, 0x80 | AUR_WEBSOCKET_RSV1 | (msg->header[0] & 0x0f),
+      len);
+  client->out_queue_bytes += msg->len;
+}
+
+/* Frame a message in the client's encoding. A JSON text is followed by
+ * a NUL, which isn't part of the websocket payload */
+static OutMsg *
+make_message_frame (AurServerClient * client, GBytes * body)
+{
+  if (client->encoding == AUR_SERVER_CLIENT_CBOR)
+    return make_frame (AUR_WEBSOCKET_OP_BINARY, body, g_bytes_get_size (body));
+
+  return make_frame (AUR_WEBSOCKET_OP_TEXT, body, g_bytes_get_size (body) - 1);
+}
+
+static gboolean aur_server_client_out_cb (GIOChannel * source,
+    GIOCondition condition, AurServerClient * client);
+
+/* Describe the remaining part of as many queued frames as fit, header
+ * and payload each as their own vector, so they go out in one write */
+static guint
+fill_write_vectors (AurServerClient * client, GOutputVector * vectors)
+{
+  guint n_vectors = 0;
+  GList *cur;
+
+  for (cur = client->out_queue.head;
+      cur != NULL && n_vectors + 2 <= MAX_WRITE_VECTORS; cur = cur->next) {
+    OutMsg *msg = cur->data;
+    const gchar *payload;
+    gsize payload_offset = 0;
+
+    if (msg->deflate)
+      deflate_out_msg (client, msg);
+    payload = g_bytes_get_data (msg->payload, NULL);
+
+    if (msg->sent < msg->header_len) {
+      vectors[n_vectors].buffer = msg->header + msg->sent;
+      vectors[n_vectors].size = msg->header_len - msg->sent;
+      n_vectors++;
+    } else {
+      payload_offset = msg->sent - msg->header_len;
     }
-    for (i = 0; i < len; i++) {
-      client->out_buf[i] = body[i] ^ mask.bytes[i % 4];
+
+    if (payload_offset < msg->payload_len) {
+      vectors[n_vectors].buffer = payload + payload_offset;
+      vectors[n_vectors].size = msg->payload_len - payload_offset;
+      n_vectors++;
     }
-    status = write_to_io_channel (client->io, client->out_buf, len);
-  } else {
-    status = write_to_io_channel (client->io, body, len);
   }
 
-done:
-  if (status != G_IO_STATUS_NORMAL)
+  return n_vectors;
+}
+
+/* Write as much of the send queue as the socket will take without
+ * blocking. If it fills up, wait for it to become writable again. The
+ * caller must hold a ref, as the client may lose its connection */
+static void
+aur_server_client_flush (AurServerClient * client)
+{
+  OutMsg *msg;
+
+  if (client->io == NULL)
+    return;                     /* Not connected yet */
+
+  while (!g_queue_is_empty (&client->out_queue)) {
+    GOutputVector vectors[MAX_WRITE_VECTORS];
+    GError *error = NULL;
+    gssize written;
+    guint n_vectors;
+
+    n_vectors = fill_write_vectors (client, vectors);
+    written = g_socket_send_message (client->socket, NULL, vectors,
+        n_vectors, NULL, 0, 0, NULL, &error);
+
+    if (written < 0) {
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+        g_error_free (error);
+        if (client->out_watch == 0) {
+          client->n_stalls++;
+          client->out_watch = g_io_add_watch (client->io,
+              G_IO_OUT | G_IO_HUP | G_IO_ERR,
+              (GIOFunc) (aur_server_client_out_cb), client);
+        }
+        return;
+      }
+
+      g_print ("Failed to write to client %u: %s\n", client->conn_id,
+          error->message);
+      g_error_free (error);
+      aur_server_connection_lost (client);
+      return;
+    }
+
+    /* Retire whatever went out completely */
+    while (written > 0) {
+      msg = g_queue_peek_head (&client->out_queue);
+      if ((gsize) written < msg->len - msg->sent) {
+        msg->sent += written;
+        break;
+      }
+
+      written -= msg->len - msg->sent;
+      g_queue_pop_head (&client->out_queue);
+      client->out_queue_bytes -= msg->len;
+      out_msg_free (msg);
+    }
+  }
+
+  if (client->out_watch) {
+    g_source_remove (client->out_watch);
+    client->out_watch = 0;
+  }
+}
+
+static gboolean
+aur_server_client_out_cb (G_GNUC_UNUSED GIOChannel * source,
+    GIOCondition condition, AurServerClient * client)
+{
+  if (condition & (G_IO_HUP | G_IO_ERR)) {
+    client->out_watch = 0;
+    g_object_ref (client);
     aur_server_connection_lost (client);
+    g_object_unref (client);
+    return FALSE;
+  }
+
+  /* flush() removes the watch once the queue is empty, so keep it alive
+   * here and let flush decide */
+  g_object_ref (client);
+  aur_server_client_flush (client);
+  g_object_unref (client);
+
+  return TRUE;
+}
+
+/* Queue a message for a websocket client, applying the send policy:
+ * - a message with a coalesce key replaces a queued, unsent message with
+ *   the same key (e.g. an older volume level)
+ * - a droppable message is dropped if the client is
+ *   already behind
+ * - anything else is always sent, in order, unless the client is so far
+ *   behind it gets disconnected */
+static void
+aur_server_client_queue_message (AurServerClient * client,
+    GBytes * body, const gchar * coalesce_key, gboolean droppable)
+{
+  OutMsg *msg;
+  GList *cur;
+
+  if (coalesce_key) {
+    for (cur = client->out_queue.head; cur != NULL; cur = cur->next) {
+      OutMsg *queued = cur->data;
+
+      /* Once compressed, a message is part of the compression context
+       * and has to go out */
+      if (queued->sent == 0 && !(queued->header[0] & AUR_WEBSOCKET_RSV1) &&
+          queued->coalesce_key &&
+          g_str_equal (queued->coalesce_key, coalesce_key)) {
+        msg = make_message_frame (client, body);
+        msg->deflate = client->deflater != NULL &&
+            msg->payload_len >= DEFLATE_MIN_SIZE;
+        msg->coalesce_key = queued->coalesce_key;
+        queued->coalesce_key = NULL;
+
+        client->out_queue_bytes += msg->len - queued->len;
+        cur->data = msg;
+        out_msg_free (queued);
+
+        client->n_coalesced++;
+        return;
+      }
+    }
+  }
+
+  if (droppable && !g_queue_is_empty (&client->out_queue)) {
+    client->n_dropped++;
+    return;
+  }
+
+  msg = make_message_frame (client, body);
+  msg->deflate = client->deflater != NULL &&
+      msg->payload_len >= DEFLATE_MIN_SIZE;
+  msg->coalesce_key = g_strdup (coalesce_key);
+  g_queue_push_tail (&client->out_queue, msg);
+  client->out_queue_bytes += msg->len;
+
+  client->max_queue_length =
+      MAX (client->max_queue_length, client->out_queue.length);
+  client->max_queue_bytes =
+      MAX (client->max_queue_bytes, client->out_queue_bytes);
+
+  if (client->out_queue_bytes > MAX_OUT_QUEUE_BYTES) {
+    g_print ("Client %u has %" G_GSIZE_FORMAT " bytes queued. "
+        "Disconnecting\n", client->conn_id, client->out_queue_bytes);
+    n_overflows++;
+    aur_server_connection_lost (client);
+    return;
+  }
+
+  /* If the socket's already backed up, the watch will get to it */
+  if (client->out_watch == 0)
+    aur_server_client_flush (client);
+}
+
+/* Control frames (pong and close replies) from the parser. These are
+ * never dropped or coalesced */
+static void
+aur_server_client_send_frame (AurWebSocketParser * parser, guint8 opcode,
+    const gchar * data, gsize len)
+{
+  AurServerClient *client = (AurServerClient *) (parser);
+  GBytes *payload;
+  OutMsg *msg;
+
+  if (client->fired_conn_lost)
+    return;
+
+  payload = g_bytes_new (data, len);
+  msg = make_frame (opcode, payload, len);
+  g_bytes_unref (payload);
+
+  g_queue_push_tail (&client->out_queue, msg);
+  client->out_queue_bytes += msg->len;
+
+  if (client->out_watch == 0) {
+    g_object_ref (client);
+    aur_server_client_flush (client);
+    g_object_unref (client);
+  }
+}
+
+static gboolean aur_server_client_heartbeat (AurServerClient * client);
+
+static void
+aur_server_client_start_heartbeat (AurServerClient * client, guint interval)
+{
+  aur_server_client_stop_heartbeat (client);
+
+  client->heartbeat_interval = interval;
+  client->heartbeat_source = g_timeout_add_seconds (interval,
+      (GSourceFunc) aur_server_client_heartbeat, client);
+}
+
+static void
+aur_server_client_stop_heartbeat (AurServerClient * client)
+{
+  if (client->heartbeat_source) {
+    g_source_remove (client->heartbeat_source);
+    client->heartbeat_source = 0;
+  }
+}
+
+/* Ping a websocket client with the current time as payload, which the
+ * pong echoes back to give the round trip time. Only one ping is ever
+ * outstanding */
+static gboolean
+heartbeat_ping (AurServerClient * client, gint64 now)
+{
+  guint8 payload[8];
+
+  if (client->ping_sent_time != 0) {
+    if (now - client->ping_sent_time > HEARTBEAT_TIMEOUT) {
+      g_print ("Client %u stopped answering pings\n", client->conn_id);
+      aur_server_connection_lost (client);
+      return FALSE;
+    }
+
+    /* Not answered within an interval - check more often until it is.
+     * Replacing the source destroys this one */
+    if (client->heartbeat_interval != HEARTBEAT_MIN_INTERVAL) {
+      aur_server_client_start_heartbeat (client, HEARTBEAT_MIN_INTERVAL);
+      return FALSE;
+    }
+    return TRUE;
+  }
+
+  GST_WRITE_UINT64_BE (payload, (guint64) now);
+  client->ping_sent_time = now;
+  client->n_pings++;
+  aur_server_client_send_frame (AUR_WEBSOCKET_PARSER (client),
+      AUR_WEBSOCKET_OP_PING, (const gchar *) payload, sizeof (payload));
+
+  return TRUE;
+}
+
+static gboolean
+aur_server_client_heartbeat (AurServerClient * client)
+{
+  gint64 now = g_get_monotonic_time ();
+  gboolean ret;
+
+  if (client->type == AUR_SERVER_CLIENT_WEBSOCKET) {
+    /* Losing the connection can drop the last reference */
+    g_object_ref (client);
+    ret = heartbeat_ping (client, now);
+    g_object_unref (client);
+    return ret;
+  }
+
+  /* Any message keeps a chunked connection alive just as well */
+  if (now - client->last_send_time <
+      (gint64) KEEPALIVE_INTERVAL * G_USEC_PER_SEC)
+    return TRUE;
+
+  if (client->encoding == AUR_SERVER_CLIENT_CBOR)
+    soup_message_body_append (client->event_pipe->response_body,
+        SOUP_MEMORY_STATIC, keepalive_cbor, sizeof (keepalive_cbor));
+  else
+    soup_message_body_append (client->event_pipe->response_body,
+        SOUP_MEMORY_STATIC, keepalive_json, sizeof (keepalive_json));
+  soup_server_unpause_message (client->soup, client->event_pipe);
+  client->last_send_time = now;
+
+  return TRUE;
+}
+
+static void
+aur_server_client_pong_received (AurWebSocketParser * parser,
+    const gchar * data, gsize len)
+{
+  AurServerClient *client = (AurServerClient *) (parser);
+  gint64 now = g_get_monotonic_time ();
+  gint64 rtt;
+
+  /* Unsolicited pongs are allowed, and ignored */
+  if (len != 8 || client->ping_sent_time == 0 ||
+      (gint64) GST_READ_UINT64_BE (data) != client->ping_sent_time)
+    return;
+
+  rtt = now - client->ping_sent_time;
+  client->ping_sent_time = 0;
+  client->n_pongs++;
+
+  /* Smoothed the way TCP does it, 1/8 weight to the new sample */
+  client->rtt = rtt;
+  if (client->srtt == 0)
+    client->srtt = rtt;
+  else
+    client->srtt += (rtt - client->srtt) / 8;
+
+  /* Answered promptly - the client can be checked less often */
+  if (client->heartbeat_interval < HEARTBEAT_MAX_INTERVAL &&
+      rtt < (gint64) client->heartbeat_interval * G_USEC_PER_SEC / 2)
+    aur_server_client_start_heartbeat (client,
+        MIN (client->heartbeat_interval * 2, HEARTBEAT_MAX_INTERVAL));
 }
 
 void
 aur_server_client_send_message (AurServerClient * client,
     gchar * body, gsize len)
 {
-  PendingMsg *msg;
+  GBytes *bytes;
+  gchar *data;
+
+  data = g_malloc (len + 1);
+  memcpy (data, body, len);
+  data[len] = '\0';
+  bytes = g_bytes_new_take (data, len + 1);
+
+  aur_server_client_send_bytes (client, bytes, NULL, FALSE);
+  g_bytes_unref (bytes);
+}
+
+/* Send a message, given in the client's encoding - as a JSON text
+ * followed by a NUL byte, or as CBOR. The bytes are referenced rather than
+ * copied, so the same GBytes can be passed to every client a message is
+ * broadcast to */
+void
+aur_server_client_send_bytes (AurServerClient * client, GBytes * body,
+    const gchar * coalesce_key, gboolean droppable)
+{
+  SoupBuffer *buffer;
+  gsize len;
 
   if (client->fired_conn_lost)
     return;
 
-  if (client->type == AUR_SERVER_CLIENT_CHUNKED) {
-    soup_message_body_append (client->event_pipe->response_body,
-        SOUP_MEMORY_COPY, body, len);
-    /* Add a NULL seperator, enable HTTP stack that abstract HTTP chunk. */
+  client->last_send_time = g_get_monotonic_time ();
+
+  len = g_bytes_get_size (body);
+  if (client->encoding == AUR_SERVER_CLIENT_JSON)
+    len--;
+
+  if (client->type == AUR_SERVER_CLIENT_CHUNKED &&
+      client->encoding == AUR_SERVER_CLIENT_CBOR) {
+    guint8 prefix[4];
+
+    /* Binary messages can contain NULs, so they're length-prefixed
+     * instead */
+    GST_WRITE_UINT32_BE (prefix, len);
     soup_message_body_append (client->event_pipe->response_body,
-        SOUP_MEMORY_COPY, "\0", 1);
+        SOUP_MEMORY_COPY, prefix, 4);
+    buffer = soup_buffer_new_with_owner (g_bytes_get_data (body, NULL),
+        len, g_bytes_ref (body), (GDestroyNotify) g_bytes_unref);
+    soup_message_body_append_buffer (client->event_pipe->response_body,
+        buffer);
+    soup_buffer_free (buffer);
+    soup_server_unpause_message (client->soup, client->event_pipe);
+    return;
+  }
+  if (client->type == AUR_SERVER_CLIENT_CHUNKED) {
+    /* The trailing NUL is the message separator, so the message goes out
+     * as one chunk, enabling the client HTTP stack to abstract chunks */
+    buffer = soup_buffer_new_with_owner (g_bytes_get_data (body, NULL),
+        g_bytes_get_size (body), g_bytes_ref (body),
+        (GDestroyNotify) g_bytes_unref);
+    soup_message_body_append_buffer (client->event_pipe->response_body,
+        buffer);
+    soup_buffer_free (buffer);
     soup_server_unpause_message (client->soup, client->event_pipe);
     return;
   }
   if (client->type == AUR_SERVER_CLIENT_SINGLE) {
-    soup_message_set_response (client->event_pipe,
-        "application/json", SOUP_MEMORY_COPY, body, len);
+    buffer = soup_buffer_new_with_owner (g_bytes_get_data (body, NULL),
+        len, g_bytes_ref (body), (GDestroyNotify) g_bytes_unref);
+    if (client->encoding == AUR_SERVER_CLIENT_JSON)
+      soup_message_headers_set_content_type (
+          client->event_pipe->response_headers, "application/json", NULL);
+    soup_message_body_append_buffer (client->event_pipe->response_body,
+        buffer);
+    soup_buffer_free (buffer);
     aur_server_connection_lost (client);
     return;
   }
 
   /* else, websocket connection */
-  if (client->io) {
-    write_fragment (client, body, len);
-    return;
-  }
+  g_object_ref (client);
+  aur_server_client_queue_message (client, body, coalesce_key, droppable);
+  g_object_unref (client);
+}
+
+AurServerClientEncoding
+aur_server_client_get_encoding (AurServerClient * client)
+{
+  return client->encoding;
+}
 
-  /* Websocket isn't ready to send yet. Store as a pending message */
-  msg = g_new (PendingMsg, 1);
-  msg->len = len;
-  msg->body = g_memdup (body, len);
+GstStructure *
+aur_server_client_get_stats (AurServerClient * client)
+{
+  const gchar *type = "chunked";
+
+  if (client->type == AUR_SERVER_CLIENT_WEBSOCKET)
+    type = "websocket";
+  else if (client->type == AUR_SERVER_CLIENT_SINGLE)
+    type = "single";
+
+  return gst_structure_new ("client",
+      "conn-id", G_TYPE_INT, (gint) client->conn_id,
+      "host", G_TYPE_STRING, client->host,
+      "type", G_TYPE_STRING, type,
+      "encoding", G_TYPE_STRING,
+      client->encoding == AUR_SERVER_CLIENT_CBOR ? "cbor" : "json",
+      "queue-length", G_TYPE_INT, (gint) client->out_queue.length,
+      "queue-bytes", G_TYPE_INT64, (gint64) client->out_queue_bytes,
+      "max-queue-length", G_TYPE_INT, (gint) client->max_queue_length,
+      "max-queue-bytes", G_TYPE_INT64, (gint64) client->max_queue_bytes,
+      "stalls", G_TYPE_INT, (gint) client->n_stalls,
+      "coalesced", G_TYPE_INT, (gint) client->n_coalesced,
+      "dropped", G_TYPE_INT, (gint) client->n_dropped,
+      "deflate", G_TYPE_BOOLEAN, client->deflater != NULL,
+      "deflated", G_TYPE_INT, (gint) client->n_deflated,
+      "deflate-bytes-in", G_TYPE_INT64, (gint64) client->deflate_bytes_in,
+      "deflate-bytes-out", G_TYPE_INT64, (gint64) client->deflate_bytes_out,
+      "heartbeat-interval", G_TYPE_INT, (gint) client->heartbeat_interval,
+      "pings", G_TYPE_INT, (gint) client->n_pings,
+      "pongs", G_TYPE_INT, (gint) client->n_pongs,
+      "rtt", G_TYPE_INT64, client->rtt,
+      "srtt", G_TYPE_INT64, client->srtt, NULL);
+}
+
+/* Smoothed round trip time to a websocket client in microseconds,
+ * measured from pings. 0 until the first pong */
+gint64
+aur_server_client_get_rtt (AurServerClient * client)
+{
+  return client->srtt;
+}
 
-  client->pending_msgs = g_list_append (client->pending_msgs, msg);
+/* Number of clients disconnected for falling too far behind */
+guint
+aur_server_client_get_overflow_count (void)
+{
+  return n_overflows;
 }
 
 const gchar *
@@ -33,6 +33,7 @@ G_BEGIN_DECLS
 
 typedef struct _AurServerClientClass AurServerClientClass;
 typedef enum _AurServerClientType AurServerClientType;
+typedef enum _AurServerClientEncoding AurServerClientEncoding;
 
 enum _AurServerClientType {
   AUR_SERVER_CLIENT_CHUNKED,
@@ -40,11 +41,18 @@ enum _AurServerClientType {
   AUR_SERVER_CLIENT_SINGLE
 };
 
+enum _AurServerClientEncoding {
+  AUR_SERVER_CLIENT_JSON,
+  AUR_SERVER_CLIENT_CBOR,
+  AUR_SERVER_CLIENT_N_ENCODINGS
+};
+
 struct _AurServerClient
 {
   AurWebSocketParser parent;
 
   AurServerClientType type;
+  AurServerClientEncoding encoding;
   gboolean fired_conn_lost;
   gboolean need_body_complete;
 
@@ -61,10 +69,36 @@ struct _AurServerClient
   GIOChannel *io;
   guint io_watch;
 
-  gchar *out_buf;
-  gsize out_bufsize;
-
-  GList *pending_msgs;
+  /* Websocket frames waiting to go out, drained by out_watch whenever
+   * the socket won't take any more */
+  GQueue out_queue;
+  gsize out_queue_bytes;
+  guint out_watch;
+
+  /* Send queue statistics */
+  guint max_queue_length;
+  gsize max_queue_bytes;
+  guint n_stalls;
+  guint n_coalesced;
+  guint n_dropped;
+
+  /* permessage-deflate, if the client offered it */
+  GConverter *deflater;
+  gboolean deflate_no_context_takeover;
+  guint n_deflated;
+  guint64 deflate_bytes_in;
+  guint64 deflate_bytes_out;
+
+  /* Heartbeats - pings to websocket clients, keepalive chunks to chunked
+   * ones. Times in microseconds */
+  guint heartbeat_source;
+  guint heartbeat_interval;
+  gint64 last_send_time;
+  gint64 ping_sent_time;
+  gint64 rtt;
+  gint64 srtt;
+  guint n_pings;
+  guint n_pongs;
 
   gulong net_event_sig;
   gulong disco_sig;
@@ -85,8 +119,17 @@ AurServerClient *aur_server_client_new_single (SoupServer * soup,
 
 void aur_server_client_send_message (AurServerClient *client,
   gchar *body, gsize len);
+void aur_server_client_send_bytes (AurServerClient *client,
+  GBytes *body, const gchar *coalesce_key, gboolean droppable);
+
+AurServerClientEncoding aur_server_client_get_encoding (AurServerClient *client);
+gboolean aur_server_client_http_accepts_cbor (SoupMessage *msg);
+
+GstStructure *aur_server_client_get_stats (AurServerClient *client);
+guint aur_server_client_get_overflow_count (void);
 
 const gchar *aur_server_client_get_host (AurServerClient *client);
+gint64 aur_server_client_get_rtt (AurServerClient *client);
 
 G_END_DECLS
 
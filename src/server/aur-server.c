@@ -28,11 +28,14 @@
 #include <libsoup/soup-socket.h>
 #include <libsoup/soup-address.h>
 
+#include "aur-asset-cache.h"
 #include "aur-config.h"
 #include "aur-server.h"
 #include "aur-server-client.h"
 #include "aur-resource.h"
 #include "aur-http-resource.h"
+#include "aur-prefetch.h"
+#include "aur-resource-cache.h"
 
 G_DEFINE_TYPE (AurServer, aur_server, G_TYPE_OBJECT);
 
@@ -84,28 +87,67 @@ server_fallback_cb (G_GNUC_UNUSED SoupServer * soup, SoupMessage * msg,
   }
 }
 
+/* Returns a new ref to the resource, creating and caching it if needed.
+ * Resources are keyed by URI so that custom files are cached too. Media
+ * DB resources are also indexed by id, so a cache hit doesn't need a
+ * database query. The custom file (G_MAXUINT) can change under the same
+ * id, so it is always looked up by URI */
 static AurHttpResource *
 aur_server_get_resource (AurServer * server, guint resource_id)
 {
-  AurHttpResource *resource = NULL;
+  AurHttpResource *resource;
+  GFile *file;
+  gchar *key;
+
+  if (resource_id != G_MAXUINT) {
+    resource = aur_resource_cache_lookup_id (server->resource_cache,
+        resource_id);
+    if (resource != NULL)
+      return resource;
+  }
 
-  resource =
-      g_hash_table_lookup (server->resources, GINT_TO_POINTER (resource_id));
+  file = server->get_resource (server, resource_id,
+      server->get_resource_userdata);
+  if (file == NULL)
+    return NULL;
+
+  key = g_file_get_uri (file);
+  resource = aur_resource_cache_lookup (server->resource_cache, key);
   if (resource == NULL) {
-    resource =
-        server->get_resource (server, resource_id,
-        server->get_resource_userdata);
-    if (resource_id != G_MAXUINT)
-      g_hash_table_insert (server->resources, GINT_TO_POINTER (resource_id),
-          resource);
+    g_print ("Creating resource %u for %s\n", resource_id, key);
+    resource = g_object_new (AUR_TYPE_HTTP_RESOURCE, "source-file", file,
+        NULL);
+    aur_resource_cache_insert (server->resource_cache, key,
+        g_object_ref (resource));
   }
+  if (resource_id != G_MAXUINT)
+    aur_resource_cache_set_id (server->resource_cache, key, resource_id);
+
+  g_free (key);
+  g_object_unref (file);
+
   return resource;
 }
 
+static gboolean
+aur_server_expire_resources (AurServer * server)
+{
+  gint idle;
+  guint n;
+
+  g_object_get (server->config, "resource-cache-idle", &idle, NULL);
+  n = aur_resource_cache_expire (server->resource_cache,
+      (gint64) idle * G_USEC_PER_SEC);
+  if (n > 0)
+    g_print ("Expired %u idle resources\n", n);
+
+  return TRUE;
+}
+
 static void
-server_resource_cb (G_GNUC_UNUSED SoupServer * soup, SoupMessage * msg,
+server_resource_cb (SoupServer * soup, SoupMessage * msg,
     const char *path, G_GNUC_UNUSED GHashTable * query,
-    G_GNUC_UNUSED SoupClientContext * client, AurServer * server)
+    SoupClientContext * client, AurServer * server)
 {
   guint resource_id = 0;
   AurHttpResource *resource;
@@ -118,73 +160,61 @@ server_resource_cb (G_GNUC_UNUSED SoupServer * soup, SoupMessage * msg,
     goto error;
 
   g_print ("Hit on resource %u\n", resource_id);
-  aur_http_resource_new_transfer (resource, msg);
+  aur_http_resource_new_transfer (resource, soup, msg, client,
+      server->config);
+  g_object_unref (resource);
 
   return;
 error:
   soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
 }
 
+/* Find the directory holding the web UI files */
 static gchar *
-get_data_filename (const gchar *basename)
+get_data_dir (void)
 {
   const gchar * const * dirs;
-  gchar *filepath = NULL;
+  gchar *dirpath, *filepath;
   gint i;
 
   dirs = g_get_system_data_dirs ();
 
   for (i = 0; dirs[i] != NULL; i++) {
-    GFile *file;
-
-    filepath = g_build_filename (dirs[i], "aurena", "htdocs", basename, NULL);
+    dirpath = g_build_filename (dirs[i], "aurena", "htdocs", NULL);
+    filepath = g_build_filename (dirpath, "index.html", NULL);
     g_print ("looking for %s\n", filepath);
-    file = g_file_new_for_path (filepath);
-    if (g_file_query_exists (file, NULL)) {
-      g_object_unref (file);
-      break;
+    if (g_file_test (filepath, G_FILE_TEST_EXISTS)) {
+      g_free (filepath);
+      return dirpath;
     }
-
-    g_object_unref (file);
     g_free (filepath);
-    filepath = NULL;
+    g_free (dirpath);
   }
 
-  if (!filepath) {
-    GFile *file;
-
-    filepath = g_build_filename (g_get_current_dir (), "data", "htdocs", basename, NULL);
-    g_print ("looking for %s\n", filepath);
-    file = g_file_new_for_path (filepath);
-    if (!g_file_query_exists (file, NULL)) {
-      g_free (filepath);
-      filepath = NULL;
-    }
-    g_object_unref (file);
+  dirpath = g_build_filename (g_get_current_dir (), "data", "htdocs", NULL);
+  filepath = g_build_filename (dirpath, "index.html", NULL);
+  g_print ("looking for %s\n", filepath);
+  if (!g_file_test (filepath, G_FILE_TEST_EXISTS)) {
+    g_free (dirpath);
+    dirpath = NULL;
   }
+  g_free (filepath);
 
-  return filepath;
+  return dirpath;
 }
 
 static void
 server_ui_cb (G_GNUC_UNUSED SoupServer * soup, SoupMessage * msg,
     const char *path, G_GNUC_UNUSED GHashTable * query,
-    G_GNUC_UNUSED SoupClientContext * client, G_GNUC_UNUSED AurServer * server)
+    G_GNUC_UNUSED SoupClientContext * client, AurServer * server)
 {
   const gchar *file_path;
-  gchar *filename = NULL;
-  gchar *contents;
-  gsize size;
-  const gchar *mime_type;
 
   if (!g_str_has_prefix (path, "/ui"))
     goto fail;
 
   file_path = path + 3;
 
-  if (strstr (file_path, "/.."))
-    goto fail;
-
   if (g_str_equal (file_path, "")) {
     aur_soup_message_set_redirect (msg, SOUP_STATUS_MOVED_PERMANENTLY, "/ui/");
     return;
@@ -193,31 +223,20 @@ server_ui_cb (G_GNUC_UNUSED SoupServer * soup, SoupMessage * msg,
   if (g_str_equal (file_path, "/"))
     file_path = "/index.html";
 
-  filename = get_data_filename (file_path);
-
-  if (!g_file_get_contents (filename, &contents, &size, NULL))
+  /* Only files loaded at startup can be served, so there's no need to
+   * worry about paths escaping the htdocs dir */
+  if (!aur_asset_cache_serve (server->assets, msg, file_path))
     goto fail;
 
-  mime_type = aur_resource_get_mime_type (filename);
-  g_print ("Returning %s - %s\n", mime_type, filename);
-
-  soup_message_set_response (msg, mime_type, SOUP_MEMORY_TAKE, contents, size);
-  soup_message_set_status (msg, SOUP_STATUS_OK);
-
-  g_free (filename);
   return;
 
 fail:
-  g_free (filename);
   soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
 }
 
 static void
-aur_server_init (AurServer * server)
+aur_server_init (G_GNUC_UNUSED AurServer * server)
 {
-  server->resources =
-      g_hash_table_new_full (g_direct_hash,
-      g_direct_equal, NULL, g_object_unref);
 }
 
 static void
@@ -225,12 +244,30 @@ aur_server_constructed (GObject * object)
 {
   AurServer *server = (AurServer *) (object);
   //SoupSocket *socket;
-  gint port;
+  gint port, cache_entries, cache_size, cache_idle, prefetch_size;
+  gchar *data_dir;
 
   if (G_OBJECT_CLASS (aur_server_parent_class)->constructed != NULL)
     G_OBJECT_CLASS (aur_server_parent_class)->constructed (object);
 
-  g_object_get (server->config, "aur-port", &port, NULL);
+  g_object_get (server->config, "aur-port", &port,
+      "resource-cache-entries", &cache_entries,
+      "resource-cache-size", &cache_size,
+      "resource-cache-idle", &cache_idle,
+      "prefetch-size", &prefetch_size, NULL);
+
+  server->resource_cache = aur_resource_cache_new (cache_entries,
+      (guint64) cache_size * 1024 * 1024);
+  /* Check for idle resources a few times per idle period */
+  server->resource_cache_timeout =
+      g_timeout_add_seconds (MAX (cache_idle / 4, 1),
+      (GSourceFunc) aur_server_expire_resources, server);
+
+  server->prefetch = aur_prefetch_new ((guint64) prefetch_size * 1024 * 1024);
+
+  data_dir = get_data_dir ();
+  server->assets = aur_asset_cache_new (data_dir);
+  g_free (data_dir);
 
   server->soup = soup_server_new (NULL, NULL);
 
@@ -284,7 +321,9 @@ aur_server_finalize (GObject * object)
 {
   AurServer *server = (AurServer *) (object);
   g_object_unref (server->soup);
-  g_hash_table_remove_all (server->resources);
+  aur_resource_cache_free (server->resource_cache);
+  aur_prefetch_free (server->prefetch);
+  aur_asset_cache_free (server->assets);
 
   if (server->config)
     g_object_unref (server->config);
@@ -299,6 +338,11 @@ aur_server_dispose (GObject * object)
 
   soup_server_disconnect (server->soup);
 
+  if (server->resource_cache_timeout) {
+    g_source_remove (server->resource_cache_timeout);
+    server->resource_cache_timeout = 0;
+  }
+
   G_OBJECT_CLASS (aur_server_parent_class)->dispose (object);
 }
 
@@ -354,13 +398,62 @@ aur_server_stop (AurServer * server)
  
 void
 aur_server_set_resource_cb (AurServer * server,
-    AurHttpResource * (*callback) (AurServer * server, guint resource_id,
+    GFile * (*callback) (AurServer * server, guint resource_id,
         void *cb_data), void *userdata)
 {
   server->get_resource = callback;
   server->get_resource_userdata = userdata;
 }
 
+/* Start reading the resource into the page cache in the background */
+void
+aur_server_prefetch_resource (AurServer * server, guint resource_id)
+{
+  GFile *file;
+
+  file = server->get_resource (server, resource_id,
+      server->get_resource_userdata);
+  if (file == NULL)
+    return;
+
+  aur_prefetch_file (server->prefetch, file);
+  g_object_unref (file);
+}
+
+/* Called when switching to a resource, to record whether it was
+ * already cached */
+gboolean
+aur_server_check_resource_cached (AurServer * server, guint resource_id)
+{
+  gboolean ret;
+  GFile *file;
+
+  file = server->get_resource (server, resource_id,
+      server->get_resource_userdata);
+  if (file == NULL)
+    return FALSE;
+
+  ret = aur_prefetch_check_cached (server->prefetch, file);
+  g_object_unref (file);
+
+  return ret;
+}
+
+/* Add the server's statistics to the passed structure */
+void
+aur_server_get_stats (AurServer * server, GstStructure * stats)
+{
+  GstStructure *s;
+
+  s = aur_resource_cache_get_stats (server->resource_cache);
+  gst_structure_set (stats, "resource-cache", GST_TYPE_STRUCTURE, s, NULL);
+  gst_structure_free (s);
+
+  s = aur_prefetch_get_stats (server->prefetch);
+  gst_structure_set (stats, "prefetch", GST_TYPE_STRUCTURE, s, NULL);
+  gst_structure_free (s);
+}
+
 void
 aur_server_add_handler (AurServer * server, const gchar * path,
     SoupServerCallback callback, gpointer user_data,
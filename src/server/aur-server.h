@@ -37,9 +37,13 @@ struct _AurServer
   GObject parent;
   SoupServer *soup;
 
-  GHashTable *resources;
+  AurResourceCache *resource_cache;
+  guint resource_cache_timeout;
 
-  AurHttpResource *(*get_resource)(AurServer *server, guint resource_id, void *cb_data);
+  AurPrefetch *prefetch;
+  AurAssetCache *assets;
+
+  GFile *(*get_resource)(AurServer *server, guint resource_id, void *cb_data);
   void *get_resource_userdata;
 
   AurConfig *config;
@@ -56,7 +60,10 @@ void aur_server_set_resource_callback (AurServer *server, void *userdata);
 void aur_server_start (AurServer *server);
 void aur_server_stop (AurServer *server);
 void aur_server_set_resource_cb (AurServer *server, 
-  AurHttpResource *(*get_resource)(AurServer *server, guint resource_id, void *cb_data), void *userdata);
+  GFile *(*get_resource)(AurServer *server, guint resource_id, void *cb_data), void *userdata);
+void aur_server_prefetch_resource (AurServer *server, guint resource_id);
+gboolean aur_server_check_resource_cached (AurServer *server, guint resource_id);
+void aur_server_get_stats (AurServer *server, GstStructure *stats);
 
 void aur_server_add_handler (AurServer *server, const gchar *path, SoupServerCallback callback, gpointer user_data, GDestroyNotify destroy_notify);
 
@@ -0,0 +1,278 @@
+#ifdef CONFIG_H
+#include "config.h"
+#endif
+
+/* Measures the cost of delivering one broadcast message to many clients,
+ * comparing the old per-client copies against the shared GBytes the
+ * server now uses.
+ *
+ * Half the simulated clients are chunked HTTP clients, whose messages go
+ * into a SoupMessageBody that is then drained the way libsoup writes it.
+ * The other half are websocket clients with a send queue. For each
+ * strategy, allocations (glibc only) and CPU time per broadcast are
+ * reported.
+ *
+ * Usage: broadcast-bench [N_CLIENTS [N_BROADCASTS]]
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+#include <json-glib/json-glib.h>
+#include <libsoup/soup.h>
+
+#ifdef __GLIBC__
+/* Count heap allocations by wrapping the libc allocator */
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static volatile gint counting = 0;
+static guint64 n_allocs = 0;
+
+void *
+malloc (size_t size)
+{
+  if (counting)
+    n_allocs++;
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+  if (counting)
+    n_allocs++;
+  return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+  if (counting)
+    n_allocs++;
+  return __libc_realloc (ptr, size);
+}
+#define START_COUNTING() G_STMT_START { n_allocs = 0; counting = 1; } G_STMT_END
+#define STOP_COUNTING() G_STMT_START { counting = 0; } G_STMT_END
+#else
+static guint64 n_allocs = 0;
+#define START_COUNTING()
+#define STOP_COUNTING()
+#endif
+
+typedef struct
+{
+  gchar *body;
+  gsize len;
+} CopiedMsg;
+
+typedef struct
+{
+  gchar header[10];
+  gsize header_len;
+  GBytes *payload;
+} SharedMsg;
+
+typedef struct
+{
+  SoupMessageBody **chunked;
+  goffset *chunked_offsets;
+  GList **ws_lists;
+  GQueue *ws_queues;
+  guint n_chunked;
+  guint n_ws;
+} Clients;
+
+static gdouble
+get_cpu_time (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static gchar *
+make_message (guint i, gsize * len)
+{
+  JsonBuilder *builder = json_builder_new ();
+  JsonGenerator *gen;
+  gchar *ret;
+
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "msg-type");
+  json_builder_add_string_value (builder, "volume");
+  json_builder_set_member_name (builder, "level");
+  json_builder_add_double_value (builder, (i % 100) / 100.0);
+  json_builder_end_object (builder);
+
+  gen = json_generator_new ();
+  json_generator_set_root (gen, json_builder_get_root (builder));
+  ret = json_generator_to_data (gen, len);
+
+  g_object_unref (gen);
+  g_object_unref (builder);
+
+  return ret;
+}
+
+/* Pull everything out of a body the way libsoup's writer does */
+static void
+drain_body (SoupMessageBody * body, goffset * offset)
+{
+  SoupBuffer *chunk;
+
+  while ((chunk = soup_message_body_get_chunk (body, *offset)) != NULL) {
+    *offset += chunk->length;
+    soup_message_body_wrote_chunk (body, chunk);
+    soup_buffer_free (chunk);
+  }
+}
+
+static void
+broadcast_copied (Clients * clients, guint i)
+{
+  gchar *body;
+  gsize len;
+  guint c;
+
+  body = make_message (i, &len);
+
+  for (c = 0; c < clients->n_chunked; c++) {
+    soup_message_body_append (clients->chunked[c], SOUP_MEMORY_COPY, body,
+        len);
+    soup_message_body_append (clients->chunked[c], SOUP_MEMORY_COPY, "\0",
+        1);
+  }
+  for (c = 0; c < clients->n_ws; c++) {
+    CopiedMsg *msg = g_new (CopiedMsg, 1);
+    msg->len = len;
+    msg->body = g_memdup (body, len);
+    clients->ws_lists[c] = g_list_append (clients->ws_lists[c], msg);
+  }
+  g_free (body);
+
+  /* Deliver */
+  for (c = 0; c < clients->n_chunked; c++)
+    drain_body (clients->chunked[c], clients->chunked_offsets + c);
+  for (c = 0; c < clients->n_ws; c++) {
+    GList *cur;
+    for (cur = clients->ws_lists[c]; cur != NULL; cur = cur->next) {
+      CopiedMsg *msg = cur->data;
+      g_free (msg->body);
+      g_free (msg);
+    }
+    g_list_free (clients->ws_lists[c]);
+    clients->ws_lists[c] = NULL;
+  }
+}
+
+static void
+broadcast_shared (Clients * clients, guint i)
+{
+  GBytes *bytes;
+  gchar *body;
+  gsize len;
+  guint c;
+
+  body = make_message (i, &len);
+  bytes = g_bytes_new_take (body, len + 1);
+
+  for (c = 0; c < clients->n_chunked; c++) {
+    SoupBuffer *buffer = soup_buffer_new_with_owner (body, len + 1,
+        g_bytes_ref (bytes), (GDestroyNotify) g_bytes_unref);
+    soup_message_body_append_buffer (clients->chunked[c], buffer);
+    soup_buffer_free (buffer);
+  }
+  for (c = 0; c < clients->n_ws; c++) {
+    SharedMsg *msg = g_new (SharedMsg, 1);
+    msg->header[0] = 0x81;
+    msg->header[1] = len;
+    msg->header_len = 2;
+    msg->payload = g_bytes_ref (bytes);
+    g_queue_push_tail (&clients->ws_queues[c], msg);
+  }
+  g_bytes_unref (bytes);
+
+  /* Deliver */
+  for (c = 0; c < clients->n_chunked; c++)
+    drain_body (clients->chunked[c], clients->chunked_offsets + c);
+  for (c = 0; c < clients->n_ws; c++) {
+    SharedMsg *msg;
+    while ((msg = g_queue_pop_head (&clients->ws_queues[c])) != NULL) {
+      g_bytes_unref (msg->payload);
+      g_free (msg);
+    }
+  }
+}
+
+static void
+run (const gchar * name, Clients * clients, guint n_broadcasts,
+    void (*broadcast) (Clients *, guint))
+{
+  guint64 total_allocs = 0;
+  gdouble start, cpu;
+  guint i;
+
+  /* Warm up */
+  broadcast (clients, 0);
+
+  start = get_cpu_time ();
+  for (i = 0; i < n_broadcasts; i++) {
+    START_COUNTING ();
+    broadcast (clients, i);
+    STOP_COUNTING ();
+    total_allocs += n_allocs;
+  }
+  cpu = get_cpu_time () - start;
+
+  g_print ("%-8s %10.1f allocs/broadcast %10.1f us/broadcast\n", name,
+      (gdouble) total_allocs / n_broadcasts, cpu * 1e6 / n_broadcasts);
+}
+
+int
+main (int argc, char **argv)
+{
+  Clients clients = { 0, };
+  guint n_clients = 1000, n_broadcasts = 1000, c;
+
+  /* Make slice allocations visible to the counter */
+  g_setenv ("G_SLICE", "always-malloc", TRUE);
+
+  if (argc > 1)
+    n_clients = MAX (atoi (argv[1]), 2);
+  if (argc > 2)
+    n_broadcasts = MAX (atoi (argv[2]), 1);
+
+  clients.n_chunked = n_clients / 2;
+  clients.n_ws = n_clients - clients.n_chunked;
+
+  clients.chunked = g_new0 (SoupMessageBody *, clients.n_chunked);
+  clients.chunked_offsets = g_new0 (goffset, clients.n_chunked);
+  for (c = 0; c < clients.n_chunked; c++) {
+    clients.chunked[c] = soup_message_body_new ();
+    soup_message_body_set_accumulate (clients.chunked[c], FALSE);
+  }
+  clients.ws_lists = g_new0 (GList *, clients.n_ws);
+  clients.ws_queues = g_new0 (GQueue, clients.n_ws);
+
+  g_print ("%u clients (%u chunked, %u websocket), %u broadcasts\n",
+      n_clients, clients.n_chunked, clients.n_ws, n_broadcasts);
+#ifndef __GLIBC__
+  g_print ("Allocation counting not supported on this platform\n");
+#endif
+
+  run ("copied", &clients, n_broadcasts, broadcast_copied);
+  run ("shared", &clients, n_broadcasts, broadcast_shared);
+
+  for (c = 0; c < clients.n_chunked; c++)
+    soup_message_body_free (clients.chunked[c]);
+  g_free (clients.chunked);
+  g_free (clients.chunked_offsets);
+  g_free (clients.ws_lists);
+  g_free (clients.ws_queues);
+
+  return 0;
+}
@@ -0,0 +1,700 @@
+#ifdef CONFIG_H
+#include "config.h"
+#endif
+
+/* Encode/decode cost of event channel messages, JSON against CBOR.
+ *
+ * Builds each type of message the server sends and times encoding it and
+ * decoding it again in both formats - decoding includes pulling out the
+ * fields a client reads, as that's where the GValue transforms happen.
+ * Reports the encoded size and the time per message for each.
+ *
+ * Then compares the two ways the server can produce a message: building
+ * a GstStructure and serialising it, against writing it directly with
+ * AurMsgWriter, reporting allocations (glibc only) and time per message.
+ *
+ * Finally compares the two ways the client can decode a message for
+ * dispatch: converting it to a GstStructure and reading that, against
+ * reading the parsed message directly with AurMsgReader.
+ *
+ * Usage: message-bench [ITERATIONS [N_PLAYERS]]
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <gst/gst.h>
+#include <json-glib/json-glib.h>
+
+#include "src/common/aur-cbor.h"
+#include "src/common/aur-json.h"
+#include "src/common/aur-msg-reader.h"
+#include "src/common/aur-msg-writer.h"
+
+#ifdef __GLIBC__
+/* Count heap allocations by wrapping the libc allocator */
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static volatile gint counting = 0;
+static guint64 n_allocs = 0;
+
+void *
+malloc (size_t size)
+{
+  if (counting)
+    n_allocs++;
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+  if (counting)
+    n_allocs++;
+  return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+  if (counting)
+    n_allocs++;
+  return __libc_realloc (ptr, size);
+}
+#define START_COUNTING() G_STMT_START { n_allocs = 0; counting = 1; } G_STMT_END
+#define STOP_COUNTING() G_STMT_START { counting = 0; } G_STMT_END
+#else
+static guint64 n_allocs = 0;
+#define START_COUNTING()
+#define STOP_COUNTING()
+#endif
+
+typedef struct
+{
+  const gchar *name;
+  GstStructure *(*build) (guint n_players);
+  void (*write) (AurMsgWriter * w, guint formats, guint n_players);
+  GstStructure *msg;
+} BenchMessage;
+
+static GstStructure *
+build_enrol (G_GNUC_UNUSED guint n_players)
+{
+  return gst_structure_new ("json",
+      "msg-type", G_TYPE_STRING, "enrol",
+      "resource-id", G_TYPE_INT64, (gint64) 12,
+      "clock-port", G_TYPE_INT, 5458,
+      "current-time", G_TYPE_INT64, (gint64) 1234567890123456,
+      "volume-level", G_TYPE_DOUBLE, 0.75,
+      "paused", G_TYPE_BOOLEAN, FALSE,
+      "enabled", G_TYPE_BOOLEAN, TRUE, NULL);
+}
+
+static void
+write_enrol (AurMsgWriter * w, guint formats, G_GNUC_UNUSED guint n_players)
+{
+  aur_msg_writer_begin (w, formats, "enrol");
+  aur_msg_writer_add_int64 (w, "resource-id", 12);
+  aur_msg_writer_add_int64 (w, "clock-port", 5458);
+  aur_msg_writer_add_int64 (w, "current-time", 1234567890123456);
+  aur_msg_writer_add_double (w, "volume-level", 0.75);
+  aur_msg_writer_add_boolean (w, "paused", FALSE);
+  aur_msg_writer_add_boolean (w, "enabled", TRUE);
+  aur_msg_writer_end (w);
+}
+
+static GstStructure *
+build_set_media (G_GNUC_UNUSED guint n_players)
+{
+  gchar *resource_path = g_strdup_printf ("/resource/%u", 12);
+  GstStructure *msg = gst_structure_new ("json",
+      "msg-type", G_TYPE_STRING, "set-media",
+      "resource-id", G_TYPE_INT64, (gint64) 12,
+      "resource-protocol", G_TYPE_STRING, "http",
+      "resource-port", G_TYPE_INT, 5457,
+      "resource-path", G_TYPE_STRING, resource_path,
+      "base-time", G_TYPE_INT64, (gint64) 1234567890123456,
+      "position", G_TYPE_INT64, (gint64) 0,
+      "paused", G_TYPE_BOOLEAN, FALSE,
+      "language", G_TYPE_STRING, "en", NULL);
+
+  g_free (resource_path);
+  return msg;
+}
+
+static void
+write_set_media (AurMsgWriter * w, guint formats,
+    G_GNUC_UNUSED guint n_players)
+{
+  gchar resource_path[32];
+
+  g_snprintf (resource_path, sizeof (resource_path), "/resource/%u", 12);
+
+  aur_msg_writer_begin (w, formats, "set-media");
+  aur_msg_writer_add_int64 (w, "resource-id", 12);
+  aur_msg_writer_add_string (w, "resource-protocol", "http");
+  aur_msg_writer_add_int64 (w, "resource-port", 5457);
+  aur_msg_writer_add_string (w, "resource-path", resource_path);
+  aur_msg_writer_add_int64 (w, "base-time", 1234567890123456);
+  aur_msg_writer_add_int64 (w, "position", 0);
+  aur_msg_writer_add_boolean (w, "paused", FALSE);
+  aur_msg_writer_add_string (w, "language", "en");
+  aur_msg_writer_end (w);
+}
+
+static GstStructure *
+build_player_clients (guint n_players)
+{
+  GstStructure *msg;
+  GValue p = G_VALUE_INIT;
+  guint i;
+
+  g_value_init (&p, GST_TYPE_ARRAY);
+
+  msg = gst_structure_new ("json",
+      "msg-type", G_TYPE_STRING, "player-clients", NULL);
+
+  for (i = 0; i < n_players; i++) {
+    GValue tmp = G_VALUE_INIT;
+    gchar *host = g_strdup_printf ("192.168.1.%u", 10 + i);
+    GstStructure *cur_struct = gst_structure_new ("client",
+        "client-id", G_TYPE_INT64, (gint64) i + 1,
+        "enabled", G_TYPE_BOOLEAN, i % 4 != 0,
+        "volume", G_TYPE_DOUBLE, (i % 10) / 10.0,
+        "host", G_TYPE_STRING, host,
+        NULL);
+
+    g_value_init (&tmp, GST_TYPE_STRUCTURE);
+    gst_value_set_structure (&tmp, cur_struct);
+    gst_value_array_append_value (&p, &tmp);
+    g_value_unset (&tmp);
+    gst_structure_free (cur_struct);
+    g_free (host);
+  }
+  gst_structure_take_value (msg, "player-clients", &p);
+
+  return msg;
+}
+
+static void
+write_player_clients (AurMsgWriter * w, guint formats, guint n_players)
+{
+  guint i;
+
+  aur_msg_writer_begin (w, formats, "player-clients");
+  aur_msg_writer_begin_array (w, "player-clients");
+  for (i = 0; i < n_players; i++) {
+    gchar host[16];
+
+    g_snprintf (host, sizeof (host), "192.168.1.%u", 10 + i);
+    aur_msg_writer_begin_object (w, NULL);
+    aur_msg_writer_add_int64 (w, "client-id", i + 1);
+    aur_msg_writer_add_boolean (w, "enabled", i % 4 != 0);
+    aur_msg_writer_add_double (w, "volume", (i % 10) / 10.0);
+    aur_msg_writer_add_string (w, "host", host);
+    aur_msg_writer_end_object (w);
+  }
+  aur_msg_writer_end (w);
+}
+
+static GstStructure *
+build_volume (G_GNUC_UNUSED guint n_players)
+{
+  return gst_structure_new ("json",
+      "msg-type", G_TYPE_STRING, "volume",
+      "level", G_TYPE_DOUBLE, 0.5, NULL);
+}
+
+static void
+write_volume (AurMsgWriter * w, guint formats, G_GNUC_UNUSED guint n_players)
+{
+  aur_msg_writer_begin (w, formats, "volume");
+  aur_msg_writer_add_double (w, "level", 0.5);
+  aur_msg_writer_end (w);
+}
+
+static GstStructure *
+build_play (G_GNUC_UNUSED guint n_players)
+{
+  return gst_structure_new ("json",
+      "msg-type", G_TYPE_STRING, "play",
+      "base-time", G_TYPE_INT64, (gint64) 1234567890123456, NULL);
+}
+
+static void
+write_play (AurMsgWriter * w, guint formats, G_GNUC_UNUSED guint n_players)
+{
+  aur_msg_writer_begin (w, formats, "play");
+  aur_msg_writer_add_int64 (w, "base-time", 1234567890123456);
+  aur_msg_writer_end (w);
+}
+
+static GstStructure *
+build_ping (G_GNUC_UNUSED guint n_players)
+{
+  return gst_structure_new ("json", "msg-type", G_TYPE_STRING, "ping", NULL);
+}
+
+static void
+write_ping (AurMsgWriter * w, guint formats, G_GNUC_UNUSED guint n_players)
+{
+  aur_msg_writer_begin (w, formats, "ping");
+  aur_msg_writer_end (w);
+}
+
+/* Read what the client's handlers read from each message type */
+static gboolean
+read_fields (const GstStructure * s)
+{
+  const gchar *msg_type = gst_structure_get_string (s, "msg-type");
+  gint64 i64;
+  gdouble d;
+  gboolean b;
+  gint i;
+
+  if (msg_type == NULL)
+    return FALSE;
+
+  if (g_str_equal (msg_type, "enrol")) {
+    return aur_json_structure_get_int (s, "clock-port", &i) &&
+        aur_json_structure_get_int64 (s, "current-time", &i64) &&
+        aur_json_structure_get_double (s, "volume-level", &d) &&
+        aur_json_structure_get_boolean (s, "enabled", &b) &&
+        aur_json_structure_get_boolean (s, "paused", &b);
+  }
+  if (g_str_equal (msg_type, "set-media")) {
+    return aur_json_structure_get_int (s, "resource-port", &i) &&
+        aur_json_structure_get_int64 (s, "base-time", &i64) &&
+        aur_json_structure_get_int64 (s, "position", &i64) &&
+        aur_json_structure_get_boolean (s, "paused", &b) &&
+        gst_structure_get_string (s, "resource-path") != NULL;
+  }
+  if (g_str_equal (msg_type, "player-clients")) {
+    const GValue *v1 = gst_structure_get_value (s, "player-clients");
+    guint n;
+
+    if (!GST_VALUE_HOLDS_ARRAY (v1))
+      return FALSE;
+    for (n = 0; n < gst_value_array_get_size (v1); n++) {
+      const GstStructure *s2 =
+          gst_value_get_structure (gst_value_array_get_value (v1, n));
+      if (!aur_json_structure_get_int64 (s2, "client-id", &i64) ||
+          !aur_json_structure_get_boolean (s2, "enabled", &b) ||
+          !aur_json_structure_get_double (s2, "volume", &d) ||
+          gst_structure_get_string (s2, "host") == NULL)
+        return FALSE;
+    }
+    return TRUE;
+  }
+  if (g_str_equal (msg_type, "volume"))
+    return aur_json_structure_get_double (s, "level", &d);
+  if (g_str_equal (msg_type, "play"))
+    return aur_json_structure_get_int64 (s, "base-time", &i64);
+
+  return TRUE;
+}
+
+static GQuark enrol_quark, set_media_quark, player_clients_quark;
+static GQuark volume_quark, play_quark, ping_quark;
+
+/* The same as read_fields(), read the way the client's handlers do now */
+static gboolean
+read_fields_typed (const AurMsgObject * msg)
+{
+  GQuark msg_type = aur_msg_object_get_type (msg);
+  gint64 i64;
+  gdouble d;
+  gboolean b;
+  gint i;
+
+  if (msg_type == enrol_quark) {
+    return aur_msg_object_get_int (msg, "clock-port", &i) &&
+        aur_msg_object_get_int64 (msg, "current-time", &i64) &&
+        aur_msg_object_get_double (msg, "volume-level", &d) &&
+        aur_msg_object_get_boolean (msg, "enabled", &b) &&
+        aur_msg_object_get_boolean (msg, "paused", &b);
+  }
+  if (msg_type == set_media_quark) {
+    gchar *path = aur_msg_object_dup_string (msg, "resource-path");
+    gboolean ret = path != NULL &&
+        aur_msg_object_get_int (msg, "resource-port", &i) &&
+        aur_msg_object_get_int64 (msg, "base-time", &i64) &&
+        aur_msg_object_get_int64 (msg, "position", &i64) &&
+        aur_msg_object_get_boolean (msg, "paused", &b);
+
+    g_free (path);
+    return ret;
+  }
+  if (msg_type == player_clients_quark) {
+    AurMsgIter iter;
+    AurMsgObject entry;
+
+    if (!aur_msg_object_get_array (msg, "player-clients", &iter))
+      return FALSE;
+    while (aur_msg_iter_next_object (&iter, &entry)) {
+      gchar *host = aur_msg_object_dup_string (&entry, "host");
+
+      g_free (host);
+      if (host == NULL ||
+          !aur_msg_object_get_int64 (&entry, "client-id", &i64) ||
+          !aur_msg_object_get_boolean (&entry, "enabled", &b) ||
+          !aur_msg_object_get_double (&entry, "volume", &d))
+        return FALSE;
+    }
+    return TRUE;
+  }
+  if (msg_type == volume_quark)
+    return aur_msg_object_get_double (msg, "level", &d);
+  if (msg_type == play_quark)
+    return aur_msg_object_get_int64 (msg, "base-time", &i64);
+
+  return msg_type == ping_quark;
+}
+
+static GBytes *
+encode_json (const GstStructure * msg)
+{
+  JsonGenerator *gen = json_generator_new ();
+  JsonNode *root = aur_json_from_gst_structure (msg);
+  gchar *body;
+  gsize len;
+
+  json_generator_set_root (gen, root);
+  body = json_generator_to_data (gen, &len);
+  g_object_unref (gen);
+  json_node_free (root);
+
+  return g_bytes_new_take (body, len + 1);
+}
+
+static GstStructure *
+decode_json (JsonParser * parser, GBytes * bytes)
+{
+  gsize len;
+  const gchar *data = g_bytes_get_data (bytes, &len);
+
+  if (!json_parser_load_from_data (parser, data, len - 1, NULL))
+    return NULL;
+
+  return aur_json_to_gst_structure (json_parser_get_root (parser));
+}
+
+static gdouble
+usecs_per_iteration (gint64 start, guint iterations)
+{
+  return (gdouble) (g_get_monotonic_time () - start) / iterations;
+}
+
+static gboolean
+bench_message (BenchMessage * m, guint iterations)
+{
+  JsonParser *parser = json_parser_new ();
+  GBytes *json, *cbor;
+  GstStructure *s;
+  gdouble json_enc, json_dec, cbor_enc, cbor_dec;
+  gint64 start;
+  guint i;
+
+  /* Check both round trips first */
+  json = encode_json (m->msg);
+  cbor = aur_cbor_from_gst_structure (m->msg);
+  s = decode_json (parser, json);
+  if (s == NULL || !read_fields (s)) {
+    g_printerr ("%s: JSON round trip failed\n", m->name);
+    return FALSE;
+  }
+  gst_structure_free (s);
+  s = aur_cbor_to_gst_structure (g_bytes_get_data (cbor, NULL),
+      g_bytes_get_size (cbor));
+  if (s == NULL || !read_fields (s)) {
+    g_printerr ("%s: CBOR round trip failed\n", m->name);
+    return FALSE;
+  }
+  gst_structure_free (s);
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++)
+    g_bytes_unref (encode_json (m->msg));
+  json_enc = usecs_per_iteration (start, iterations);
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++) {
+    s = decode_json (parser, json);
+    read_fields (s);
+    gst_structure_free (s);
+  }
+  json_dec = usecs_per_iteration (start, iterations);
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++)
+    g_bytes_unref (aur_cbor_from_gst_structure (m->msg));
+  cbor_enc = usecs_per_iteration (start, iterations);
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++) {
+    s = aur_cbor_to_gst_structure (g_bytes_get_data (cbor, NULL),
+        g_bytes_get_size (cbor));
+    read_fields (s);
+    gst_structure_free (s);
+  }
+  cbor_dec = usecs_per_iteration (start, iterations);
+
+  g_print ("%-16s %6" G_GSIZE_FORMAT " %6" G_GSIZE_FORMAT
+      " %8.2f %8.2f %8.2f %8.2f\n", m->name, g_bytes_get_size (json) - 1,
+      g_bytes_get_size (cbor), json_enc, cbor_enc, json_dec, cbor_dec);
+
+  g_bytes_unref (json);
+  g_bytes_unref (cbor);
+  g_object_unref (parser);
+
+  return TRUE;
+}
+
+/* Produce a message the way the manager used to - build a structure,
+ * convert it to a JsonNode tree and generate - against writing it
+ * directly */
+static void
+bench_production (BenchMessage * m, AurMsgWriter * writer, guint iterations,
+    guint n_players)
+{
+  guint64 struct_allocs, writer_allocs, cbor_allocs;
+  gdouble struct_time, writer_time, cbor_time;
+  gint64 start;
+  guint i;
+
+  START_COUNTING ();
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++) {
+    GstStructure *s = m->build (n_players);
+    g_bytes_unref (encode_json (s));
+    gst_structure_free (s);
+  }
+  struct_time = usecs_per_iteration (start, iterations);
+  STOP_COUNTING ();
+  struct_allocs = n_allocs;
+
+  START_COUNTING ();
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++) {
+    m->write (writer, AUR_MSG_WRITER_JSON, n_players);
+    g_bytes_unref (aur_msg_writer_get_bytes (writer, AUR_MSG_WRITER_JSON));
+  }
+  writer_time = usecs_per_iteration (start, iterations);
+  STOP_COUNTING ();
+  writer_allocs = n_allocs;
+
+  START_COUNTING ();
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++) {
+    m->write (writer, AUR_MSG_WRITER_JSON | AUR_MSG_WRITER_CBOR, n_players);
+    g_bytes_unref (aur_msg_writer_get_bytes (writer, AUR_MSG_WRITER_JSON));
+    g_bytes_unref (aur_msg_writer_get_bytes (writer, AUR_MSG_WRITER_CBOR));
+  }
+  cbor_time = usecs_per_iteration (start, iterations);
+  STOP_COUNTING ();
+  cbor_allocs = n_allocs;
+
+  g_print ("%-16s %8.1f %8.2f %8.1f %8.2f %8.1f %8.2f\n", m->name,
+      (gdouble) struct_allocs / iterations, struct_time,
+      (gdouble) writer_allocs / iterations, writer_time,
+      (gdouble) cbor_allocs / iterations, cbor_time);
+}
+
+/* The writer's output has to decode to the same fields as the
+ * structure's */
+static gboolean
+check_writer (BenchMessage * m, AurMsgWriter * writer, guint n_players)
+{
+  JsonParser *parser = json_parser_new ();
+  GBytes *json, *cbor;
+  GstStructure *s1, *s2;
+  gboolean ret;
+
+  m->write (writer, AUR_MSG_WRITER_JSON | AUR_MSG_WRITER_CBOR, n_players);
+  json = aur_msg_writer_get_bytes (writer, AUR_MSG_WRITER_JSON);
+  cbor = aur_msg_writer_get_bytes (writer, AUR_MSG_WRITER_CBOR);
+
+  s1 = decode_json (parser, json);
+  s2 = aur_cbor_to_gst_structure (g_bytes_get_data (cbor, NULL),
+      g_bytes_get_size (cbor));
+  ret = s1 != NULL && s2 != NULL && read_fields (s1) && read_fields (s2);
+  if (!ret)
+    g_printerr ("%s: writer output doesn't decode\n", m->name);
+
+  if (s1)
+    gst_structure_free (s1);
+  if (s2)
+    gst_structure_free (s2);
+  g_bytes_unref (json);
+  g_bytes_unref (cbor);
+  g_object_unref (parser);
+
+  return ret;
+}
+
+/* Decode and read each message both ways. Structures first, as the
+ * client used to, then the reader */
+static gboolean
+bench_dispatch (BenchMessage * m, AurMsgReader * reader, guint iterations)
+{
+  JsonParser *parser = json_parser_new ();
+  GBytes *json = encode_json (m->msg);
+  GBytes *cbor = aur_cbor_from_gst_structure (m->msg);
+  gsize json_len, cbor_len;
+  const gchar *json_data = g_bytes_get_data (json, &json_len);
+  const guint8 *cbor_data = g_bytes_get_data (cbor, &cbor_len);
+  guint64 allocs[4];
+  gdouble times[4];
+  AurMsgObject msg;
+  GstStructure *s;
+  gint64 start;
+  guint i;
+
+  if (!aur_msg_reader_load_json (reader, json_data, json_len - 1, &msg) ||
+      !read_fields_typed (&msg)) {
+    g_printerr ("%s: reader can't read JSON\n", m->name);
+    goto fail;
+  }
+  if (!aur_msg_reader_load_cbor (reader, cbor_data, cbor_len, &msg) ||
+      !read_fields_typed (&msg)) {
+    g_printerr ("%s: reader can't read CBOR\n", m->name);
+    goto fail;
+  }
+
+  START_COUNTING ();
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++) {
+    s = decode_json (parser, json);
+    read_fields (s);
+    gst_structure_free (s);
+  }
+  times[0] = usecs_per_iteration (start, iterations);
+  STOP_COUNTING ();
+  allocs[0] = n_allocs;
+
+  START_COUNTING ();
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++) {
+    aur_msg_reader_load_json (reader, json_data, json_len - 1, &msg);
+    read_fields_typed (&msg);
+  }
+  times[1] = usecs_per_iteration (start, iterations);
+  STOP_COUNTING ();
+  allocs[1] = n_allocs;
+
+  START_COUNTING ();
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++) {
+    s = aur_cbor_to_gst_structure (cbor_data, cbor_len);
+    read_fields (s);
+    gst_structure_free (s);
+  }
+  times[2] = usecs_per_iteration (start, iterations);
+  STOP_COUNTING ();
+  allocs[2] = n_allocs;
+
+  START_COUNTING ();
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++) {
+    aur_msg_reader_load_cbor (reader, cbor_data, cbor_len, &msg);
+    read_fields_typed (&msg);
+  }
+  times[3] = usecs_per_iteration (start, iterations);
+  STOP_COUNTING ();
+  allocs[3] = n_allocs;
+
+  g_print ("%-16s", m->name);
+  for (i = 0; i < 4; i++)
+    g_print (" %8.1f %8.2f", (gdouble) allocs[i] / iterations, times[i]);
+  g_print ("\n");
+
+  g_bytes_unref (json);
+  g_bytes_unref (cbor);
+  g_object_unref (parser);
+  return TRUE;
+
+fail:
+  g_bytes_unref (json);
+  g_bytes_unref (cbor);
+  g_object_unref (parser);
+  return FALSE;
+}
+
+int
+main (int argc, char **argv)
+{
+  BenchMessage messages[] = {
+    {"enrol", build_enrol, write_enrol, NULL},
+    {"set-media", build_set_media, write_set_media, NULL},
+    {"player-clients", build_player_clients, write_player_clients, NULL},
+    {"volume", build_volume, write_volume, NULL},
+    {"play", build_play, write_play, NULL},
+    {"ping", build_ping, write_ping, NULL},
+  };
+  guint iterations = 100000, n_players = 8, i;
+  AurMsgWriter *writer;
+  AurMsgReader *reader;
+  gboolean ok = TRUE;
+
+  /* Make slice allocations visible to the counter */
+  g_setenv ("G_SLICE", "always-malloc", TRUE);
+
+  gst_init (&argc, &argv);
+
+  enrol_quark = g_quark_from_static_string ("enrol");
+  set_media_quark = g_quark_from_static_string ("set-media");
+  player_clients_quark = g_quark_from_static_string ("player-clients");
+  volume_quark = g_quark_from_static_string ("volume");
+  play_quark = g_quark_from_static_string ("play");
+  ping_quark = g_quark_from_static_string ("ping");
+
+  if (argc > 1)
+    iterations = MAX (atoi (argv[1]), 1);
+  if (argc > 2)
+    n_players = MAX (atoi (argv[2]), 0);
+
+  g_print ("%u iterations, %u players\n", iterations, n_players);
+  g_print ("%-16s %6s %6s %8s %8s %8s %8s\n", "", "json", "cbor",
+      "json enc", "cbor enc", "json dec", "cbor dec");
+  g_print ("%-16s %6s %6s %8s %8s %8s %8s\n", "", "(bytes)", "(bytes)",
+      "(us)", "(us)", "(us)", "(us)");
+
+  for (i = 0; i < G_N_ELEMENTS (messages); i++) {
+    messages[i].msg = messages[i].build (n_players);
+    ok &= bench_message (&messages[i], iterations);
+  }
+
+  writer = aur_msg_writer_new ();
+
+  g_print ("\nProducing messages: structure + generator, writer (JSON), "
+      "writer (JSON + CBOR)\n");
+  g_print ("%-16s %8s %8s %8s %8s %8s %8s\n", "", "allocs", "(us)",
+      "allocs", "(us)", "allocs", "(us)");
+
+  for (i = 0; i < G_N_ELEMENTS (messages); i++) {
+    if (!check_writer (&messages[i], writer, n_players)) {
+      ok = FALSE;
+      continue;
+    }
+    bench_production (&messages[i], writer, iterations, n_players);
+  }
+
+  aur_msg_writer_free (writer);
+
+  reader = aur_msg_reader_new ();
+
+  g_print ("\nDecoding for dispatch: structure (JSON), reader (JSON), "
+      "structure (CBOR), reader (CBOR)\n");
+  g_print ("%-16s %8s %8s %8s %8s %8s %8s %8s %8s\n", "", "allocs", "(us)",
+      "allocs", "(us)", "allocs", "(us)", "allocs", "(us)");
+
+  for (i = 0; i < G_N_ELEMENTS (messages); i++) {
+    ok &= bench_dispatch (&messages[i], reader, iterations);
+    gst_structure_free (messages[i].msg);
+  }
+
+  aur_msg_reader_free (reader);
+
+  return ok ? 0 : 1;
+}
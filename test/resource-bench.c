@@ -0,0 +1,181 @@
+#ifdef CONFIG_H
+#include "config.h"
+#endif
+
+/* Load generator for the server's /resource/<id> handler.
+ *
+ * Keeps N concurrent downloads of a resource running for a fixed time and
+ * reports the throughput. If the server's PID is given, the CPU time the
+ * server used is sampled from /proc, giving bytes/s per core - run once
+ * for each transfer-mode in the server config (mmap, sendfile, stream) to
+ * compare.
+ *
+ * Usage: resource-bench URL [N_CLIENTS [SECONDS [SERVER_PID]]]
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <libsoup/soup.h>
+
+#ifdef G_OS_UNIX
+#include <unistd.h>
+#endif
+
+typedef struct
+{
+  SoupSession *soup;
+  gchar *url;
+  gint64 end_time;
+
+  guint64 total_bytes;
+  guint n_completed;
+  guint n_failed;
+  guint n_active;
+} BenchState;
+
+GMainLoop *loop;
+
+static void start_download (BenchState * state);
+
+static gboolean
+get_process_cpu_time (gint pid, gdouble * seconds)
+{
+  gchar *path, *contents, *ptr;
+  gchar **fields;
+  gboolean ret = FALSE;
+
+  path = g_strdup_printf ("/proc/%d/stat", pid);
+  if (!g_file_get_contents (path, &contents, NULL, NULL)) {
+    g_free (path);
+    return FALSE;
+  }
+  g_free (path);
+
+  /* Skip past the command name, which may contain spaces */
+  ptr = strrchr (contents, ')');
+  if (ptr != NULL) {
+    fields = g_strsplit (ptr + 2, " ", 0);
+    /* utime and stime are fields 14 and 15, counting from the PID */
+    if (g_strv_length (fields) > 12) {
+      gdouble ticks = g_ascii_strtod (fields[11], NULL) +
+          g_ascii_strtod (fields[12], NULL);
+      *seconds = ticks / sysconf (_SC_CLK_TCK);
+      ret = TRUE;
+    }
+    g_strfreev (fields);
+  }
+  g_free (contents);
+
+  return ret;
+}
+
+static void
+got_chunk (G_GNUC_UNUSED SoupMessage * msg, SoupBuffer * chunk,
+    BenchState * state)
+{
+  state->total_bytes += chunk->length;
+}
+
+static void
+download_done (G_GNUC_UNUSED SoupSession * soup, SoupMessage * msg,
+    BenchState * state)
+{
+  state->n_active--;
+
+  if (SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
+    state->n_completed++;
+  else if (msg->status_code != SOUP_STATUS_CANCELLED)
+    state->n_failed++;
+
+  if (g_get_monotonic_time () < state->end_time)
+    start_download (state);
+  else if (state->n_active == 0)
+    g_main_loop_quit (loop);
+}
+
+static void
+start_download (BenchState * state)
+{
+  SoupMessage *msg = soup_message_new ("GET", state->url);
+
+  /* Don't keep the body around, we only care about the byte count */
+  soup_message_body_set_accumulate (msg->response_body, FALSE);
+  g_signal_connect (msg, "got-chunk", G_CALLBACK (got_chunk), state);
+
+  state->n_active++;
+  soup_session_queue_message (state->soup, msg,
+      (SoupSessionCallback) download_done, state);
+}
+
+static gboolean
+stop_downloads (BenchState * state)
+{
+  soup_session_abort (state->soup);
+  return FALSE;
+}
+
+int
+main (int argc, char **argv)
+{
+  BenchState state = { 0, };
+  guint n_clients = 8, seconds = 10, i;
+  gint server_pid = 0;
+  gdouble cpu_start = 0, cpu_end = 0, elapsed;
+  gboolean have_cpu = FALSE;
+  gint64 start_time;
+
+  if (argc < 2) {
+    g_printerr ("Usage: %s URL [N_CLIENTS [SECONDS [SERVER_PID]]]\n",
+        argv[0]);
+    return 1;
+  }
+
+  state.url = argv[1];
+  if (argc > 2)
+    n_clients = MAX (atoi (argv[2]), 1);
+  if (argc > 3)
+    seconds = MAX (atoi (argv[3]), 1);
+  if (argc > 4)
+    server_pid = atoi (argv[4]);
+
+  state.soup = soup_session_async_new_with_options (
+      SOUP_SESSION_MAX_CONNS, n_clients,
+      SOUP_SESSION_MAX_CONNS_PER_HOST, n_clients, NULL);
+
+  if (server_pid > 0)
+    have_cpu = get_process_cpu_time (server_pid, &cpu_start);
+
+  loop = g_main_loop_new (NULL, FALSE);
+
+  start_time = g_get_monotonic_time ();
+  state.end_time = start_time + (gint64) seconds * G_USEC_PER_SEC;
+  for (i = 0; i < n_clients; i++)
+    start_download (&state);
+  g_timeout_add_seconds (seconds, (GSourceFunc) stop_downloads, &state);
+
+  g_main_loop_run (loop);
+
+  elapsed = (g_get_monotonic_time () - start_time) / (gdouble) G_USEC_PER_SEC;
+  if (have_cpu)
+    have_cpu = get_process_cpu_time (server_pid, &cpu_end);
+
+  g_print ("%u clients, %.2f s: %" G_GUINT64_FORMAT " bytes, %u complete, "
+      "%u failed\n", n_clients, elapsed, state.total_bytes,
+      state.n_completed, state.n_failed);
+  g_print ("Throughput: %.2f MB/s\n",
+      state.total_bytes / elapsed / (1024.0 * 1024.0));
+  if (have_cpu) {
+    gdouble cpu = cpu_end - cpu_start;
+    g_print ("Server CPU: %.2f s (%.1f%% of one core)\n", cpu,
+        100.0 * cpu / elapsed);
+    if (cpu > 0)
+      g_print ("Per core: %.2f MB/s\n",
+          state.total_bytes / cpu / (1024.0 * 1024.0));
+  }
+
+  g_object_unref (state.soup);
+  g_main_loop_unref (loop);
+
+  return 0;
+}
@@ -0,0 +1,259 @@
+#ifdef CONFIG_H
+#include "config.h"
+#endif
+
+/* Microbenchmarks for the websocket code.
+ *
+ * Masking: masks buffers of increasing size with the plain scalar loop
+ * and with the kernel picked for this CPU, checks they agree and reports
+ * the throughput of each.
+ *
+ * Compression: sends a stream of typical event channel messages through
+ * permessage-deflate, with and without context takeover, checks they
+ * decompress correctly and reports bytes on the wire and CPU time per
+ * message.
+ *
+ * Usage: websocket-bench [MB_PER_SIZE [N_MESSAGES]]
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+
+#include "src/common/aur-websocket-deflate.h"
+#include "src/common/aur-websocket-mask.h"
+
+static const gsize sizes[] = {
+  16, 64, 125, 256, 1024, 4096, 65536, 1024 * 1024
+};
+
+static void
+mask_bytewise (gchar * data, gsize len, const gchar * mask, gsize offset)
+{
+  gsize i;
+
+  for (i = 0; i < len; i++)
+    data[i] ^= mask[(offset + i) & 3];
+}
+
+static gdouble
+time_mask (AurWebSocketMaskFunc func, gchar * data, gsize len,
+    const gchar * mask, guint64 total)
+{
+  guint64 done = 0;
+  gint64 start;
+
+  start = g_get_monotonic_time ();
+  while (done < total) {
+    func (data, len, mask, 0);
+    done += len;
+  }
+
+  return (g_get_monotonic_time () - start) / (gdouble) G_USEC_PER_SEC;
+}
+
+/* Size of a server to client frame header for a payload */
+static gsize
+frame_header_size (gsize len)
+{
+  if (len < 126)
+    return 2;
+  if (len < 65536)
+    return 4;
+  return 10;
+}
+
+/* A message like those the manager sends - the player list grows and
+ * shrinks and volumes change, the rest is repetitive */
+static gchar *
+make_event_message (guint n)
+{
+  GString *s;
+  guint i, n_players;
+
+  switch (n % 3) {
+    case 0:
+      return g_strdup_printf ("{\"msg-type\":\"enrol\",\"client-id\":%u,"
+          "\"connected-time\":%" G_GUINT64_FORMAT ",\"volume-level\":%.3f,"
+          "\"paused\":false,\"resource-id\":%u,"
+          "\"resource-protocol\":\"http\",\"resource-port\":5457,"
+          "\"resource-path\":\"/resource/%u\",\"position\":0,"
+          "\"base-time\":%" G_GUINT64_FORMAT "}", n,
+          (guint64) n * 1000000007, (n % 100) / 100.0, n % 50, n % 50,
+          (guint64) n * 999983);
+    case 1:
+      return g_strdup_printf ("{\"msg-type\":\"set-media\","
+          "\"resource-id\":%u,\"resource-protocol\":\"http\","
+          "\"resource-port\":5457,\"resource-path\":\"/resource/%u\","
+          "\"base-time\":%" G_GUINT64_FORMAT ",\"position\":0,"
+          "\"paused\":false,\"language\":\"en\"}", n % 50, n % 50,
+          (guint64) n * 999983);
+    default:
+      break;
+  }
+
+  s = g_string_new ("{\"msg-type\":\"player-clients\",\"player-clients\":[");
+  n_players = 4 + n % 12;
+  for (i = 0; i < n_players; i++) {
+    g_string_append_printf (s, "%s{\"client-id\":%u,\"enabled\":%s,"
+        "\"volume\":%.3f,\"host\":\"192.168.1.%u\"}", i ? "," : "", i + 1,
+        (i + n) % 4 ? "true" : "false", ((i * 7 + n) % 100) / 100.0, 10 + i);
+  }
+  g_string_append (s, "]}");
+
+  return g_string_free (s, FALSE);
+}
+
+static gdouble
+cpu_time (void)
+{
+  return (gdouble) clock () / CLOCKS_PER_SEC;
+}
+
+/* Compress and decompress a message stream, as a client with the given
+ * settings would see it. min_size is the threshold below which messages
+ * go out uncompressed, or 0 for no compression at all */
+static gboolean
+bench_deflate (const gchar * name, gchar ** messages, guint n_messages,
+    gsize min_size, gboolean context_takeover)
+{
+  GConverter *compressor = aur_websocket_deflate_new_compressor ();
+  GConverter *decompressor = aur_websocket_deflate_new_decompressor ();
+  GByteArray *out = g_byte_array_new ();
+  guint64 text_bytes = 0, wire_bytes = 0;
+  gdouble deflate_time = 0, inflate_time = 0, t;
+  guint i, n_deflated = 0;
+  gboolean ret = TRUE;
+
+  for (i = 0; i < n_messages; i++) {
+    gsize len = strlen (messages[i]);
+    GBytes *compressed;
+
+    text_bytes += len;
+
+    if (min_size == 0 || len < min_size) {
+      wire_bytes += frame_header_size (len) + len;
+      continue;
+    }
+
+    t = cpu_time ();
+    if (!context_takeover)
+      g_converter_reset (compressor);
+    compressed = aur_websocket_deflate_message (compressor, messages[i], len);
+    deflate_time += cpu_time () - t;
+
+    if (compressed == NULL) {
+      ret = FALSE;
+      break;
+    }
+    wire_bytes += frame_header_size (g_bytes_get_size (compressed)) +
+        g_bytes_get_size (compressed);
+    n_deflated++;
+
+    t = cpu_time ();
+    if (!context_takeover)
+      g_converter_reset (decompressor);
+    g_byte_array_set_size (out, 0);
+    if (!aur_websocket_inflate_message (decompressor,
+            g_bytes_get_data (compressed, NULL),
+            g_bytes_get_size (compressed), 16 * 1024 * 1024, out))
+      ret = FALSE;
+    inflate_time += cpu_time () - t;
+    g_bytes_unref (compressed);
+
+    if (!ret || out->len != len || memcmp (out->data, messages[i], len)) {
+      g_printerr ("%s: message %u didn't survive the round trip\n", name, i);
+      ret = FALSE;
+      break;
+    }
+  }
+
+  if (ret) {
+    g_print ("%-22s %8.1f %8.1f %7.1f%% %9.2f %9.2f\n", name,
+        (gdouble) text_bytes / n_messages, (gdouble) wire_bytes / n_messages,
+        100.0 * wire_bytes / text_bytes,
+        n_deflated ? 1e6 * deflate_time / n_deflated : 0.0,
+        n_deflated ? 1e6 * inflate_time / n_deflated : 0.0);
+  }
+
+  g_byte_array_free (out, TRUE);
+  g_object_unref (compressor);
+  g_object_unref (decompressor);
+
+  return ret;
+}
+
+int
+main (int argc, char **argv)
+{
+  const gchar mask[4] = { 0x37, (gchar) 0xfa, 0x21, 0x3d };
+  guint64 total = 256 * 1024 * 1024;
+  guint n_messages = 10000;
+  gchar **messages;
+  gboolean ok = TRUE;
+  guint i;
+
+  if (argc > 1)
+    total = (guint64) MAX (atoi (argv[1]), 1) * 1024 * 1024;
+  if (argc > 2)
+    n_messages = MAX (atoi (argv[2]), 1);
+
+  g_print ("Masking implementation: %s\n",
+      aur_websocket_mask_get_impl_name ());
+  g_print ("%10s %12s %12s %12s\n", "size", "bytewise", "scalar",
+      "dispatched");
+
+  for (i = 0; i < G_N_ELEMENTS (sizes); i++) {
+    gsize len = sizes[i];
+    gchar *a = g_malloc (len + 1), *b = g_malloc (len + 1);
+    gdouble t_byte, t_scalar, t_fast;
+    gsize j;
+
+    /* Check every mask phase and an unaligned start against the
+     * reference */
+    for (j = 0; j < len; j++)
+      a[j + 1] = b[j + 1] = (gchar) g_random_int ();
+    for (j = 0; j < 4; j++) {
+      aur_websocket_mask (a + 1, len, mask, j);
+      mask_bytewise (b + 1, len, mask, j);
+      if (memcmp (a + 1, b + 1, len) != 0) {
+        g_printerr ("Mismatch at size %" G_GSIZE_FORMAT " offset %"
+            G_GSIZE_FORMAT "\n", len, j);
+        return 1;
+      }
+    }
+
+    t_byte = time_mask (mask_bytewise, a, len, mask, total);
+    t_scalar = time_mask (aur_websocket_mask_scalar, a, len, mask, total);
+    t_fast = time_mask (aur_websocket_mask, a, len, mask, total);
+
+    g_print ("%10" G_GSIZE_FORMAT " %9.0f MB/s %7.0f MB/s %7.0f MB/s\n", len,
+        total / t_byte / (1024.0 * 1024.0),
+        total / t_scalar / (1024.0 * 1024.0),
+        total / t_fast / (1024.0 * 1024.0));
+
+    g_free (a);
+    g_free (b);
+  }
+
+  messages = g_new0 (gchar *, n_messages + 1);
+  for (i = 0; i < n_messages; i++)
+    messages[i] = make_event_message (i);
+
+  g_print ("\n%u event messages\n", n_messages);
+  g_print ("%-22s %8s %8s %8s %9s %9s\n", "", "text/msg", "wire/msg",
+      "ratio", "deflate", "inflate");
+  g_print ("%-22s %8s %8s %8s %9s %9s\n", "", "(bytes)", "(bytes)", "",
+      "(us/msg)", "(us/msg)");
+
+  ok &= bench_deflate ("uncompressed", messages, n_messages, 0, FALSE);
+  ok &= bench_deflate ("no context takeover", messages, n_messages, 1, FALSE);
+  ok &= bench_deflate ("context takeover", messages, n_messages, 1, TRUE);
+  ok &= bench_deflate ("takeover, >= 128 bytes", messages, n_messages, 128,
+      TRUE);
+
+  g_strfreev (messages);
+
+  return ok ? 0 : 1;
+}